@@ -0,0 +1,607 @@
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <apr_atomic.h>
+#include <apr_file_io.h>
+#include <apr_file_info.h>
+#include <apr_lib.h>
+#include <apr_strings.h>
+#include <apr_thread_proc.h>
+#include <httpd.h>
+#include <http_config.h>
+#include <http_log.h>
+#include "accesslog.h"
+#include "util.h"
+
+#define ACCESSLOG_BUFFER_SIZE  65536    // bytes written to the file at once
+#define ACCESSLOG_LINE_LEN     4096     // bytes of a single formatted record
+
+extern module AP_MODULE_DECLARE_DATA okioki_module;
+
+/** A slot of the ring buffer.
+ * The sequence tells who owns the slot: it equals the position of the producer when the slot is free,
+ * and the position plus one when the record can be written to the file.
+ */
+typedef struct {
+    volatile apr_uint32_t sequence;
+    accesslog_record_t    record;
+} accesslog_slot_t;
+
+/** A file written by the writer thread, in large writes of whole lines.
+ */
+typedef struct {
+    const char            *path;
+    apr_off_t             max_size;
+    apr_file_t            *file;
+    apr_pool_t            *pool;
+    char                  *buffer;
+    apr_size_t            len;
+    int                   rotated;
+} accesslog_file_t;
+
+static accesslog_file_t      mod_okioki_accesslog_log;
+static accesslog_file_t      mod_okioki_accesslog_capture;
+static apr_uint32_t          mod_okioki_accesslog_sample;
+static volatile apr_uint32_t mod_okioki_accesslog_nr_started;
+static apr_uint32_t          mod_okioki_accesslog_nr_slots;
+static accesslog_slot_t      *mod_okioki_accesslog_slots = NULL;
+static volatile apr_uint32_t mod_okioki_accesslog_enqueue_pos;
+static apr_uint32_t          mod_okioki_accesslog_dequeue_pos;
+static volatile apr_uint32_t mod_okioki_accesslog_nr_dropped;
+static apr_thread_t          *mod_okioki_accesslog_thread = NULL;
+static volatile int          mod_okioki_accesslog_stopping = 0;
+
+const char *mod_okioki_accesslog_configure(apr_pool_t *pool, const char *path, apr_off_t max_size, int nr_slots)
+{
+    if (nr_slots < 2) {
+        return "The access log requires at least two slots.";
+    }
+
+    // Positions wrap around at 2^32, which must be a multiple of the number of slots.
+    mod_okioki_accesslog_log.path     = path;
+    mod_okioki_accesslog_log.max_size = max_size;
+    mod_okioki_accesslog_nr_slots     = mod_okioki_nlpo2(nr_slots - 1);
+    return NULL;
+}
+
+const char *mod_okioki_accesslog_capture_configure(apr_pool_t *pool, const char *path, apr_off_t max_size, int sample)
+{
+    if (sample < 1) {
+        return "The capture requires a sample of at least one.";
+    }
+
+    mod_okioki_accesslog_capture.path     = path;
+    mod_okioki_accesslog_capture.max_size = max_size;
+    mod_okioki_accesslog_sample           = sample;
+    return NULL;
+}
+
+void mod_okioki_accesslog_pre_config(void)
+{
+    // The paths were allocated on the previous configuration pool.
+    mod_okioki_accesslog_log.path     = NULL;
+    mod_okioki_accesslog_capture.path = NULL;
+    mod_okioki_accesslog_nr_slots     = mod_okioki_nlpo2(ACCESSLOG_SLOTS - 1);
+}
+
+/** Add a record to the ring buffer, without waiting.
+ *
+ * @returns  0 on success, -1 when the buffer is full and the record was dropped.
+ */
+static int mod_okioki_accesslog_push(accesslog_record_t *record)
+{
+    accesslog_slot_t *slot;
+    apr_uint32_t     pos;
+    apr_int32_t      dif;
+
+    pos = apr_atomic_read32(&mod_okioki_accesslog_enqueue_pos);
+    for (;;) {
+        slot = &mod_okioki_accesslog_slots[pos & (mod_okioki_accesslog_nr_slots - 1)];
+        dif = (apr_int32_t)(apr_atomic_read32(&slot->sequence) - pos);
+
+        if (dif == 0) {
+            // The slot is free, claim it by moving the position.
+            if (apr_atomic_cas32(&mod_okioki_accesslog_enqueue_pos, pos + 1, pos) == pos) {
+                break;
+            }
+            pos = apr_atomic_read32(&mod_okioki_accesslog_enqueue_pos);
+
+        } else if (dif < 0) {
+            // The writer did not yet take the record of the previous round.
+            apr_atomic_inc32(&mod_okioki_accesslog_nr_dropped);
+            return -1;
+
+        } else {
+            // Another thread claimed the slot first.
+            pos = apr_atomic_read32(&mod_okioki_accesslog_enqueue_pos);
+        }
+    }
+
+    slot->record = *record;
+
+    // Exchange is a full memory barrier, the writer sees the record before the sequence.
+    apr_atomic_xchg32(&slot->sequence, pos + 1);
+    return 0;
+}
+
+/** Take the next record from the ring buffer.
+ * Only the writer thread takes records.
+ *
+ * @returns  0 on success, -1 when the buffer is empty.
+ */
+static int mod_okioki_accesslog_pop(accesslog_record_t *record)
+{
+    apr_uint32_t     pos = mod_okioki_accesslog_dequeue_pos;
+    accesslog_slot_t *slot = &mod_okioki_accesslog_slots[pos & (mod_okioki_accesslog_nr_slots - 1)];
+
+    if (apr_atomic_read32(&slot->sequence) != pos + 1) {
+        return -1;
+    }
+
+    *record = slot->record;
+    apr_atomic_xchg32(&slot->sequence, pos + mod_okioki_accesslog_nr_slots);
+    mod_okioki_accesslog_dequeue_pos = pos + 1;
+    return 0;
+}
+
+/** Copy a string between double quotes, escaping it for JSON.
+ *
+ * @returns  The number of characters written, or 0 when it does not fit.
+ */
+static apr_size_t mod_okioki_accesslog_quote(char *buffer, apr_size_t size, const char *s, apr_size_t s_len)
+{
+    static const char hex[] = "0123456789abcdef";
+    apr_size_t        len = 0;
+    apr_size_t        i;
+    unsigned char     c;
+
+    // Room for the worst case, every character as a unicode escape.
+    if (size < s_len * 6 + 2) {
+        return 0;
+    }
+
+    buffer[len++] = '"';
+    for (i = 0; i < s_len; i++) {
+        c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') {
+            buffer[len++] = '\\';
+            buffer[len++] = c;
+        } else if (c < 32 || c == 127) {
+            buffer[len++] = '\\';
+            buffer[len++] = 'u';
+            buffer[len++] = '0';
+            buffer[len++] = '0';
+            buffer[len++] = hex[c >> 4];
+            buffer[len++] = hex[c & 0xf];
+        } else {
+            buffer[len++] = c;
+        }
+    }
+    buffer[len++] = '"';
+    return len;
+}
+
+/** Format a record as a line of JSON.
+ *
+ * @returns  The length of the line, or 0 when it does not fit.
+ */
+static apr_size_t mod_okioki_accesslog_format(char *buffer, apr_size_t size, accesslog_record_t *record)
+{
+    apr_size_t len = 0;
+    apr_size_t n;
+    const char *s;
+    const char *comma;
+
+    len+= apr_snprintf(&buffer[len], size - len, "{\"time\": %" APR_TIME_T_FMT ", \"view\": ", record->time);
+    if ((n = mod_okioki_accesslog_quote(&buffer[len], size - len, record->view, strlen(record->view))) == 0) {
+        return 0;
+    }
+    len+= n;
+
+    // The argument names are separated by commas.
+    len+= apr_snprintf(&buffer[len], size - len, ", \"arguments\": [");
+    for (s = record->arguments; s[0] != 0; s = comma[0] != 0 ? &comma[1] : comma) {
+        if ((comma = strchr(s, ',')) == NULL) {
+            comma = &s[strlen(s)];
+        }
+        if (s != record->arguments) {
+            len+= apr_snprintf(&buffer[len], size - len, ", ");
+        }
+        if ((n = mod_okioki_accesslog_quote(&buffer[len], size - len, s, comma - s)) == 0) {
+            return 0;
+        }
+        len+= n;
+    }
+
+    len+= apr_snprintf(&buffer[len], size - len,
+        "], \"status\": %i, \"rows\": %i, \"bytes\": %" APR_OFF_T_FMT ", \"db_time\": %" APR_TIME_T_FMT ", \"duration\": %" APR_TIME_T_FMT "}\n",
+        record->status, record->nr_rows, record->bytes, record->db_time, record->duration
+    );
+    return len < size - 1 ? len : 0;
+}
+
+/** Format a captured record as a line of tab separated fields, for okioki-replay.
+ * The fields are the time, the method, the escaped path with the arguments as a query string,
+ * the status, the duration, the database time and the number of rows.
+ *
+ * @returns  The length of the line, or 0 when it does not fit.
+ */
+static apr_size_t mod_okioki_accesslog_format_capture(char *buffer, apr_size_t size, accesslog_record_t *record)
+{
+    apr_size_t method_len = strcspn(record->view, " ");
+    apr_size_t len;
+
+    len = apr_snprintf(buffer, size,
+        "%" APR_TIME_T_FMT "\t%.*s\t%s\t%i\t%" APR_TIME_T_FMT "\t%" APR_TIME_T_FMT "\t%i\n",
+        record->time, (int)method_len, record->view, record->request, record->status, record->duration, record->db_time, record->nr_rows
+    );
+    return len < size - 1 ? len : 0;
+}
+
+/** (Re)open a log file.
+ */
+static apr_status_t mod_okioki_accesslog_open(accesslog_file_t *lf)
+{
+    apr_pool_clear(lf->pool);
+    lf->file = NULL;
+
+    return apr_file_open(
+        &lf->file, lf->path,
+        APR_WRITE | APR_CREATE | APR_APPEND, APR_OS_DEFAULT, lf->pool
+    );
+}
+
+/** Rotate a log file when it is too large, or reopen it when another child rotated it.
+ */
+static void mod_okioki_accesslog_rotate(accesslog_file_t *lf, apr_pool_t *pool)
+{
+    apr_finfo_t path_info;
+    apr_finfo_t file_info;
+    apr_status_t ret;
+
+    if (
+        lf->file == NULL ||
+        (ret = apr_stat(&path_info, lf->path, APR_FINFO_IDENT | APR_FINFO_SIZE, pool)) != APR_SUCCESS ||
+        (ret = apr_file_info_get(&file_info, APR_FINFO_IDENT, lf->file)) != APR_SUCCESS ||
+        path_info.inode != file_info.inode || path_info.device != file_info.device
+    ) {
+        mod_okioki_accesslog_open(lf);
+        return;
+    }
+
+    if (path_info.size >= lf->max_size) {
+        if ((ret = apr_file_rename(lf->path, apr_pstrcat(pool, lf->path, ".1", NULL), pool)) != APR_SUCCESS) {
+            ap_log_perror(APLOG_MARK, APLOG_ERR, ret, pool, "[mod_okioki] Could not rotate log '%s'.", lf->path);
+            return;
+        }
+        mod_okioki_accesslog_open(lf);
+    }
+}
+
+/** Write the buffer of a log file, rotating the file before the first write of a flush.
+ * Each write is appended at once, so that the lines of the children are not mixed.
+ */
+static void mod_okioki_accesslog_write(accesslog_file_t *lf, apr_pool_t *pool)
+{
+    if (lf->len == 0) {
+        return;
+    }
+
+    if (!lf->rotated) {
+        mod_okioki_accesslog_rotate(lf, pool);
+        lf->rotated = 1;
+    }
+    if (lf->file != NULL) {
+        apr_file_write_full(lf->file, lf->buffer, lf->len, NULL);
+    }
+    lf->len = 0;
+}
+
+/** Add a line to the buffer of a log file, writing the buffer first when the line does not fit.
+ */
+static void mod_okioki_accesslog_append(accesslog_file_t *lf, apr_pool_t *pool, const char *line, apr_size_t len)
+{
+    if (lf->len + len > ACCESSLOG_BUFFER_SIZE) {
+        mod_okioki_accesslog_write(lf, pool);
+    }
+    memcpy(&lf->buffer[lf->len], line, len);
+    lf->len+= len;
+}
+
+/** Write all records in the ring buffer to the files.
+ */
+static void mod_okioki_accesslog_flush(apr_pool_t *pool)
+{
+    accesslog_record_t record;
+    char               line[ACCESSLOG_LINE_LEN];
+    apr_size_t         n;
+    apr_uint32_t       nr_dropped;
+
+    mod_okioki_accesslog_log.rotated     = 0;
+    mod_okioki_accesslog_capture.rotated = 0;
+
+    while (mod_okioki_accesslog_pop(&record) == 0) {
+        if (mod_okioki_accesslog_log.path != NULL) {
+            if ((n = mod_okioki_accesslog_format(line, ACCESSLOG_LINE_LEN, &record)) > 0) {
+                mod_okioki_accesslog_append(&mod_okioki_accesslog_log, pool, line, n);
+            } else {
+                // A record that does not fit in a line is lost.
+                apr_atomic_inc32(&mod_okioki_accesslog_nr_dropped);
+            }
+        }
+
+        if (record.captured && record.request[0] != 0) {
+            if ((n = mod_okioki_accesslog_format_capture(line, ACCESSLOG_LINE_LEN, &record)) > 0) {
+                mod_okioki_accesslog_append(&mod_okioki_accesslog_capture, pool, line, n);
+            }
+        }
+    }
+
+    mod_okioki_accesslog_write(&mod_okioki_accesslog_log, pool);
+    mod_okioki_accesslog_write(&mod_okioki_accesslog_capture, pool);
+
+    // Report the records that where dropped since the last time.
+    if ((nr_dropped = apr_atomic_xchg32(&mod_okioki_accesslog_nr_dropped, 0)) > 0 && mod_okioki_accesslog_log.path != NULL) {
+        if (!mod_okioki_accesslog_log.rotated) {
+            mod_okioki_accesslog_rotate(&mod_okioki_accesslog_log, pool);
+        }
+        if (mod_okioki_accesslog_log.file != NULL) {
+            apr_file_printf(mod_okioki_accesslog_log.file, "{\"time\": %" APR_TIME_T_FMT ", \"dropped\": %u}\n", apr_time_now(), nr_dropped);
+        }
+    }
+    apr_pool_clear(pool);
+}
+
+/** Background thread that writes the records to the files, so that requests never wait for the disk.
+ */
+static void * APR_THREAD_FUNC mod_okioki_accesslog_writer(apr_thread_t *thread, void *data)
+{
+    apr_pool_t *pool;
+
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS) {
+        return NULL;
+    }
+
+    while (!mod_okioki_accesslog_stopping) {
+        apr_sleep(ACCESSLOG_FLUSH_INTERVAL * 1000);
+        mod_okioki_accesslog_flush(pool);
+    }
+
+    // Write the records of the last requests.
+    mod_okioki_accesslog_flush(pool);
+
+    apr_pool_destroy(pool);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+/** Stop the writer thread, after it wrote the remaining records.
+ */
+static apr_status_t mod_okioki_accesslog_stop(void *data)
+{
+    apr_status_t thread_ret;
+
+    mod_okioki_accesslog_stopping = 1;
+    apr_thread_join(&thread_ret, mod_okioki_accesslog_thread);
+    mod_okioki_accesslog_thread = NULL;
+    mod_okioki_accesslog_slots = NULL;
+    return APR_SUCCESS;
+}
+
+/** Open a log file and allocate its buffer, in the child.
+ */
+static apr_status_t mod_okioki_accesslog_file_init(accesslog_file_t *lf, apr_pool_t *pool, server_rec *server)
+{
+    apr_status_t ret;
+
+    if ((ret = apr_pool_create(&lf->pool, pool)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, ret, server, "[mod_okioki] Could not create log pool.");
+        return ret;
+    }
+
+    if ((lf->buffer = apr_palloc(pool, ACCESSLOG_BUFFER_SIZE)) == NULL) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, server, "[mod_okioki] Could not allocate log buffer.");
+        return APR_ENOMEM;
+    }
+    lf->len = 0;
+
+    // The file is opened by the child, it must be writable by the user the server runs as.
+    if ((ret = mod_okioki_accesslog_open(lf)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, ret, server, "[mod_okioki] Could not open log '%s'.", lf->path);
+        return ret;
+    }
+    return APR_SUCCESS;
+}
+
+int mod_okioki_accesslog_child_init(apr_pool_t *pool, server_rec *server)
+{
+    apr_status_t ret;
+    apr_uint32_t i;
+
+    if (mod_okioki_accesslog_log.path == NULL && mod_okioki_accesslog_capture.path == NULL) {
+        return APR_SUCCESS;
+    }
+
+    if (mod_okioki_accesslog_log.path != NULL && (ret = mod_okioki_accesslog_file_init(&mod_okioki_accesslog_log, pool, server)) != APR_SUCCESS) {
+        return ret;
+    }
+    if (mod_okioki_accesslog_capture.path != NULL && (ret = mod_okioki_accesslog_file_init(&mod_okioki_accesslog_capture, pool, server)) != APR_SUCCESS) {
+        return ret;
+    }
+
+    if ((mod_okioki_accesslog_slots = apr_palloc(pool, mod_okioki_accesslog_nr_slots * sizeof (accesslog_slot_t))) == NULL) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, server, "[mod_okioki] Could not allocate access log ring buffer.");
+        return APR_ENOMEM;
+    }
+    for (i = 0; i < mod_okioki_accesslog_nr_slots; i++) {
+        mod_okioki_accesslog_slots[i].sequence = i;
+    }
+    mod_okioki_accesslog_enqueue_pos = 0;
+    mod_okioki_accesslog_dequeue_pos = 0;
+    mod_okioki_accesslog_nr_dropped  = 0;
+    mod_okioki_accesslog_nr_started  = 0;
+
+    mod_okioki_accesslog_stopping = 0;
+    if ((ret = apr_thread_create(&mod_okioki_accesslog_thread, NULL, mod_okioki_accesslog_writer, NULL, pool)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, ret, server, "[mod_okioki] Could not start access log thread.");
+        mod_okioki_accesslog_slots = NULL;
+        return ret;
+    }
+    apr_pool_cleanup_register(pool, NULL, mod_okioki_accesslog_stop, apr_pool_cleanup_null);
+
+    return APR_SUCCESS;
+}
+
+accesslog_record_t *mod_okioki_accesslog_start(request_rec *http_request, view_t *view, const char *view_name)
+{
+    accesslog_record_t *record;
+    apr_size_t         len = 0;
+    apr_size_t         n;
+    int                captured;
+    int                i;
+
+    if (mod_okioki_accesslog_slots == NULL) {
+        return NULL;
+    }
+
+    // Every so many requests to a view is captured, the others only need a record for the access log.
+    captured = mod_okioki_accesslog_capture.path != NULL && view != NULL && apr_atomic_inc32(&mod_okioki_accesslog_nr_started) % mod_okioki_accesslog_sample == 0;
+    if (!captured && mod_okioki_accesslog_log.path == NULL) {
+        return NULL;
+    }
+
+    if ((record = apr_pcalloc(http_request->pool, sizeof (accesslog_record_t))) == NULL) {
+        return NULL;
+    }
+    record->time     = http_request->request_time;
+    record->nr_rows  = -1;
+    record->captured = captured;
+    apr_cpystrn(record->view, view_name, ACCESSLOG_VIEW_LEN);
+
+    // The names of the bound arguments, as many as fit.
+    for (i = 0; view != NULL && i < view->nr_sql_params; i++) {
+        if (view->sql_params[i] == NULL) {
+            continue;
+        }
+        n = view->sql_params_len[i];
+        if (len + n + 2 > ACCESSLOG_ARGUMENTS_LEN) {
+            break;
+        }
+        if (len > 0) {
+            record->arguments[len++] = ',';
+        }
+        memcpy(&record->arguments[len], view->sql_params[i], n);
+        len+= n;
+    }
+    record->arguments[len] = 0;
+
+    ap_set_module_config(http_request->request_config, &okioki_module, record);
+    return record;
+}
+
+/** Append a string to a captured request, escaping everything but unreserved characters.
+ *
+ * @returns  The new length, or 0 when it does not fit.
+ */
+static apr_size_t mod_okioki_accesslog_escape(char *buffer, apr_size_t len, const char *s)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    unsigned char     c;
+
+    for (; *s != 0; s++) {
+        c = (unsigned char)*s;
+        if (apr_isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~' || c == '/') {
+            if (len + 1 >= ACCESSLOG_REQUEST_LEN) {
+                return 0;
+            }
+            buffer[len++] = c;
+        } else {
+            if (len + 3 >= ACCESSLOG_REQUEST_LEN) {
+                return 0;
+            }
+            buffer[len++] = '%';
+            buffer[len++] = hex[c >> 4];
+            buffer[len++] = hex[c & 0xf];
+        }
+    }
+    buffer[len] = 0;
+    return len;
+}
+
+void mod_okioki_accesslog_arguments(request_rec *http_request, view_t *view, apr_hash_t *arguments)
+{
+    accesslog_record_t *record;
+    const char         *value;
+    char               separator = '?';
+    apr_size_t         len;
+    int                i;
+
+    if ((record = mod_okioki_accesslog_get(http_request)) == NULL || !record->captured) {
+        return;
+    }
+
+    // The path and the bound arguments as a query string; a request that does not fit is not captured.
+    if ((len = mod_okioki_accesslog_escape(record->request, 0, http_request->uri)) == 0) {
+        record->request[0] = 0;
+        return;
+    }
+    for (i = 0; i < view->nr_sql_params; i++) {
+        if (view->sql_params[i] == NULL || (value = apr_hash_get(arguments, view->sql_params[i], view->sql_params_len[i])) == NULL) {
+            continue;
+        }
+
+        if (len + 2 >= ACCESSLOG_REQUEST_LEN) {
+            record->request[0] = 0;
+            return;
+        }
+        record->request[len++] = separator;
+        separator = '&';
+
+        if ((len = mod_okioki_accesslog_escape(record->request, len, view->sql_params[i])) == 0 || len + 2 >= ACCESSLOG_REQUEST_LEN) {
+            record->request[0] = 0;
+            return;
+        }
+        record->request[len++] = '=';
+        record->request[len] = 0;
+
+        if (value[0] != 0 && (len = mod_okioki_accesslog_escape(record->request, len, value)) == 0) {
+            record->request[0] = 0;
+            return;
+        }
+    }
+}
+
+accesslog_record_t *mod_okioki_accesslog_get(request_rec *http_request)
+{
+    return (accesslog_record_t *)ap_get_module_config(http_request->request_config, &okioki_module);
+}
+
+int mod_okioki_accesslog_log_transaction(request_rec *http_request)
+{
+    accesslog_record_t *record;
+
+    if ((record = mod_okioki_accesslog_get(http_request)) == NULL || mod_okioki_accesslog_slots == NULL) {
+        return DECLINED;
+    }
+
+    record->status   = http_request->status;
+    record->bytes    = http_request->bytes_sent;
+    record->duration = apr_time_now() - http_request->request_time;
+
+    mod_okioki_accesslog_push(record);
+    return OK;
+}
@@ -0,0 +1,95 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <httpd.h>
+#include <http_log.h>
+#include "mod_okioki.h"
+
+#define ACCESSLOG_SLOTS           4096     // default number of records in the ring buffer
+#define ACCESSLOG_MAX_SIZE        64       // default MByte before the log file is rotated
+#define ACCESSLOG_FLUSH_INTERVAL  250      // milliseconds between writes of the background thread
+#define ACCESSLOG_VIEW_LEN        96
+#define ACCESSLOG_ARGUMENTS_LEN   160
+#define ACCESSLOG_REQUEST_LEN     512
+#define ACCESSLOG_SAMPLE          1        // default 1 in N requests that are captured
+
+/** A record of a single execution of a view, filled in while the request is handled.
+ */
+typedef struct {
+    apr_time_t          time;
+    apr_interval_time_t duration;
+    apr_interval_time_t db_time;
+    apr_off_t           bytes;
+    int                 status;
+    int                 nr_rows;
+    char                view[ACCESSLOG_VIEW_LEN];
+    char                arguments[ACCESSLOG_ARGUMENTS_LEN];
+    int                 captured;
+    char                request[ACCESSLOG_REQUEST_LEN];
+} accesslog_record_t;
+
+/** Set the file of the access log at configuration time.
+ *
+ * @param path      The path of the log file, rotated to path.1.
+ * @param max_size  The size in bytes after which the file is rotated.
+ * @param nr_slots  The number of records in the ring buffer of each child.
+ * @returns         NULL, or an error message.
+ */
+const char *mod_okioki_accesslog_configure(apr_pool_t *pool, const char *path, apr_off_t max_size, int nr_slots);
+
+/** Set the file of the traffic capture at configuration time.
+ * Captured requests are written with their arguments, so that okioki-replay can send them again.
+ *
+ * @param path      The path of the capture file, rotated to path.1.
+ * @param max_size  The size in bytes after which the file is rotated.
+ * @param sample    Capture 1 in this many requests of each child.
+ * @returns         NULL, or an error message.
+ */
+const char *mod_okioki_accesslog_capture_configure(apr_pool_t *pool, const char *path, apr_off_t max_size, int sample);
+
+/** Forget the access log of the previous configuration, called before the configuration is (re)read.
+ */
+void mod_okioki_accesslog_pre_config(void);
+
+/** Open the log files and start the writer thread, called once for each child.
+ */
+int mod_okioki_accesslog_child_init(apr_pool_t *pool, server_rec *server);
+
+/** Start a record for the request, when the access log is enabled.
+ * The record is added to the ring buffer when the transaction is logged.
+ *
+ * @returns  The record to fill in, or NULL when there is no access log and the request is not captured.
+ */
+accesslog_record_t *mod_okioki_accesslog_start(request_rec *http_request, view_t *view, const char *view_name);
+
+/** Store the path and the arguments of a captured request.
+ * Requests whose path and arguments do not fit in the record are not captured.
+ */
+void mod_okioki_accesslog_arguments(request_rec *http_request, view_t *view, apr_hash_t *arguments);
+
+/** The record of the request, or NULL.
+ */
+accesslog_record_t *mod_okioki_accesslog_get(request_rec *http_request);
+
+/** Add the record of the request to the ring buffer, dropping it when the buffer is full.
+ * Hooked into the log_transaction phase.
+ */
+int mod_okioki_accesslog_log_transaction(request_rec *http_request);
+
+#endif
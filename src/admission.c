@@ -0,0 +1,236 @@
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <apr_hash.h>
+#include <apr_strings.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#include <httpd.h>
+#include <http_log.h>
+#include <http_protocol.h>
+#include <http_request.h>
+#include <util_filter.h>
+#include "admission.h"
+#include "writebehind.h"
+
+static apr_pool_t         *mod_okioki_admission_pool;
+static apr_thread_mutex_t *mod_okioki_admission_mutex;
+
+limiter_t *mod_okioki_limiter_create(apr_pool_t *pool, int max_active, int max_queued, apr_time_t max_wait)
+{
+    limiter_t *limiter;
+
+    if ((limiter = apr_pcalloc(pool, sizeof (limiter_t))) == NULL) {
+        return NULL;
+    }
+
+    limiter->max_active = max_active;
+    limiter->max_queued = max_queued;
+    limiter->max_wait   = max_wait;
+    limiter->cond       = NULL;
+    return limiter;
+}
+
+int mod_okioki_admission_child_init(apr_pool_t *pool, server_rec *server)
+{
+    apr_status_t ret;
+
+    if ((ret = apr_thread_mutex_create(&mod_okioki_admission_mutex, APR_THREAD_MUTEX_DEFAULT, pool)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, ret, server, "[mod_okioki] Could not create admission mutex.");
+        return ret;
+    }
+
+    // The condition variables of the limiters are created on first use in the child's pool.
+    mod_okioki_admission_pool = pool;
+    return APR_SUCCESS;
+}
+
+/** Reject a request, and tell the client when to try again.
+ */
+static int mod_okioki_admission_reject(request_rec *http_request, limiter_t *limiter, const char *reason, char **error)
+{
+    apr_time_t retry_after = apr_time_sec(limiter->max_wait) + 1;
+
+    apr_table_setn(http_request->err_headers_out, "Retry-After", apr_psprintf(http_request->pool, "%" APR_TIME_T_FMT, retry_after));
+
+    // Rejections are expected under overload, so they are not logged as errors.
+    *error = apr_psprintf(http_request->pool, "Service overloaded, %s.", reason);
+    return HTTP_SERVICE_UNAVAILABLE;
+}
+
+int mod_okioki_admission_enter(request_rec *http_request, limiter_t *limiter, char **error)
+{
+    apr_time_t start;
+    apr_time_t deadline;
+    apr_time_t wait;
+
+    if (limiter == NULL || limiter->max_active == 0 || mod_okioki_admission_mutex == NULL) {
+        return HTTP_OK;
+    }
+
+    apr_thread_mutex_lock(mod_okioki_admission_mutex);
+
+    // Fast path, there is room.
+    if (limiter->nr_active < limiter->max_active) {
+        limiter->nr_active++;
+        limiter->nr_admitted++;
+        apr_thread_mutex_unlock(mod_okioki_admission_mutex);
+        return HTTP_OK;
+    }
+
+    // Fail fast when the queue is full.
+    if (limiter->nr_queued >= limiter->max_queued) {
+        limiter->nr_rejected++;
+        apr_thread_mutex_unlock(mod_okioki_admission_mutex);
+        return mod_okioki_admission_reject(http_request, limiter, "queue is full", error);
+    }
+
+    if (limiter->cond == NULL && apr_thread_cond_create(&limiter->cond, mod_okioki_admission_pool) != APR_SUCCESS) {
+        limiter->nr_rejected++;
+        apr_thread_mutex_unlock(mod_okioki_admission_mutex);
+        return mod_okioki_admission_reject(http_request, limiter, "could not wait in queue", error);
+    }
+
+    // Wait in the queue until a place is free, or the time is up.
+    limiter->nr_queued++;
+    if (limiter->nr_queued > limiter->max_queue_depth) {
+        limiter->max_queue_depth = limiter->nr_queued;
+    }
+    start = apr_time_now();
+    deadline = start + limiter->max_wait;
+    while (limiter->nr_active >= limiter->max_active && apr_time_now() < deadline) {
+        apr_thread_cond_timedwait(limiter->cond, mod_okioki_admission_mutex, deadline - apr_time_now());
+    }
+    limiter->nr_queued--;
+
+    wait = apr_time_now() - start;
+    limiter->total_wait+= wait;
+    apr_table_setn(http_request->subprocess_env, "OKIOKI_QUEUE_WAIT", apr_psprintf(http_request->pool, "%" APR_TIME_T_FMT, wait));
+
+    if (limiter->nr_active >= limiter->max_active) {
+        limiter->nr_timeouts++;
+        apr_thread_mutex_unlock(mod_okioki_admission_mutex);
+        return mod_okioki_admission_reject(http_request, limiter, "timeout in queue", error);
+    }
+
+    limiter->nr_active++;
+    limiter->nr_admitted++;
+    apr_thread_mutex_unlock(mod_okioki_admission_mutex);
+    return HTTP_OK;
+}
+
+void mod_okioki_admission_leave(limiter_t *limiter)
+{
+    if (limiter == NULL || limiter->max_active == 0 || mod_okioki_admission_mutex == NULL) {
+        return;
+    }
+
+    apr_thread_mutex_lock(mod_okioki_admission_mutex);
+    limiter->nr_active--;
+    if (limiter->cond != NULL) {
+        apr_thread_cond_signal(limiter->cond);
+    }
+    apr_thread_mutex_unlock(mod_okioki_admission_mutex);
+}
+
+apr_status_t mod_okioki_admission_cleanup(void *limiter)
+{
+    mod_okioki_admission_leave((limiter_t *)limiter);
+    return APR_SUCCESS;
+}
+
+/** Add a CSV line with the counters of a limiter, the caller must hold the mutex.
+ */
+static apr_status_t mod_okioki_admission_status_line(apr_bucket_brigade *bb, const char *name, limiter_t *limiter)
+{
+    return apr_brigade_printf(bb, NULL, NULL,
+        "\"%s\",%i,%i,%i,%i,%" APR_UINT64_T_FMT ",%" APR_UINT64_T_FMT ",%" APR_UINT64_T_FMT ",%i,%" APR_TIME_T_FMT "\r\n",
+        name, limiter->max_active, limiter->max_queued, limiter->nr_active, limiter->nr_queued,
+        limiter->nr_admitted, limiter->nr_rejected, limiter->nr_timeouts, limiter->max_queue_depth, limiter->total_wait
+    );
+}
+
+int mod_okioki_admission_status(request_rec *http_request, mod_okioki_dir_config *cfg, char **error)
+{
+    apr_pool_t         *pool = http_request->pool;
+    apr_bucket_alloc_t *alloc = http_request->connection->bucket_alloc;
+    apr_bucket_brigade *bb;
+    apr_bucket         *b;
+    apr_hash_index_t   *hi;
+    const void         *name;
+    void               *_view;
+    view_t             *view;
+    int                writebehind_header = 0;
+
+    ASSERT_NOT_NULL(
+        bb = apr_brigade_create(pool, alloc),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate a bucket brigade."
+    )
+
+    ASSERT_APR_SUCCESS(
+        apr_brigade_puts(bb, NULL, NULL, "name,max_active,max_queued,active,queued,admitted,rejected,timeouts,max_queue_depth,total_wait_usec\r\n"),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not write status."
+    )
+
+    // The counters are copied while holding the lock, names of views never contain quotes.
+    if (mod_okioki_admission_mutex != NULL) {
+        apr_thread_mutex_lock(mod_okioki_admission_mutex);
+    }
+    if (cfg->limiter != NULL) {
+        mod_okioki_admission_status_line(bb, "*", cfg->limiter);
+    }
+    for (hi = apr_hash_first(pool, cfg->views); hi != NULL; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, &name, NULL, &_view);
+        view = (view_t *)_view;
+        if (view->limiter != NULL) {
+            mod_okioki_admission_status_line(bb, (const char *)name, view->limiter);
+        }
+    }
+    if (mod_okioki_admission_mutex != NULL) {
+        apr_thread_mutex_unlock(mod_okioki_admission_mutex);
+    }
+
+    // The counters of the write-behind queues follow as a second table, each queue has its own lock.
+    for (hi = apr_hash_first(pool, cfg->views); hi != NULL; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, &name, NULL, &_view);
+        view = (view_t *)_view;
+        if (view->writebehind == NULL) {
+            continue;
+        }
+
+        if (!writebehind_header) {
+            ASSERT_APR_SUCCESS(
+                apr_brigade_puts(bb, NULL, NULL, "\r\nname,max_queued,queued,enqueued,rejected,batches,failed\r\n"),
+                HTTP_INTERNAL_SERVER_ERROR, "Could not write status."
+            )
+            writebehind_header = 1;
+        }
+        mod_okioki_writebehind_status_line(bb, (const char *)name, view->writebehind);
+    }
+
+    // Add an end-of-stream.
+    ASSERT_NOT_NULL(
+        b = apr_bucket_eos_create(alloc),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
+    )
+    APR_BRIGADE_INSERT_TAIL(bb, b);
+
+    // Return the data.
+    ap_set_content_type(http_request, "text/csv");
+    http_request->status = HTTP_OK;
+    return ap_pass_brigade(http_request->output_filters, bb);
+}
@@ -0,0 +1,72 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <httpd.h>
+#include <http_log.h>
+#include <apr_thread_cond.h>
+#include "mod_okioki.h"
+
+/** Limits the number of requests that execute at the same time.
+ * Requests above the limit wait in a short queue, when the queue is full or the wait
+ * takes too long the request is rejected. The state and counters are per child.
+ */
+struct limiter_t {
+    int                max_active;
+    int                max_queued;
+    apr_time_t         max_wait;
+
+    int                nr_active;
+    int                nr_queued;
+    apr_thread_cond_t  *cond;
+
+    // Counters.
+    apr_uint64_t       nr_admitted;
+    apr_uint64_t       nr_rejected;
+    apr_uint64_t       nr_timeouts;
+    int                max_queue_depth;
+    apr_time_t         total_wait;
+};
+
+/** Allocate a limiter at configuration time.
+ */
+limiter_t *mod_okioki_limiter_create(apr_pool_t *pool, int max_active, int max_queued, apr_time_t max_wait);
+
+/** Create the lock that protects all limiters, called once for each child.
+ */
+int mod_okioki_admission_child_init(apr_pool_t *pool, server_rec *server);
+
+/** Wait until the request may execute.
+ * @returns  HTTP_OK when admitted, or HTTP_SERVICE_UNAVAILABLE with a Retry-After header set
+ *           when the queue is full or the request waited too long.
+ */
+int mod_okioki_admission_enter(request_rec *http_request, limiter_t *limiter, char **error);
+
+/** Give up the place of an admitted request.
+ */
+void mod_okioki_admission_leave(limiter_t *limiter);
+
+/** Give up the place of an admitted request when a pool is cleaned up, for apr_pool_cleanup_register().
+ */
+apr_status_t mod_okioki_admission_cleanup(void *limiter);
+
+/** Write the counters of the limiters of the directory and its views as CSV.
+ */
+int mod_okioki_admission_status(request_rec *http_request, mod_okioki_dir_config *cfg, char **error);
+
+#endif
@@ -0,0 +1,293 @@
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <apr_portable.h>
+#include <apr_strings.h>
+#include <apr_dbd.h>
+#include <httpd.h>
+#include <http_log.h>
+#include <http_protocol.h>
+#include <http_request.h>
+#include <ap_mpm.h>
+#include <libpq-fe.h>
+#include "async.h"
+#include "accesslog.h"
+#include "pool.h"
+#include "util.h"
+
+extern module AP_MODULE_DECLARE_DATA okioki_module;
+
+/** A statement that is executed while its request is suspended.
+ */
+typedef struct {
+    request_rec       *http_request;
+    view_t            *view;
+    mod_okioki_conn_t *db_conn;
+    PGconn            *pg_conn;
+    PGresult          *pg_result;
+    apr_socket_t      *sockets[2];
+    apr_time_t        start;
+    apr_time_t        deadline;
+    async_complete_t  complete;
+} async_query_t;
+
+static int mod_okioki_async_can_suspend = 0;
+
+int mod_okioki_async_child_init(apr_pool_t *pool, server_rec *server)
+{
+    if (ap_mpm_query(AP_MPMQ_CAN_SUSPEND, &mod_okioki_async_can_suspend) != APR_SUCCESS) {
+        mod_okioki_async_can_suspend = 0;
+    }
+    return APR_SUCCESS;
+}
+
+/** Take the results that have arrived, without blocking.
+ *
+ * @returns  1 when all results were received, 0 when the socket must be waited on again.
+ */
+static int mod_okioki_async_consume(async_query_t *query)
+{
+    PGresult *pg_result;
+
+    for (;;) {
+        if (PQisBusy(query->pg_conn)) {
+            return 0;
+        }
+        if ((pg_result = PQgetResult(query->pg_conn)) == NULL) {
+            return 1;
+        }
+
+        // Only the last result of the statement is kept.
+        if (query->pg_result != NULL) {
+            PQclear(query->pg_result);
+        }
+        query->pg_result = pg_result;
+    }
+}
+
+static void mod_okioki_async_ready(void *baton);
+static void mod_okioki_async_timeout(void *baton);
+
+/** Wait for the database socket to become readable, until the server's Timeout has passed since the statement was sent.
+ */
+static apr_status_t mod_okioki_async_wait(async_query_t *query)
+{
+    apr_time_t timeout = query->deadline - apr_time_now();
+
+    return ap_mpm_register_socket_callback_timeout(
+        query->sockets, query->http_request->pool, 1, mod_okioki_async_ready, mod_okioki_async_timeout, query, timeout > 0 ? timeout : 0
+    );
+}
+
+/** Send the response of the suspended request and let the MPM continue with the connection.
+ */
+static void mod_okioki_async_finish(async_query_t *query, int ret, result_t *db_result, char **error)
+{
+    request_rec        *http_request = query->http_request;
+    conn_rec           *connection = http_request->connection;
+    accesslog_record_t *record;
+
+    if ((record = mod_okioki_accesslog_get(http_request)) != NULL) {
+        record->db_time = apr_time_now() - query->start;
+        record->nr_rows = db_result != NULL ? mod_okioki_result_num_tuples(db_result) : 0;
+    }
+
+    // Finish the request like the core would have after the handler, including sending an error that was returned.
+    ret = query->complete(http_request, query->view, ret, db_result, error);
+    if (ret == OK || ret == DONE || (ret = mod_okioki_response_failed(http_request, ret)) == OK) {
+        ap_finalize_request_protocol(http_request);
+    } else {
+        ap_die(ret, http_request);
+    }
+    ap_process_request_after_handler(http_request);
+    ap_mpm_resume_suspended(connection);
+}
+
+/** Called by the MPM on a worker thread when the database did not answer in time.
+ * The statement is cancelled, so that the connection can be reused, and the request is answered with an error.
+ */
+static void mod_okioki_async_timeout(void *baton)
+{
+    async_query_t *query = (async_query_t *)baton;
+    apr_pool_t    *pool = query->http_request->pool;
+    PGcancel      *cancel;
+    PGresult      *pg_result;
+    char          cancel_error[256];
+    char          *_error = NULL;
+    char          **error = &_error;
+
+    ap_mpm_unregister_socket_callback(query->sockets, pool);
+
+    if ((cancel = PQgetCancel(query->pg_conn)) != NULL) {
+        if (!PQcancel(cancel, cancel_error, sizeof (cancel_error))) {
+            ap_log_perror(APLOG_MARK, APLOG_ERR, 0, pool, "[mod_okioki] Could not cancel statement: %s", cancel_error);
+        }
+        PQfreeCancel(cancel);
+    }
+
+    // The results of the cancelled statement are read before the connection is released.
+    while ((pg_result = PQgetResult(query->pg_conn)) != NULL) {
+        PQclear(pg_result);
+    }
+    if (query->pg_result != NULL) {
+        PQclear(query->pg_result);
+        query->pg_result = NULL;
+    }
+
+    *error = apr_pstrdup(pool, "The database did not answer in time.");
+    ap_log_perror(APLOG_MARK, APLOG_ERR, 0, pool, "[mod_okioki] %s", *error);
+    mod_okioki_async_finish(query, HTTP_GATEWAY_TIME_OUT, NULL, error);
+}
+
+/** Called by the MPM on a worker thread when the database socket is readable.
+ * Finishes the suspended request once the whole result is received.
+ */
+static void mod_okioki_async_ready(void *baton)
+{
+    async_query_t      *query = (async_query_t *)baton;
+    request_rec        *http_request = query->http_request;
+    apr_pool_t         *pool = http_request->pool;
+    result_t           *db_result = NULL;
+    char               *_error = NULL;
+    char               **error = &_error;
+    int                ret = HTTP_OK;
+
+    ap_mpm_unregister_socket_callback(query->sockets, pool);
+
+    if (!PQconsumeInput(query->pg_conn)) {
+        ret = HTTP_BAD_GATEWAY;
+        *error = apr_pstrdup(pool, PQerrorMessage(query->pg_conn));
+
+    } else if (!mod_okioki_async_consume(query)) {
+        // Only part of the result has arrived, wait for the rest.
+        if (mod_okioki_async_wait(query) == APR_SUCCESS) {
+            return;
+        }
+        ret = HTTP_INTERNAL_SERVER_ERROR;
+        *error = apr_pstrdup(pool, "Could not wait for the database.");
+
+    } else if (query->pg_result == NULL) {
+        ret = HTTP_BAD_GATEWAY;
+        *error = apr_pstrdup(pool, "No result was received from the database.");
+
+    } else if (PQresultStatus(query->pg_result) != PGRES_TUPLES_OK && PQresultStatus(query->pg_result) != PGRES_COMMAND_OK) {
+        ret = HTTP_BAD_GATEWAY;
+        *error = apr_pstrdup(pool, PQresultErrorMessage(query->pg_result));
+        PQclear(query->pg_result);
+
+    } else if ((db_result = mod_okioki_result_make_pg(pool, query->pg_result)) == NULL) {
+        ret = HTTP_INTERNAL_SERVER_ERROR;
+        *error = apr_pstrdup(pool, "Could not allocate result.");
+        PQclear(query->pg_result);
+    }
+    if (db_result != NULL) {
+        db_result->columns = query->view->columns;
+    }
+    query->pg_result = NULL;
+
+    if (ret != HTTP_OK) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, 0, pool, "[mod_okioki] %s", *error);
+    }
+
+    mod_okioki_async_finish(query, ret, db_result, error);
+}
+
+int mod_okioki_async_begin(request_rec *http_request, view_t *view, apr_hash_t *arguments, async_complete_t complete, char **error)
+{
+    apr_pool_t               *pool = http_request->pool;
+    mod_okioki_server_config *scfg = (mod_okioki_server_config *)ap_get_module_config(http_request->server->module_config, &okioki_module);
+    async_query_t            *query;
+    apr_dbd_prepared_t       *db_statement;
+    apr_os_sock_t            fd;
+    const char               *name;
+    int                      argc = view->nr_sql_params;
+    const char               *argv[argc + 1];
+    int                      i;
+    int                      ret;
+
+    // Only PostgreSQL connections can be used without blocking; this is known before a connection is taken from the pool.
+    if (!mod_okioki_async_can_suspend || (scfg->primary != NULL && strcmp(scfg->db_driver_name, "pgsql") != 0)) {
+        return DECLINED;
+    }
+
+    ASSERT_NOT_NULL(
+        query = apr_pcalloc(pool, sizeof (async_query_t)),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate query."
+    )
+    query->http_request = http_request;
+    query->view         = view;
+    query->complete     = complete;
+    query->start        = apr_time_now();
+    query->deadline     = query->start + http_request->server->timeout;
+
+    // Copy the pointers parameters in the right order for the SQL statement.
+    for (i = 0; i < argc; i++) {
+        ASSERT_NOT_NULL(
+            argv[i] = apr_hash_get(arguments, view->sql_params[i], view->sql_params_len[i]),
+            HTTP_BAD_REQUEST, "Could not find parameter '%s' in request.", view->sql_params[i]
+        )
+    }
+    argv[i] = NULL;
+
+    ASSERT_HTTP_OK(
+        ret = mod_okioki_conn_acquire(http_request, http_request->method_number == M_GET, &query->db_conn, error),
+        ret, "Can not get database connection."
+    )
+
+    // mod_dbd keeps its connection for the request, it is used by the view handler instead.
+    if (strcmp(apr_dbd_name(query->db_conn->driver), "pgsql") != 0) {
+        return DECLINED;
+    }
+
+    // The statement is prepared the first time, by apr_dbd, before it is executed by name.
+    ASSERT_HTTP_OK(
+        ret = mod_okioki_conn_prepare(pool, query->db_conn, view, &db_statement, error),
+        ret, "Can not get prepared statement."
+    )
+    name = mod_okioki_conn_statement_name(pool, query->db_conn, view);
+
+    ASSERT_NOT_NULL(
+        query->pg_conn = apr_dbd_native_handle(query->db_conn->driver, query->db_conn->handle),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not get libpq connection."
+    )
+
+    fd = PQsocket(query->pg_conn);
+    ASSERT_APR_SUCCESS(
+        apr_os_sock_put(&query->sockets[0], &fd, pool),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not wrap database socket."
+    )
+    query->sockets[1] = NULL;
+
+    // The statement is small, so it is sent in blocking mode; only waiting for the result is asynchronous.
+    if (!PQsendQueryPrepared(query->pg_conn, name, argc, argv, NULL, NULL, 0)) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, 0, pool, "[mod_okioki] %s", PQerrorMessage(query->pg_conn));
+        *error = apr_pstrdup(pool, PQerrorMessage(query->pg_conn));
+        return HTTP_BAD_GATEWAY;
+    }
+
+    if ((ret = mod_okioki_async_wait(query)) != APR_SUCCESS) {
+        // Wait for the result here instead, so that the connection can be reused.
+        while ((query->pg_result = PQgetResult(query->pg_conn)) != NULL) {
+            PQclear(query->pg_result);
+        }
+        ap_log_perror(APLOG_MARK, APLOG_ERR, ret, pool, "[mod_okioki] Could not register database socket.");
+        *error = apr_pstrdup(pool, "Could not register database socket.");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    return SUSPENDED;
+}
@@ -0,0 +1,47 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <httpd.h>
+#include <http_log.h>
+#include <apr_hash.h>
+#include "mod_okioki.h"
+#include "result.h"
+
+/** Called on a worker thread when the result of an asynchronous view is received, to send the response.
+ *
+ * @param ret        HTTP_OK, or the HTTP status of the error.
+ * @param db_result  The result, NULL on error.
+ * @returns          OK, or the HTTP status of an error that is sent by the core.
+ */
+typedef int (*async_complete_t)(request_rec *http_request, view_t *view, int ret, result_t *db_result, char **error);
+
+/** Find out if the MPM can suspend requests, called once for each child.
+ */
+int mod_okioki_async_child_init(apr_pool_t *pool, server_rec *server);
+
+/** Send the statement of the view to the database without waiting for the result.
+ * The worker thread is released while the database executes the statement; when the result
+ * is received the complete function is called on a worker thread and the request is finished.
+ *
+ * @returns  SUSPENDED, DECLINED when the view can not be executed asynchronously, or the HTTP
+ *           status of an error before the request was suspended.
+ */
+int mod_okioki_async_begin(request_rec *http_request, view_t *view, apr_hash_t *arguments, async_complete_t complete, char **error);
+
+#endif
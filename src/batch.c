@@ -0,0 +1,266 @@
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <apr_hash.h>
+#include <apr_strings.h>
+#include <apr_dbd.h>
+#include <httpd.h>
+#include <http_log.h>
+#include <http_protocol.h>
+#include <http_request.h>
+#include "batch.h"
+#include "csv.h"
+#include "json.h"
+#include "params.h"
+#include "pool.h"
+#include "urlencoding.h"
+#include "views.h"
+#include "viewfile.h"
+
+typedef struct {
+    char   *path;
+    char   *query;
+    view_t *view;
+} batch_item_t;
+
+/** Execute a single view of the batch and append its result, or its error, to the brigade.
+ * Errors of a single view are returned in its entry, they do not fail the batch.
+ */
+static int mod_okioki_batch_item(request_rec *http_request, mod_okioki_dir_config *cfg, mod_okioki_conn_t *db_conn, batch_item_t *item, apr_bucket_brigade *bb, char **error)
+{
+    apr_pool_t         *pool = http_request->pool;
+    apr_bucket_alloc_t *alloc = bb->bucket_alloc;
+    apr_hash_t         *arguments;
+    apr_dbd_results_t  *db_single_result;
+    result_t           *db_result = NULL;
+    apr_bucket_brigade *csv_bb;
+    char               *csv;
+    apr_size_t         csv_len;
+    char               *_item_error = NULL;
+    char               **item_error = &_item_error;
+    int                ret;
+
+    ASSERT_NOT_NULL(
+        arguments = apr_hash_make(pool),
+        HTTP_INTERNAL_SERVER_ERROR, "Failed to allocate argument table."
+    )
+
+    if (item->view == NULL) {
+        ret = HTTP_NOT_FOUND;
+        _item_error = apr_psprintf(pool, "Could not find view for 'GET %s'.", item->path);
+
+    } else if (item->view->output_type == O_SSE) {
+        ret = HTTP_BAD_REQUEST;
+        _item_error = "Event streams can not be batched.";
+
+    } else if (item->view->output_type == O_RAW) {
+        ret = HTTP_BAD_REQUEST;
+        _item_error = "Raw views can not be batched.";
+
+    } else if (
+        (ret = mod_okioki_parse_query(http_request, arguments, item->query, item_error)) == HTTP_OK &&
+        (ret = mod_okioki_param_check(http_request, item->view, arguments, item_error)) == HTTP_OK
+    ) {
+        if (item->view->shard != NULL) {
+            // A sharded view needs connections to its shards.
+            ret = mod_okioki_view_execute(http_request, cfg, item->view, arguments, &db_result, item_error);
+
+        } else if ((ret = mod_okioki_view_select(pool, db_conn, item->view, arguments, &db_single_result, item_error)) == HTTP_OK) {
+            ASSERT_NOT_NULL(
+                db_result = mod_okioki_result_make(pool, db_conn->driver, db_single_result),
+                HTTP_INTERNAL_SERVER_ERROR, "Could not allocate result."
+            )
+            db_result->columns = item->view->columns;
+        }
+    }
+
+    ASSERT_APR_SUCCESS(
+        apr_brigade_puts(bb, NULL, NULL, "{\"path\": "),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not write batch."
+    )
+    ASSERT_HTTP_OK(
+        mod_okioki_json_append_string(bb, pool, alloc, item->path, error),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not write batch."
+    )
+    ASSERT_APR_SUCCESS(
+        apr_brigade_printf(bb, NULL, NULL, ", \"status\": %i, ", ret),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not write batch."
+    )
+
+    if (ret != HTTP_OK) {
+        ASSERT_APR_SUCCESS(
+            apr_brigade_puts(bb, NULL, NULL, "\"error\": "),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not write batch."
+        )
+        ASSERT_HTTP_OK(
+            mod_okioki_json_append_string(bb, pool, alloc, _item_error ? _item_error : "Could not execute view.", error),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not write batch."
+        )
+
+    } else if (item->view->output_type == O_CSV) {
+        // CSV is embedded as a string.
+        ASSERT_NOT_NULL(
+            csv_bb = apr_brigade_create(pool, alloc),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not allocate a bucket brigade."
+        )
+        ASSERT_HTTP_OK(
+            ret = mod_okioki_csv_append_result(csv_bb, pool, alloc, db_result, NULL, error),
+            ret, "Could not write CSV result."
+        )
+        ASSERT_APR_SUCCESS(
+            apr_brigade_pflatten(csv_bb, &csv, &csv_len, pool),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not flatten CSV result."
+        )
+        ASSERT_APR_SUCCESS(
+            apr_brigade_puts(bb, NULL, NULL, "\"body\": "),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not write batch."
+        )
+        ASSERT_HTTP_OK(
+            mod_okioki_json_append_string(bb, pool, alloc, apr_pstrmemdup(pool, csv, csv_len), error),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not write batch."
+        )
+
+    } else {
+        ASSERT_APR_SUCCESS(
+            apr_brigade_puts(bb, NULL, NULL, "\"body\": "),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not write batch."
+        )
+        ASSERT_HTTP_OK(
+            ret = mod_okioki_json_append_result(bb, pool, alloc, db_result, item->view->result_strings, item->view->nest, NULL, error),
+            ret, "Could not write JSON result."
+        )
+    }
+
+    ASSERT_APR_SUCCESS(
+        apr_brigade_puts(bb, NULL, NULL, "}"),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not write batch."
+    )
+    return HTTP_OK;
+}
+
+int mod_okioki_batch_handler(request_rec *http_request, mod_okioki_dir_config *cfg, const char *data, apr_size_t data_len, char **error)
+{
+    apr_pool_t            *pool = http_request->pool;
+    apr_bucket_alloc_t    *alloc = http_request->connection->bucket_alloc;
+    batch_item_t          items[MAX_BATCH_VIEWS];
+    int                   nr_items = 0;
+    mod_okioki_conn_t     *db_conn;
+    apr_dbd_transaction_t *db_transaction = NULL;
+    apr_bucket_brigade    *bb;
+    apr_bucket            *b;
+    char                  *lines;
+    char                  *line;
+    char                  *last;
+    int                   nr_rows;
+    int                   ret;
+    int                   i;
+
+    ASSERT_NOT_NULL(
+        lines = apr_pstrmemdup(pool, data, data_len),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not copy batch."
+    )
+
+    // Find all views before doing any database work.
+    for (line = apr_strtok(lines, "\r\n", &last); line != NULL; line = apr_strtok(NULL, "\r\n", &last)) {
+        ASSERT_POSITIVE(
+            MAX_BATCH_VIEWS - nr_items - 1,
+            HTTP_BAD_REQUEST, "Too many views in batch, the maximum is %i.", MAX_BATCH_VIEWS
+        )
+
+        items[nr_items].path = line;
+        if ((items[nr_items].query = strchr(line, '?')) != NULL) {
+            *items[nr_items].query++ = 0;
+        }
+        items[nr_items].view = mod_okioki_viewfile_find(http_request, cfg, apr_pstrcat(pool, "GET ", line, NULL));
+        nr_items++;
+    }
+
+    ASSERT_POSITIVE(
+        nr_items - 1,
+        HTTP_BAD_REQUEST, "Empty batch."
+    )
+
+    ASSERT_NOT_NULL(
+        bb = apr_brigade_create(pool, alloc),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate a bucket brigade."
+    )
+    ASSERT_APR_SUCCESS(
+        apr_brigade_puts(bb, NULL, NULL, "[\n"),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not write batch."
+    )
+
+    // All views use the same connection, from a read replica when there are any.
+    ASSERT_HTTP_OK(
+        ret = mod_okioki_conn_acquire(http_request, 1, &db_conn, error),
+        ret, "Can not get database connection."
+    )
+
+    // Optionally all views see the same snapshot of the database. The driver executes each statement
+    // within a savepoint and rolls back to it when the statement fails, so that a failing view does
+    // not abort the transaction for the views after it.
+    if (cfg->batch_snapshot) {
+        ASSERT_ZERO(
+            apr_dbd_transaction_start(db_conn->driver, pool, db_conn->handle, &db_transaction),
+            HTTP_BAD_GATEWAY, "Could not start transaction: %s", apr_dbd_error(db_conn->driver, db_conn->handle, 0)
+        )
+        apr_dbd_transaction_mode_set(db_conn->driver, db_transaction, APR_DBD_TRANSACTION_ROLLBACK | APR_DBD_TRANSACTION_IGNORE_ERRORS);
+
+        if (apr_dbd_query(db_conn->driver, db_conn->handle, &nr_rows, "SET TRANSACTION ISOLATION LEVEL REPEATABLE READ READ ONLY") != 0) {
+            *error = apr_psprintf(pool, "Could not set snapshot: %s", apr_dbd_error(db_conn->driver, db_conn->handle, 0));
+            apr_dbd_transaction_end(db_conn->driver, pool, db_transaction);
+            return HTTP_BAD_GATEWAY;
+        }
+    }
+
+    // Every error after the transaction was started breaks out of the loop, so that it is always ended.
+    for (i = 0; i < nr_items; i++) {
+        if (i > 0 && apr_brigade_puts(bb, NULL, NULL, ",\n") != APR_SUCCESS) {
+            *error = "Could not write batch.";
+            ret = HTTP_INTERNAL_SERVER_ERROR;
+            break;
+        }
+
+        if ((ret = mod_okioki_batch_item(http_request, cfg, db_conn, &items[i], bb, error)) != HTTP_OK) {
+            break;
+        }
+    }
+
+    // The snapshot was read only, so it is rolled back, also when the batch failed.
+    if (db_transaction != NULL) {
+        apr_dbd_transaction_end(db_conn->driver, pool, db_transaction);
+    }
+    if (ret != HTTP_OK) {
+        return ret;
+    }
+
+    ASSERT_APR_SUCCESS(
+        apr_brigade_puts(bb, NULL, NULL, "\n]\n"),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not write batch."
+    )
+
+    // Add an end-of-stream.
+    ASSERT_NOT_NULL(
+        b = apr_bucket_eos_create(alloc),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
+    )
+    APR_BRIGADE_INSERT_TAIL(bb, b);
+
+    // Return the data.
+    ap_set_content_type(http_request, "application/json");
+    http_request->status = HTTP_OK;
+    return ap_pass_brigade(http_request->output_filters, bb);
+}
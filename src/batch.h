@@ -0,0 +1,36 @@
+#ifndef BATCH_H
+#define BATCH_H
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <httpd.h>
+#include <http_log.h>
+#include "mod_okioki.h"
+
+#define MAX_BATCH_VIEWS 32
+
+/** Execute several GET views in one request, on one database connection.
+ * The request body has one view on each line, as a path with an optional query string:
+ *     /test_id?id=1
+ * The results are returned as a JSON list with an object for each view, holding the path, the status
+ * and either the body or the error. JSON and NDJSON views are embedded as JSON, CSV as a string.
+ *
+ * @param data  The request body.
+ */
+int mod_okioki_batch_handler(request_rec *http_request, mod_okioki_dir_config *cfg, const char *data, apr_size_t data_len, char **error);
+
+#endif
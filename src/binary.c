@@ -0,0 +1,750 @@
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <apr_hash.h>
+#include <apr_strings.h>
+#include <httpd.h>
+#include <http_config.h>
+#include <http_connection.h>
+#include <http_log.h>
+#include <http_protocol.h>
+#include <http_request.h>
+#include <util_filter.h>
+#include "binary.h"
+#include "accesslog.h"
+#include "admission.h"
+#include "params.h"
+#include "result.h"
+#include "util.h"
+#include "views.h"
+#include "writebehind.h"
+
+extern module AP_MODULE_DECLARE_DATA okioki_module;
+
+/** A view that can be executed over the binary protocol.
+ */
+typedef struct {
+    char                  *name;
+    char                  *method;
+    view_t                *view;
+    mod_okioki_dir_config *cfg;
+
+    // The server and the configuration of the location of the view, which its requests are executed in.
+    server_rec            *server;
+    ap_conf_vector_t      *section;
+    ap_conf_vector_t      *per_dir_config;
+} binary_view_t;
+
+/** State of a connection that speaks the binary protocol.
+ */
+typedef struct {
+    conn_rec           *connection;
+    apr_bucket_brigade *bb_in;
+    apr_bucket_brigade *bb_out;
+    apr_off_t          bytes_out;
+
+    // Received data, starting with the first frame that is not yet handled.
+    char               *in;
+    apr_size_t         in_len;
+    apr_size_t         in_size;
+} binary_conn_t;
+
+// Views indexed by statement number, and their ids by name; set at configuration time.
+static binary_view_t mod_okioki_binary_views[MAX_VIEWS];
+static int           mod_okioki_binary_nr_views;
+static apr_hash_t    *mod_okioki_binary_names;
+
+static apr_uint32_t mod_okioki_binary_get16(const unsigned char *p)
+{
+    return ((apr_uint32_t)p[0] << 8) | p[1];
+}
+
+static apr_uint32_t mod_okioki_binary_get32(const unsigned char *p)
+{
+    return ((apr_uint32_t)p[0] << 24) | ((apr_uint32_t)p[1] << 16) | ((apr_uint32_t)p[2] << 8) | p[3];
+}
+
+static apr_uint64_t mod_okioki_binary_get64(const unsigned char *p)
+{
+    return ((apr_uint64_t)mod_okioki_binary_get32(p) << 32) | mod_okioki_binary_get32(&p[4]);
+}
+
+static void mod_okioki_binary_put16(unsigned char *p, apr_uint32_t x)
+{
+    p[0] = (x >> 8) & 0xff;
+    p[1] = x & 0xff;
+}
+
+static void mod_okioki_binary_put32(unsigned char *p, apr_uint32_t x)
+{
+    p[0] = (x >> 24) & 0xff;
+    p[1] = (x >> 16) & 0xff;
+    p[2] = (x >> 8) & 0xff;
+    p[3] = x & 0xff;
+}
+
+void mod_okioki_binary_pre_config(void)
+{
+    memset(mod_okioki_binary_views, 0, sizeof (mod_okioki_binary_views));
+    mod_okioki_binary_nr_views = 0;
+    mod_okioki_binary_names    = NULL;
+}
+
+const char *mod_okioki_binary_register(cmd_parms *cmd, const char *method, const char *path, view_t *view, mod_okioki_dir_config *cfg)
+{
+    apr_pool_t    *pool = cmd->pool;
+    const char    *location = cmd->path;
+    binary_view_t *bview = &mod_okioki_binary_views[view->statement_nr];
+    char          *prefix = "";
+    apr_size_t    prefix_len;
+    int           *id;
+
+    if (mod_okioki_binary_names == NULL && (mod_okioki_binary_names = apr_hash_make(pool)) == NULL) {
+        return "Could not allocate table of view names.";
+    }
+
+    // The path of a view is relative to its location.
+    if (location != NULL && (prefix = apr_pstrdup(pool, location)) != NULL) {
+        prefix_len = strlen(prefix);
+        if (prefix_len > 0 && prefix[prefix_len - 1] == '/') {
+            prefix[prefix_len - 1] = 0;
+        }
+    }
+
+    if (
+        (bview->name = apr_pstrcat(pool, method, " ", prefix ? prefix : "", path, NULL)) == NULL ||
+        (bview->method = apr_pstrdup(pool, method)) == NULL ||
+        (id = apr_palloc(pool, sizeof (int))) == NULL
+    ) {
+        return "Could not allocate binary protocol view.";
+    }
+    bview->view    = view;
+    bview->cfg     = cfg;
+    bview->server  = cmd->server;
+    bview->section = (ap_conf_vector_t *)cmd->context;
+
+    *id = view->statement_nr;
+    apr_hash_set(mod_okioki_binary_names, bview->name, APR_HASH_KEY_STRING, id);
+
+    if (mod_okioki_binary_nr_views <= view->statement_nr) {
+        mod_okioki_binary_nr_views = view->statement_nr + 1;
+    }
+    return NULL;
+}
+
+int mod_okioki_binary_child_init(apr_pool_t *pool, server_rec *server)
+{
+    binary_view_t *bview;
+    int           i;
+
+    // A request over HTTP gets the same merged configuration from the core when its location is walked.
+    for (i = 0; i < mod_okioki_binary_nr_views; i++) {
+        bview = &mod_okioki_binary_views[i];
+        if (bview->view == NULL) {
+            continue;
+        }
+
+        if (bview->section == NULL || bview->section == bview->server->lookup_defaults) {
+            bview->per_dir_config = bview->server->lookup_defaults;
+        } else if ((bview->per_dir_config = ap_merge_per_dir_configs(pool, bview->server->lookup_defaults, bview->section)) == NULL) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, server, "[mod_okioki] Could not merge configuration of '%s'.", bview->name);
+            return APR_ENOMEM;
+        }
+    }
+    return APR_SUCCESS;
+}
+
+/** Find a view that is available over the binary protocol.
+ *
+ * @returns  The view, or NULL when there is no view with the id or its location has not enabled OkiokiBinaryViews.
+ */
+static binary_view_t *mod_okioki_binary_find(int view_id)
+{
+    binary_view_t *bview;
+
+    if (view_id < 0 || view_id >= mod_okioki_binary_nr_views) {
+        return NULL;
+    }
+    bview = &mod_okioki_binary_views[view_id];
+    if (bview->view == NULL || !bview->cfg->binary) {
+        return NULL;
+    }
+    return bview;
+}
+
+/** Write data to the response of the connection.
+ * The data is copied, and passed to the network when enough has been collected.
+ */
+static apr_status_t mod_okioki_binary_write(binary_conn_t *bc, const void *data, apr_size_t len)
+{
+    bc->bytes_out+= len;
+    return apr_brigade_write(bc->bb_out, ap_filter_flush, bc->connection->output_filters, (const char *)data, len);
+}
+
+static apr_status_t mod_okioki_binary_header(binary_conn_t *bc, apr_uint32_t stream, int type, apr_size_t len)
+{
+    unsigned char header[BINARY_HEADER_LEN];
+
+    mod_okioki_binary_put32(header, len);
+    mod_okioki_binary_put32(&header[4], stream);
+    header[8] = type;
+    return mod_okioki_binary_write(bc, header, BINARY_HEADER_LEN);
+}
+
+/** Send all buffered responses to the client.
+ */
+static apr_status_t mod_okioki_binary_flush(binary_conn_t *bc)
+{
+    apr_bucket   *b;
+    apr_status_t status;
+
+    if ((b = apr_bucket_flush_create(bc->connection->bucket_alloc)) == NULL) {
+        return APR_ENOMEM;
+    }
+    APR_BRIGADE_INSERT_TAIL(bc->bb_out, b);
+
+    status = ap_pass_brigade(bc->connection->output_filters, bc->bb_out);
+    apr_brigade_cleanup(bc->bb_out);
+    return status;
+}
+
+/** Read from the client, appending to the received data.
+ *
+ * @param block  APR_NONBLOCK_READ to only read what has already arrived.
+ * @returns      APR_SUCCESS, APR_EAGAIN when nothing has arrived, APR_EOF when the client closed the connection.
+ */
+static apr_status_t mod_okioki_binary_fill(binary_conn_t *bc, apr_read_type_e block)
+{
+    apr_size_t   new_size;
+    apr_size_t   len;
+    apr_status_t status;
+
+    // Make room for a full read, the buffer grows until it can hold the largest frame.
+    if (bc->in_size - bc->in_len < BINARY_READ_SIZE) {
+        new_size = mod_okioki_nlpo2(bc->in_len + BINARY_READ_SIZE);
+        if ((bc->in = mod_okioki_realloc(bc->connection->pool, bc->in, bc->in_len, new_size)) == NULL) {
+            return APR_ENOMEM;
+        }
+        bc->in_size = new_size;
+    }
+
+    status = ap_get_brigade(bc->connection->input_filters, bc->bb_in, AP_MODE_READBYTES, block, bc->in_size - bc->in_len);
+    if (status == APR_SUCCESS) {
+        len = bc->in_size - bc->in_len;
+        status = apr_brigade_flatten(bc->bb_in, &bc->in[bc->in_len], &len);
+        bc->in_len+= len;
+
+        if (status == APR_SUCCESS && len == 0) {
+            status = block == APR_BLOCK_READ ? APR_EOF : APR_EAGAIN;
+        }
+    }
+    apr_brigade_cleanup(bc->bb_in);
+    return status;
+}
+
+/** Build a request for a frame, so that the view is executed like a request over HTTP.
+ */
+static request_rec *mod_okioki_binary_request(conn_rec *connection, apr_pool_t *pool)
+{
+    request_rec *http_request;
+
+    if ((http_request = apr_pcalloc(pool, sizeof (request_rec))) == NULL) {
+        return NULL;
+    }
+
+    http_request->pool            = pool;
+    http_request->connection      = connection;
+    http_request->server          = connection->base_server;
+    http_request->request_time    = apr_time_now();
+    http_request->request_config  = ap_create_request_config(pool);
+    http_request->per_dir_config  = connection->base_server->lookup_defaults;
+    http_request->headers_in      = apr_table_make(pool, 1);
+    http_request->headers_out     = apr_table_make(pool, 1);
+    http_request->err_headers_out = apr_table_make(pool, 1);
+    http_request->subprocess_env  = apr_table_make(pool, 1);
+    http_request->notes           = apr_table_make(pool, 1);
+    http_request->protocol        = "OKIOKI";
+    http_request->method          = "GET";
+    http_request->method_number   = M_GET;
+    http_request->status          = HTTP_OK;
+    return http_request;
+}
+
+/** Answer a lookup of a view by name with its id.
+ */
+static int mod_okioki_binary_lookup(binary_conn_t *bc, request_rec *http_request, apr_uint32_t stream, const unsigned char *payload, apr_size_t len, char **error)
+{
+    apr_pool_t    *pool = http_request->pool;
+    unsigned char id[2];
+    char          *name;
+    int           *view_id;
+
+    ASSERT_NOT_NULL(
+        name = apr_pstrmemdup(pool, (const char *)payload, len),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not copy name of view."
+    )
+
+    if (
+        mod_okioki_binary_names == NULL || (view_id = apr_hash_get(mod_okioki_binary_names, name, APR_HASH_KEY_STRING)) == NULL ||
+        mod_okioki_binary_find(*view_id) == NULL
+    ) {
+        *error = apr_psprintf(pool, "Could not find view for '%s'.", name);
+        return HTTP_NOT_FOUND;
+    }
+
+    mod_okioki_binary_put16(id, *view_id);
+    ASSERT_APR_SUCCESS(
+        mod_okioki_binary_header(bc, stream, BINARY_VIEW_ID, 2),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not write view id."
+    )
+    ASSERT_APR_SUCCESS(
+        mod_okioki_binary_write(bc, id, 2),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not write view id."
+    )
+    return HTTP_OK;
+}
+
+/** Write the result as a frame with the column names and frames of rows.
+ * Each value is a 32 bit length, or 0xffffffff for NULL, followed by the value as returned by the database.
+ */
+static int mod_okioki_binary_rows(binary_conn_t *bc, apr_pool_t *pool, apr_uint32_t stream, result_t *db_result, int *_nr_rows, char **error)
+{
+    int            nr_cols = mod_okioki_result_num_cols(db_result);
+    int            nr_tuples = mod_okioki_result_num_tuples(db_result);
+    const char     **values;
+    apr_uint32_t   *values_len;
+    apr_dbd_row_t  *db_row;
+    unsigned char  buf[4];
+    const char     *value;
+    apr_size_t     len;
+    int            row_nr;
+    int            nr_rows;
+    int            col_nr;
+    int            i;
+
+    // The values of a chunk of rows, or the names of the columns.
+    ASSERT_NOT_NULL(
+        values = apr_palloc(pool, (OUTPUT_CHUNK_ROWS * nr_cols + 1) * sizeof (char *)),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate values."
+    )
+    ASSERT_NOT_NULL(
+        values_len = apr_palloc(pool, (OUTPUT_CHUNK_ROWS * nr_cols + 1) * sizeof (apr_uint32_t)),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate values."
+    )
+
+    // The names of the columns.
+    len = 2;
+    for (col_nr = 0; col_nr < nr_cols; col_nr++) {
+        ASSERT_NOT_NULL(
+            values[col_nr] = mod_okioki_result_get_name(db_result, col_nr),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not retrieve name of column from database result."
+        )
+        values_len[col_nr] = strlen(values[col_nr]);
+        len+= 2 + values_len[col_nr];
+    }
+
+    ASSERT_APR_SUCCESS(
+        mod_okioki_binary_header(bc, stream, BINARY_COLUMNS, len),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not write columns."
+    )
+    mod_okioki_binary_put16(buf, nr_cols);
+    ASSERT_APR_SUCCESS(
+        mod_okioki_binary_write(bc, buf, 2),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not write columns."
+    )
+    for (col_nr = 0; col_nr < nr_cols; col_nr++) {
+        mod_okioki_binary_put16(buf, values_len[col_nr]);
+        ASSERT_APR_SUCCESS(
+            mod_okioki_binary_write(bc, buf, 2),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not write columns."
+        )
+        ASSERT_APR_SUCCESS(
+            mod_okioki_binary_write(bc, values[col_nr], values_len[col_nr]),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not write columns."
+        )
+    }
+
+    // The rows in chunks, the length of a frame is known after the values of its rows are retrieved.
+    for (row_nr = 0; row_nr < nr_tuples; row_nr+= nr_rows) {
+        nr_rows = MIN(nr_tuples - row_nr, OUTPUT_CHUNK_ROWS);
+
+        len = 2;
+        for (i = 0; i < nr_rows; i++) {
+            ASSERT_APR_SUCCESS(
+                mod_okioki_result_get_row(db_result, pool, &db_row),
+                HTTP_INTERNAL_SERVER_ERROR, "Could not get row"
+            )
+
+            for (col_nr = 0; col_nr < nr_cols; col_nr++) {
+                value = mod_okioki_result_get_entry(db_result, db_row, col_nr);
+                values[i * nr_cols + col_nr]     = value;
+                values_len[i * nr_cols + col_nr] = value ? strlen(value) : 0xffffffff;
+                len+= 4 + (value ? values_len[i * nr_cols + col_nr] : 0);
+            }
+        }
+
+        ASSERT_APR_SUCCESS(
+            mod_okioki_binary_header(bc, stream, BINARY_ROWS, len),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not write rows."
+        )
+        mod_okioki_binary_put16(buf, nr_rows);
+        ASSERT_APR_SUCCESS(
+            mod_okioki_binary_write(bc, buf, 2),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not write rows."
+        )
+        for (i = 0; i < nr_rows * nr_cols; i++) {
+            mod_okioki_binary_put32(buf, values_len[i]);
+            ASSERT_APR_SUCCESS(
+                mod_okioki_binary_write(bc, buf, 4),
+                HTTP_INTERNAL_SERVER_ERROR, "Could not write rows."
+            )
+            if (values[i] != NULL) {
+                ASSERT_APR_SUCCESS(
+                    mod_okioki_binary_write(bc, values[i], values_len[i]),
+                    HTTP_INTERNAL_SERVER_ERROR, "Could not write rows."
+                )
+            }
+        }
+    }
+
+    *_nr_rows = nr_tuples;
+    return HTTP_OK;
+}
+
+/** Write the frame that completes a stream.
+ */
+static int mod_okioki_binary_end(binary_conn_t *bc, apr_pool_t *pool, apr_uint32_t stream, int status, int nr_rows, char **error)
+{
+    unsigned char buf[6];
+
+    mod_okioki_binary_put16(buf, status);
+    mod_okioki_binary_put32(&buf[2], nr_rows);
+    ASSERT_APR_SUCCESS(
+        mod_okioki_binary_header(bc, stream, BINARY_END, 6),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not write end of stream."
+    )
+    ASSERT_APR_SUCCESS(
+        mod_okioki_binary_write(bc, buf, 6),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not write end of stream."
+    )
+    return HTTP_OK;
+}
+
+/** Execute a view with the arguments of a query frame.
+ * The arguments are converted to text and checked like the arguments of an HTTP request, then the view is
+ * executed through the same limiters and the same execution path.
+ */
+static int mod_okioki_binary_query(binary_conn_t *bc, request_rec *http_request, apr_uint32_t stream, const unsigned char *p, apr_size_t len, char **error)
+{
+    apr_pool_t          *pool = http_request->pool;
+    const unsigned char *end = p + len;
+    binary_view_t       *bview;
+    view_t              *view;
+    apr_hash_t          *arguments;
+    accesslog_record_t  *record;
+    result_t            *db_result = NULL;
+    apr_time_t          start;
+    apr_uint64_t        bits;
+    apr_uint32_t        n;
+    double              d;
+    char                *value;
+    int                 view_id;
+    int                 nr_args;
+    int                 nr_rows = 0;
+    int                 ret;
+    int                 i;
+
+    ASSERT_POSITIVE(
+        (apr_off_t)len - 4,
+        HTTP_BAD_REQUEST, "Query frame is too short."
+    )
+    view_id = mod_okioki_binary_get16(p);
+    nr_args = mod_okioki_binary_get16(&p[2]);
+    p+= 4;
+
+    ASSERT_NOT_NULL(
+        bview = mod_okioki_binary_find(view_id),
+        HTTP_NOT_FOUND, "Could not find view %i.", view_id
+    )
+    view = bview->view;
+
+    // The view is executed in the server and the location it is configured in, like over HTTP.
+    http_request->server         = bview->server;
+    http_request->per_dir_config = bview->per_dir_config;
+    http_request->method         = bview->method;
+    http_request->method_number  = ap_method_number_of(bview->method);
+    http_request->the_request    = bview->name;
+    record = mod_okioki_accesslog_start(http_request, view, bview->name);
+
+    ASSERT_ZERO(
+        nr_args - (int)view->nr_sql_params,
+        HTTP_BAD_REQUEST, "View '%s' takes %i arguments.", bview->name, (int)view->nr_sql_params
+    )
+    ASSERT_NOT_NULL(
+        arguments = apr_hash_make(pool),
+        HTTP_INTERNAL_SERVER_ERROR, "Failed to allocate argument table."
+    )
+
+    // The arguments are in the order of the parameters of the view, each starting with its type.
+    for (i = 0; i < nr_args; i++) {
+        ASSERT_POSITIVE(
+            end - p - 1,
+            HTTP_BAD_REQUEST, "Argument %i is truncated.", i
+        )
+
+        switch (*p++) {
+        case BINARY_ARG_INT:
+            ASSERT_POSITIVE(
+                end - p - 8,
+                HTTP_BAD_REQUEST, "Argument %i is truncated.", i
+            )
+            value = apr_psprintf(pool, "%" APR_INT64_T_FMT, (apr_int64_t)mod_okioki_binary_get64(p));
+            p+= 8;
+            break;
+
+        case BINARY_ARG_FLOAT:
+            ASSERT_POSITIVE(
+                end - p - 8,
+                HTTP_BAD_REQUEST, "Argument %i is truncated.", i
+            )
+            bits = mod_okioki_binary_get64(p);
+            memcpy(&d, &bits, sizeof (d));
+            value = apr_psprintf(pool, "%.17g", d);
+            p+= 8;
+            break;
+
+        case BINARY_ARG_BOOL:
+            ASSERT_POSITIVE(
+                end - p - 1,
+                HTTP_BAD_REQUEST, "Argument %i is truncated.", i
+            )
+            value = *p++ ? "t" : "f";
+            break;
+
+        case BINARY_ARG_TEXT:
+            ASSERT_POSITIVE(
+                end - p - 4,
+                HTTP_BAD_REQUEST, "Argument %i is truncated.", i
+            )
+            n = mod_okioki_binary_get32(p);
+            p+= 4;
+            ASSERT_POSITIVE(
+                (end - p) - (apr_off_t)n,
+                HTTP_BAD_REQUEST, "Argument %i is truncated.", i
+            )
+            ASSERT_ZERO(
+                memchr(p, 0, n) != NULL,
+                HTTP_BAD_REQUEST, "Argument %i contains a nul character.", i
+            )
+            value = apr_pstrmemdup(pool, (const char *)p, n);
+            p+= n;
+            break;
+
+        default:
+            *error = apr_psprintf(pool, "Argument %i has an unknown type.", i);
+            return HTTP_BAD_REQUEST;
+        }
+
+        ASSERT_NOT_NULL(
+            value,
+            HTTP_INTERNAL_SERVER_ERROR, "Could not copy argument %i.", i
+        )
+        apr_hash_set(arguments, view->sql_params[i], view->sql_params_len[i], value);
+    }
+
+    if ((ret = mod_okioki_param_check(http_request, view, arguments, error)) != HTTP_OK) {
+        return ret;
+    }
+
+    // Requests to a write-behind view are queued and executed later in a batch.
+    if (view->writebehind != NULL) {
+        if ((ret = mod_okioki_writebehind_enqueue(http_request, view, arguments, error)) != HTTP_ACCEPTED) {
+            return ret;
+        }
+        http_request->status = HTTP_ACCEPTED;
+        return mod_okioki_binary_end(bc, pool, stream, HTTP_ACCEPTED, 0, error);
+    }
+
+    if (view->output_type == O_SSE) {
+        *error = "Event streams are not available over the binary protocol.";
+        return HTTP_BAD_REQUEST;
+    }
+
+    // Wait for a place in the directory and then in the view, before using a database connection.
+    if ((ret = mod_okioki_admission_enter(http_request, bview->cfg->limiter, error)) != HTTP_OK) {
+        return ret;
+    }
+    if ((ret = mod_okioki_admission_enter(http_request, view->limiter, error)) != HTTP_OK) {
+        mod_okioki_admission_leave(bview->cfg->limiter);
+        return ret;
+    }
+
+    start = apr_time_now();
+    ret = mod_okioki_view_execute(http_request, bview->cfg, view, arguments, &db_result, error);
+    if (record != NULL) {
+        record->db_time = apr_time_now() - start;
+    }
+
+    // The version of a conditional write is an argument of the query, a write that changed no rows was made against an older version.
+    if (ret == HTTP_OK && view->if_match != NULL) {
+        ret = mod_okioki_view_check_if_match(http_request, view, db_result, error);
+    }
+
+    if (ret == HTTP_OK && db_result != NULL) {
+        ret = mod_okioki_binary_rows(bc, pool, stream, db_result, &nr_rows, error);
+    }
+    mod_okioki_admission_leave(view->limiter);
+    mod_okioki_admission_leave(bview->cfg->limiter);
+
+    if (ret != HTTP_OK) {
+        return ret;
+    }
+    if (record != NULL) {
+        record->nr_rows = nr_rows;
+    }
+    return mod_okioki_binary_end(bc, pool, stream, HTTP_OK, nr_rows, error);
+}
+
+/** Handle a single frame, errors are returned to the client in an error frame on the stream.
+ * The memory and database connection used by the frame are released before the next frame.
+ *
+ * @returns  APR_SUCCESS, or the status of writing to the connection.
+ */
+static apr_status_t mod_okioki_binary_frame(binary_conn_t *bc, apr_uint32_t stream, int type, const unsigned char *payload, apr_size_t len)
+{
+    apr_pool_t    *pool;
+    request_rec   *http_request;
+    apr_off_t     bytes_out = bc->bytes_out;
+    unsigned char buf[2];
+    char          *_error = NULL;
+    char          **error = &_error;
+    apr_status_t  status = APR_SUCCESS;
+    int           ret;
+
+    if ((status = apr_pool_create(&pool, bc->connection->pool)) != APR_SUCCESS) {
+        return status;
+    }
+
+    if ((http_request = mod_okioki_binary_request(bc->connection, pool)) == NULL) {
+        ret = HTTP_INTERNAL_SERVER_ERROR;
+    } else if (type == BINARY_LOOKUP) {
+        ret = mod_okioki_binary_lookup(bc, http_request, stream, payload, len, error);
+    } else if (type == BINARY_QUERY) {
+        ret = mod_okioki_binary_query(bc, http_request, stream, payload, len, error);
+    } else {
+        ret = HTTP_BAD_REQUEST;
+        _error = apr_psprintf(pool, "Unknown frame type %i.", type);
+    }
+
+    if (ret != HTTP_OK) {
+        if (_error == NULL) {
+            _error = "Could not handle frame.";
+        }
+        mod_okioki_binary_put16(buf, ret);
+        if (
+            (status = mod_okioki_binary_header(bc, stream, BINARY_ERROR, 2 + strlen(_error))) == APR_SUCCESS &&
+            (status = mod_okioki_binary_write(bc, buf, 2)) == APR_SUCCESS
+        ) {
+            status = mod_okioki_binary_write(bc, _error, strlen(_error));
+        }
+    }
+
+    if (http_request != NULL) {
+        if (ret != HTTP_OK) {
+            http_request->status = ret;
+        }
+        http_request->bytes_sent = bc->bytes_out - bytes_out;
+        mod_okioki_accesslog_log_transaction(http_request);
+    }
+
+    apr_pool_destroy(pool);
+    return status;
+}
+
+int mod_okioki_binary_process_connection(conn_rec *connection)
+{
+    mod_okioki_server_config *scfg = (mod_okioki_server_config *)ap_get_module_config(connection->base_server->module_config, &okioki_module);
+    binary_conn_t            *bc;
+    apr_size_t               offset;
+    apr_uint32_t             len;
+    apr_status_t             status = APR_SUCCESS;
+
+    if (!scfg->binary_protocol) {
+        return DECLINED;
+    }
+
+    if (
+        (bc = apr_pcalloc(connection->pool, sizeof (binary_conn_t))) == NULL ||
+        (bc->bb_in = apr_brigade_create(connection->pool, connection->bucket_alloc)) == NULL ||
+        (bc->bb_out = apr_brigade_create(connection->pool, connection->bucket_alloc)) == NULL
+    ) {
+        ap_log_cerror(APLOG_MARK, APLOG_ERR, 0, connection, "[mod_okioki] Could not allocate binary protocol connection.");
+        return OK;
+    }
+    bc->connection = connection;
+    connection->keepalive = AP_CONN_CLOSE;
+
+    for (;;) {
+        // Handle all complete frames that have been received.
+        offset = 0;
+        while (bc->in_len - offset >= BINARY_HEADER_LEN) {
+            len = mod_okioki_binary_get32((unsigned char *)&bc->in[offset]);
+            if (len > BINARY_MAX_FRAME) {
+                ap_log_cerror(APLOG_MARK, APLOG_ERR, 0, connection, "[mod_okioki] Binary protocol frame of %u bytes is too large.", len);
+                return OK;
+            }
+            if (bc->in_len - offset - BINARY_HEADER_LEN < len) {
+                break;
+            }
+
+            if ((status = mod_okioki_binary_frame(
+                bc,
+                mod_okioki_binary_get32((unsigned char *)&bc->in[offset + 4]),
+                (unsigned char)bc->in[offset + 8],
+                (unsigned char *)&bc->in[offset + BINARY_HEADER_LEN],
+                len
+            )) != APR_SUCCESS) {
+                return OK;
+            }
+            offset+= BINARY_HEADER_LEN + len;
+        }
+
+        // Keep the start of an incomplete frame.
+        memmove(bc->in, &bc->in[offset], bc->in_len - offset);
+        bc->in_len-= offset;
+
+        // The responses are sent when the client has nothing more waiting, so that pipelined frames share packets.
+        if ((status = mod_okioki_binary_fill(bc, APR_NONBLOCK_READ)) == APR_SUCCESS) {
+            continue;
+        }
+        if (!APR_STATUS_IS_EAGAIN(status)) {
+            break;
+        }
+        if ((status = mod_okioki_binary_flush(bc)) != APR_SUCCESS) {
+            break;
+        }
+        if ((status = mod_okioki_binary_fill(bc, APR_BLOCK_READ)) != APR_SUCCESS) {
+            break;
+        }
+    }
+
+    if (!APR_STATUS_IS_EOF(status)) {
+        ap_log_cerror(APLOG_MARK, APLOG_DEBUG, status, connection, "[mod_okioki] Binary protocol connection closed.");
+    }
+    return OK;
+}
@@ -0,0 +1,72 @@
+#ifndef BINARY_H
+#define BINARY_H
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <httpd.h>
+#include <http_log.h>
+#include <http_config.h>
+#include "mod_okioki.h"
+
+#define BINARY_HEADER_LEN  9            // payload length, stream id and frame type
+#define BINARY_MAX_FRAME   1048576      // 1 MByte, largest payload of a request frame
+#define BINARY_READ_SIZE   65536        // 64 kbyte
+
+// Frames sent by the client.
+#define BINARY_LOOKUP      'L'          // name of a view, answered by BINARY_VIEW_ID
+#define BINARY_QUERY       'Q'          // view id and typed arguments, answered by the result
+
+// Frames sent by the server.
+#define BINARY_VIEW_ID     'I'          // view id
+#define BINARY_COLUMNS     'C'          // names of the columns
+#define BINARY_ROWS        'R'          // a chunk of rows
+#define BINARY_END         'E'          // status and number of rows, the stream is complete
+#define BINARY_ERROR       'X'          // status and message, the stream is complete
+
+// Types of the arguments of a query.
+#define BINARY_ARG_INT     'i'          // 64 bit signed integer
+#define BINARY_ARG_FLOAT   'd'          // 64 bit IEEE 754 floating point
+#define BINARY_ARG_BOOL    'b'          // single byte, zero is false
+#define BINARY_ARG_TEXT    's'          // 32 bit length followed by the characters
+
+/** Forget the views of the previous configuration, called before the configuration is (re)read.
+ */
+void mod_okioki_binary_pre_config(void);
+
+/** Make a view available over the binary protocol, at configuration time.
+ * The id of the view is its statement number, its name is the method and the full path of the view.
+ * The view is only executed when OkiokiBinaryViews is enabled for its location.
+ *
+ * @param cmd  The directive that configures the view, inside the section of its location.
+ * @returns    NULL, or an error message.
+ */
+const char *mod_okioki_binary_register(cmd_parms *cmd, const char *method, const char *path, view_t *view, mod_okioki_dir_config *cfg);
+
+/** Merge the configuration of the location of each view with that of its server, called once for each child.
+ */
+int mod_okioki_binary_child_init(apr_pool_t *pool, server_rec *server);
+
+/** Handle a connection to a server with OkiokiBinaryProtocol enabled.
+ * Frames are handled in the order they are received on the persistent connection, responses are
+ * buffered until the client has no more complete frames waiting, then sent together.
+ *
+ * @returns  DECLINED when the protocol is not enabled for the server, otherwise OK.
+ */
+int mod_okioki_binary_process_connection(conn_rec *connection);
+
+#endif
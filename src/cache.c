@@ -0,0 +1,446 @@
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <apr_hash.h>
+#include <apr_strings.h>
+#include <apr_thread_mutex.h>
+#include <httpd.h>
+#include <http_log.h>
+#include <http_protocol.h>
+#include <http_request.h>
+#include "cache.h"
+#include "admission.h"
+#include "capture.h"
+#include "csv.h"
+#include "delta.h"
+#include "json.h"
+#include "notify.h"
+#include "util.h"
+#include "views.h"
+
+struct cache_entry_t {
+    // The entry owns its pool, so that the response outlives the request that executed it.
+    apr_pool_t   *pool;
+    char         *key;
+    apr_size_t   key_len;
+    view_t       *view;
+    apr_time_t   expires;
+    apr_uint32_t generation;
+    int          nr_references;
+    capture_t    capture;
+
+    // Set while a request refreshes this stale entry.
+    int           refreshing;
+
+    // An expired entry with the same key, kept to be send when executing the view fails.
+    cache_entry_t *stale;
+    int           stale_sent;
+};
+
+static apr_thread_mutex_t *mod_okioki_cache_mutex;
+static apr_hash_t         *mod_okioki_cache_entries;
+
+/** Release a reference to an entry, the caller must hold the mutex.
+ */
+static void mod_okioki_cache_release(cache_entry_t *entry)
+{
+    if (--entry->nr_references == 0) {
+        apr_pool_destroy(entry->pool);
+    }
+}
+
+/** Remove an entry from the cache, the caller must hold the mutex.
+ */
+static void mod_okioki_cache_remove(cache_entry_t *entry)
+{
+    apr_hash_set(mod_okioki_cache_entries, entry->key, entry->key_len, NULL);
+    mod_okioki_cache_release(entry);
+}
+
+/** Remove all entries of views that depend on the channel.
+ */
+static void mod_okioki_cache_invalidate(channel_t *channel, const char *payload, void *data)
+{
+    apr_hash_index_t *hi;
+    void             *_entry;
+    cache_entry_t    *entry;
+    int              i;
+
+    apr_thread_mutex_lock(mod_okioki_cache_mutex);
+    for (hi = apr_hash_first(NULL, mod_okioki_cache_entries); hi != NULL; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, &_entry);
+        entry = (cache_entry_t *)_entry;
+
+        for (i = 0; i < entry->view->cache->channels->nelts; i++) {
+            if (APR_ARRAY_IDX(entry->view->cache->channels, i, channel_t *) == channel) {
+                mod_okioki_cache_remove(entry);
+                break;
+            }
+        }
+    }
+    apr_thread_mutex_unlock(mod_okioki_cache_mutex);
+}
+
+void mod_okioki_cache_forget(view_t *view)
+{
+    apr_hash_index_t *hi;
+    void             *_entry;
+
+    apr_thread_mutex_lock(mod_okioki_cache_mutex);
+    for (hi = apr_hash_first(NULL, mod_okioki_cache_entries); hi != NULL; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, &_entry);
+        if (((cache_entry_t *)_entry)->view == view) {
+            mod_okioki_cache_remove((cache_entry_t *)_entry);
+        }
+    }
+    apr_thread_mutex_unlock(mod_okioki_cache_mutex);
+
+    mod_okioki_delta_forget(view);
+}
+
+/** The time until an entry is kept, after it expired it may still be send as a stale response.
+ */
+static apr_time_t mod_okioki_cache_retain(cache_entry_t *entry)
+{
+    cache_spec_t *cache = entry->view->cache;
+
+    if (cache->stale_while_revalidate > cache->stale_if_error) {
+        return entry->expires + cache->stale_while_revalidate;
+    } else {
+        return entry->expires + cache->stale_if_error;
+    }
+}
+
+/** Remove all entries that are no longer kept, the caller must hold the mutex.
+ */
+static void mod_okioki_cache_purge(apr_time_t now)
+{
+    apr_hash_index_t *hi;
+    void             *_entry;
+
+    for (hi = apr_hash_first(NULL, mod_okioki_cache_entries); hi != NULL; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, &_entry);
+        if (mod_okioki_cache_retain((cache_entry_t *)_entry) <= now) {
+            mod_okioki_cache_remove((cache_entry_t *)_entry);
+        }
+    }
+}
+
+int mod_okioki_cache_child_init(apr_pool_t *pool, server_rec *server)
+{
+    apr_status_t ret;
+
+    if ((ret = apr_thread_mutex_create(&mod_okioki_cache_mutex, APR_THREAD_MUTEX_DEFAULT, pool)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, ret, server, "[mod_okioki] Could not create cache mutex.");
+        return ret;
+    }
+
+    if ((mod_okioki_cache_entries = apr_hash_make(pool)) == NULL) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, server, "[mod_okioki] Could not create cache table.");
+        return APR_ENOMEM;
+    }
+
+    mod_okioki_notify_subscribe(pool, mod_okioki_cache_invalidate, NULL);
+    return APR_SUCCESS;
+}
+
+/** Create an entry to fill, it gets its own pool, as it outlives the request.
+ */
+static cache_entry_t *mod_okioki_cache_create(request_rec *http_request, view_t *view, const char *key, apr_size_t key_len)
+{
+    cache_entry_t *entry;
+    apr_pool_t    *entry_pool;
+
+    if (apr_pool_create(&entry_pool, NULL) != APR_SUCCESS) {
+        return NULL;
+    }
+
+    if (
+        (entry = apr_pcalloc(entry_pool, sizeof (cache_entry_t))) == NULL ||
+        (entry->key = apr_pmemdup(entry_pool, key, key_len)) == NULL
+    ) {
+        apr_pool_destroy(entry_pool);
+        return NULL;
+    }
+    entry->pool          = entry_pool;
+    entry->key_len       = key_len;
+    entry->view          = view;
+    entry->expires       = http_request->request_time + view->cache->ttl;
+    entry->nr_references = 1;
+
+    // Notifications received from now on make the result stale.
+    entry->generation    = mod_okioki_notify_generation(view->cache->channels);
+    return entry;
+}
+
+/** Send the response of an entry, or 304 Not Modified when the client already has it.
+ * A client with an older version may get a patch instead.
+ * The caller must hold a reference to the entry.
+ */
+static int mod_okioki_cache_send(request_rec *http_request, cache_entry_t *entry, int flush, char **error)
+{
+    const char *if_none_match;
+    int        ret;
+
+    if_none_match = apr_table_get(http_request->headers_in, "If-None-Match");
+    if (if_none_match != NULL && entry->capture.etag != NULL && mod_okioki_etag_match(if_none_match, entry->capture.etag)) {
+        apr_table_setn(http_request->headers_out, "ETag", apr_pstrdup(http_request->pool, entry->capture.etag));
+        return HTTP_NOT_MODIFIED;
+    }
+
+    // A cached entry is never modified, so it is safe to read without the lock.
+    if (entry->capture.etag != NULL && (ret = mod_okioki_delta_send(http_request, entry->view, entry->key, entry->key_len, entry->capture.etag, error)) != DECLINED) {
+        return ret;
+    }
+    return mod_okioki_capture_send(http_request, &entry->capture, flush, error);
+}
+
+/** Generate the response of the view into the capture of an entry, without sending it.
+ * Streamed output types are not rendered.
+ */
+static int mod_okioki_cache_render(request_rec *http_request, view_t *view, result_t *db_result, capture_t *capture, char **error)
+{
+    apr_pool_t         *pool = http_request->pool;
+    apr_bucket_alloc_t *alloc = http_request->connection->bucket_alloc;
+    apr_bucket_brigade *bb;
+    int                ret;
+
+    ASSERT_NOT_NULL(
+        bb = apr_brigade_create(pool, alloc),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate a bucket brigade."
+    )
+
+    switch (view->output_type) {
+    case O_CSV:
+        capture->content_type = "text/csv";
+        ret = mod_okioki_csv_append_result(bb, pool, alloc, db_result, NULL, error);
+        break;
+    case O_JSON:
+        capture->content_type = "application/json";
+        ret = mod_okioki_json_append_result(bb, pool, alloc, db_result, view->result_strings, view->nest, NULL, error);
+        break;
+    default:
+        return DECLINED;
+    }
+    if (ret != HTTP_OK) {
+        return ret;
+    }
+
+    ASSERT_APR_SUCCESS(
+        apr_brigade_pflatten(bb, &capture->data, &capture->data_len, capture->pool),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not flatten refreshed response."
+    )
+    apr_brigade_destroy(bb);
+
+    capture->data_size = capture->data_len;
+    capture->status    = HTTP_OK;
+    capture->etag      = mod_okioki_etag(capture->pool, capture->data, capture->data_len);
+    capture->complete  = 1;
+    return HTTP_OK;
+}
+
+/** Execute the view again and replace the stale entry, after its response was send to the client.
+ * The refresh waits for a place in the limiters of the directory and the view like any execution;
+ * when it is rejected the entry stays stale, and a later request tries again.
+ */
+static void mod_okioki_cache_refresh(request_rec *http_request, mod_okioki_dir_config *cfg, view_t *view, apr_hash_t *arguments, cache_entry_t *stale)
+{
+    cache_entry_t *fill;
+    result_t      *db_result;
+    char          *error = NULL;
+
+    if (mod_okioki_admission_enter(http_request, cfg->limiter, &error) != HTTP_OK) {
+        return;
+    }
+    if (mod_okioki_admission_enter(http_request, view->limiter, &error) != HTTP_OK) {
+        mod_okioki_admission_leave(cfg->limiter);
+        return;
+    }
+
+    if ((fill = mod_okioki_cache_create(http_request, view, stale->key, stale->key_len)) != NULL) {
+        fill->capture.pool = fill->pool;
+
+        if (
+            mod_okioki_view_execute(http_request, cfg, view, arguments, &db_result, &error) == HTTP_OK &&
+            db_result != NULL
+        ) {
+            mod_okioki_cache_render(http_request, view, db_result, &fill->capture, &error);
+        }
+
+        // An incomplete entry is released without being stored.
+        mod_okioki_cache_end(fill);
+    }
+
+    mod_okioki_admission_leave(view->limiter);
+    mod_okioki_admission_leave(cfg->limiter);
+}
+
+int mod_okioki_cache_begin(request_rec *http_request, mod_okioki_dir_config *cfg, view_t *view, const char *view_name, apr_hash_t *arguments, cache_entry_t **_fill, char **error)
+{
+    apr_pool_t    *pool = http_request->pool;
+    apr_time_t    now = http_request->request_time;
+    cache_entry_t *entry;
+    cache_entry_t *stale = NULL;
+    char          *key;
+    apr_size_t    key_len;
+    int           refresh;
+    int           ret;
+
+    *_fill = NULL;
+    if (mod_okioki_cache_entries == NULL) {
+        return DECLINED;
+    }
+
+    // The response depends on the version of the client and whether it understands patches.
+    if (view->delta != NULL) {
+        apr_table_mergen(http_request->headers_out, "Vary", "Accept, If-None-Match");
+    }
+
+    // Let the view report a missing parameter.
+    if (mod_okioki_view_key(pool, view, view_name, arguments, &key, &key_len, error) != HTTP_OK) {
+        return DECLINED;
+    }
+
+    apr_thread_mutex_lock(mod_okioki_cache_mutex);
+    if ((entry = apr_hash_get(mod_okioki_cache_entries, key, key_len)) != NULL) {
+        if (entry->expires > now) {
+            entry->nr_references++;
+            apr_thread_mutex_unlock(mod_okioki_cache_mutex);
+
+            ret = mod_okioki_cache_send(http_request, entry, 0, error);
+
+            apr_thread_mutex_lock(mod_okioki_cache_mutex);
+            mod_okioki_cache_release(entry);
+            apr_thread_mutex_unlock(mod_okioki_cache_mutex);
+            return ret;
+        }
+
+        if (
+            entry->expires + view->cache->stale_while_revalidate > now &&
+            (view->output_type == O_CSV || view->output_type == O_JSON)
+        ) {
+            // The stale response is send right away, only the first request refreshes it, after the
+            // response has been flushed to its client.
+            refresh = !entry->refreshing;
+            entry->refreshing = 1;
+            entry->nr_references++;
+            apr_thread_mutex_unlock(mod_okioki_cache_mutex);
+
+            ret = mod_okioki_cache_send(http_request, entry, refresh, error);
+            if (refresh) {
+                mod_okioki_cache_refresh(http_request, cfg, view, arguments, entry);
+            }
+
+            apr_thread_mutex_lock(mod_okioki_cache_mutex);
+            if (refresh) {
+                // When the refresh failed, the next request may try again.
+                entry->refreshing = 0;
+            }
+            mod_okioki_cache_release(entry);
+            apr_thread_mutex_unlock(mod_okioki_cache_mutex);
+            return ret;
+        }
+
+        if (entry->expires + view->cache->stale_if_error > now) {
+            // Keep the stale entry, in case executing the view fails.
+            stale = entry;
+            stale->nr_references++;
+        } else {
+            mod_okioki_cache_remove(entry);
+        }
+    }
+    apr_thread_mutex_unlock(mod_okioki_cache_mutex);
+
+    // Fill the cache.
+    if ((entry = mod_okioki_cache_create(http_request, view, key, key_len)) == NULL) {
+        if (stale != NULL) {
+            apr_thread_mutex_lock(mod_okioki_cache_mutex);
+            mod_okioki_cache_release(stale);
+            apr_thread_mutex_unlock(mod_okioki_cache_mutex);
+        }
+        return DECLINED;
+    }
+    entry->stale = stale;
+
+    mod_okioki_capture_start(http_request, &entry->capture, entry->pool, 1);
+
+    *_fill = entry;
+    return DECLINED;
+}
+
+int mod_okioki_cache_send_stale(request_rec *http_request, cache_entry_t *fill, char **error)
+{
+    if (fill->stale == NULL) {
+        return DECLINED;
+    }
+
+    // The stale response passes through the capture of the fill, it must not be stored again.
+    fill->stale_sent = 1;
+    return mod_okioki_cache_send(http_request, fill->stale, 0, error);
+}
+
+void mod_okioki_cache_end(cache_entry_t *fill)
+{
+    cache_entry_t *old;
+
+    // The entry may be freed below, while the request still passes data through the filter.
+    mod_okioki_capture_stop(&fill->capture);
+
+    apr_thread_mutex_lock(mod_okioki_cache_mutex);
+    if (fill->stale != NULL) {
+        mod_okioki_cache_release(fill->stale);
+        fill->stale = NULL;
+    }
+
+    if (
+        !fill->capture.complete ||
+        fill->capture.status != HTTP_OK ||
+        fill->stale_sent ||
+        fill->generation != mod_okioki_notify_generation(fill->view->cache->channels)
+    ) {
+        mod_okioki_cache_release(fill);
+        apr_thread_mutex_unlock(mod_okioki_cache_mutex);
+        return;
+    }
+    // Another request may have filled the same entry.
+    if ((old = apr_hash_get(mod_okioki_cache_entries, fill->key, fill->key_len)) != NULL) {
+        mod_okioki_cache_remove(old);
+    }
+
+    if (apr_hash_count(mod_okioki_cache_entries) >= MAX_CACHE_ENTRIES) {
+        mod_okioki_cache_purge(apr_time_now());
+    }
+
+    if (apr_hash_count(mod_okioki_cache_entries) >= MAX_CACHE_ENTRIES) {
+        mod_okioki_cache_release(fill);
+        apr_thread_mutex_unlock(mod_okioki_cache_mutex);
+        return;
+    }
+    apr_hash_set(mod_okioki_cache_entries, fill->key, fill->key_len, fill);
+
+    // Keep the new version for patches, without holding the lock while it is split into rows.
+    if (fill->view->delta != NULL) {
+        fill->nr_references++;
+        apr_thread_mutex_unlock(mod_okioki_cache_mutex);
+
+        mod_okioki_delta_record(fill->view, fill->key, fill->key_len, fill->capture.etag, fill->capture.data, fill->capture.data_len);
+
+        apr_thread_mutex_lock(mod_okioki_cache_mutex);
+        mod_okioki_cache_release(fill);
+    }
+    apr_thread_mutex_unlock(mod_okioki_cache_mutex);
+}
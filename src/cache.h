@@ -0,0 +1,60 @@
+#ifndef CACHE_H
+#define CACHE_H
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <httpd.h>
+#include <http_log.h>
+#include "mod_okioki.h"
+
+#define MAX_CACHE_ENTRIES 1024
+
+/** A cached response of a view.
+ */
+typedef struct cache_entry_t cache_entry_t;
+
+/** Create the cache and subscribe to the notification channels, called once for each child.
+ */
+int mod_okioki_cache_child_init(apr_pool_t *pool, server_rec *server);
+
+/** Remove all entries of a view, before the view is freed.
+ */
+void mod_okioki_cache_forget(view_t *view);
+
+/** Send the cached response of the view with these arguments.
+ * When the client already has the response, as told by If-None-Match, 304 Not Modified is returned.
+ *
+ * @param fill  On return the entry to pass to mod_okioki_cache_end(), when this request
+ *              must execute the view to fill the cache, otherwise NULL.
+ * @returns     DECLINED when the caller must execute the view itself, otherwise the result
+ *              of sending the cached response.
+ */
+int mod_okioki_cache_begin(request_rec *http_request, mod_okioki_dir_config *cfg, view_t *view, const char *view_name, apr_hash_t *arguments, cache_entry_t **fill, char **error);
+
+/** Send the stale response instead, when executing the view failed.
+ *
+ * @param fill  The entry returned by mod_okioki_cache_begin().
+ * @returns     DECLINED when there is no stale response, otherwise the result of sending it.
+ */
+int mod_okioki_cache_send_stale(request_rec *http_request, cache_entry_t *fill, char **error);
+
+/** Store the response in the cache, unless it failed, the stale response was send or a notification
+ * was received while it was executed.
+ */
+void mod_okioki_cache_end(cache_entry_t *fill);
+
+#endif
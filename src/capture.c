@@ -0,0 +1,168 @@
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <apr_strings.h>
+#include <httpd.h>
+#include <http_log.h>
+#include <http_protocol.h>
+#include <http_request.h>
+#include <util_filter.h>
+#include "capture.h"
+#include "util.h"
+
+static ap_filter_rec_t *mod_okioki_capture_filter_handle;
+
+/** Copy the response into the capture, while passing it on to the next filter.
+ * Only the request that is captured writes to the capture, until it is complete.
+ */
+static apr_status_t mod_okioki_capture_filter(ap_filter_t *f, apr_bucket_brigade *bb)
+{
+    capture_t   *capture = (capture_t *)f->ctx;
+    apr_bucket  *bucket;
+    const char  *tmp_data;
+    apr_size_t  tmp_data_len;
+    apr_size_t  new_size;
+
+    for (bucket = APR_BRIGADE_FIRST(bb); bucket != APR_BRIGADE_SENTINEL(bb); bucket = APR_BUCKET_NEXT(bucket)) {
+        if (APR_BUCKET_IS_EOS(bucket)) {
+            capture->status       = f->r->status;
+            capture->content_type = f->r->content_type ? apr_pstrdup(capture->pool, f->r->content_type) : NULL;
+
+            // The copy gets its ETag however many passes it took, the response itself only when its
+            // headers have not been sent yet, which is when this is the first pass.
+            if (capture->want_etag) {
+                capture->etag = mod_okioki_etag(capture->pool, capture->data, capture->data_len);
+
+                if (capture->nr_passes == 0 && capture->status == HTTP_OK) {
+                    apr_table_setn(f->r->headers_out, "ETag", apr_pstrdup(f->r->pool, capture->etag));
+                }
+            }
+
+            capture->complete = 1;
+            break;
+        }
+
+        if (APR_BUCKET_IS_METADATA(bucket)) {
+            continue;
+        }
+
+        if (apr_bucket_read(bucket, &tmp_data, &tmp_data_len, APR_BLOCK_READ) != APR_SUCCESS) {
+            return ap_pass_brigade(f->next, bb);
+        }
+
+        // Grow the buffer when needed.
+        if (tmp_data_len > (capture->data_size - capture->data_len)) {
+            new_size = mod_okioki_nlpo2(capture->data_len + tmp_data_len);
+            if ((capture->data = mod_okioki_realloc(capture->pool, capture->data, capture->data_len, new_size)) == NULL) {
+                return APR_ENOMEM;
+            }
+            capture->data_size = new_size;
+        }
+
+        memcpy(&capture->data[capture->data_len], tmp_data, tmp_data_len);
+        capture->data_len+= tmp_data_len;
+    }
+
+    capture->nr_passes++;
+    return ap_pass_brigade(f->next, bb);
+}
+
+void mod_okioki_capture_register_hooks(apr_pool_t *pool)
+{
+    mod_okioki_capture_filter_handle = ap_register_output_filter(
+        "OKIOKI_CAPTURE", mod_okioki_capture_filter, NULL, AP_FTYPE_RESOURCE
+    );
+}
+
+void mod_okioki_capture_start(request_rec *http_request, capture_t *capture, apr_pool_t *pool, int want_etag)
+{
+    capture->pool         = pool;
+    capture->want_etag    = want_etag;
+    capture->complete     = 0;
+    capture->status       = 0;
+    capture->content_type = NULL;
+    capture->etag         = NULL;
+    capture->data         = NULL;
+    capture->data_len     = 0;
+    capture->data_size    = 0;
+    capture->nr_passes    = 0;
+
+    capture->filter = ap_add_output_filter_handle(mod_okioki_capture_filter_handle, capture, http_request, http_request->connection);
+    if (want_etag) {
+        apr_table_setn(http_request->notes, CAPTURE_WHOLE_NOTE, "1");
+    }
+}
+
+int mod_okioki_capture_whole(request_rec *http_request)
+{
+    return apr_table_get(http_request->notes, CAPTURE_WHOLE_NOTE) != NULL;
+}
+
+void mod_okioki_capture_stop(capture_t *capture)
+{
+    if (capture->filter != NULL) {
+        apr_table_unset(capture->filter->r->notes, CAPTURE_WHOLE_NOTE);
+        ap_remove_output_filter(capture->filter);
+        capture->filter = NULL;
+    }
+}
+
+int mod_okioki_capture_send(request_rec *http_request, capture_t *capture, int flush, char **error)
+{
+    apr_pool_t         *pool = http_request->pool;
+    apr_bucket_alloc_t *alloc = http_request->connection->bucket_alloc;
+    apr_bucket_brigade *bb;
+    apr_bucket         *b;
+
+    ASSERT_NOT_NULL(
+        bb = apr_brigade_create(pool, alloc),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate a bucket brigade."
+    )
+
+    // The data is owned by the capture, filters that hold on to it will make their own copy.
+    if (capture->data_len > 0) {
+        ASSERT_NOT_NULL(
+            b = apr_bucket_transient_create(capture->data, capture->data_len, alloc),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
+        )
+        APR_BRIGADE_INSERT_TAIL(bb, b);
+    }
+
+    if (flush) {
+        ASSERT_NOT_NULL(
+            b = apr_bucket_flush_create(alloc),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
+        )
+        APR_BRIGADE_INSERT_TAIL(bb, b);
+    }
+
+    // Add an end-of-stream.
+    ASSERT_NOT_NULL(
+        b = apr_bucket_eos_create(alloc),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
+    )
+    APR_BRIGADE_INSERT_TAIL(bb, b);
+
+    if (capture->content_type != NULL) {
+        ap_set_content_type(http_request, apr_pstrdup(pool, capture->content_type));
+    }
+    if (capture->etag != NULL && capture->status == HTTP_OK) {
+        apr_table_setn(http_request->headers_out, "ETag", apr_pstrdup(pool, capture->etag));
+    }
+    http_request->status = capture->status;
+    return ap_pass_brigade(http_request->output_filters, bb);
+}
@@ -0,0 +1,83 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <httpd.h>
+#include <http_log.h>
+#include <util_filter.h>
+#include "mod_okioki.h"
+
+#define CAPTURE_WHOLE_NOTE "mod_okioki_capture_whole"
+
+/** A copy of a response, made while it is send to the client.
+ */
+typedef struct {
+    // The pool the copy is allocated on, it may outlive the request.
+    apr_pool_t *pool;
+
+    // Set when the ETag of the response must be calculated.
+    int        want_etag;
+
+    // Only valid when complete is set.
+    int        complete;
+    int        status;
+    const char *content_type;
+    const char *etag;
+    char       *data;
+    apr_size_t data_len;
+    apr_size_t data_size;
+
+    // Number of times data was passed to the next filter, headers are only sent on the first pass.
+    int        nr_passes;
+
+    // The filter of the request that fills the capture, NULL when it was removed.
+    ap_filter_t *filter;
+} capture_t;
+
+/** Register the output filter that captures responses.
+ */
+void mod_okioki_capture_register_hooks(apr_pool_t *pool);
+
+/** Start capturing the response of the request.
+ * When want_etag is set the ETag of the copy is calculated, and when the whole response is passed in
+ * one go the ETag header is added to the response as well.
+ *
+ * @param pool  The pool to allocate the copy on.
+ */
+void mod_okioki_capture_start(request_rec *http_request, capture_t *capture, apr_pool_t *pool, int want_etag);
+
+/** Check if the response of the request is captured with its ETag.
+ * The captured copy is kept whole anyway, so such a response is generated whole as well and
+ * passed in one go, so that the ETag header is sent with it.
+ */
+int mod_okioki_capture_whole(request_rec *http_request);
+
+/** Stop capturing the response of the request.
+ * Must be called before the pool of the capture is destroyed, as the request may still pass data,
+ * such as a late end-of-stream, through the filter.
+ */
+void mod_okioki_capture_stop(capture_t *capture);
+
+/** Send a copy of a captured response.
+ * The copy must not be modified or freed while it is being send.
+ *
+ * @param flush  Set to write the response to the client right away, before the request is finished.
+ */
+int mod_okioki_capture_send(request_rec *http_request, capture_t *capture, int flush, char **error);
+
+#endif
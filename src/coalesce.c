@@ -0,0 +1,160 @@
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <apr_hash.h>
+#include <apr_strings.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#include <httpd.h>
+#include <http_log.h>
+#include <http_protocol.h>
+#include <http_request.h>
+#include <util_filter.h>
+#include "coalesce.h"
+#include "capture.h"
+#include "views.h"
+
+struct coalesce_flight_t {
+    // The flight owns its pool, so that the response outlives the request that executed it.
+    apr_pool_t        *pool;
+    char              *key;
+    apr_size_t        key_len;
+    apr_thread_cond_t *cond;
+    int               nr_references;
+
+    // The captured response, only valid when done and complete are set. Only a successful response is
+    // shared, the waiters of a request that failed execute the view themselves.
+    int               done;
+    capture_t         capture;
+};
+
+static apr_thread_mutex_t *mod_okioki_coalesce_mutex;
+static apr_hash_t         *mod_okioki_coalesce_flights;
+
+/** Release a reference to a flight, the caller must hold the mutex.
+ */
+static void mod_okioki_coalesce_release(coalesce_flight_t *flight)
+{
+    if (--flight->nr_references == 0) {
+        apr_pool_destroy(flight->pool);
+    }
+}
+
+int mod_okioki_coalesce_child_init(apr_pool_t *pool, server_rec *server)
+{
+    apr_status_t ret;
+
+    if ((ret = apr_thread_mutex_create(&mod_okioki_coalesce_mutex, APR_THREAD_MUTEX_DEFAULT, pool)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, ret, server, "[mod_okioki] Could not create coalesce mutex.");
+        return ret;
+    }
+
+    if ((mod_okioki_coalesce_flights = apr_hash_make(pool)) == NULL) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, server, "[mod_okioki] Could not create coalesce table.");
+        return APR_ENOMEM;
+    }
+
+    return APR_SUCCESS;
+}
+
+int mod_okioki_coalesce_begin(request_rec *http_request, view_t *view, const char *view_name, apr_hash_t *arguments, coalesce_flight_t **_flight, char **error)
+{
+    apr_pool_t        *pool = http_request->pool;
+    coalesce_flight_t *flight;
+    apr_pool_t        *flight_pool;
+    char              *key;
+    apr_size_t        key_len;
+    apr_time_t        deadline;
+    int               ret;
+
+    *_flight = NULL;
+    if (mod_okioki_coalesce_flights == NULL) {
+        return DECLINED;
+    }
+
+    // Let the view report a missing parameter.
+    if (mod_okioki_view_key(pool, view, view_name, arguments, &key, &key_len, error) != HTTP_OK) {
+        return DECLINED;
+    }
+
+    apr_thread_mutex_lock(mod_okioki_coalesce_mutex);
+    if ((flight = apr_hash_get(mod_okioki_coalesce_flights, key, key_len)) != NULL) {
+        // Wait for the request in flight.
+        flight->nr_references++;
+        deadline = apr_time_now() + view->coalesce_timeout;
+        while (!flight->done && apr_time_now() < deadline) {
+            apr_thread_cond_timedwait(flight->cond, mod_okioki_coalesce_mutex, deadline - apr_time_now());
+        }
+
+        if (flight->done && flight->capture.complete && flight->capture.status == HTTP_OK) {
+            // The flight is done and will not be modified anymore, so it is safe to read without the lock.
+            apr_thread_mutex_unlock(mod_okioki_coalesce_mutex);
+            ret = mod_okioki_capture_send(http_request, &flight->capture, 0, error);
+
+            apr_thread_mutex_lock(mod_okioki_coalesce_mutex);
+            mod_okioki_coalesce_release(flight);
+            apr_thread_mutex_unlock(mod_okioki_coalesce_mutex);
+            return ret;
+        }
+
+        // Timed out, or the request in flight failed, execute the view ourselves.
+        mod_okioki_coalesce_release(flight);
+        apr_thread_mutex_unlock(mod_okioki_coalesce_mutex);
+        return DECLINED;
+    }
+
+    // Start a new flight, it gets its own pool, as it may outlive this request.
+    if (apr_pool_create(&flight_pool, NULL) != APR_SUCCESS) {
+        apr_thread_mutex_unlock(mod_okioki_coalesce_mutex);
+        return DECLINED;
+    }
+
+    if (
+        (flight = apr_pcalloc(flight_pool, sizeof (coalesce_flight_t))) == NULL ||
+        (flight->key = apr_pmemdup(flight_pool, key, key_len)) == NULL ||
+        apr_thread_cond_create(&flight->cond, flight_pool) != APR_SUCCESS
+    ) {
+        apr_thread_mutex_unlock(mod_okioki_coalesce_mutex);
+        apr_pool_destroy(flight_pool);
+        return DECLINED;
+    }
+    flight->pool          = flight_pool;
+    flight->key_len       = key_len;
+    flight->nr_references = 1;
+
+    apr_hash_set(mod_okioki_coalesce_flights, flight->key, flight->key_len, flight);
+    apr_thread_mutex_unlock(mod_okioki_coalesce_mutex);
+
+    // Capture the response while it is send to the client.
+    mod_okioki_capture_start(http_request, &flight->capture, flight_pool, 0);
+
+    *_flight = flight;
+    return DECLINED;
+}
+
+void mod_okioki_coalesce_end(coalesce_flight_t *flight)
+{
+    // The flight may be freed below, while the request still passes data through the filter.
+    mod_okioki_capture_stop(&flight->capture);
+
+    apr_thread_mutex_lock(mod_okioki_coalesce_mutex);
+    apr_hash_set(mod_okioki_coalesce_flights, flight->key, flight->key_len, NULL);
+    flight->done = 1;
+    apr_thread_cond_broadcast(flight->cond);
+    mod_okioki_coalesce_release(flight);
+    apr_thread_mutex_unlock(mod_okioki_coalesce_mutex);
+}
@@ -0,0 +1,48 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <httpd.h>
+#include <http_log.h>
+#include <apr_hash.h>
+#include "mod_okioki.h"
+
+/** A request that is being executed, which identical requests may wait for.
+ */
+typedef struct coalesce_flight_t coalesce_flight_t;
+
+/** Create the table of flights, called once for each child.
+ */
+int mod_okioki_coalesce_child_init(apr_pool_t *pool, server_rec *server);
+
+/** Join or start a flight for the view with these arguments.
+ * When an identical request is already in flight, wait for it for at most view->coalesce_timeout
+ * and send a copy of its response, when it succeeded.
+ *
+ * @param flight  On return the flight to pass to mod_okioki_coalesce_end(), when this request
+ *                executes the view for the others, otherwise NULL.
+ * @returns       DECLINED when the caller must execute the view itself, otherwise the result
+ *                of sending the copied response.
+ */
+int mod_okioki_coalesce_begin(request_rec *http_request, view_t *view, const char *view_name, apr_hash_t *arguments, coalesce_flight_t **flight, char **error);
+
+/** Finish the flight and wake up the requests waiting for it.
+ */
+void mod_okioki_coalesce_end(coalesce_flight_t *flight);
+
+#endif
@@ -0,0 +1,286 @@
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <apr_strings.h>
+#include <apr_dbd.h>
+#include <httpd.h>
+#include <http_log.h>
+#include <libpq-fe.h>
+#include "columns.h"
+#include "csv.h"
+#include "json.h"
+#include "pool.h"
+
+// Views and the server they are configured in, indexed by statement number; set at configuration time.
+static view_t     *mod_okioki_columns_views[MAX_VIEWS];
+static server_rec *mod_okioki_columns_servers[MAX_VIEWS];
+static int        mod_okioki_columns_nr_views;
+
+static apr_status_t mod_okioki_columns_clear(void *pg_result)
+{
+    PQclear((PGresult *)pg_result);
+    return APR_SUCCESS;
+}
+
+void mod_okioki_columns_pre_config(void)
+{
+    memset(mod_okioki_columns_views, 0, sizeof (mod_okioki_columns_views));
+    memset(mod_okioki_columns_servers, 0, sizeof (mod_okioki_columns_servers));
+    mod_okioki_columns_nr_views = 0;
+}
+
+void mod_okioki_columns_register(server_rec *server, view_t *view)
+{
+    mod_okioki_columns_views[view->statement_nr]   = view;
+    mod_okioki_columns_servers[view->statement_nr] = server;
+
+    if (mod_okioki_columns_nr_views <= view->statement_nr) {
+        mod_okioki_columns_nr_views = view->statement_nr + 1;
+    }
+}
+
+int mod_okioki_columns_make(apr_pool_t *pool, apr_bucket_alloc_t *alloc, int nr_cols, const char **names, apr_hash_t *result_strings, view_columns_t **_columns, char **error)
+{
+    view_columns_t     *columns;
+    apr_bucket_brigade *bb;
+    char               *data;
+    apr_size_t         data_len;
+    int                col_nr;
+
+    ASSERT_NOT_NULL(
+        columns = apr_pcalloc(pool, sizeof (view_columns_t)),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate columns."
+    )
+    ASSERT_NOT_NULL(
+        columns->names = apr_pcalloc(pool, (nr_cols + 1) * sizeof (char *)),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate column names."
+    )
+    ASSERT_NOT_NULL(
+        columns->json_keys = apr_pcalloc(pool, (nr_cols + 1) * sizeof (char *)),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate column keys."
+    )
+    ASSERT_NOT_NULL(
+        columns->json_keys_len = apr_pcalloc(pool, (nr_cols + 1) * sizeof (apr_size_t)),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate column keys."
+    )
+    ASSERT_NOT_NULL(
+        columns->is_string = apr_pcalloc(pool, (nr_cols + 1) * sizeof (int)),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate column types."
+    )
+    ASSERT_NOT_NULL(
+        bb = apr_brigade_create(pool, alloc),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate a bucket brigade."
+    )
+    columns->nr_cols = nr_cols;
+
+    // Each name is escaped into a brigade, which is flattened into a single string.
+    for (col_nr = 0; col_nr < nr_cols; col_nr++) {
+        ASSERT_NOT_NULL(
+            columns->names[col_nr] = apr_pstrdup(pool, names[col_nr]),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not copy column name."
+        )
+        columns->is_string[col_nr] = result_strings != NULL && apr_hash_get(result_strings, names[col_nr], APR_HASH_KEY_STRING) == result_strings;
+
+        ASSERT_HTTP_OK(
+            mod_okioki_json_append_string(bb, pool, alloc, names[col_nr], error),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not escape column name."
+        )
+        ASSERT_APR_SUCCESS(
+            apr_brigade_pflatten(bb, &data, &data_len, pool),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not flatten column name."
+        )
+        apr_brigade_cleanup(bb);
+        columns->json_keys[col_nr]     = data;
+        columns->json_keys_len[col_nr] = data_len;
+
+        if (col_nr != 0) {
+            ASSERT_APR_SUCCESS(
+                apr_brigade_puts(bb, NULL, NULL, ","),
+                HTTP_INTERNAL_SERVER_ERROR, "Could not write CSV header."
+            )
+        }
+        ASSERT_HTTP_OK(
+            mod_okioki_csv_append_value(bb, pool, alloc, names[col_nr], error),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not escape column name."
+        )
+    }
+
+    // The CSV header is the escaped names as a single line.
+    ASSERT_APR_SUCCESS(
+        apr_brigade_puts(bb, NULL, NULL, "\r\n"),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not write CSV header."
+    )
+    ASSERT_APR_SUCCESS(
+        apr_brigade_pflatten(bb, &data, &data_len, pool),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not flatten CSV header."
+    )
+    apr_brigade_destroy(bb);
+    columns->csv_header     = data;
+    columns->csv_header_len = data_len;
+
+    *_columns = columns;
+    return HTTP_OK;
+}
+
+int mod_okioki_columns_get(apr_pool_t *pool, apr_bucket_alloc_t *alloc, result_t *db_result, apr_hash_t *result_strings, const view_columns_t **columns, char **error)
+{
+    int            nr_cols = mod_okioki_result_num_cols(db_result);
+    const char     *names[nr_cols + 1];
+    view_columns_t *made;
+    int            col_nr;
+    int            ret;
+
+    if (db_result->columns != NULL && db_result->columns->nr_cols == nr_cols) {
+        *columns = db_result->columns;
+        return HTTP_OK;
+    }
+
+    for (col_nr = 0; col_nr < nr_cols; col_nr++) {
+        ASSERT_NOT_NULL(
+            names[col_nr] = mod_okioki_result_get_name(db_result, col_nr),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not retrieve name of column from database result."
+        )
+    }
+
+    if ((ret = mod_okioki_columns_make(pool, alloc, nr_cols, names, result_strings, &made, error)) != HTTP_OK) {
+        return ret;
+    }
+    *columns = made;
+    return HTTP_OK;
+}
+
+/** Tell a lost database connection apart from a statement that does not match its view.
+ *
+ * @returns  ret, or HTTP_SERVICE_UNAVAILABLE when the connection failed.
+ */
+static int mod_okioki_columns_failed(apr_pool_t *pool, mod_okioki_conn_t *db_conn, int ret)
+{
+    return apr_dbd_check_conn(db_conn->driver, pool, db_conn->handle) == APR_SUCCESS ? ret : HTTP_SERVICE_UNAVAILABLE;
+}
+
+/** Describe the statement of a view and check that it takes the parameters of the view.
+ * Only statements on PostgreSQL are described, the columns of other views are made for each response.
+ *
+ * @param pool        Pool for the description, the columns are allocated from the child pool.
+ * @returns           HTTP_OK, HTTP_SERVICE_UNAVAILABLE when the connection failed, or another HTTP status
+ *                    when the statement does not match the view.
+ */
+static int mod_okioki_columns_describe(apr_pool_t *pool, apr_pool_t *child_pool, apr_bucket_alloc_t *alloc, mod_okioki_conn_t *db_conn, view_t *view, char **error)
+{
+    apr_dbd_prepared_t *statement;
+    PGconn             *pg_conn;
+    PGresult           *pg_result;
+    int                nr_cols;
+    int                col_nr;
+    int                ret;
+
+    // Preparing the statement also checks that the sql is valid, or that the mod_dbd label exists.
+    if ((ret = mod_okioki_conn_prepare(pool, db_conn, view, &statement, error)) != HTTP_OK) {
+        return mod_okioki_columns_failed(pool, db_conn, ret);
+    }
+
+    // The native handle of another driver is not a libpq connection.
+    if (strcmp(apr_dbd_name(db_conn->driver), "pgsql") != 0) {
+        return HTTP_OK;
+    }
+
+    ASSERT_NOT_NULL(
+        pg_conn = apr_dbd_native_handle(db_conn->driver, db_conn->handle),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not get the PostgreSQL connection."
+    )
+    if ((pg_result = PQdescribePrepared(pg_conn, mod_okioki_conn_statement_name(pool, db_conn, view))) == NULL) {
+        *error = apr_psprintf(pool, "Could not describe statement: %s", PQerrorMessage(pg_conn));
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
+    apr_pool_cleanup_register(pool, pg_result, mod_okioki_columns_clear, apr_pool_cleanup_null);
+
+    if (PQresultStatus(pg_result) != PGRES_COMMAND_OK) {
+        *error = apr_psprintf(pool, "Could not describe statement: %s", PQresultErrorMessage(pg_result));
+        return mod_okioki_columns_failed(pool, db_conn, HTTP_BAD_GATEWAY);
+    }
+    ASSERT_ZERO(
+        PQnparams(pg_result) != (int)view->nr_sql_params,
+        HTTP_INTERNAL_SERVER_ERROR, "The view binds %i parameters, but the statement takes %i.", (int)view->nr_sql_params, PQnparams(pg_result)
+    )
+
+    nr_cols = PQnfields(pg_result);
+    {
+        const char *names[nr_cols + 1];
+
+        for (col_nr = 0; col_nr < nr_cols; col_nr++) {
+            names[col_nr] = PQfname(pg_result, col_nr);
+        }
+        return mod_okioki_columns_make(child_pool, alloc, nr_cols, names, view->result_strings, &view->columns, error);
+    }
+}
+
+void mod_okioki_columns_child_init(apr_pool_t *pool, server_rec *server)
+{
+    apr_bucket_alloc_t *alloc;
+    apr_pool_t         *describe_pool = NULL;
+    mod_okioki_conn_t  *db_conn = NULL;
+    server_rec         *db_server = NULL;
+    char               *error = NULL;
+    view_t             *view;
+    int                ret;
+    int                i;
+
+    if (mod_okioki_columns_nr_views == 0 || (alloc = apr_bucket_alloc_create(pool)) == NULL) {
+        return;
+    }
+
+    for (i = 0; i < mod_okioki_columns_nr_views; i++) {
+        if ((view = mod_okioki_columns_views[i]) == NULL) {
+            continue;
+        }
+
+        // The views of a server are described over a single connection.
+        if (mod_okioki_columns_servers[i] != db_server) {
+            if (describe_pool != NULL) {
+                apr_pool_destroy(describe_pool);
+            }
+            if (apr_pool_create(&describe_pool, pool) != APR_SUCCESS) {
+                return;
+            }
+            db_server = mod_okioki_columns_servers[i];
+
+            if (mod_okioki_conn_open(describe_pool, db_server, &db_conn, &error) != HTTP_OK) {
+                ap_log_error(APLOG_MARK, APLOG_WARNING, 0, db_server, "[mod_okioki] Could not describe views: %s", error);
+                db_conn = NULL;
+            }
+        }
+        if (db_conn == NULL) {
+            continue;
+        }
+
+        // When the database goes away the columns of the remaining views of the server are made for each response.
+        if ((ret = mod_okioki_columns_describe(describe_pool, pool, alloc, db_conn, view, &error)) == HTTP_SERVICE_UNAVAILABLE) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, db_server, "[mod_okioki] Could not describe views: %s", error);
+            db_conn = NULL;
+
+        } else if (ret != HTTP_OK) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, 0, db_server, "[mod_okioki] View '%s' does not match its statement: %s", view->sql, error);
+            exit(APEXIT_CHILDFATAL);
+        }
+    }
+
+    if (describe_pool != NULL) {
+        apr_pool_destroy(describe_pool);
+    }
+}
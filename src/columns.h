@@ -0,0 +1,54 @@
+#ifndef COLUMNS_H
+#define COLUMNS_H
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <httpd.h>
+#include <apr_buckets.h>
+#include <apr_hash.h>
+#include "mod_okioki.h"
+#include "result.h"
+
+/** Reset the list of views to describe, before the configuration is read.
+ */
+void mod_okioki_columns_pre_config(void);
+
+/** Add a view to the list of views that are described when a child starts.
+ */
+void mod_okioki_columns_register(server_rec *server, view_t *view);
+
+/** Describe the statement of every view on the database.
+ * A view that binds a different number of parameters than its statement takes stops the child, so that a
+ * configuration error is found at startup instead of on the first request. When the database can not be
+ * reached the views are not described, and the columns are found from each result instead.
+ */
+void mod_okioki_columns_child_init(apr_pool_t *pool, server_rec *server);
+
+/** Escape the column names for each output type.
+ *
+ * @param result_strings  Columns that are sent as JSON strings, may be NULL.
+ */
+int mod_okioki_columns_make(apr_pool_t *pool, apr_bucket_alloc_t *alloc, int nr_cols, const char **names, apr_hash_t *result_strings, view_columns_t **columns, char **error);
+
+/** Get the columns of a result.
+ * The columns described at startup are used when the result still has the same number of columns,
+ * otherwise the names are escaped from the result.
+ */
+int mod_okioki_columns_get(apr_pool_t *pool, apr_bucket_alloc_t *alloc, result_t *db_result, apr_hash_t *result_strings, const view_columns_t **columns, char **error);
+
+#endif
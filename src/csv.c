@@ -24,6 +24,9 @@
 #include <apr_hash.h>
 #include <apr_dbd.h>
 #include "csv.h"
+#include "capture.h"
+#include "columns.h"
+#include "util.h"
 
 int mod_okioki_csv_append_value(apr_bucket_brigade *bb, apr_pool_t *pool, apr_bucket_alloc_t *alloc, const char *s, char **error)
 {
@@ -90,60 +93,37 @@ int mod_okioki_csv_append_value(apr_bucket_brigade *bb, apr_pool_t *pool, apr_bu
     return HTTP_OK;
 }
 
-int mod_okioki_generate_csv(request_rec *http_request, apr_pool_t *pool, apr_bucket_alloc_t *alloc, const apr_dbd_driver_t *db_driver, apr_dbd_results_t *db_result, char **error)
+int mod_okioki_csv_append_result(apr_bucket_brigade *bb, apr_pool_t *pool, apr_bucket_alloc_t *alloc, result_t *db_result, ap_filter_t *next, char **error)
 {
-    const char *name;
+    const view_columns_t *columns;
     const char *value;
     apr_dbd_row_t *db_row;
-    apr_bucket_brigade *bb;
     apr_bucket *b;
     int col_nr;
     int nr_cols;
     int row_nr;
     int nr_rows;
 
-    ASSERT_NOT_NULL(
-        bb = apr_brigade_create(pool, alloc),
-        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate a bucket brigade."
-    )
-
-    nr_cols = apr_dbd_num_cols(db_driver, db_result);
-    nr_rows = apr_dbd_num_tuples(db_driver, db_result);
-
-    // Create a csv header.
-    for (col_nr = 0; col_nr < nr_cols; col_nr++) {
-        // Add a comma between each entry.
-        if (col_nr != 0) {
-            ASSERT_NOT_NULL(
-                b = apr_bucket_immortal_create(",", 1, alloc),
-                HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
-            )
-            APR_BRIGADE_INSERT_TAIL(bb, b);
-        }
-
-        ASSERT_NOT_NULL(
-            name = apr_dbd_get_name(db_driver, db_result, col_nr),
-            HTTP_INTERNAL_SERVER_ERROR, "Could not retrieve name of column from database result."
-        )
-
-        ASSERT_HTTP_OK(
-            mod_okioki_csv_append_value(bb, pool, alloc, name, error),
-            HTTP_INTERNAL_SERVER_ERROR, "Not enough room to store CSV result."
-        )
-    }
+    nr_cols = mod_okioki_result_num_cols(db_result);
+    nr_rows = mod_okioki_result_num_tuples(db_result);
 
-    // Finish off the header with a carriage return and linefeed.
+    // The header was escaped when the view was described.
+    ASSERT_HTTP_OK(
+        mod_okioki_columns_get(pool, alloc, db_result, NULL, &columns, error),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not get the columns of the result."
+    )
     ASSERT_NOT_NULL(
-        b = apr_bucket_immortal_create("\r\n", 2, alloc),
+        b = apr_bucket_immortal_create(columns->csv_header, columns->csv_header_len, alloc),
         HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
     )
     APR_BRIGADE_INSERT_TAIL(bb, b);
 
     // Check each row and figure out all the column names.
+    // The row structure is allocated once and reused for every row.
     db_row = NULL;
     for (row_nr = 0; row_nr < nr_rows; row_nr++) {
         ASSERT_APR_SUCCESS(
-            apr_dbd_get_row(db_driver, pool, db_result, &db_row, -1),
+            mod_okioki_result_get_row(db_result, pool, &db_row),
             HTTP_INTERNAL_SERVER_ERROR, "Could not get row"
         )
         ASSERT_NOT_NULL(
@@ -162,7 +142,7 @@ int mod_okioki_generate_csv(request_rec *http_request, apr_pool_t *pool, apr_buc
             }
 
             ASSERT_NOT_NULL(
-                value = apr_dbd_get_entry(db_driver, db_row, col_nr),
+                value = mod_okioki_result_get_entry(db_result, db_row, col_nr),
                 HTTP_INTERNAL_SERVER_ERROR, "Could not retrieve name of column from database result."
             )
 
@@ -178,18 +158,41 @@ int mod_okioki_generate_csv(request_rec *http_request, apr_pool_t *pool, apr_buc
             HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
         )
         APR_BRIGADE_INSERT_TAIL(bb, b);
+
+        if (next != NULL && (row_nr + 1) % OUTPUT_CHUNK_ROWS == 0) {
+            ASSERT_APR_SUCCESS(
+                mod_okioki_pass_chunk(next, bb),
+                HTTP_INTERNAL_SERVER_ERROR, "Could not pass CSV chunk to the output filters."
+            )
+        }
     }
 
-    // Add an end-of-stream.
+    return HTTP_OK;
+}
+
+int mod_okioki_generate_csv(request_rec *http_request, apr_pool_t *pool, apr_bucket_alloc_t *alloc, result_t *db_result, char **error)
+{
+    apr_bucket_brigade *bb;
+    ap_filter_t *next;
+    int ret;
+
     ASSERT_NOT_NULL(
-        b = apr_bucket_eos_create(alloc),
-        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
+        bb = apr_brigade_create(pool, alloc),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate a bucket brigade."
     )
-    APR_BRIGADE_INSERT_TAIL(bb, b);
 
-    // Return the data.
+    // The content type must be known before the first chunk is passed down the filter chain.
     ap_set_content_type(http_request, "text/csv");
     http_request->status = HTTP_OK;
-    return ap_pass_brigade(http_request->output_filters, bb);
+
+    // A result of less than a chunk of rows is generated whole, so that it can be sent at once. So is a
+    // response that is captured with its ETag, so that the ETag is sent with it.
+    next = mod_okioki_result_num_tuples(db_result) < OUTPUT_CHUNK_ROWS || mod_okioki_capture_whole(http_request) ? NULL : http_request->output_filters;
+
+    if ((ret = mod_okioki_csv_append_result(bb, pool, alloc, db_result, next, error)) != HTTP_OK) {
+        return mod_okioki_response_failed(http_request, ret);
+    }
+
+    return mod_okioki_pass_response(http_request, bb, alloc, next == NULL, error);
 }
 
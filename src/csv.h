@@ -21,7 +21,17 @@
 #include <apr_hash.h>
 #include <apr_tables.h>
 #include "mod_okioki.h"
+#include "result.h"
 
-int mod_okioki_generate_csv(request_rec *http_request, apr_pool_t *pool, apr_bucket_alloc_t *alloc, const apr_dbd_driver_t *db_driver, apr_dbd_results_t *db_result, char **error);
+/** Append a value as a CSV field to the brigade, quoted when needed.
+ */
+int mod_okioki_csv_append_value(apr_bucket_brigade *bb, apr_pool_t *pool, apr_bucket_alloc_t *alloc, const char *s, char **error);
+
+/** Append the result as CSV with a header to the brigade, without an end-of-stream.
+ * When next is set, every chunk of rows is passed to that filter, otherwise the whole result is kept in the brigade.
+ */
+int mod_okioki_csv_append_result(apr_bucket_brigade *bb, apr_pool_t *pool, apr_bucket_alloc_t *alloc, result_t *db_result, ap_filter_t *next, char **error);
+
+int mod_okioki_generate_csv(request_rec *http_request, apr_pool_t *pool, apr_bucket_alloc_t *alloc, result_t *db_result, char **error);
 
 #endif
@@ -0,0 +1,571 @@
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <apr_hash.h>
+#include <apr_strings.h>
+#include <apr_thread_mutex.h>
+#include <httpd.h>
+#include <http_log.h>
+#include <http_protocol.h>
+#include "delta.h"
+#include "util.h"
+
+/** A piece of the text of a version.
+ */
+typedef struct {
+    const char *data;
+    apr_size_t len;
+} delta_text_t;
+
+/** A version of a cached response, split into the objects of its rows.
+ */
+typedef struct {
+    apr_pool_t   *pool;
+    char         *etag;
+    char         *data;
+    apr_size_t   data_len;
+    int          nr_rows;
+    delta_text_t *rows;
+    delta_text_t *ids;
+    apr_hash_t   *row_nrs;      // the number of the row of each id
+    int          nr_references;
+} delta_version_t;
+
+/** The recent versions of a cached response, the newest last.
+ */
+typedef struct {
+    apr_pool_t      *pool;
+    char            *key;
+    apr_size_t      key_len;
+    view_t          *view;
+    apr_time_t      used;
+    int             nr_versions;
+    delta_version_t *versions[MAX_DELTA_VERSIONS];
+} delta_history_t;
+
+static apr_thread_mutex_t *mod_okioki_delta_mutex;
+static apr_hash_t         *mod_okioki_delta_histories;
+
+int mod_okioki_delta_child_init(apr_pool_t *pool, server_rec *server)
+{
+    apr_status_t ret;
+
+    if ((ret = apr_thread_mutex_create(&mod_okioki_delta_mutex, APR_THREAD_MUTEX_DEFAULT, pool)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, ret, server, "[mod_okioki] Could not create delta mutex.");
+        return ret;
+    }
+
+    if ((mod_okioki_delta_histories = apr_hash_make(pool)) == NULL) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, server, "[mod_okioki] Could not create delta table.");
+        return APR_ENOMEM;
+    }
+    return APR_SUCCESS;
+}
+
+/** Release a reference to a version, the caller must hold the mutex.
+ */
+static void mod_okioki_delta_release(delta_version_t *version)
+{
+    if (--version->nr_references == 0) {
+        apr_pool_destroy(version->pool);
+    }
+}
+
+/** Remove a history and release its versions, the caller must hold the mutex.
+ */
+static void mod_okioki_delta_remove(delta_history_t *history)
+{
+    int i;
+
+    apr_hash_set(mod_okioki_delta_histories, history->key, history->key_len, NULL);
+    for (i = 0; i < history->nr_versions; i++) {
+        mod_okioki_delta_release(history->versions[i]);
+    }
+    apr_pool_destroy(history->pool);
+}
+
+void mod_okioki_delta_forget(view_t *view)
+{
+    apr_hash_index_t *hi;
+    void             *_history;
+
+    if (mod_okioki_delta_histories == NULL) {
+        return;
+    }
+
+    apr_thread_mutex_lock(mod_okioki_delta_mutex);
+    for (hi = apr_hash_first(NULL, mod_okioki_delta_histories); hi != NULL; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, &_history);
+        if (((delta_history_t *)_history)->view == view) {
+            mod_okioki_delta_remove((delta_history_t *)_history);
+        }
+    }
+    apr_thread_mutex_unlock(mod_okioki_delta_mutex);
+}
+
+/** Skip white space.
+ */
+static const char *mod_okioki_delta_skip(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+        p++;
+    }
+    return p;
+}
+
+/** Split a list generated by mod_okioki_json_append_result() into the text of its objects,
+ * and find the value of the key in each.
+ *
+ * @returns  0, or -1 when the response is not a list of objects that each have the key.
+ */
+static int mod_okioki_delta_parse(delta_version_t *version, const delta_spec_t *delta)
+{
+    apr_array_header_t *rows;
+    apr_array_header_t *ids;
+    delta_text_t       *row;
+    delta_text_t       *id;
+    const char         *p = version->data;
+    const char         *end = &version->data[version->data_len];
+    const char         *key_start;
+    const char         *value_start;
+    const char         *value_end;
+    int                depth;
+    int                in_string;
+    int                escape;
+    int                expect_key;
+    int                matched;
+    int                i;
+
+    if (
+        (rows = apr_array_make(version->pool, 64, sizeof (delta_text_t))) == NULL ||
+        (ids = apr_array_make(version->pool, 64, sizeof (delta_text_t))) == NULL
+    ) {
+        return -1;
+    }
+
+    // A single row is not send as a list, a patch can only be made between lists.
+    if ((p = mod_okioki_delta_skip(p, end)) == end || *p++ != '[') {
+        return -1;
+    }
+
+    for (;;) {
+        if ((p = mod_okioki_delta_skip(p, end)) == end || *p != '{') {
+            return -1;
+        }
+
+        row = (delta_text_t *)apr_array_push(rows);
+        row->data = p;
+        depth = in_string = escape = expect_key = matched = 0;
+        key_start = value_start = value_end = NULL;
+
+        // Scan the object, only the keys and values at its top level matter.
+        for (; p < end; p++) {
+            if (in_string) {
+                if (escape) {
+                    escape = 0;
+                } else if (*p == '\\') {
+                    escape = 1;
+                } else if (*p == '"') {
+                    in_string = 0;
+                    if (key_start != NULL) {
+                        matched = (apr_size_t)(p + 1 - key_start) == delta->json_key_len && memcmp(key_start, delta->json_key, delta->json_key_len) == 0;
+                        key_start = NULL;
+                    }
+                }
+                continue;
+            }
+
+            switch (*p) {
+            case '"':
+                in_string = 1;
+                if (depth == 1 && expect_key) {
+                    key_start = p;
+                }
+                break;
+            case '{':
+            case '[':
+                if (++depth == 1) {
+                    expect_key = 1;
+                }
+                break;
+            case ':':
+                if (depth == 1) {
+                    expect_key = 0;
+                    if (matched) {
+                        value_start = p + 1;
+                        matched = 0;
+                    }
+                }
+                break;
+            case ',':
+            case '}':
+            case ']':
+                if (depth == 1) {
+                    if (value_start != NULL && value_end == NULL) {
+                        value_end = p;
+                    }
+                    expect_key = 1;
+                }
+                if (*p != ',') {
+                    depth--;
+                }
+                break;
+            }
+
+            if (depth == 0) {
+                p++;
+                break;
+            }
+        }
+        if (depth != 0 || value_end == NULL) {
+            return -1;
+        }
+        row->len = p - row->data;
+
+        // The value of the key, without the white space around it.
+        value_start = mod_okioki_delta_skip(value_start, value_end);
+        while (value_end > value_start && (value_end[-1] == ' ' || value_end[-1] == '\t' || value_end[-1] == '\r' || value_end[-1] == '\n')) {
+            value_end--;
+        }
+        id = (delta_text_t *)apr_array_push(ids);
+        id->data = value_start;
+        id->len  = value_end - value_start;
+
+        if ((p = mod_okioki_delta_skip(p, end)) == end) {
+            return -1;
+        }
+        if (*p == ']') {
+            break;
+        }
+        if (*p++ != ',') {
+            return -1;
+        }
+    }
+
+    version->nr_rows = rows->nelts;
+    version->rows    = (delta_text_t *)rows->elts;
+    version->ids     = (delta_text_t *)ids->elts;
+
+    // A patch can not address rows by a key that is not unique.
+    if ((version->row_nrs = apr_hash_make(version->pool)) == NULL) {
+        return -1;
+    }
+    for (i = 0; i < version->nr_rows; i++) {
+        if (apr_hash_get(version->row_nrs, version->ids[i].data, version->ids[i].len) != NULL) {
+            return -1;
+        }
+        apr_hash_set(version->row_nrs, version->ids[i].data, version->ids[i].len, &version->rows[i]);
+    }
+    return 0;
+}
+
+/** The number of a row in a version, or -1 when the version has no row with the id.
+ */
+static int mod_okioki_delta_find(delta_version_t *version, delta_text_t *id)
+{
+    delta_text_t *row;
+
+    if ((row = apr_hash_get(version->row_nrs, id->data, id->len)) == NULL) {
+        return -1;
+    }
+    return row - version->rows;
+}
+
+/** Remove the least recently used history, to make room for another, the caller must hold the mutex.
+ */
+static void mod_okioki_delta_evict(void)
+{
+    apr_hash_index_t *hi;
+    void             *_history;
+    delta_history_t  *oldest = NULL;
+
+    for (hi = apr_hash_first(NULL, mod_okioki_delta_histories); hi != NULL; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, &_history);
+        if (oldest == NULL || ((delta_history_t *)_history)->used < oldest->used) {
+            oldest = (delta_history_t *)_history;
+        }
+    }
+    if (oldest != NULL) {
+        mod_okioki_delta_remove(oldest);
+    }
+}
+
+void mod_okioki_delta_record(view_t *view, const char *key, apr_size_t key_len, const char *etag, const char *data, apr_size_t data_len)
+{
+    delta_version_t *version;
+    delta_history_t *history;
+    apr_pool_t      *pool;
+    int             i;
+
+    if (view->delta == NULL || mod_okioki_delta_histories == NULL || etag == NULL) {
+        return;
+    }
+
+    // The version is split into rows once, outside of the lock.
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS) {
+        return;
+    }
+    if (
+        (version = apr_pcalloc(pool, sizeof (delta_version_t))) == NULL ||
+        (version->etag = apr_pstrdup(pool, etag)) == NULL ||
+        (version->data = apr_pmemdup(pool, data, data_len)) == NULL
+    ) {
+        apr_pool_destroy(pool);
+        return;
+    }
+    version->pool          = pool;
+    version->data_len      = data_len;
+    version->nr_references = 1;
+
+    if (mod_okioki_delta_parse(version, view->delta) != 0) {
+        apr_pool_destroy(pool);
+        return;
+    }
+
+    apr_thread_mutex_lock(mod_okioki_delta_mutex);
+
+    // The key names the view, a history of another view under the same key is replaced.
+    if ((history = apr_hash_get(mod_okioki_delta_histories, key, key_len)) != NULL && history->view != view) {
+        mod_okioki_delta_remove(history);
+        history = NULL;
+    }
+    if (history == NULL) {
+        if (apr_hash_count(mod_okioki_delta_histories) >= MAX_DELTA_HISTORIES) {
+            mod_okioki_delta_evict();
+        }
+
+        if (
+            apr_pool_create(&pool, NULL) != APR_SUCCESS ||
+            (history = apr_pcalloc(pool, sizeof (delta_history_t))) == NULL ||
+            (history->key = apr_pmemdup(pool, key, key_len)) == NULL
+        ) {
+            mod_okioki_delta_release(version);
+            apr_thread_mutex_unlock(mod_okioki_delta_mutex);
+            return;
+        }
+        history->pool    = pool;
+        history->key_len = key_len;
+        history->view    = view;
+        apr_hash_set(mod_okioki_delta_histories, history->key, history->key_len, history);
+    }
+    history->used = apr_time_now();
+
+    // The same response filled again is not a new version.
+    if (history->nr_versions > 0 && strcmp(history->versions[history->nr_versions - 1]->etag, etag) == 0) {
+        mod_okioki_delta_release(version);
+        apr_thread_mutex_unlock(mod_okioki_delta_mutex);
+        return;
+    }
+
+    while (history->nr_versions >= view->delta->nr_versions) {
+        mod_okioki_delta_release(history->versions[0]);
+        for (i = 1; i < history->nr_versions; i++) {
+            history->versions[i - 1] = history->versions[i];
+        }
+        history->nr_versions--;
+    }
+    history->versions[history->nr_versions++] = version;
+    apr_thread_mutex_unlock(mod_okioki_delta_mutex);
+}
+
+/** Append an operation of the patch.
+ *
+ * @param from   The row the operation moves from, or -1.
+ * @param value  The object of the row, or NULL.
+ */
+static apr_status_t mod_okioki_delta_op(apr_bucket_brigade *bb, int first, const char *op, int from, int path, delta_text_t *value)
+{
+    apr_status_t ret;
+
+    if (from >= 0) {
+        ret = apr_brigade_printf(bb, NULL, NULL, "%s\n{\"op\": \"%s\", \"from\": \"/%i\", \"path\": \"/%i\"}", first ? "" : ",", op, from, path);
+    } else {
+        ret = apr_brigade_printf(bb, NULL, NULL, "%s\n{\"op\": \"%s\", \"path\": \"/%i\"", first ? "" : ",", op, path);
+    }
+    if (ret != APR_SUCCESS) {
+        return ret;
+    }
+
+    if (value != NULL) {
+        if (
+            (ret = apr_brigade_write(bb, NULL, NULL, ", \"value\": ", 11)) != APR_SUCCESS ||
+            (ret = apr_brigade_write(bb, NULL, NULL, value->data, value->len)) != APR_SUCCESS
+        ) {
+            return ret;
+        }
+    }
+    return from >= 0 ? APR_SUCCESS : apr_brigade_write(bb, NULL, NULL, "}", 1);
+}
+
+/** Append the operations that turn the old list into the new list, the rows are matched on their key.
+ * Rows that are gone are removed from the end, so that the numbers of the rows before them stay valid,
+ * then each row of the new list is replaced, moved or added in order.
+ */
+static int mod_okioki_delta_diff(apr_pool_t *pool, apr_bucket_brigade *bb, delta_version_t *old, delta_version_t *new, char **error)
+{
+    int *rows;
+    int nr_rows = 0;
+    int first = 1;
+    int row_nr;
+    int old_nr;
+    int from;
+    int i;
+    int j;
+
+    // The old row at each position of the list, while it is being patched.
+    ASSERT_NOT_NULL(
+        rows = apr_palloc(pool, (old->nr_rows + new->nr_rows) * sizeof (int)),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate patch rows."
+    )
+
+    ASSERT_APR_SUCCESS(
+        apr_brigade_write(bb, NULL, NULL, "[", 1),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not write patch."
+    )
+
+    for (i = old->nr_rows - 1; i >= 0; i--) {
+        if (mod_okioki_delta_find(new, &old->ids[i]) < 0) {
+            ASSERT_APR_SUCCESS(
+                mod_okioki_delta_op(bb, first, "remove", -1, i, NULL),
+                HTTP_INTERNAL_SERVER_ERROR, "Could not write patch."
+            )
+            first = 0;
+        }
+    }
+    for (i = 0; i < old->nr_rows; i++) {
+        if (mod_okioki_delta_find(new, &old->ids[i]) >= 0) {
+            rows[nr_rows++] = i;
+        }
+    }
+
+    for (row_nr = 0; row_nr < new->nr_rows; row_nr++) {
+        old_nr = mod_okioki_delta_find(old, &new->ids[row_nr]);
+
+        if (old_nr < 0) {
+            // A new row.
+            for (j = nr_rows; j > row_nr; j--) {
+                rows[j] = rows[j - 1];
+            }
+            rows[row_nr] = -1;
+            nr_rows++;
+            ASSERT_APR_SUCCESS(
+                mod_okioki_delta_op(bb, first, "add", -1, row_nr, &new->rows[row_nr]),
+                HTTP_INTERNAL_SERVER_ERROR, "Could not write patch."
+            )
+            first = 0;
+            continue;
+        }
+
+        if (rows[row_nr] != old_nr) {
+            // A row that moved up, all rows before its position are already in place.
+            for (from = row_nr + 1; rows[from] != old_nr; from++);
+            for (j = from; j > row_nr; j--) {
+                rows[j] = rows[j - 1];
+            }
+            rows[row_nr] = old_nr;
+            ASSERT_APR_SUCCESS(
+                mod_okioki_delta_op(bb, first, "move", from, row_nr, NULL),
+                HTTP_INTERNAL_SERVER_ERROR, "Could not write patch."
+            )
+            first = 0;
+        }
+
+        if (old->rows[old_nr].len != new->rows[row_nr].len || memcmp(old->rows[old_nr].data, new->rows[row_nr].data, new->rows[row_nr].len) != 0) {
+            ASSERT_APR_SUCCESS(
+                mod_okioki_delta_op(bb, first, "replace", -1, row_nr, &new->rows[row_nr]),
+                HTTP_INTERNAL_SERVER_ERROR, "Could not write patch."
+            )
+            first = 0;
+        }
+    }
+
+    ASSERT_APR_SUCCESS(
+        apr_brigade_write(bb, NULL, NULL, first ? "]\n" : "\n]\n", first ? 2 : 3),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not write patch."
+    )
+    return HTTP_OK;
+}
+
+int mod_okioki_delta_send(request_rec *http_request, view_t *view, const char *key, apr_size_t key_len, const char *etag, char **error)
+{
+    apr_pool_t         *pool = http_request->pool;
+    apr_bucket_alloc_t *alloc = http_request->connection->bucket_alloc;
+    apr_bucket_brigade *bb;
+    const char         *accept;
+    const char         *if_none_match;
+    delta_history_t    *history;
+    delta_version_t    *old = NULL;
+    delta_version_t    *new = NULL;
+    apr_off_t          len;
+    apr_size_t         full_len;
+    int                ret;
+    int                i;
+
+    if (view->delta == NULL || mod_okioki_delta_histories == NULL) {
+        return DECLINED;
+    }
+
+    if (
+        (accept = apr_table_get(http_request->headers_in, "Accept")) == NULL ||
+        strstr(accept, "application/json-patch+json") == NULL ||
+        (if_none_match = apr_table_get(http_request->headers_in, "If-None-Match")) == NULL
+    ) {
+        return DECLINED;
+    }
+
+    // Take the current version and the newest version the client has.
+    apr_thread_mutex_lock(mod_okioki_delta_mutex);
+    if ((history = apr_hash_get(mod_okioki_delta_histories, key, key_len)) != NULL && history->view == view) {
+        history->used = apr_time_now();
+        for (i = history->nr_versions - 1; i >= 0; i--) {
+            if (new == NULL && strcmp(history->versions[i]->etag, etag) == 0) {
+                new = history->versions[i];
+            } else if (old == NULL && mod_okioki_etag_match(if_none_match, history->versions[i]->etag)) {
+                old = history->versions[i];
+            }
+        }
+    }
+    if (old == NULL || new == NULL) {
+        apr_thread_mutex_unlock(mod_okioki_delta_mutex);
+        return DECLINED;
+    }
+    old->nr_references++;
+    new->nr_references++;
+    apr_thread_mutex_unlock(mod_okioki_delta_mutex);
+    full_len = new->data_len;
+
+    if ((bb = apr_brigade_create(pool, alloc)) == NULL) {
+        ret = DECLINED;
+    } else {
+        ret = mod_okioki_delta_diff(pool, bb, old, new, error);
+    }
+
+    apr_thread_mutex_lock(mod_okioki_delta_mutex);
+    mod_okioki_delta_release(old);
+    mod_okioki_delta_release(new);
+    apr_thread_mutex_unlock(mod_okioki_delta_mutex);
+
+    // When most rows changed the full response is smaller.
+    if (ret != HTTP_OK || apr_brigade_length(bb, 1, &len) != APR_SUCCESS || len >= (apr_off_t)full_len) {
+        return DECLINED;
+    }
+
+    ap_set_content_type(http_request, "application/json-patch+json");
+    apr_table_setn(http_request->headers_out, "ETag", apr_pstrdup(pool, etag));
+    http_request->status = HTTP_OK;
+    return mod_okioki_pass_response(http_request, bb, alloc, 1, error);
+}
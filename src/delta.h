@@ -0,0 +1,54 @@
+#ifndef DELTA_H
+#define DELTA_H
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <httpd.h>
+#include <http_log.h>
+#include "mod_okioki.h"
+
+#define DELTA_VERSIONS      4           // default number of versions kept of each cached response
+#define MAX_DELTA_VERSIONS  16
+#define MAX_DELTA_HISTORIES 1024        // cached responses with versions, per child
+
+/** Create the version store, called once for each child.
+ */
+int mod_okioki_delta_child_init(apr_pool_t *pool, server_rec *server);
+
+/** Keep a new version of a cached response, so that a patch from it can be sent later.
+ * Responses that are not a list of objects with the key column are not kept.
+ *
+ * @param key   The key of the cache entry.
+ * @param etag  The entity tag of the response.
+ */
+void mod_okioki_delta_record(view_t *view, const char *key, apr_size_t key_len, const char *etag, const char *data, apr_size_t data_len);
+
+/** Remove all versions of a view, before the view is freed.
+ */
+void mod_okioki_delta_forget(view_t *view);
+
+/** Send a JSON Patch from the version the client has to the current version of a cached response.
+ * The client names its version in If-None-Match and must accept application/json-patch+json.
+ *
+ * @param key   The key of the cache entry.
+ * @param etag  The entity tag of the current response.
+ * @returns     DECLINED when the full response must be sent, otherwise the result of sending the patch.
+ */
+int mod_okioki_delta_send(request_rec *http_request, view_t *view, const char *key, apr_size_t key_len, const char *etag, char **error);
+
+#endif
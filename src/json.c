@@ -24,6 +24,9 @@
 #include <apr_hash.h>
 #include <apr_dbd.h>
 #include "json.h"
+#include "capture.h"
+#include "columns.h"
+#include "util.h"
 
 int mod_okioki_json_append_nonstring(apr_bucket_brigade *bb, apr_pool_t *pool, apr_bucket_alloc_t *alloc, const char *s, char **error)
 {
@@ -137,11 +140,11 @@ int mod_okioki_json_append_string(apr_bucket_brigade *bb, apr_pool_t *pool, apr_
                 )
                 APR_BRIGADE_INSERT_TAIL(bb, b);
             } else {
-                // Encode using escaped unicode.
+                // Encode using escaped unicode, the bucket gets its own copy of the escape.
                 char esc_u[7];
                 sprintf(esc_u, "\\u00%02hhx", c);
                 ASSERT_NOT_NULL(
-                    b = apr_bucket_immortal_create(esc_u, 6, alloc),
+                    b = apr_bucket_heap_create(esc_u, 6, NULL, alloc),
                     HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
                 )
                 APR_BRIGADE_INSERT_TAIL(bb, b);
@@ -188,25 +191,290 @@ int mod_okioki_json_append_value(apr_bucket_brigade *bb, apr_pool_t *pool, apr_b
     }
 }
 
-int mod_okioki_generate_json(request_rec *http_request, apr_pool_t *pool, apr_bucket_alloc_t *alloc, const apr_dbd_driver_t *db_driver, apr_dbd_results_t *db_result, apr_hash_t *result_strings, char **error)
+/** Append the "name": value pair of a column to an object.
+ *
+ * @param first  Set for the first pair of the object.
+ * @param indent The indentation of the pair.
+ */
+static int mod_okioki_json_append_pair(apr_bucket_brigade *bb, apr_pool_t *pool, apr_bucket_alloc_t *alloc, result_t *db_result, apr_dbd_row_t *db_row, int col_nr, const view_columns_t *columns, int first, const char *indent, char **error)
+{
+    const char *value;
+    apr_bucket *b;
+
+    ASSERT_NOT_NULL(
+        b = apr_bucket_immortal_create(first ? "\n" : ",\n", first ? 1 : 2, alloc),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
+    )
+    APR_BRIGADE_INSERT_TAIL(bb, b);
+
+    ASSERT_NOT_NULL(
+        b = apr_bucket_immortal_create(indent, strlen(indent), alloc),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
+    )
+    APR_BRIGADE_INSERT_TAIL(bb, b);
+
+    ASSERT_NOT_NULL(
+        b = apr_bucket_immortal_create(columns->json_keys[col_nr], columns->json_keys_len[col_nr], alloc),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
+    )
+    APR_BRIGADE_INSERT_TAIL(bb, b);
+
+    ASSERT_NOT_NULL(
+        b = apr_bucket_immortal_create(": ", 2, alloc),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
+    )
+    APR_BRIGADE_INSERT_TAIL(bb, b);
+
+    ASSERT_NOT_NULL(
+        value = mod_okioki_result_get_entry(db_result, db_row, col_nr),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not retrieve name of column from database result."
+    )
+
+    ASSERT_HTTP_OK(
+        mod_okioki_json_append_value(bb, pool, alloc, value, columns->is_string[col_nr], error),
+        HTTP_INTERNAL_SERVER_ERROR, "Not enough room to store JSON result."
+    )
+    return HTTP_OK;
+}
+
+/** Find the number of a column in the result.
+ */
+static int mod_okioki_json_find_column(result_t *db_result, const char *name)
+{
+    const char *col_name;
+    int        col_nr;
+
+    for (col_nr = 0; col_nr < mod_okioki_result_num_cols(db_result); col_nr++) {
+        if ((col_name = mod_okioki_result_get_name(db_result, col_nr)) != NULL && strcmp(col_name, name) == 0) {
+            return col_nr;
+        }
+    }
+    return -1;
+}
+
+/** Close the object of a group, appending its nested arrays.
+ */
+static int mod_okioki_json_close_group(apr_bucket_brigade *bb, apr_pool_t *pool, apr_bucket_alloc_t *alloc, json_nest_t *nest, apr_bucket_brigade **array_bbs, char **error)
+{
+    json_nest_array_t *array;
+    int               i;
+
+    for (i = 0; i < nest->arrays->nelts; i++) {
+        array = &APR_ARRAY_IDX(nest->arrays, i, json_nest_array_t);
+
+        ASSERT_APR_SUCCESS(
+            apr_brigade_puts(bb, NULL, NULL, ",\n\t"),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not write JSON result."
+        )
+        ASSERT_HTTP_OK(
+            mod_okioki_json_append_value(bb, pool, alloc, array->name, 1, error),
+            HTTP_INTERNAL_SERVER_ERROR, "Not enough room to store JSON result."
+        )
+        ASSERT_APR_SUCCESS(
+            apr_brigade_puts(bb, NULL, NULL, ": ["),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not write JSON result."
+        )
+        APR_BRIGADE_CONCAT(bb, array_bbs[i]);
+        ASSERT_APR_SUCCESS(
+            apr_brigade_puts(bb, NULL, NULL, "]"),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not write JSON result."
+        )
+    }
+
+    ASSERT_APR_SUCCESS(
+        apr_brigade_puts(bb, NULL, NULL, "\n}"),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not write JSON result."
+    )
+    return HTTP_OK;
+}
+
+/** Fold consecutive rows with the same key into objects with nested arrays, in a single pass.
+ * Only the nested arrays of the current group are held back, the rest is appended as it is read.
+ */
+static int mod_okioki_json_append_nested(apr_bucket_brigade *bb, apr_pool_t *pool, apr_bucket_alloc_t *alloc, result_t *db_result, apr_hash_t *result_strings, json_nest_t *nest, ap_filter_t *next, char **error)
 {
-    const char *name;
+    int                nr_cols = mod_okioki_result_num_cols(db_result);
+    int                nr_keys = nest->keys->nelts;
+    int                col_arrays[nr_cols];
+    int                key_cols[nr_keys];
+    const char         *key_values[nr_keys];
+    apr_bucket_brigade *array_bbs[nest->arrays->nelts];
+    int                array_sizes[nest->arrays->nelts];
+    json_nest_array_t  *array;
+    const view_columns_t *columns;
+    apr_pool_t         *group_pool;
+    apr_dbd_row_t      *db_row = NULL;
+    const char         *value;
+    int                nr_groups = 0;
+    int                same_group;
+    int                has_child;
+    int                first;
+    int                col_nr;
+    int                i;
+    int                j;
+    int                ret;
+
+    ASSERT_HTTP_OK(
+        mod_okioki_columns_get(pool, alloc, db_result, result_strings, &columns, error),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not get the columns of the result."
+    )
+
+    // Every column belongs to the parent (-1) or to one of the nested arrays.
+    for (col_nr = 0; col_nr < nr_cols; col_nr++) {
+        col_arrays[col_nr] = -1;
+    }
+    for (i = 0; i < nest->arrays->nelts; i++) {
+        array = &APR_ARRAY_IDX(nest->arrays, i, json_nest_array_t);
+        for (j = 0; j < array->columns->nelts; j++) {
+            ASSERT_POSITIVE(
+                col_nr = mod_okioki_json_find_column(db_result, APR_ARRAY_IDX(array->columns, j, char *)),
+                HTTP_INTERNAL_SERVER_ERROR, "Could not find nested column '%s' in result.", APR_ARRAY_IDX(array->columns, j, char *)
+            )
+            col_arrays[col_nr] = i;
+        }
+
+        ASSERT_NOT_NULL(
+            array_bbs[i] = apr_brigade_create(pool, alloc),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not allocate a bucket brigade."
+        )
+    }
+    for (i = 0; i < nr_keys; i++) {
+        ASSERT_POSITIVE(
+            key_cols[i] = mod_okioki_json_find_column(db_result, APR_ARRAY_IDX(nest->keys, i, char *)),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not find key column '%s' in result.", APR_ARRAY_IDX(nest->keys, i, char *)
+        )
+    }
+
+    // The key of the current group is copied, as the row is reused for the next row.
+    ASSERT_APR_SUCCESS(
+        apr_pool_create(&group_pool, pool),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate group pool."
+    )
+    ASSERT_APR_SUCCESS(
+        apr_brigade_puts(bb, NULL, NULL, "[\n"),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not write JSON result."
+    )
+
+    while (mod_okioki_result_get_row(db_result, pool, &db_row) == 0) {
+        same_group = nr_groups > 0;
+        for (i = 0; i < nr_keys && same_group; i++) {
+            if ((value = mod_okioki_result_get_entry(db_result, db_row, key_cols[i])) == NULL || strcmp(value, key_values[i]) != 0) {
+                same_group = 0;
+            }
+        }
+
+        if (!same_group) {
+            if (nr_groups > 0) {
+                if ((ret = mod_okioki_json_close_group(bb, pool, alloc, nest, array_bbs, error)) != HTTP_OK) {
+                    return ret;
+                }
+
+                // Only closed groups are passed on, the arrays of the open group are still being filled.
+                if (next != NULL && nr_groups % OUTPUT_CHUNK_ROWS == 0) {
+                    ASSERT_APR_SUCCESS(
+                        mod_okioki_pass_chunk(next, bb),
+                        HTTP_INTERNAL_SERVER_ERROR, "Could not pass JSON chunk to the output filters."
+                    )
+                }
+            }
+
+            // Start the object of the new group with the columns of the parent.
+            ASSERT_APR_SUCCESS(
+                apr_brigade_puts(bb, NULL, NULL, nr_groups > 0 ? ", {" : "{"),
+                HTTP_INTERNAL_SERVER_ERROR, "Could not write JSON result."
+            )
+
+            first = 1;
+            for (col_nr = 0; col_nr < nr_cols; col_nr++) {
+                if (col_arrays[col_nr] < 0) {
+                    if ((ret = mod_okioki_json_append_pair(bb, pool, alloc, db_result, db_row, col_nr, columns, first, "\t", error)) != HTTP_OK) {
+                        return ret;
+                    }
+                    first = 0;
+                }
+            }
+
+            apr_pool_clear(group_pool);
+            for (i = 0; i < nr_keys; i++) {
+                value = mod_okioki_result_get_entry(db_result, db_row, key_cols[i]);
+                key_values[i] = apr_pstrdup(group_pool, value ? value : "");
+            }
+            for (i = 0; i < nest->arrays->nelts; i++) {
+                array_sizes[i] = 0;
+            }
+            nr_groups++;
+        }
+
+        // Add a child object to each nested array, unless all its columns are empty, as happens with an outer join.
+        for (i = 0; i < nest->arrays->nelts; i++) {
+            has_child = 0;
+            for (col_nr = 0; col_nr < nr_cols; col_nr++) {
+                if (col_arrays[col_nr] == i && (value = mod_okioki_result_get_entry(db_result, db_row, col_nr)) != NULL && value[0] != 0) {
+                    has_child = 1;
+                }
+            }
+            if (!has_child) {
+                continue;
+            }
+
+            ASSERT_APR_SUCCESS(
+                apr_brigade_puts(array_bbs[i], NULL, NULL, array_sizes[i] > 0 ? ", {" : "{"),
+                HTTP_INTERNAL_SERVER_ERROR, "Could not write JSON result."
+            )
+            first = 1;
+            for (col_nr = 0; col_nr < nr_cols; col_nr++) {
+                if (col_arrays[col_nr] == i) {
+                    if ((ret = mod_okioki_json_append_pair(array_bbs[i], pool, alloc, db_result, db_row, col_nr, columns, first, "\t\t", error)) != HTTP_OK) {
+                        return ret;
+                    }
+                    first = 0;
+                }
+            }
+            ASSERT_APR_SUCCESS(
+                apr_brigade_puts(array_bbs[i], NULL, NULL, "\n\t}"),
+                HTTP_INTERNAL_SERVER_ERROR, "Could not write JSON result."
+            )
+            array_sizes[i]++;
+        }
+    }
+
+    if (nr_groups > 0) {
+        if ((ret = mod_okioki_json_close_group(bb, pool, alloc, nest, array_bbs, error)) != HTTP_OK) {
+            return ret;
+        }
+    }
+
+    apr_pool_destroy(group_pool);
+    ASSERT_APR_SUCCESS(
+        apr_brigade_puts(bb, NULL, NULL, "\n]\n"),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not write JSON result."
+    )
+    return HTTP_OK;
+}
+
+int mod_okioki_json_append_result(apr_bucket_brigade *bb, apr_pool_t *pool, apr_bucket_alloc_t *alloc, result_t *db_result, apr_hash_t *result_strings, json_nest_t *nest, ap_filter_t *next, char **error)
+{
+    const view_columns_t *columns;
     const char *value;
     apr_dbd_row_t *db_row;
-    apr_bucket_brigade *bb;
     apr_bucket *b;
     int col_nr;
     int nr_cols;
     int row_nr;
     int nr_rows;
 
-    ASSERT_NOT_NULL(
-        bb = apr_brigade_create(pool, alloc),
-        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate a bucket brigade."
-    )
+    if (nest != NULL) {
+        return mod_okioki_json_append_nested(bb, pool, alloc, db_result, result_strings, nest, next, error);
+    }
+
+    nr_cols = mod_okioki_result_num_cols(db_result);
+    nr_rows = mod_okioki_result_num_tuples(db_result);
 
-    nr_cols = apr_dbd_num_cols(db_driver, db_result);
-    nr_rows = apr_dbd_num_tuples(db_driver, db_result);
+    // The column names were escaped when the view was described.
+    ASSERT_HTTP_OK(
+        mod_okioki_columns_get(pool, alloc, db_result, result_strings, &columns, error),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not get the columns of the result."
+    )
 
     // If there is more than one row we go in list mode.
     if (nr_rows > 1) {
@@ -218,6 +486,7 @@ int mod_okioki_generate_json(request_rec *http_request, apr_pool_t *pool, apr_bu
     }
 
     // Check each row and figure out all the column names.
+    // The row structure is allocated once and reused for every row.
     db_row = NULL;
     for (row_nr = 0; row_nr < nr_rows; row_nr++) {
         // Start an object/dictionary.
@@ -236,7 +505,7 @@ int mod_okioki_generate_json(request_rec *http_request, apr_pool_t *pool, apr_bu
         }
 
         ASSERT_APR_SUCCESS(
-            apr_dbd_get_row(db_driver, pool, db_result, &db_row, -1),
+            mod_okioki_result_get_row(db_result, pool, &db_row),
             HTTP_INTERNAL_SERVER_ERROR, "Could not get row"
         )
         ASSERT_NOT_NULL(
@@ -261,14 +530,10 @@ int mod_okioki_generate_json(request_rec *http_request, apr_pool_t *pool, apr_bu
             }
 
             ASSERT_NOT_NULL(
-                name = apr_dbd_get_name(db_driver, db_result, col_nr),
-                HTTP_INTERNAL_SERVER_ERROR, "Could not retrieve name of column from database result."
-            )
-
-            ASSERT_HTTP_OK(
-                mod_okioki_json_append_value(bb, pool, alloc, name, 1, error),
-                HTTP_INTERNAL_SERVER_ERROR, "Not enough room to store CSV result."
+                b = apr_bucket_immortal_create(columns->json_keys[col_nr], columns->json_keys_len[col_nr], alloc),
+                HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
             )
+            APR_BRIGADE_INSERT_TAIL(bb, b);
 
             ASSERT_NOT_NULL(
                 b = apr_bucket_immortal_create(": ", 2, alloc),
@@ -277,14 +542,12 @@ int mod_okioki_generate_json(request_rec *http_request, apr_pool_t *pool, apr_bu
             APR_BRIGADE_INSERT_TAIL(bb, b);
 
             ASSERT_NOT_NULL(
-                value = apr_dbd_get_entry(db_driver, db_row, col_nr),
+                value = mod_okioki_result_get_entry(db_result, db_row, col_nr),
                 HTTP_INTERNAL_SERVER_ERROR, "Could not retrieve name of column from database result."
             )
 
-            int is_string = (apr_hash_get(result_strings, name, APR_HASH_KEY_STRING) == result_strings);
-
             ASSERT_HTTP_OK(
-                mod_okioki_json_append_value(bb, pool, alloc, value, is_string, error),
+                mod_okioki_json_append_value(bb, pool, alloc, value, columns->is_string[col_nr], error),
                 HTTP_INTERNAL_SERVER_ERROR, "Not enough room to store CSV result."
             )
         }
@@ -295,6 +558,13 @@ int mod_okioki_generate_json(request_rec *http_request, apr_pool_t *pool, apr_bu
             HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
         )
         APR_BRIGADE_INSERT_TAIL(bb, b);
+
+        if (next != NULL && (row_nr + 1) % OUTPUT_CHUNK_ROWS == 0) {
+            ASSERT_APR_SUCCESS(
+                mod_okioki_pass_chunk(next, bb),
+                HTTP_INTERNAL_SERVER_ERROR, "Could not pass JSON chunk to the output filters."
+            )
+        }
     }
 
     if (nr_rows > 1) {
@@ -311,16 +581,156 @@ int mod_okioki_generate_json(request_rec *http_request, apr_pool_t *pool, apr_bu
     )
     APR_BRIGADE_INSERT_TAIL(bb, b);
 
-    // Add an end-of-stream.
+    return HTTP_OK;
+}
+
+int mod_okioki_generate_json(request_rec *http_request, apr_pool_t *pool, apr_bucket_alloc_t *alloc, result_t *db_result, apr_hash_t *result_strings, json_nest_t *nest, char **error)
+{
+    apr_bucket_brigade *bb;
+    ap_filter_t *next;
+    int ret;
+
     ASSERT_NOT_NULL(
-        b = apr_bucket_eos_create(alloc),
-        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
+        bb = apr_brigade_create(pool, alloc),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate a bucket brigade."
     )
-    APR_BRIGADE_INSERT_TAIL(bb, b);
 
-    // Return the data.
+    // The content type must be known before the first chunk is passed down the filter chain.
     ap_set_content_type(http_request, "application/json");
     http_request->status = HTTP_OK;
-    return ap_pass_brigade(http_request->output_filters, bb);
+
+    // A result of less than a chunk of rows is generated whole, so that it can be sent at once. So is a
+    // response that is captured with its ETag, so that the ETag is sent with it.
+    next = mod_okioki_result_num_tuples(db_result) < OUTPUT_CHUNK_ROWS || mod_okioki_capture_whole(http_request) ? NULL : http_request->output_filters;
+
+    if ((ret = mod_okioki_json_append_result(bb, pool, alloc, db_result, result_strings, nest, next, error)) != HTTP_OK) {
+        return mod_okioki_response_failed(http_request, ret);
+    }
+
+    return mod_okioki_pass_response(http_request, bb, alloc, next == NULL, error);
+}
+
+
+/** Generate the NDJSON response, passing it down the filter chain in chunks of rows.
+ */
+static int mod_okioki_ndjson_generate_rows(request_rec *http_request, apr_pool_t *pool, apr_bucket_alloc_t *alloc, result_t *db_result, apr_hash_t *result_strings, char **error)
+{
+    const view_columns_t *columns;
+    const char *value;
+    apr_dbd_row_t *db_row;
+    apr_bucket_brigade *bb;
+    apr_bucket *b;
+    int col_nr;
+    int nr_cols;
+    int row_nr;
+    int nr_rows;
+    int whole;
+
+    ASSERT_NOT_NULL(
+        bb = apr_brigade_create(pool, alloc),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate a bucket brigade."
+    )
+
+    nr_cols = mod_okioki_result_num_cols(db_result);
+    nr_rows = mod_okioki_result_num_tuples(db_result);
+
+    // A response that is captured with its ETag is kept whole anyway, it is not flushed in chunks.
+    whole = nr_rows < NDJSON_CHUNK_ROWS || mod_okioki_capture_whole(http_request);
+
+    // The column names were escaped when the view was described.
+    ASSERT_HTTP_OK(
+        mod_okioki_columns_get(pool, alloc, db_result, result_strings, &columns, error),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not get the columns of the result."
+    )
+
+    // The content type must be known before the first chunk is passed down the filter chain.
+    ap_set_content_type(http_request, "application/x-ndjson");
+    http_request->status = HTTP_OK;
+
+    // Each row becomes a single compact object on its own line, there is no enclosing list.
+    db_row = NULL;
+    for (row_nr = 0; row_nr < nr_rows; row_nr++) {
+        ASSERT_NOT_NULL(
+            b = apr_bucket_immortal_create("{", 1, alloc),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
+        )
+        APR_BRIGADE_INSERT_TAIL(bb, b);
+
+        ASSERT_APR_SUCCESS(
+            mod_okioki_result_get_row(db_result, pool, &db_row),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not get row"
+        )
+        ASSERT_NOT_NULL(
+            db_row,
+            HTTP_INTERNAL_SERVER_ERROR, "Could not retrieve row."
+        )
+
+        for (col_nr = 0; col_nr < nr_cols; col_nr++) {
+            // Add a comma between each entry.
+            if (col_nr != 0) {
+                ASSERT_NOT_NULL(
+                    b = apr_bucket_immortal_create(",", 1, alloc),
+                    HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
+                )
+                APR_BRIGADE_INSERT_TAIL(bb, b);
+            }
+
+            ASSERT_NOT_NULL(
+                b = apr_bucket_immortal_create(columns->json_keys[col_nr], columns->json_keys_len[col_nr], alloc),
+                HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
+            )
+            APR_BRIGADE_INSERT_TAIL(bb, b);
+
+            ASSERT_NOT_NULL(
+                b = apr_bucket_immortal_create(":", 1, alloc),
+                HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
+            )
+            APR_BRIGADE_INSERT_TAIL(bb, b);
+
+            ASSERT_NOT_NULL(
+                value = mod_okioki_result_get_entry(db_result, db_row, col_nr),
+                HTTP_INTERNAL_SERVER_ERROR, "Could not retrieve name of column from database result."
+            )
+
+            ASSERT_HTTP_OK(
+                mod_okioki_json_append_value(bb, pool, alloc, value, columns->is_string[col_nr], error),
+                HTTP_INTERNAL_SERVER_ERROR, "Not enough room to store NDJSON result."
+            )
+        }
+
+        // Finish off the object with a linefeed, which is the record separator.
+        ASSERT_NOT_NULL(
+            b = apr_bucket_immortal_create("}\n", 2, alloc),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
+        )
+        APR_BRIGADE_INSERT_TAIL(bb, b);
+
+        // Every chunk of rows is flushed to the client, so that it can start parsing while we continue.
+        if (!whole && (row_nr + 1) % NDJSON_CHUNK_ROWS == 0) {
+            ASSERT_NOT_NULL(
+                b = apr_bucket_flush_create(alloc),
+                HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
+            )
+            APR_BRIGADE_INSERT_TAIL(bb, b);
+
+            ASSERT_APR_SUCCESS(
+                mod_okioki_pass_chunk(http_request->output_filters, bb),
+                HTTP_INTERNAL_SERVER_ERROR, "Could not pass NDJSON chunk to the output filters."
+            )
+        }
+    }
+
+    // Without a flush the client received nothing yet, and the result can be sent at once.
+    return mod_okioki_pass_response(http_request, bb, alloc, whole, error);
+}
+
+int mod_okioki_generate_ndjson(request_rec *http_request, apr_pool_t *pool, apr_bucket_alloc_t *alloc, result_t *db_result, apr_hash_t *result_strings, char **error)
+{
+    int ret;
+
+    if ((ret = mod_okioki_ndjson_generate_rows(http_request, pool, alloc, db_result, result_strings, error)) != OK) {
+        return mod_okioki_response_failed(http_request, ret);
+    }
+    return OK;
 }
 
@@ -21,7 +21,19 @@
 #include <apr_hash.h>
 #include <apr_tables.h>
 #include "mod_okioki.h"
+#include "result.h"
 
-int mod_okioki_generate_json(request_rec *http_request, apr_pool_t *pool, apr_bucket_alloc_t *alloc, const apr_dbd_driver_t *db_driver, apr_dbd_results_t *db_result, apr_hash_t *result_strings, char **error);
+/** Append a value as a JSON string to the brigade.
+ */
+int mod_okioki_json_append_string(apr_bucket_brigade *bb, apr_pool_t *pool, apr_bucket_alloc_t *alloc, const char *s, char **error);
+
+/** Append the result as a JSON document to the brigade, without an end-of-stream.
+ * When nest is set the rows are folded into a list of nested objects.
+ * When next is set, every chunk of rows is passed to that filter, otherwise the whole result is kept in the brigade.
+ */
+int mod_okioki_json_append_result(apr_bucket_brigade *bb, apr_pool_t *pool, apr_bucket_alloc_t *alloc, result_t *db_result, apr_hash_t *result_strings, json_nest_t *nest, ap_filter_t *next, char **error);
+
+int mod_okioki_generate_json(request_rec *http_request, apr_pool_t *pool, apr_bucket_alloc_t *alloc, result_t *db_result, apr_hash_t *result_strings, json_nest_t *nest, char **error);
+int mod_okioki_generate_ndjson(request_rec *http_request, apr_pool_t *pool, apr_bucket_alloc_t *alloc, result_t *db_result, apr_hash_t *result_strings, char **error);
 
 #endif
@@ -15,6 +15,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdlib.h>
 #include <sys/types.h>
 #include <regex.h>
 #include <httpd.h>
@@ -34,9 +35,31 @@
 #include "csv.h"
 #include "json.h"
 #include "util.h"
+#include "pool.h"
+#include "sse.h"
+#include "capture.h"
+#include "cache.h"
+#include "delta.h"
+#include "coalesce.h"
+#include "admission.h"
+#include "batch.h"
+#include "params.h"
+#include "notify.h"
+#include "writebehind.h"
+#include "accesslog.h"
+#include "async.h"
+#include "binary.h"
+#include "columns.h"
+#include "raw.h"
+#include "upload.h"
+#include "viewfile.h"
 
 module AP_MODULE_DECLARE_DATA okioki_module;
 
+/** Number of statements handed out to views, used as index in the per-connection table of prepared statements.
+ */
+static int mod_okioki_nr_statements = 0;
+
 /** Allocate per-directory configuration structure.
  * The structure contains information on how to connect to the backend database.
  * It also contains a resource pool of database connections.
@@ -65,6 +88,85 @@ static void *mod_okioki_create_dir_config(apr_pool_t *pool, char *dir)
         return NULL;
     }
 
+    new_cfg->coalesce_timeout = 0;
+    new_cfg->limiter          = NULL;
+    new_cfg->view_max_active  = 0;
+    new_cfg->view_max_queued  = 0;
+    new_cfg->view_max_wait    = 0;
+
+    new_cfg->writebehind_max_queued = 0;
+    new_cfg->writebehind_batch_size = 0;
+
+    new_cfg->cache          = NULL;
+    new_cfg->delta          = NULL;
+    new_cfg->event_channels = NULL;
+    new_cfg->shard          = NULL;
+    new_cfg->nest           = NULL;
+    new_cfg->upload         = NULL;
+    new_cfg->if_match       = NULL;
+    new_cfg->batch_path     = NULL;
+    new_cfg->batch_snapshot = 0;
+    new_cfg->async          = 0;
+    new_cfg->binary         = 0;
+    new_cfg->flatten_size   = FLATTEN_SIZE;
+    new_cfg->view_file      = NULL;
+
+    return (void *)new_cfg;
+}
+
+/** Allocate per-server configuration structure.
+ * The structure contains information on how to connect to the primary and replica databases
+ * when the module's own connection pool is used instead of mod_dbd.
+ *
+ * @param pool   Memory pool to allocate structure on.
+ * @param server The server record.
+ * @returns      The configuration structure.
+ */
+static void *mod_okioki_create_server_config(apr_pool_t *pool, server_rec *server)
+{
+    mod_okioki_server_config *new_cfg;
+
+    // Allocate structure.
+    if ((new_cfg = (mod_okioki_server_config *)apr_pcalloc(pool, sizeof (mod_okioki_server_config))) == NULL) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, 0, pool, "Failed to allocate per-server config.");
+        return NULL;
+    }
+
+    if ((new_cfg->replicas = apr_array_make(pool, 4, sizeof (backend_t *))) == NULL) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, 0, pool, "Failed to allocate replicas array.");
+        return NULL;
+    }
+
+    if ((new_cfg->shards = apr_array_make(pool, 4, sizeof (backend_t *))) == NULL) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, 0, pool, "Failed to allocate shards array.");
+        return NULL;
+    }
+
+    new_cfg->db_driver_name  = "pgsql";
+    new_cfg->primary         = NULL;
+    new_cfg->max_connections = MAX_CONNECTIONS;
+    new_cfg->next_replica    = 0;
+    new_cfg->listen_params   = NULL;
+    return (void *)new_cfg;
+}
+
+/** Merge per-server configuration structures.
+ * A virtual host without its own primary database or shards uses the databases of the main server.
+ */
+static void *mod_okioki_merge_server_config(apr_pool_t *pool, void *_base, void *_add)
+{
+    mod_okioki_server_config *base = (mod_okioki_server_config *)_base;
+    mod_okioki_server_config *add  = (mod_okioki_server_config *)_add;
+    mod_okioki_server_config *new_cfg;
+
+    if ((new_cfg = (mod_okioki_server_config *)apr_pmemdup(pool, (add->primary || add->shards->nelts > 0) ? add : base, sizeof (mod_okioki_server_config))) == NULL) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, 0, pool, "Failed to allocate per-server config.");
+        return NULL;
+    }
+
+    new_cfg->next_replica    = 0;
+    new_cfg->listen_params   = add->listen_params ? add->listen_params : base->listen_params;
+    new_cfg->binary_protocol = add->binary_protocol;
     return (void *)new_cfg;
 }
 
@@ -80,11 +182,11 @@ static void *mod_okioki_create_dir_config(apr_pool_t *pool, char *dir)
 static int mod_okioki_read_data(request_rec *http_request, char **_data, size_t *_data_len, char **error)
 {
     apr_pool_t              *pool = http_request->pool;
-    apr_pool_t              *bucket_pool = http_request->connection->pool;
+    apr_pool_t              *bucket_pool = http_request->pool;
     apr_bucket_alloc_t      *bucket_alloc = http_request->connection->bucket_alloc;
     apr_bucket_brigade      *bb;
     apr_bucket              *bucket;
-    int                     seen_eos;
+    int                     seen_eos = 0;
     char                    *data;
     size_t                  data_size = MIN_INPUT_BUFFER;
     size_t                  data_len = 0;
@@ -145,6 +247,7 @@ static int mod_okioki_read_data(request_rec *http_request, char **_data, size_t
                     data = mod_okioki_realloc(pool, data, data_len, new_size),
                     HTTP_INTERNAL_SERVER_ERROR, "Could not resize input buffer to %i", (int)new_size
                 )
+                data_size = new_size;
             }
 
             // Copy the data into the buffer.
@@ -162,7 +265,7 @@ static int mod_okioki_read_data(request_rec *http_request, char **_data, size_t
     return HTTP_OK;
 }
 
-static int mod_okioki_input_handler(request_rec *http_request, apr_hash_t **_arguments, char **error)
+static int mod_okioki_input_handler(request_rec *http_request, view_t *view, apr_hash_t **_arguments, char **error)
 {
     apr_pool_t              *pool = http_request->pool;
     apr_hash_t              *arguments;
@@ -189,12 +292,6 @@ static int mod_okioki_input_handler(request_rec *http_request, apr_hash_t **_arg
 
     // Extract parameters from the POST/PUT data.
     if (((http_request->method_number == M_POST) | (http_request->method_number == M_PUT))) {
-        // Read all data from the buckets and brigades.
-        ASSERT_HTTP_OK(
-            ret = mod_okioki_read_data(http_request, &data, &data_size, error),
-            ret, "Could not read input from buckets."
-        )
-
         // Check for the content-type of the request.
         ASSERT_NOT_NULL(
             _content_type = apr_table_get(http_request->headers_in, "Content-type"),
@@ -211,6 +308,17 @@ static int mod_okioki_input_handler(request_rec *http_request, apr_hash_t **_arg
         // Get the charset from the content_type string.
         charset = apr_strtok(NULL, ";", &last_token);
 
+        // A binary body is stored while it is received, instead of being read into memory.
+        if (view->upload != NULL && (strcmp(content_type, "application/octet-stream") == 0 || strcmp(content_type, "multipart/form-data") == 0)) {
+            return mod_okioki_upload_handler(http_request, view, arguments, _content_type, error);
+        }
+
+        // Read all data from the buckets and brigades.
+        ASSERT_HTTP_OK(
+            ret = mod_okioki_read_data(http_request, &data, &data_size, error),
+            ret, "Could not read input from buckets."
+        )
+
         if (strcmp(content_type, "application/x-www-form-urlencoded") == 0) {
             ASSERT_HTTP_OK(
                 ret = mod_okioki_parse_query(http_request, arguments, data, error),
@@ -274,7 +382,7 @@ int mod_okioki_generate_error(request_rec *http_request, apr_pool_t *pool, apr_b
 
 /** Generate no output.
  */
-int mod_okioki_generate_empty(request_rec *http_request, apr_pool_t *pool, apr_bucket_alloc_t *alloc, char **error)
+int mod_okioki_generate_empty(request_rec *http_request, apr_pool_t *pool, apr_bucket_alloc_t *alloc, int ret, char **error)
 {
     apr_bucket_brigade *bb;
     apr_bucket *b;
@@ -293,10 +401,118 @@ int mod_okioki_generate_empty(request_rec *http_request, apr_pool_t *pool, apr_b
 
     // Return the data.
     ap_set_content_type(http_request, "text/plain");
-    http_request->status = HTTP_OK;
+    http_request->status = ret;
     return ap_pass_brigade(http_request->output_filters, bb);
 }
 
+static int mod_okioki_view_output(request_rec *http_request, view_t *view, int ret, result_t *db_result, char **error);
+
+/** Execute the view and write its result to the client.
+ *
+ * @param http_request  Information about the http_request.
+ * @param cfg           The per-directory configuration.
+ * @param view          The view to execute.
+ * @param arguments     The arguments parsed from the request.
+ * @param fill          The cache entry that is filled by this request, or NULL.
+ * @returns             HTTP status.
+ */
+static int mod_okioki_view_handler(request_rec *http_request, mod_okioki_dir_config *cfg, view_t *view, apr_hash_t *arguments, cache_entry_t *fill, char **error)
+{
+    apr_pool_t              *bucket_pool = http_request->pool;
+    apr_bucket_alloc_t      *bucket_alloc = http_request->connection->bucket_alloc;
+    int                     ret;
+    int                     stale_ret;
+    result_t                *db_result = NULL;
+    accesslog_record_t      *record = mod_okioki_accesslog_get(http_request);
+    apr_time_t              db_start = record != NULL ? apr_time_now() : 0;
+
+    // A raw view sends a single value as the body, straight from the database connection.
+    if (view->output_type == O_RAW) {
+        if ((ret = mod_okioki_raw_handler(http_request, view, arguments, error)) != OK) {
+            return mod_okioki_generate_error(http_request, bucket_pool, bucket_alloc, ret, error);
+        }
+        return OK;
+    }
+
+    // Handle the view, in the transaction of its upload.
+    ret = mod_okioki_view_execute(http_request, cfg, view, arguments, &db_result, error);
+    if (ret == HTTP_OK && view->if_match != NULL) {
+        // A conditional write that returned no rows was made against an older version, a stored upload is rolled back.
+        ret = mod_okioki_view_check_if_match(http_request, view, db_result, error);
+    }
+    if (view->upload != NULL) {
+        ret = mod_okioki_upload_end(http_request, ret, error);
+    }
+    if (record != NULL) {
+        record->db_time = apr_time_now() - db_start;
+        record->nr_rows = ret == HTTP_OK && db_result != NULL ? mod_okioki_result_num_tuples(db_result) : 0;
+    }
+
+    if (ret != HTTP_OK) {
+        // When the database fails, a cached view sends its last good response instead.
+        if (fill != NULL && ret >= HTTP_INTERNAL_SERVER_ERROR && (stale_ret = mod_okioki_cache_send_stale(http_request, fill, error)) != DECLINED) {
+            return stale_ret;
+        }
+        return mod_okioki_generate_error(http_request, bucket_pool, bucket_alloc, ret, error);
+    }
+
+    return mod_okioki_view_output(http_request, view, HTTP_OK, db_result, error);
+}
+
+/** Write the result of a view, or the error, to the client.
+ *
+ * @param ret        HTTP_OK, or the HTTP status of the error.
+ * @param db_result  The result of the view, NULL when the statement does not return rows.
+ * @returns          HTTP status.
+ */
+static int mod_okioki_view_output(request_rec *http_request, view_t *view, int ret, result_t *db_result, char **error)
+{
+    apr_pool_t              *bucket_pool = http_request->pool;
+    apr_bucket_alloc_t      *bucket_alloc = http_request->connection->bucket_alloc;
+
+    if (ret != HTTP_OK) {
+        return mod_okioki_generate_error(http_request, bucket_pool, bucket_alloc, ret, error);
+    }
+
+    if (db_result != NULL) {
+        switch (view->output_type) {
+        case O_CSV:
+            return mod_okioki_generate_csv(http_request, bucket_pool, bucket_alloc, db_result, error);
+        case O_JSON:
+            return mod_okioki_generate_json(http_request, bucket_pool, bucket_alloc, db_result, view->result_strings, view->nest, error);
+        case O_NDJSON:
+            return mod_okioki_generate_ndjson(http_request, bucket_pool, bucket_alloc, db_result, view->result_strings, error);
+        case O_SSE:
+            // Event streams are handled by mod_okioki_sse_handler().
+            break;
+        case O_RAW:
+            // Raw views are handled by mod_okioki_raw_handler().
+            break;
+        }
+    } else {
+        return mod_okioki_generate_empty(http_request, bucket_pool, bucket_alloc, HTTP_OK, error);
+    }
+
+    /* NOTREACHED */
+    return HTTP_INTERNAL_SERVER_ERROR;
+}
+
+/** Send the result of a view that was executed while its request was suspended.
+ * The request still holds its places in the limiters of the directory and the view.
+ */
+static int mod_okioki_async_complete(request_rec *http_request, view_t *view, int ret, result_t *db_result, char **error)
+{
+    mod_okioki_dir_config *cfg = (mod_okioki_dir_config *)ap_get_module_config(http_request->per_dir_config, &okioki_module);
+
+    if (ret == HTTP_OK && view->if_match != NULL) {
+        ret = mod_okioki_view_check_if_match(http_request, view, db_result, error);
+    }
+    ret = mod_okioki_view_output(http_request, view, ret, db_result, error);
+    mod_okioki_admission_leave(view->limiter);
+    mod_okioki_admission_leave(cfg->limiter);
+    return ret;
+}
+
 /** This is the main handler for any request withing some folder.
  * It will find a view based on the value of PATH_INFO.
  * Then it will get a free postgresql connection and pass it on to the view.
@@ -308,15 +524,17 @@ int mod_okioki_generate_empty(request_rec *http_request, apr_pool_t *pool, apr_b
 static int mod_okioki_handler(request_rec *http_request)
 {
     apr_pool_t              *pool = http_request->pool;
-    apr_pool_t              *bucket_pool = http_request->connection->pool;
+    apr_pool_t              *bucket_pool = http_request->pool;
     apr_bucket_alloc_t      *bucket_alloc = http_request->connection->bucket_alloc;
     mod_okioki_dir_config   *cfg = (mod_okioki_dir_config *)ap_get_module_config(http_request->per_dir_config, &okioki_module);
     char                    *view_name;
     view_t                  *view;
     apr_hash_t              *arguments;
     int                     ret;
-    const apr_dbd_driver_t  *db_driver;
-    apr_dbd_results_t       *db_result;
+    coalesce_flight_t       *flight = NULL;
+    cache_entry_t           *fill = NULL;
+    char                    *data;
+    size_t                  data_len;
     char                    *_error;
     char                    **error = &_error;
 
@@ -325,46 +543,232 @@ static int mod_okioki_handler(request_rec *http_request)
         return DECLINED;
     }
 
+    // The batch endpoint executes several views at once, it counts as a single request for admission control.
+    if (cfg->batch_path != NULL && http_request->method_number == M_POST && http_request->path_info != NULL && strcmp(http_request->path_info, cfg->batch_path) == 0) {
+        mod_okioki_accesslog_start(http_request, NULL, apr_pstrcat(pool, http_request->method, " ", http_request->path_info, NULL));
+
+        if ((ret = mod_okioki_read_data(http_request, &data, &data_len, error)) != HTTP_OK) {
+            return mod_okioki_generate_error(http_request, bucket_pool, bucket_alloc, ret, error);
+        }
+
+        if ((ret = mod_okioki_admission_enter(http_request, cfg->limiter, error)) != HTTP_OK) {
+            return mod_okioki_generate_error(http_request, bucket_pool, bucket_alloc, ret, error);
+        }
+        ret = mod_okioki_batch_handler(http_request, cfg, data, data_len, error);
+        mod_okioki_admission_leave(cfg->limiter);
+
+        if (ret != OK) {
+            return mod_okioki_generate_error(http_request, bucket_pool, bucket_alloc, ret, error);
+        }
+        return OK;
+    }
+
     // Find a view matching the url.
     view_name = apr_pstrcat(pool, http_request->method, " ", http_request->path_info, NULL);
     ASSERT_NOT_NULL(
-        view = apr_hash_get(cfg->views, view_name, APR_HASH_KEY_STRING),
+        view = mod_okioki_viewfile_find(http_request, cfg, view_name),
         HTTP_NOT_FOUND, "Could not find view for '%s'.", view_name
     )
+    mod_okioki_accesslog_start(http_request, view, view_name);
+
+    // A conditional write without If-Match is refused before its body is read, which may store an upload.
+    if (view->if_match != NULL && (ret = mod_okioki_view_require_if_match(http_request, error)) != HTTP_OK) {
+        return mod_okioki_generate_error(http_request, bucket_pool, bucket_alloc, ret, error);
+    }
+
+    // An upload is stored on a database connection while its body is received, so the request waits for its places
+    // in the limiters before the body is read. They are held until the pinned connection is released with the request.
+    if (view->upload != NULL) {
+        if ((ret = mod_okioki_admission_enter(http_request, cfg->limiter, error)) == HTTP_OK && (ret = mod_okioki_admission_enter(http_request, view->limiter, error)) != HTTP_OK) {
+            mod_okioki_admission_leave(cfg->limiter);
+        }
+        if (ret != HTTP_OK) {
+            return mod_okioki_generate_error(http_request, bucket_pool, bucket_alloc, ret, error);
+        }
+        apr_pool_cleanup_register(pool, cfg->limiter, mod_okioki_admission_cleanup, apr_pool_cleanup_null);
+        apr_pool_cleanup_register(pool, view->limiter, mod_okioki_admission_cleanup, apr_pool_cleanup_null);
+    }
 
     // Handle all input data and build up the arguments table. These arguments are used in the execution
     // of the prepared sql statement.
-    if ((ret = mod_okioki_input_handler(http_request, &arguments, error)) != HTTP_OK) {
+    if ((ret = mod_okioki_input_handler(http_request, view, &arguments, error)) != HTTP_OK) {
         return mod_okioki_generate_error(http_request, bucket_pool, bucket_alloc, ret, error);
     }
 
-    // Handle the view.
-    if ((ret = mod_okioki_view_execute(http_request, cfg, view, arguments, &db_driver, &db_result, error)) != HTTP_OK) {
+    // The arguments are captured as the client sent them, before they are bound and normalized.
+    mod_okioki_accesslog_arguments(http_request, view, arguments);
+
+    // A conditional write compares the version the client has read with the version in the database.
+    if (view->if_match != NULL) {
+        if ((ret = mod_okioki_view_bind_if_match(http_request, view, arguments, error)) != HTTP_OK) {
+            return mod_okioki_generate_error(http_request, bucket_pool, bucket_alloc, ret, error);
+        }
+    }
+
+    // Reject missing and malformed parameters before doing any database work.
+    if ((ret = mod_okioki_param_check(http_request, view, arguments, error)) != HTTP_OK) {
         return mod_okioki_generate_error(http_request, bucket_pool, bucket_alloc, ret, error);
     }
 
-    if (db_result != NULL) {
-        switch (view->output_type) {
-        case O_CSV:
-            return mod_okioki_generate_csv(http_request, bucket_pool, bucket_alloc, db_driver, db_result, error);
-        case O_JSON:
-            return mod_okioki_generate_json(http_request, bucket_pool, bucket_alloc, db_driver, db_result, view->result_strings, error);
+    // Requests to a write-behind view are queued and executed later in a batch.
+    if (view->writebehind != NULL) {
+        if ((ret = mod_okioki_writebehind_enqueue(http_request, view, arguments, error)) != HTTP_ACCEPTED) {
+            return mod_okioki_generate_error(http_request, bucket_pool, bucket_alloc, ret, error);
+        }
+        return mod_okioki_generate_empty(http_request, bucket_pool, bucket_alloc, ret, error);
+    }
+
+    // An event stream holds on to the request until the client goes away, it is not cached or coalesced;
+    // a place in the limiters and a database connection are only used while the view is executed for an event.
+    if (view->output_type == O_SSE) {
+        if ((ret = mod_okioki_sse_handler(http_request, cfg, view, arguments, error)) != OK) {
+            return mod_okioki_generate_error(http_request, bucket_pool, bucket_alloc, ret, error);
+        }
+        return OK;
+    }
+
+    // Responses of cached views are send from the cache, until they expire or are invalidated by a notification.
+    if (view->cache != NULL && http_request->method_number == M_GET) {
+        if ((ret = mod_okioki_cache_begin(http_request, cfg, view, view_name, arguments, &fill, error)) != DECLINED) {
+            return ret;
+        }
+    }
+
+    // Identical GET requests that are in flight at the same time are executed only once, the
+    // other requests get a copy of the result.
+    if (view->coalesce_timeout > 0 && http_request->method_number == M_GET) {
+        if ((ret = mod_okioki_coalesce_begin(http_request, view, view_name, arguments, &flight, error)) != DECLINED) {
+            // The copy passed through the capture of the cache as well.
+            if (fill != NULL) {
+                mod_okioki_cache_end(fill);
+            }
+            return ret;
+        }
+    }
+
+    // Wait for a place in the directory and then in the view, before using a database connection; an upload already has them.
+    if (view->upload != NULL) {
+        ret = HTTP_OK;
+    } else if ((ret = mod_okioki_admission_enter(http_request, cfg->limiter, error)) == HTTP_OK && (ret = mod_okioki_admission_enter(http_request, view->limiter, error)) != HTTP_OK) {
+        mod_okioki_admission_leave(cfg->limiter);
+    }
+
+    if (ret != HTTP_OK) {
+        // A rejected request does not hand its 503 to the requests waiting for it, they try to get a place themselves.
+        if (flight != NULL) {
+            mod_okioki_coalesce_end(flight);
+            flight = NULL;
         }
+        ret = mod_okioki_generate_error(http_request, bucket_pool, bucket_alloc, ret, error);
+
+    } else if (
+        cfg->async && fill == NULL && flight == NULL && view->shard == NULL && view->output_type != O_SSE && view->output_type != O_RAW && view->upload == NULL &&
+        (ret = mod_okioki_async_begin(http_request, view, arguments, mod_okioki_async_complete, error)) != DECLINED
+    ) {
+        // The worker thread is released while the database executes the view, the limiters are left
+        // when the request completes.
+        if (ret == SUSPENDED) {
+            return SUSPENDED;
+        }
+        mod_okioki_admission_leave(view->limiter);
+        mod_okioki_admission_leave(cfg->limiter);
+        ret = mod_okioki_generate_error(http_request, bucket_pool, bucket_alloc, ret, error);
+
     } else {
-        return mod_okioki_generate_empty(http_request, bucket_pool, bucket_alloc, error);
+        ret = mod_okioki_view_handler(http_request, cfg, view, arguments, fill, error);
+        if (view->upload == NULL) {
+            mod_okioki_admission_leave(view->limiter);
+            mod_okioki_admission_leave(cfg->limiter);
+        }
     }
 
-    /* NOTREACHED */
-    return HTTP_INTERNAL_SERVER_ERROR;
+    if (flight != NULL) {
+        mod_okioki_coalesce_end(flight);
+    }
+    if (fill != NULL) {
+        mod_okioki_cache_end(fill);
+    }
+    return ret;
+}
+
+/** Handler that shows the admission control counters of the views in a directory.
+ *
+ * @param http_request  Information about the http_request.
+ * @returns             HTTP status.
+ */
+static int mod_okioki_status_handler(request_rec *http_request)
+{
+    mod_okioki_dir_config   *cfg = (mod_okioki_dir_config *)ap_get_module_config(http_request->per_dir_config, &okioki_module);
+    char                    *_error;
+    char                    **error = &_error;
+    int                     ret;
+
+    // Check if we need to process the request. We only need to if the handler is set to "okioki-status".
+    if (http_request->handler == NULL || (strcmp(http_request->handler, "okioki-status") != 0)) {
+        return DECLINED;
+    }
+
+    if ((ret = mod_okioki_admission_status(http_request, cfg, error)) != APR_SUCCESS) {
+        return mod_okioki_generate_error(http_request, http_request->pool, http_request->connection->bucket_alloc, ret, error);
+    }
+    return OK;
+}
+
+/** Reset the statement counter before the configuration is (re)read.
+ */
+static int mod_okioki_pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp)
+{
+    mod_okioki_nr_statements = 0;
+    mod_okioki_writebehind_pre_config();
+    mod_okioki_notify_pre_config();
+    mod_okioki_accesslog_pre_config();
+    mod_okioki_binary_pre_config();
+    mod_okioki_columns_pre_config();
+    mod_okioki_viewfile_pre_config();
+    return OK;
+}
+
+/** Create the module's own connection pools in each child.
+ */
+static void mod_okioki_child_init(apr_pool_t *pool, server_rec *server)
+{
+    mod_okioki_pool_child_init(pool, server);
+    mod_okioki_columns_child_init(pool, server);
+    mod_okioki_coalesce_child_init(pool, server);
+    mod_okioki_admission_child_init(pool, server);
+    mod_okioki_writebehind_child_init(pool, server);
+    mod_okioki_accesslog_child_init(pool, server);
+    mod_okioki_async_child_init(pool, server);
+    mod_okioki_binary_child_init(pool, server);
+    mod_okioki_viewfile_child_init(pool, server, mod_okioki_nr_statements);
+
+    // The cache subscribes to notifications, before the listener is started.
+    mod_okioki_cache_child_init(pool, server);
+    mod_okioki_delta_child_init(pool, server);
+    mod_okioki_notify_child_init(pool, server);
 }
 
+static const char *const mod_okioki_child_init_pre[] = {"mod_dbd.c", NULL};
+
 /** This function setups all the handlers at startup.
  * @param pool  The memory pool in case we need to allocate anything.
  */
 static void mod_okioki_register_hooks(apr_pool_t *pool)
 {
+    ap_hook_pre_config(mod_okioki_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+    // Views are described over mod_dbd connections, so its connection pool must exist first.
+    ap_hook_child_init(mod_okioki_child_init, mod_okioki_child_init_pre, NULL, APR_HOOK_MIDDLE);
+    mod_okioki_capture_register_hooks(pool);
+
     // Setup a standard request handler.
     ap_hook_handler(mod_okioki_handler, NULL, NULL, APR_HOOK_LAST);
+    ap_hook_handler(mod_okioki_status_handler, NULL, NULL, APR_HOOK_LAST);
+
+    // Servers with the binary protocol enabled handle their connections before the HTTP protocol does.
+    ap_hook_process_connection(mod_okioki_binary_process_connection, NULL, NULL, APR_HOOK_MIDDLE);
+
+    // Records of view executions are added to the access log after the response is sent.
+    ap_hook_log_transaction(mod_okioki_accesslog_log_transaction, NULL, NULL, APR_HOOK_MIDDLE);
 }
 
 /** Process the OkiokiSetCommand configuration directive.
@@ -375,17 +779,10 @@ const char *mod_okioki_dircfg_set_command(cmd_parms *cmd, void *_conf, int argc,
     mod_okioki_dir_config *conf      = (mod_okioki_dir_config *)_conf;
     char                  *view_name;
     view_t                *view;
-    unsigned int          i;
-    char                  *param;
+    const char            *msg;
 
-    // Make sure this configuration directive has at least two arguments.
-    if (argc < 4) {
-        return "[OkiokiSetCommand] Requires at least four arguments.";
-    }
-
-    // Create a new view.
-    if ((view = (view_t *)apr_palloc(pool, sizeof (view_t))) == NULL) {
-        return "[OkiokiSetCommand] Could not allocate view.";
+    if ((msg = mod_okioki_view_make(pool, cmd->server, conf, argc, argv, &view)) != NULL) {
+        return apr_pstrcat(pool, "[OkiokiSetCommand] ", msg, NULL);
     }
 
     // Add the view to the hash table. The name of the view is the method
@@ -395,39 +792,19 @@ const char *mod_okioki_dircfg_set_command(cmd_parms *cmd, void *_conf, int argc,
     }
     apr_hash_set(conf->views, view_name, APR_HASH_KEY_STRING, view);
 
-    if (strcmp(argv[2], "CSV") == 0) {
-        view->output_type = O_CSV;
-    } else if (strcmp(argv[2], "JSON") == 0) {
-        view->output_type = O_JSON;
-    } else {
-        return "[OkiokiSetCommand] Third argument must be CSV or JSON";
-    }
-
-    if ((view->sql = apr_pstrdup(pool, argv[3])) == NULL) {
-        return "[OkiokiSetCommand] Failed to copy fourth argument.";
+    // Give each view its own slot in the per-connection table of prepared statements.
+    if (mod_okioki_nr_statements >= MAX_VIEWS) {
+        return "[OkiokiSetCommand] Too many views.";
     }
-    view->sql_len = strlen(view->sql);
-
-    // Copy the parameter names from the rest of argv.
-    view->nr_sql_params = 0;
-    for (i = 0; i < MAX_PARAMETERS; i++) {
-        if (i < argc - 4) {
-            if ((param = apr_pstrdup(pool, argv[i + 4])) == NULL) {
-                return "[OkiokiSetCommand] Failed to copy sql parameter.";
-            }
+    view->statement_nr = mod_okioki_nr_statements++;
 
-            view->sql_params[i]     = param;
-            view->sql_params_len[i] = strlen(param);
-            view->nr_sql_params++;
-        } else {
-            view->sql_params[i]     = NULL;
-            view->sql_params_len[i] = 0;
-        }
+    // The view can be executed over the binary protocol by its statement number.
+    if ((msg = mod_okioki_binary_register(cmd, argv[0], argv[1], view, conf)) != NULL) {
+        return apr_pstrcat(pool, "[OkiokiSetCommand] ", msg, NULL);
     }
 
-    // Copy the result strings, multiple views can use the same result strings.
-    view->result_strings = conf->result_strings;
-
+    // The statement of the view is described when a child starts.
+    mod_okioki_columns_register(cmd->server, view);
     return NULL;
 }
 
@@ -455,35 +832,867 @@ const char *mod_okioki_dircfg_result_strings(cmd_parms *cmd, void *_conf, int ar
     return NULL;
 }
 
-/** A set of command to execute when a configuration parameter is parsed.
+/** Process the OkiokiCoalesceTimeout configuration directive.
  */
-static const command_rec mod_okioki_cmds[] = {
-    AP_INIT_TAKE_ARGV(
-        "OkiokiResultStrings",
-        mod_okioki_dircfg_result_strings,
-        NULL,
-        OR_AUTHCFG,
-        "OkiokiResultStrings [<params>[ <params>]...]"
-    ),
-    AP_INIT_TAKE_ARGV(
-        "OkiokiCommand",
-        mod_okioki_dircfg_set_command,
-        NULL,
-        OR_AUTHCFG,
-        "OkiokiCommand GET|POST|PUT|DELETE <path> CSV|JSON <prepared sql> [<params>[ <params>]...]"
-    ),
-    {NULL}
-};
+const char *mod_okioki_dircfg_coalesce_timeout(cmd_parms *cmd, void *_conf, const char *arg)
+{
+    mod_okioki_dir_config *conf = (mod_okioki_dir_config *)_conf;
+    int                   timeout = atoi(arg);
 
-/** The module's datastructe, which is used by the server for information about this module.
+    if (timeout < 0) {
+        return "[OkiokiCoalesceTimeout] Requires a number of milliseconds, or 0 to disable.";
+    }
+    conf->coalesce_timeout = apr_time_from_msec(timeout);
+    return NULL;
+}
+
+/** Parse the arguments of the OkiokiConcurrency and OkiokiDirConcurrency configuration directives.
  */
-module AP_MODULE_DECLARE_DATA okioki_module =
+static const char *mod_okioki_dircfg_parse_limits(const char *arg1, const char *arg2, const char *arg3, int *max_active, int *max_queued, apr_time_t *max_wait)
 {
-    STANDARD20_MODULE_STUFF,
-    mod_okioki_create_dir_config,
-    NULL,
-    NULL,
+    if ((*max_active = atoi(arg1)) < 0) {
+        return "Maximum number of active requests must be 0 or positive.";
+    }
+
+    if ((*max_queued = arg2 ? atoi(arg2) : 0) < 0) {
+        return "Maximum number of queued requests must be 0 or positive.";
+    }
+
+    if ((*max_wait = apr_time_from_msec(arg3 ? atoi(arg3) : 1000)) < 0) {
+        return "Maximum wait time must be 0 or positive.";
+    }
+    return NULL;
+}
+
+/** Process the OkiokiConcurrency configuration directive.
+ * The limits are given to each of the OkiokiCommand directives that follow.
+ */
+const char *mod_okioki_dircfg_concurrency(cmd_parms *cmd, void *_conf, const char *arg1, const char *arg2, const char *arg3)
+{
+    mod_okioki_dir_config *conf = (mod_okioki_dir_config *)_conf;
+
+    return mod_okioki_dircfg_parse_limits(arg1, arg2, arg3, &conf->view_max_active, &conf->view_max_queued, &conf->view_max_wait);
+}
+
+/** Process the OkiokiDirConcurrency configuration directive.
+ * The limits are shared by all views of the directory.
+ */
+const char *mod_okioki_dircfg_dir_concurrency(cmd_parms *cmd, void *_conf, const char *arg1, const char *arg2, const char *arg3)
+{
+    mod_okioki_dir_config *conf = (mod_okioki_dir_config *)_conf;
+    const char            *msg;
+    int                   max_active;
+    int                   max_queued;
+    apr_time_t            max_wait;
+
+    if ((msg = mod_okioki_dircfg_parse_limits(arg1, arg2, arg3, &max_active, &max_queued, &max_wait)) != NULL) {
+        return msg;
+    }
+
+    if ((conf->limiter = mod_okioki_limiter_create(cmd->pool, max_active, max_queued, max_wait)) == NULL) {
+        return "[OkiokiDirConcurrency] Could not allocate limiter.";
+    }
+    return NULL;
+}
+
+/** Process the OkiokiWriteBehind configuration directive.
+ * The queue settings are given to each of the OkiokiCommand directives that follow, which do not use GET.
+ */
+const char *mod_okioki_dircfg_writebehind(cmd_parms *cmd, void *_conf, const char *arg1, const char *arg2)
+{
+    mod_okioki_dir_config *conf = (mod_okioki_dir_config *)_conf;
+
+    if ((conf->writebehind_max_queued = atoi(arg1)) < 0) {
+        return "[OkiokiWriteBehind] Maximum number of queued requests must be 0 or positive.";
+    }
+
+    if ((conf->writebehind_batch_size = arg2 ? atoi(arg2) : 100) <= 0) {
+        return "[OkiokiWriteBehind] Batch size must be positive.";
+    }
+    return NULL;
+}
+
+/** Process the OkiokiCache configuration directive.
+ * The cache settings are given to each of the OkiokiCommand directives that follow, which use GET.
+ */
+const char *mod_okioki_dircfg_cache(cmd_parms *cmd, void *_conf, int argc, char *const argv[])
+{
+    apr_pool_t            *pool = cmd->pool;
+    mod_okioki_dir_config *conf = (mod_okioki_dir_config *)_conf;
+    channel_t             *channel;
+    int                   ttl;
+    int                   i;
+
+    if (argc < 1) {
+        return "[OkiokiCache] Requires a number of seconds.";
+    }
+
+    if ((ttl = atoi(argv[0])) < 0) {
+        return "[OkiokiCache] Requires a number of seconds, or 0 to disable.";
+    }
+
+    if (ttl == 0) {
+        conf->cache = NULL;
+        return NULL;
+    }
+
+    // A new cache spec, as views that where already configured keep using the old one.
+    if ((conf->cache = (cache_spec_t *)apr_pcalloc(pool, sizeof (cache_spec_t))) == NULL) {
+        return "[OkiokiCache] Could not allocate cache.";
+    }
+    conf->cache->ttl = apr_time_from_sec(ttl);
+
+    if ((conf->cache->channels = apr_array_make(pool, argc, sizeof (channel_t *))) == NULL) {
+        return "[OkiokiCache] Could not allocate channels.";
+    }
+
+    for (i = 1; i < argc; i++) {
+        if ((channel = mod_okioki_notify_channel(pool, argv[i])) == NULL) {
+            return "[OkiokiCache] Could not allocate channel.";
+        }
+        APR_ARRAY_PUSH(conf->cache->channels, channel_t *) = channel;
+    }
+    return NULL;
+}
+
+/** Process the OkiokiCacheStale configuration directive.
+ * The stale windows are added to the cache of the last OkiokiCache directive, for the OkiokiCommand directives that follow.
+ */
+const char *mod_okioki_dircfg_cache_stale(cmd_parms *cmd, void *_conf, const char *arg1, const char *arg2)
+{
+    apr_pool_t            *pool = cmd->pool;
+    mod_okioki_dir_config *conf = (mod_okioki_dir_config *)_conf;
+    int                   stale_while_revalidate;
+    int                   stale_if_error = 0;
+
+    if (conf->cache == NULL) {
+        return "[OkiokiCacheStale] Requires an OkiokiCache directive before it.";
+    }
+
+    if ((stale_while_revalidate = atoi(arg1)) < 0) {
+        return "[OkiokiCacheStale] Stale-while-revalidate requires a number of seconds.";
+    }
+    if (arg2 != NULL && (stale_if_error = atoi(arg2)) < 0) {
+        return "[OkiokiCacheStale] Stale-if-error requires a number of seconds.";
+    }
+
+    // A copy of the cache spec, as views that where already configured keep using the old one.
+    if ((conf->cache = (cache_spec_t *)apr_pmemdup(pool, conf->cache, sizeof (cache_spec_t))) == NULL) {
+        return "[OkiokiCacheStale] Could not allocate cache.";
+    }
+    conf->cache->stale_while_revalidate = apr_time_from_sec(stale_while_revalidate);
+    conf->cache->stale_if_error         = apr_time_from_sec(stale_if_error);
+    return NULL;
+}
+
+/** Process the OkiokiDelta configuration directive.
+ * The key column is given to each of the OkiokiCommand directives that follow, which are cached and return JSON.
+ */
+const char *mod_okioki_dircfg_delta(cmd_parms *cmd, void *_conf, const char *arg1, const char *arg2)
+{
+    apr_pool_t            *pool = cmd->pool;
+    mod_okioki_dir_config *conf = (mod_okioki_dir_config *)_conf;
+    delta_spec_t          *delta;
+    const char            *c;
+
+    if (strcmp(arg1, "none") == 0) {
+        conf->delta = NULL;
+        return NULL;
+    }
+
+    // The name is compared with the keys of the JSON objects as they are generated.
+    for (c = arg1; *c != 0; c++) {
+        if (*c == '"' || *c == '\\' || (unsigned char)*c < 0x20) {
+            return "[OkiokiDelta] Key column must not contain quotes, backslashes or control characters.";
+        }
+    }
+
+    if ((delta = (delta_spec_t *)apr_pcalloc(pool, sizeof (delta_spec_t))) == NULL) {
+        return "[OkiokiDelta] Could not allocate delta.";
+    }
+    if (
+        (delta->key_column = apr_pstrdup(pool, arg1)) == NULL ||
+        (delta->json_key = apr_pstrcat(pool, "\"", arg1, "\"", NULL)) == NULL
+    ) {
+        return "[OkiokiDelta] Failed to copy key column.";
+    }
+    delta->json_key_len = strlen(delta->json_key);
+
+    delta->nr_versions = arg2 != NULL ? atoi(arg2) : DELTA_VERSIONS;
+    if (delta->nr_versions < 2 || delta->nr_versions > MAX_DELTA_VERSIONS) {
+        return apr_psprintf(pool, "[OkiokiDelta] Requires between 2 and %i versions.", MAX_DELTA_VERSIONS);
+    }
+
+    conf->delta = delta;
+    return NULL;
+}
+
+/** Process the OkiokiEventChannels configuration directive.
+ * The channels are given to each of the OkiokiCommand directives that follow, which use SSE.
+ */
+const char *mod_okioki_dircfg_event_channels(cmd_parms *cmd, void *_conf, int argc, char *const argv[])
+{
+    apr_pool_t            *pool = cmd->pool;
+    mod_okioki_dir_config *conf = (mod_okioki_dir_config *)_conf;
+    channel_t             *channel;
+    int                   i;
+
+    if (argc < 1) {
+        return "[OkiokiEventChannels] Requires at least one channel.";
+    }
+
+    // A new array, as views that where already configured keep using the old one.
+    if ((conf->event_channels = apr_array_make(pool, argc, sizeof (channel_t *))) == NULL) {
+        return "[OkiokiEventChannels] Could not allocate channels.";
+    }
+
+    for (i = 0; i < argc; i++) {
+        if ((channel = mod_okioki_notify_channel(pool, argv[i])) == NULL) {
+            return "[OkiokiEventChannels] Could not allocate channel.";
+        }
+        APR_ARRAY_PUSH(conf->event_channels, channel_t *) = channel;
+    }
+    return NULL;
+}
+
+/** Process the OkiokiShard configuration directive.
+ * The sharding is given to each of the OkiokiCommand directives that follow.
+ */
+const char *mod_okioki_dircfg_shard(cmd_parms *cmd, void *_conf, int argc, char *const argv[])
+{
+    apr_pool_t            *pool = cmd->pool;
+    mod_okioki_dir_config *conf = (mod_okioki_dir_config *)_conf;
+    shard_spec_t          *shard;
+
+    if (argc < 1 || argc > 3) {
+        return "[OkiokiShard] Requires one to three arguments.";
+    }
+
+    if (strcmp(argv[0], "none") == 0) {
+        conf->shard = NULL;
+        return NULL;
+    }
+
+    if ((shard = (shard_spec_t *)apr_pcalloc(pool, sizeof (shard_spec_t))) == NULL) {
+        return "[OkiokiShard] Could not allocate sharding.";
+    }
+
+    if (strcmp(argv[0], "key") == 0) {
+        if (argc != 2) {
+            return "[OkiokiShard] key requires the name of the shard key parameter.";
+        }
+        if ((shard->shard_key = apr_pstrdup(pool, argv[1])) == NULL) {
+            return "[OkiokiShard] Failed to copy shard key.";
+        }
+        shard->shard_key_len = strlen(shard->shard_key);
+
+    } else if (strcmp(argv[0], "all") == 0) {
+        if (argc >= 2 && (shard->merge_column = apr_pstrdup(pool, argv[1])) == NULL) {
+            return "[OkiokiShard] Failed to copy merge column.";
+        }
+        if (argc == 3) {
+            if (strcmp(argv[2], "desc") == 0) {
+                shard->merge_desc = 1;
+            } else if (strcmp(argv[2], "asc") != 0) {
+                return "[OkiokiShard] Sort order must be asc or desc.";
+            }
+        }
+
+    } else {
+        return "[OkiokiShard] First argument must be none, key or all.";
+    }
+
+    conf->shard = shard;
+    return NULL;
+}
+
+/** Split a comma separated list of column names into an array.
+ */
+static apr_array_header_t *mod_okioki_split_columns(apr_pool_t *pool, const char *arg)
+{
+    apr_array_header_t *columns;
+    char               *list;
+    char               *column;
+    char               *last;
+
+    if ((columns = apr_array_make(pool, 4, sizeof (char *))) == NULL) {
+        return NULL;
+    }
+    if ((list = apr_pstrdup(pool, arg)) == NULL) {
+        return NULL;
+    }
+
+    for (column = apr_strtok(list, ",", &last); column != NULL; column = apr_strtok(NULL, ",", &last)) {
+        APR_ARRAY_PUSH(columns, char *) = column;
+    }
+    return columns->nelts > 0 ? columns : NULL;
+}
+
+/** Process the OkiokiJsonNest configuration directive.
+ * The nesting is given to each of the OkiokiCommand directives that follow.
+ */
+const char *mod_okioki_dircfg_json_nest(cmd_parms *cmd, void *_conf, int argc, char *const argv[])
+{
+    apr_pool_t            *pool = cmd->pool;
+    mod_okioki_dir_config *conf = (mod_okioki_dir_config *)_conf;
+    json_nest_t           *nest;
+    json_nest_array_t     *array;
+    char                  *colon;
+    int                   i;
+
+    if (argc == 1 && strcmp(argv[0], "none") == 0) {
+        conf->nest = NULL;
+        return NULL;
+    }
+
+    if (argc < 2) {
+        return "[OkiokiJsonNest] Requires the key columns and at least one nested array.";
+    }
+
+    if ((nest = (json_nest_t *)apr_pcalloc(pool, sizeof (json_nest_t))) == NULL) {
+        return "[OkiokiJsonNest] Could not allocate nesting.";
+    }
+    if ((nest->keys = mod_okioki_split_columns(pool, argv[0])) == NULL) {
+        return "[OkiokiJsonNest] Requires at least one key column.";
+    }
+    if ((nest->arrays = apr_array_make(pool, argc - 1, sizeof (json_nest_array_t))) == NULL) {
+        return "[OkiokiJsonNest] Could not allocate nested arrays.";
+    }
+
+    for (i = 1; i < argc; i++) {
+        if ((colon = strchr(argv[i], ':')) == NULL || colon == argv[i]) {
+            return "[OkiokiJsonNest] Nested array must be given as <name>:<column>[,<column>]...";
+        }
+
+        array = (json_nest_array_t *)apr_array_push(nest->arrays);
+        if ((array->name = apr_pstrndup(pool, argv[i], colon - argv[i])) == NULL) {
+            return "[OkiokiJsonNest] Failed to copy name of nested array.";
+        }
+        if ((array->columns = mod_okioki_split_columns(pool, &colon[1])) == NULL) {
+            return "[OkiokiJsonNest] Nested array requires at least one column.";
+        }
+    }
+
+    conf->nest = nest;
+    return NULL;
+}
+
+/** Process the OkiokiIfMatch configuration directive.
+ */
+const char *mod_okioki_dircfg_if_match(cmd_parms *cmd, void *_conf, const char *param, const char *version_column)
+{
+    apr_pool_t            *pool = cmd->pool;
+    mod_okioki_dir_config *conf = (mod_okioki_dir_config *)_conf;
+    if_match_spec_t       *if_match;
+
+    if (version_column == NULL) {
+        if (strcmp(param, "none") != 0) {
+            return "[OkiokiIfMatch] Requires none or <parameter> <version column>.";
+        }
+        conf->if_match = NULL;
+        return NULL;
+    }
+
+    if ((if_match = (if_match_spec_t *)apr_pcalloc(pool, sizeof (if_match_spec_t))) == NULL) {
+        return "[OkiokiIfMatch] Could not allocate if-match.";
+    }
+
+    if ((if_match->param = apr_pstrdup(pool, param)) == NULL || (if_match->version_column = apr_pstrdup(pool, version_column)) == NULL) {
+        return "[OkiokiIfMatch] Failed to copy parameter and version column.";
+    }
+    if_match->param_len = strlen(if_match->param);
+
+    conf->if_match = if_match;
+    return NULL;
+}
+
+/** Process the OkiokiUpload configuration directive.
+ */
+const char *mod_okioki_dircfg_upload(cmd_parms *cmd, void *_conf, int argc, char *const argv[])
+{
+    apr_pool_t            *pool = cmd->pool;
+    mod_okioki_dir_config *conf = (mod_okioki_dir_config *)_conf;
+    upload_spec_t         *upload;
+
+    if (argc == 1 && strcmp(argv[0], "none") == 0) {
+        conf->upload = NULL;
+        return NULL;
+    }
+
+    if ((upload = (upload_spec_t *)apr_pcalloc(pool, sizeof (upload_spec_t))) == NULL) {
+        return "[OkiokiUpload] Could not allocate upload.";
+    }
+
+    if (argc == 2 && strcmp(argv[1], "lo") == 0) {
+        upload->mode = U_LARGE_OBJECT;
+    } else if (argc == 5 && strcmp(argv[1], "copy") == 0) {
+        upload->mode = U_COPY;
+        if ((upload->table = apr_pstrdup(pool, argv[2])) == NULL || (upload->column = apr_pstrdup(pool, argv[3])) == NULL) {
+            return "[OkiokiUpload] Failed to copy table and column.";
+        }
+        if ((upload->id_column = apr_pstrdup(pool, argv[4])) == NULL) {
+            return "[OkiokiUpload] Failed to copy id column.";
+        }
+    } else {
+        return "[OkiokiUpload] Requires none, <parameter> lo or <parameter> copy <table> <column> <id column>.";
+    }
+
+    if ((upload->param = apr_pstrdup(pool, argv[0])) == NULL) {
+        return "[OkiokiUpload] Failed to copy parameter.";
+    }
+    upload->param_len = strlen(upload->param);
+
+    conf->upload = upload;
+    return NULL;
+}
+
+/** Process the OkiokiAsync configuration directive.
+ */
+const char *mod_okioki_dircfg_async(cmd_parms *cmd, void *_conf, int flag)
+{
+    mod_okioki_dir_config *conf = (mod_okioki_dir_config *)_conf;
+
+    conf->async = flag;
+    return NULL;
+}
+
+/** Process the OkiokiBinaryViews configuration directive.
+ */
+const char *mod_okioki_dircfg_binary(cmd_parms *cmd, void *_conf, int flag)
+{
+    mod_okioki_dir_config *conf = (mod_okioki_dir_config *)_conf;
+
+    conf->binary = flag;
+    return NULL;
+}
+
+/** Process the OkiokiFlattenSize configuration directive.
+ */
+const char *mod_okioki_dircfg_flatten_size(cmd_parms *cmd, void *_conf, const char *arg)
+{
+    mod_okioki_dir_config *conf = (mod_okioki_dir_config *)_conf;
+    int                   size = atoi(arg);
+
+    if (size < 0) {
+        return "[OkiokiFlattenSize] Requires a number of bytes, or 0 to always stream.";
+    }
+    conf->flatten_size = size;
+    return NULL;
+}
+
+/** Process the OkiokiViewFile configuration directive.
+ */
+const char *mod_okioki_dircfg_view_file(cmd_parms *cmd, void *_conf, const char *arg1)
+{
+    mod_okioki_dir_config *conf = (mod_okioki_dir_config *)_conf;
+    const char            *path;
+    const char            *msg;
+
+    if ((path = ap_server_root_relative(cmd->pool, arg1)) == NULL) {
+        return "[OkiokiViewFile] Invalid path.";
+    }
+
+    if ((msg = mod_okioki_viewfile_configure(cmd->pool, cmd->temp_pool, conf, path)) != NULL) {
+        return apr_pstrcat(cmd->pool, "[OkiokiViewFile] ", msg, NULL);
+    }
+    return NULL;
+}
+
+/** Process the OkiokiBatch configuration directive.
+ */
+const char *mod_okioki_dircfg_batch(cmd_parms *cmd, void *_conf, const char *arg1, const char *arg2)
+{
+    mod_okioki_dir_config *conf = (mod_okioki_dir_config *)_conf;
+
+    if ((conf->batch_path = apr_pstrdup(cmd->pool, arg1)) == NULL) {
+        return "[OkiokiBatch] Failed to copy path.";
+    }
+
+    if (arg2 != NULL && strcmp(arg2, "snapshot") != 0) {
+        return "[OkiokiBatch] Second argument must be snapshot.";
+    }
+    conf->batch_snapshot = arg2 != NULL;
+    return NULL;
+}
+
+/** Process the OkiokiDBDriver configuration directive.
+ */
+const char *mod_okioki_srvcfg_db_driver(cmd_parms *cmd, void *_conf, const char *arg)
+{
+    mod_okioki_server_config *scfg = (mod_okioki_server_config *)ap_get_module_config(cmd->server->module_config, &okioki_module);
+
+    if ((scfg->db_driver_name = apr_pstrdup(cmd->pool, arg)) == NULL) {
+        return "[OkiokiDBDriver] Failed to copy driver name.";
+    }
+    return NULL;
+}
+
+/** Allocate a backend for the OkiokiDBPrimary and OkiokiDBReplica configuration directives.
+ */
+static backend_t *mod_okioki_srvcfg_backend(cmd_parms *cmd, mod_okioki_server_config *scfg, const char *arg)
+{
+    backend_t *backend;
+
+    if ((backend = (backend_t *)apr_pcalloc(cmd->pool, sizeof (backend_t))) == NULL) {
+        return NULL;
+    }
+
+    if ((backend->params = apr_pstrdup(cmd->pool, arg)) == NULL) {
+        return NULL;
+    }
+    backend->db_driver       = NULL;
+    backend->max_connections = scfg->max_connections;
+    backend->connections     = NULL;
+    return backend;
+}
+
+/** Process the OkiokiDBPrimary configuration directive.
+ */
+const char *mod_okioki_srvcfg_db_primary(cmd_parms *cmd, void *_conf, const char *arg)
+{
+    mod_okioki_server_config *scfg = (mod_okioki_server_config *)ap_get_module_config(cmd->server->module_config, &okioki_module);
+
+    if ((scfg->primary = mod_okioki_srvcfg_backend(cmd, scfg, arg)) == NULL) {
+        return "[OkiokiDBPrimary] Failed to allocate backend.";
+    }
+    return NULL;
+}
+
+/** Process the OkiokiDBReplica configuration directive.
+ */
+const char *mod_okioki_srvcfg_db_replica(cmd_parms *cmd, void *_conf, const char *arg)
+{
+    mod_okioki_server_config *scfg = (mod_okioki_server_config *)ap_get_module_config(cmd->server->module_config, &okioki_module);
+    backend_t                *replica;
+
+    if ((replica = mod_okioki_srvcfg_backend(cmd, scfg, arg)) == NULL) {
+        return "[OkiokiDBReplica] Failed to allocate backend.";
+    }
+    APR_ARRAY_PUSH(scfg->replicas, backend_t *) = replica;
+    return NULL;
+}
+
+/** Process the OkiokiDBShard configuration directive.
+ */
+const char *mod_okioki_srvcfg_db_shard(cmd_parms *cmd, void *_conf, const char *arg)
+{
+    mod_okioki_server_config *scfg = (mod_okioki_server_config *)ap_get_module_config(cmd->server->module_config, &okioki_module);
+    backend_t                *shard;
+
+    if ((shard = mod_okioki_srvcfg_backend(cmd, scfg, arg)) == NULL) {
+        return "[OkiokiDBShard] Failed to allocate backend.";
+    }
+    APR_ARRAY_PUSH(scfg->shards, backend_t *) = shard;
+    return NULL;
+}
+
+/** Process the OkiokiDBMaxConnections configuration directive.
+ */
+const char *mod_okioki_srvcfg_db_max_connections(cmd_parms *cmd, void *_conf, const char *arg)
+{
+    mod_okioki_server_config *scfg = (mod_okioki_server_config *)ap_get_module_config(cmd->server->module_config, &okioki_module);
+    int                      i;
+
+    if ((scfg->max_connections = atoi(arg)) <= 0) {
+        return "[OkiokiDBMaxConnections] Requires a positive number.";
+    }
+
+    // Also update the backends that where already configured.
+    if (scfg->primary != NULL) {
+        scfg->primary->max_connections = scfg->max_connections;
+    }
+    for (i = 0; i < scfg->replicas->nelts; i++) {
+        APR_ARRAY_IDX(scfg->replicas, i, backend_t *)->max_connections = scfg->max_connections;
+    }
+    for (i = 0; i < scfg->shards->nelts; i++) {
+        APR_ARRAY_IDX(scfg->shards, i, backend_t *)->max_connections = scfg->max_connections;
+    }
+    return NULL;
+}
+
+/** Process the OkiokiListen configuration directive.
+ */
+const char *mod_okioki_srvcfg_listen(cmd_parms *cmd, void *_conf, const char *arg)
+{
+    mod_okioki_server_config *scfg = (mod_okioki_server_config *)ap_get_module_config(cmd->server->module_config, &okioki_module);
+
+    if ((scfg->listen_params = apr_pstrdup(cmd->pool, arg)) == NULL) {
+        return "[OkiokiListen] Failed to copy connection parameters.";
+    }
+    return NULL;
+}
+
+/** Process the OkiokiBinaryProtocol configuration directive.
+ */
+const char *mod_okioki_srvcfg_binary_protocol(cmd_parms *cmd, void *_conf, int flag)
+{
+    mod_okioki_server_config *scfg = (mod_okioki_server_config *)ap_get_module_config(cmd->server->module_config, &okioki_module);
+
+    scfg->binary_protocol = flag;
+    return NULL;
+}
+
+/** Process the OkiokiAccessLog configuration directive.
+ */
+const char *mod_okioki_srvcfg_access_log(cmd_parms *cmd, void *_conf, const char *arg1, const char *arg2, const char *arg3)
+{
+    const char *path;
+    const char *msg;
+    int        max_size = ACCESSLOG_MAX_SIZE;
+    int        nr_slots = ACCESSLOG_SLOTS;
+
+    if ((path = ap_server_root_relative(cmd->pool, arg1)) == NULL) {
+        return "[OkiokiAccessLog] Invalid path.";
+    }
+    if (arg2 != NULL && (max_size = atoi(arg2)) <= 0) {
+        return "[OkiokiAccessLog] Maximum size requires a number of MBytes.";
+    }
+    if (arg3 != NULL && (nr_slots = atoi(arg3)) <= 0) {
+        return "[OkiokiAccessLog] Requires a number of slots.";
+    }
+
+    if ((msg = mod_okioki_accesslog_configure(cmd->pool, path, (apr_off_t)max_size * 1048576, nr_slots)) != NULL) {
+        return apr_pstrcat(cmd->pool, "[OkiokiAccessLog] ", msg, NULL);
+    }
+    return NULL;
+}
+
+/** Process the OkiokiCapture configuration directive.
+ */
+const char *mod_okioki_srvcfg_capture(cmd_parms *cmd, void *_conf, const char *arg1, const char *arg2, const char *arg3)
+{
+    const char *path;
+    const char *msg;
+    int        sample = ACCESSLOG_SAMPLE;
+    int        max_size = ACCESSLOG_MAX_SIZE;
+
+    if ((path = ap_server_root_relative(cmd->pool, arg1)) == NULL) {
+        return "[OkiokiCapture] Invalid path.";
+    }
+    if (arg2 != NULL && (sample = atoi(arg2)) <= 0) {
+        return "[OkiokiCapture] Sample requires a number of requests.";
+    }
+    if (arg3 != NULL && (max_size = atoi(arg3)) <= 0) {
+        return "[OkiokiCapture] Maximum size requires a number of MBytes.";
+    }
+
+    if ((msg = mod_okioki_accesslog_capture_configure(cmd->pool, path, (apr_off_t)max_size * 1048576, sample)) != NULL) {
+        return apr_pstrcat(cmd->pool, "[OkiokiCapture] ", msg, NULL);
+    }
+    return NULL;
+}
+
+/** A set of command to execute when a configuration parameter is parsed.
+ */
+static const command_rec mod_okioki_cmds[] = {
+    AP_INIT_TAKE_ARGV(
+        "OkiokiResultStrings",
+        mod_okioki_dircfg_result_strings,
+        NULL,
+        OR_AUTHCFG,
+        "OkiokiResultStrings [<params>[ <params>]...]"
+    ),
+    AP_INIT_TAKE_ARGV(
+        "OkiokiCommand",
+        mod_okioki_dircfg_set_command,
+        NULL,
+        OR_AUTHCFG,
+        "OkiokiCommand GET|POST|PUT|DELETE <path> CSV|JSON|NDJSON|SSE|RAW <prepared sql> [<param>[:<type>][ <param>[:<type>]]...]"
+    ),
+    AP_INIT_TAKE1(
+        "OkiokiCoalesceTimeout",
+        mod_okioki_dircfg_coalesce_timeout,
+        NULL,
+        OR_AUTHCFG,
+        "OkiokiCoalesceTimeout <milliseconds to wait for an identical GET request in flight, 0 disables>"
+    ),
+    AP_INIT_TAKE123(
+        "OkiokiConcurrency",
+        mod_okioki_dircfg_concurrency,
+        NULL,
+        OR_AUTHCFG,
+        "OkiokiConcurrency <max active> [<max queued> [<max wait milliseconds>]], for each view, 0 disables"
+    ),
+    AP_INIT_TAKE123(
+        "OkiokiDirConcurrency",
+        mod_okioki_dircfg_dir_concurrency,
+        NULL,
+        OR_AUTHCFG,
+        "OkiokiDirConcurrency <max active> [<max queued> [<max wait milliseconds>]], shared by all views, 0 disables"
+    ),
+    AP_INIT_TAKE12(
+        "OkiokiWriteBehind",
+        mod_okioki_dircfg_writebehind,
+        NULL,
+        OR_AUTHCFG,
+        "OkiokiWriteBehind <max queued> [<batch size>], for each view not using GET, 0 disables"
+    ),
+    AP_INIT_TAKE_ARGV(
+        "OkiokiCache",
+        mod_okioki_dircfg_cache,
+        NULL,
+        OR_AUTHCFG,
+        "OkiokiCache <seconds> [<channel>[ <channel>]...], for each view using GET, 0 disables"
+    ),
+    AP_INIT_TAKE12(
+        "OkiokiCacheStale",
+        mod_okioki_dircfg_cache_stale,
+        NULL,
+        OR_AUTHCFG,
+        "OkiokiCacheStale <stale-while-revalidate seconds> [<stale-if-error seconds>], after OkiokiCache"
+    ),
+    AP_INIT_TAKE12(
+        "OkiokiDelta",
+        mod_okioki_dircfg_delta,
+        NULL,
+        OR_AUTHCFG,
+        "OkiokiDelta none|<key column> [<versions>], send cached JSON lists as patches between versions"
+    ),
+    AP_INIT_TAKE_ARGV(
+        "OkiokiEventChannels",
+        mod_okioki_dircfg_event_channels,
+        NULL,
+        OR_AUTHCFG,
+        "OkiokiEventChannels <channel>[ <channel>]..., for each view using SSE"
+    ),
+    AP_INIT_TAKE_ARGV(
+        "OkiokiShard",
+        mod_okioki_dircfg_shard,
+        NULL,
+        OR_AUTHCFG,
+        "OkiokiShard none|key <param>|all [<sort column> [asc|desc]], for each view"
+    ),
+    AP_INIT_TAKE_ARGV(
+        "OkiokiJsonNest",
+        mod_okioki_dircfg_json_nest,
+        NULL,
+        OR_AUTHCFG,
+        "OkiokiJsonNest none|<key column>[,<key column>]... <array>:<column>[,<column>]..., for each view"
+    ),
+    AP_INIT_TAKE_ARGV(
+        "OkiokiUpload",
+        mod_okioki_dircfg_upload,
+        NULL,
+        OR_AUTHCFG,
+        "OkiokiUpload none|<parameter> lo|<parameter> copy <table> <column> <id column>, for each POST or PUT view"
+    ),
+    AP_INIT_TAKE12(
+        "OkiokiIfMatch",
+        mod_okioki_dircfg_if_match,
+        NULL,
+        OR_AUTHCFG,
+        "OkiokiIfMatch none|<parameter> <version column>, for each PUT or DELETE view"
+    ),
+    AP_INIT_FLAG(
+        "OkiokiAsync",
+        mod_okioki_dircfg_async,
+        NULL,
+        OR_AUTHCFG,
+        "OkiokiAsync On|Off, execute views without holding a worker thread under the event MPM"
+    ),
+    AP_INIT_FLAG(
+        "OkiokiBinaryViews",
+        mod_okioki_dircfg_binary,
+        NULL,
+        OR_AUTHCFG,
+        "OkiokiBinaryViews On|Off, make the views available over the binary protocol"
+    ),
+    AP_INIT_TAKE1(
+        "OkiokiFlattenSize",
+        mod_okioki_dircfg_flatten_size,
+        NULL,
+        OR_AUTHCFG,
+        "OkiokiFlattenSize <bytes>, largest response sent as a single buffer with a Content-Length"
+    ),
+    AP_INIT_TAKE1(
+        "OkiokiViewFile",
+        mod_okioki_dircfg_view_file,
+        NULL,
+        OR_AUTHCFG,
+        "OkiokiViewFile <file>, load views from a file that is reloaded when it changes"
+    ),
+    AP_INIT_TAKE12(
+        "OkiokiBatch",
+        mod_okioki_dircfg_batch,
+        NULL,
+        OR_AUTHCFG,
+        "OkiokiBatch <path> [snapshot], POST a list of GET views to execute them on one connection"
+    ),
+    AP_INIT_TAKE1(
+        "OkiokiDBDriver",
+        mod_okioki_srvcfg_db_driver,
+        NULL,
+        RSRC_CONF,
+        "OkiokiDBDriver <apr_dbd driver name>"
+    ),
+    AP_INIT_TAKE1(
+        "OkiokiDBPrimary",
+        mod_okioki_srvcfg_db_primary,
+        NULL,
+        RSRC_CONF,
+        "OkiokiDBPrimary <connection parameters>"
+    ),
+    AP_INIT_TAKE1(
+        "OkiokiDBReplica",
+        mod_okioki_srvcfg_db_replica,
+        NULL,
+        RSRC_CONF,
+        "OkiokiDBReplica <connection parameters>"
+    ),
+    AP_INIT_TAKE1(
+        "OkiokiDBShard",
+        mod_okioki_srvcfg_db_shard,
+        NULL,
+        RSRC_CONF,
+        "OkiokiDBShard <connection parameters>"
+    ),
+    AP_INIT_TAKE1(
+        "OkiokiDBMaxConnections",
+        mod_okioki_srvcfg_db_max_connections,
+        NULL,
+        RSRC_CONF,
+        "OkiokiDBMaxConnections <number of connections per database>"
+    ),
+    AP_INIT_TAKE1(
+        "OkiokiListen",
+        mod_okioki_srvcfg_listen,
+        NULL,
+        RSRC_CONF,
+        "OkiokiListen <libpq connection string used to LISTEN for notifications>"
+    ),
+    AP_INIT_TAKE123(
+        "OkiokiAccessLog",
+        mod_okioki_srvcfg_access_log,
+        NULL,
+        RSRC_CONF,
+        "OkiokiAccessLog <file> [<maximum MBytes> [<slots>]]"
+    ),
+    AP_INIT_TAKE123(
+        "OkiokiCapture",
+        mod_okioki_srvcfg_capture,
+        NULL,
+        RSRC_CONF,
+        "OkiokiCapture <file> [<capture 1 in N requests> [<maximum MBytes>]]"
+    ),
+    AP_INIT_FLAG(
+        "OkiokiBinaryProtocol",
+        mod_okioki_srvcfg_binary_protocol,
+        NULL,
+        RSRC_CONF,
+        "OkiokiBinaryProtocol On|Off, connections to this server speak the binary protocol instead of HTTP"
+    ),
+    {NULL}
+};
+
+/** The module's datastructe, which is used by the server for information about this module.
+ */
+module AP_MODULE_DECLARE_DATA okioki_module =
+{
+    STANDARD20_MODULE_STUFF,
+    mod_okioki_create_dir_config,
     NULL,
+    mod_okioki_create_server_config,
+    mod_okioki_merge_server_config,
     mod_okioki_cmds,
     mod_okioki_register_hooks,
 };
@@ -20,10 +20,18 @@
 #include <apr.h>
 #include <apr_hash.h>
 #include <apr_strings.h>
+#include <apr_tables.h>
+#include <apr_reslist.h>
+#include <apr_dbd.h>
+#include <apr_time.h>
 
 #define MAX_PARAMETERS 32
 #define MAX_VIEWS 200
+#define MAX_CONNECTIONS 16              // per backend, per child
 #define MAX_ROWS 1024
+#define NDJSON_CHUNK_ROWS  64           // rows per flushed chunk
+#define OUTPUT_CHUNK_ROWS  256          // rows per chunk passed down the filter chain
+#define FLATTEN_SIZE       16384        // 16 kbyte, default largest response sent as a single bucket
 #define MIN_INPUT_BUFFER   65536        // 64 kbyte
 #define MAX_INPUT_BUFFER   67108864     // 64 MByte
 
@@ -64,23 +72,221 @@
 
 typedef enum {
     O_CSV,
-    O_JSON
+    O_JSON,
+    O_NDJSON,
+    O_SSE,
+    O_RAW
 } output_type_t;
 
+typedef struct limiter_t limiter_t;
+typedef struct param_spec_t param_spec_t;
+typedef struct writebehind_t writebehind_t;
+typedef struct backend_t backend_t;
+typedef struct viewfile_t viewfile_t;
+
+/** A database notification channel, the generation is incremented on each notification.
+ */
+typedef struct {
+    char                  *name;
+    volatile apr_uint32_t generation;
+} channel_t;
+
+/** How long responses of a view are cached.
+ * After the ttl a response is stale; it is still send while it is refreshed during
+ * stale_while_revalidate, and when executing the view fails during stale_if_error.
+ */
+typedef struct {
+    apr_time_t         ttl;
+    apr_time_t         stale_while_revalidate;
+    apr_time_t         stale_if_error;
+    apr_array_header_t *channels;
+} cache_spec_t;
+
+/** A nested array of a JSON document, holding the columns of the child rows.
+ */
+typedef struct {
+    char               *name;
+    apr_array_header_t *columns;
+} json_nest_array_t;
+
+/** How the rows of a join are folded into nested JSON documents.
+ * Consecutive rows with the same values in the key columns become one object, the columns of each
+ * nested array become an object in that array, all other columns are columns of the parent.
+ */
+typedef struct {
+    apr_array_header_t *keys;
+    apr_array_header_t *arrays;
+} json_nest_t;
+
+/** How a view is distributed over the shards.
+ * With a shard key the view is executed on the shard the key hashes to, otherwise it is executed on
+ * all shards and the results are concatenated, or merged on a column when they are sorted.
+ */
+typedef struct {
+    char               *shard_key;
+    apr_size_t         shard_key_len;
+    char               *merge_column;
+    int                merge_desc;
+} shard_spec_t;
+
+typedef enum {
+    U_LARGE_OBJECT,
+    U_COPY
+} upload_mode_t;
+
+/** Where the binary body of a POST or PUT is stored, the id of the stored body is bound to a parameter.
+ * A large object is bound by its oid; with COPY the body becomes the column of a new row of the table,
+ * bound by the current value of the sequence of the table's id column.
+ */
+typedef struct {
+    char               *param;
+    apr_size_t         param_len;
+    upload_mode_t      mode;
+    char               *table;
+    char               *column;
+    char               *id_column;
+} upload_spec_t;
+
+/** How a PUT or DELETE is made conditional on the version the client last read.
+ * The entity-tag of the If-Match header is bound to a parameter; the statement compares it with the
+ * version column and returns the new version, or no rows when the version has changed.
+ */
+typedef struct {
+    char               *param;
+    apr_size_t         param_len;
+    char               *version_column;
+} if_match_spec_t;
+
+/** How a cached JSON list is sent as a patch to a client that has an older version.
+ * The rows of two versions are matched on the value of the key column.
+ */
+typedef struct {
+    char               *key_column;
+    char               *json_key;       // the escaped and quoted name of the key column
+    apr_size_t         json_key_len;
+    int                nr_versions;
+} delta_spec_t;
+
+/** The columns of the result of a view, with their names escaped once for each output type.
+ */
+typedef struct {
+    int                nr_cols;
+    const char         **names;
+    const char         *csv_header;     // the escaped names separated by commas, including the line end
+    apr_size_t         csv_header_len;
+    const char         **json_keys;     // the escaped and quoted name of each column
+    apr_size_t         *json_keys_len;
+    int                *is_string;      // set for columns listed in OkiokiResultStrings
+} view_columns_t;
+
+/** A point on the consistent hash ring of the shards.
+ */
+typedef struct {
+    apr_uint32_t       hash;
+    backend_t          *backend;
+} shard_point_t;
+
 typedef struct {
-    char           *sql;
-    size_t         sql_len;
-    size_t         nr_sql_params;
-    char           *sql_params[MAX_PARAMETERS];
-    size_t         sql_params_len[MAX_PARAMETERS];
-    output_type_t  output_type;
-    apr_hash_t     *result_strings;
+    char               *sql;
+    size_t             sql_len;
+    int                statement_nr;
+    apr_uint32_t       statement_version; // changes when the statement number is reused by a reloaded view
+    size_t             nr_sql_params;
+    char               *sql_params[MAX_PARAMETERS];
+    size_t             sql_params_len[MAX_PARAMETERS];
+    param_spec_t       *sql_param_specs[MAX_PARAMETERS];
+    output_type_t      output_type;
+    apr_hash_t         *result_strings;
+    apr_time_t         coalesce_timeout;
+    limiter_t          *limiter;
+    writebehind_t      *writebehind;
+    cache_spec_t       *cache;
+    delta_spec_t       *delta;
+    apr_array_header_t *event_channels;
+    shard_spec_t       *shard;
+    json_nest_t        *nest;
+    upload_spec_t      *upload;
+    if_match_spec_t    *if_match;
+    view_columns_t     *columns;        // described when the child starts, NULL when unknown
 } view_t;
 
 typedef struct {
     // Views.
     apr_hash_t *views;
     apr_hash_t *result_strings;
+    apr_time_t coalesce_timeout;
+
+    // Admission control, shared by all views in the directory, and the limits for each new view.
+    limiter_t  *limiter;
+    int        view_max_active;
+    int        view_max_queued;
+    apr_time_t view_max_wait;
+
+    // Write-behind queue for each new view that modifies data.
+    int        writebehind_max_queued;
+    int        writebehind_batch_size;
+
+    // Response cache for each new view that reads data, and the patches between its versions.
+    cache_spec_t *cache;
+    delta_spec_t *delta;
+
+    // Notification channels for each new view that streams events.
+    apr_array_header_t *event_channels;
+
+    // Sharding of each new view.
+    shard_spec_t *shard;
+
+    // Nesting of the JSON output of each new view.
+    json_nest_t *nest;
+
+    // Storage of binary uploads to each new view.
+    upload_spec_t *upload;
+
+    // Version check of each new PUT or DELETE view.
+    if_match_spec_t *if_match;
+
+    // Path of the batch endpoint, NULL when disabled.
+    char       *batch_path;
+    int        batch_snapshot;
+
+    // Set to execute views without holding a worker thread, under an MPM that can suspend requests.
+    int        async;
+
+    // Set to make the views available over the binary protocol.
+    int        binary;
+
+    // Largest response that is sent as a single bucket with a Content-Length, 0 to always stream.
+    apr_size_t flatten_size;
+
+    // Views loaded from a file that is reloaded when it changes, NULL when not used.
+    viewfile_t *view_file;
 } mod_okioki_dir_config;
 
+struct backend_t {
+    const apr_dbd_driver_t *db_driver;
+    char                   *params;
+    int                    max_connections;
+    apr_reslist_t          *connections;
+};
+
+typedef struct {
+    // Module owned connection pool, when not set mod_dbd is used.
+    char                   *db_driver_name;
+    backend_t              *primary;
+    apr_array_header_t     *replicas;
+    int                    max_connections;
+    apr_uint32_t           next_replica;
+
+    // Connection used to LISTEN for notifications, defaults to the primary.
+    char                   *listen_params;
+
+    // Shards, and the consistent hash ring build from them in each child.
+    apr_array_header_t     *shards;
+    shard_point_t          *shard_ring;
+    int                    nr_shard_points;
+
+    // Set when connections to this server speak the binary protocol instead of HTTP.
+    int                    binary_protocol;
+} mod_okioki_server_config;
+
 #endif
@@ -0,0 +1,310 @@
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <poll.h>
+#include <apr_atomic.h>
+#include <apr_hash.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+#include <apr_thread_proc.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#include <httpd.h>
+#include <http_config.h>
+#include <http_log.h>
+#include <libpq-fe.h>
+#include "notify.h"
+
+#define NOTIFY_POLL_TIMEOUT    1000     // milliseconds, how often the thread checks if it must stop
+#define NOTIFY_RETRY_INTERVAL  1        // seconds between reconnects
+
+extern module AP_MODULE_DECLARE_DATA okioki_module;
+
+typedef struct {
+    notify_callback_t callback;
+    void              *data;
+} subscriber_t;
+
+static apr_hash_t         *mod_okioki_notify_channels = NULL;
+static apr_array_header_t *mod_okioki_notify_subscribers = NULL;
+static const char         *mod_okioki_notify_params = NULL;
+static apr_thread_t       *mod_okioki_notify_thread = NULL;
+static volatile int       mod_okioki_notify_stopping = 0;
+static apr_thread_mutex_t *mod_okioki_notify_mutex = NULL;
+static apr_thread_cond_t  *mod_okioki_notify_cond = NULL;
+
+channel_t *mod_okioki_notify_channel(apr_pool_t *pool, const char *name)
+{
+    channel_t *channel;
+
+    if (mod_okioki_notify_channels == NULL) {
+        if ((mod_okioki_notify_channels = apr_hash_make(pool)) == NULL) {
+            return NULL;
+        }
+    }
+
+    if ((channel = apr_hash_get(mod_okioki_notify_channels, name, APR_HASH_KEY_STRING)) != NULL) {
+        return channel;
+    }
+
+    if ((channel = apr_pcalloc(pool, sizeof (channel_t))) == NULL) {
+        return NULL;
+    }
+    if ((channel->name = apr_pstrdup(pool, name)) == NULL) {
+        return NULL;
+    }
+    channel->generation = 0;
+
+    apr_hash_set(mod_okioki_notify_channels, channel->name, APR_HASH_KEY_STRING, channel);
+    return channel;
+}
+
+void mod_okioki_notify_pre_config(void)
+{
+    // The hash table was allocated on the previous configuration pool.
+    mod_okioki_notify_channels = NULL;
+}
+
+void mod_okioki_notify_subscribe(apr_pool_t *pool, notify_callback_t callback, void *data)
+{
+    subscriber_t *subscriber;
+
+    if (mod_okioki_notify_subscribers == NULL) {
+        mod_okioki_notify_subscribers = apr_array_make(pool, 4, sizeof (subscriber_t));
+    }
+
+    subscriber = &APR_ARRAY_PUSH(mod_okioki_notify_subscribers, subscriber_t);
+    subscriber->callback = callback;
+    subscriber->data     = data;
+}
+
+/** Bump the generation of the channel and tell every subscriber.
+ */
+static void mod_okioki_notify_dispatch(channel_t *channel, const char *payload)
+{
+    subscriber_t *subscriber;
+    int          i;
+
+    apr_atomic_inc32(&channel->generation);
+
+    // Wake up the requests waiting for a notification.
+    apr_thread_mutex_lock(mod_okioki_notify_mutex);
+    apr_thread_cond_broadcast(mod_okioki_notify_cond);
+    apr_thread_mutex_unlock(mod_okioki_notify_mutex);
+
+    if (mod_okioki_notify_subscribers == NULL) {
+        return;
+    }
+    for (i = 0; i < mod_okioki_notify_subscribers->nelts; i++) {
+        subscriber = &APR_ARRAY_IDX(mod_okioki_notify_subscribers, i, subscriber_t);
+        subscriber->callback(channel, payload, subscriber->data);
+    }
+}
+
+apr_uint32_t mod_okioki_notify_generation(apr_array_header_t *channels)
+{
+    apr_uint32_t generation = 0;
+    int          i;
+
+    for (i = 0; i < channels->nelts; i++) {
+        generation+= apr_atomic_read32(&APR_ARRAY_IDX(channels, i, channel_t *)->generation);
+    }
+    return generation;
+}
+
+int mod_okioki_notify_wait(apr_array_header_t *channels, apr_uint32_t *generation, apr_interval_time_t timeout)
+{
+    apr_time_t   deadline = apr_time_now() + timeout;
+    apr_uint32_t new_generation;
+
+    // Without a listener there will never be a notification.
+    if (mod_okioki_notify_thread == NULL) {
+        apr_sleep(timeout);
+        return 0;
+    }
+
+    apr_thread_mutex_lock(mod_okioki_notify_mutex);
+    while ((new_generation = mod_okioki_notify_generation(channels)) == *generation && apr_time_now() < deadline) {
+        apr_thread_cond_timedwait(mod_okioki_notify_cond, mod_okioki_notify_mutex, deadline - apr_time_now());
+    }
+    apr_thread_mutex_unlock(mod_okioki_notify_mutex);
+
+    if (new_generation == *generation) {
+        return 0;
+    }
+    *generation = new_generation;
+    return 1;
+}
+
+/** Connect to the database and LISTEN on every channel.
+ */
+static PGconn *mod_okioki_notify_connect(apr_pool_t *pool)
+{
+    PGconn           *conn;
+    PGresult         *result;
+    apr_hash_index_t *hi;
+    const void       *name;
+    char             *identifier;
+    int              ok;
+
+    conn = PQconnectdb(mod_okioki_notify_params);
+    if (PQstatus(conn) != CONNECTION_OK) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, 0, pool, "[mod_okioki] Could not connect to database for notifications: %s", PQerrorMessage(conn));
+        PQfinish(conn);
+        return NULL;
+    }
+
+    for (hi = apr_hash_first(pool, mod_okioki_notify_channels); hi != NULL; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, &name, NULL, NULL);
+
+        // Channel names are identifiers, escape them so that any name can be used.
+        if ((identifier = PQescapeIdentifier(conn, (const char *)name, strlen((const char *)name))) == NULL) {
+            PQfinish(conn);
+            return NULL;
+        }
+        result = PQexec(conn, apr_pstrcat(pool, "LISTEN ", identifier, NULL));
+        PQfreemem(identifier);
+
+        ok = PQresultStatus(result) == PGRES_COMMAND_OK;
+        PQclear(result);
+        if (!ok) {
+            ap_log_perror(APLOG_MARK, APLOG_ERR, 0, pool, "[mod_okioki] Could not listen on channel '%s': %s", (const char *)name, PQerrorMessage(conn));
+            PQfinish(conn);
+            return NULL;
+        }
+    }
+
+    return conn;
+}
+
+/** Background thread that waits for notifications and dispatches them.
+ */
+static void * APR_THREAD_FUNC mod_okioki_notify_listen(apr_thread_t *thread, void *data)
+{
+    apr_pool_t       *pool;
+    PGconn           *conn = NULL;
+    PGnotify         *notify;
+    channel_t        *channel;
+    apr_hash_index_t *hi;
+    void             *_channel;
+    struct pollfd    pfd;
+
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS) {
+        return NULL;
+    }
+
+    while (!mod_okioki_notify_stopping) {
+        if (conn == NULL) {
+            if ((conn = mod_okioki_notify_connect(pool)) == NULL) {
+                apr_sleep(apr_time_from_sec(NOTIFY_RETRY_INTERVAL));
+                continue;
+            }
+
+            // Notifications may have been missed while there was no connection.
+            for (hi = apr_hash_first(pool, mod_okioki_notify_channels); hi != NULL; hi = apr_hash_next(hi)) {
+                apr_hash_this(hi, NULL, NULL, &_channel);
+                mod_okioki_notify_dispatch((channel_t *)_channel, NULL);
+            }
+            apr_pool_clear(pool);
+        }
+
+        pfd.fd      = PQsocket(conn);
+        pfd.events  = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, NOTIFY_POLL_TIMEOUT) < 0 || (pfd.revents & POLLIN) == 0) {
+            continue;
+        }
+
+        if (PQconsumeInput(conn) == 0 || PQstatus(conn) != CONNECTION_OK) {
+            ap_log_perror(APLOG_MARK, APLOG_ERR, 0, pool, "[mod_okioki] Lost connection to database for notifications: %s", PQerrorMessage(conn));
+            PQfinish(conn);
+            conn = NULL;
+            continue;
+        }
+
+        while ((notify = PQnotifies(conn)) != NULL) {
+            if ((channel = apr_hash_get(mod_okioki_notify_channels, notify->relname, APR_HASH_KEY_STRING)) != NULL) {
+                mod_okioki_notify_dispatch(channel, notify->extra);
+            }
+            PQfreemem(notify);
+        }
+    }
+
+    if (conn != NULL) {
+        PQfinish(conn);
+    }
+    apr_pool_destroy(pool);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+/** Stop the listener thread.
+ */
+static apr_status_t mod_okioki_notify_stop(void *data)
+{
+    apr_status_t thread_ret;
+
+    mod_okioki_notify_stopping = 1;
+    apr_thread_join(&thread_ret, mod_okioki_notify_thread);
+    mod_okioki_notify_thread = NULL;
+    return APR_SUCCESS;
+}
+
+int mod_okioki_notify_child_init(apr_pool_t *pool, server_rec *server)
+{
+    mod_okioki_server_config *scfg;
+    apr_status_t             ret;
+    server_rec               *s;
+
+    if (mod_okioki_notify_channels == NULL || apr_hash_count(mod_okioki_notify_channels) == 0) {
+        return APR_SUCCESS;
+    }
+
+    // There is a single listener for each child, use the first server that has a database configured.
+    for (s = server; s != NULL && mod_okioki_notify_params == NULL; s = s->next) {
+        scfg = (mod_okioki_server_config *)ap_get_module_config(s->module_config, &okioki_module);
+        if (scfg->listen_params != NULL) {
+            mod_okioki_notify_params = scfg->listen_params;
+        } else if (scfg->primary != NULL) {
+            mod_okioki_notify_params = scfg->primary->params;
+        }
+    }
+
+    if (mod_okioki_notify_params == NULL) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, server, "[mod_okioki] Notification channels are used, but OkiokiListen is not set.");
+        return APR_EINVAL;
+    }
+
+    if ((ret = apr_thread_mutex_create(&mod_okioki_notify_mutex, APR_THREAD_MUTEX_DEFAULT, pool)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, ret, server, "[mod_okioki] Could not create notification mutex.");
+        return ret;
+    }
+
+    if ((ret = apr_thread_cond_create(&mod_okioki_notify_cond, pool)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, ret, server, "[mod_okioki] Could not create notification condition.");
+        return ret;
+    }
+
+    mod_okioki_notify_stopping = 0;
+    if ((ret = apr_thread_create(&mod_okioki_notify_thread, NULL, mod_okioki_notify_listen, NULL, pool)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, ret, server, "[mod_okioki] Could not start notification thread.");
+        return ret;
+    }
+    apr_pool_cleanup_register(pool, NULL, mod_okioki_notify_stop, apr_pool_cleanup_null);
+
+    return APR_SUCCESS;
+}
@@ -0,0 +1,59 @@
+#ifndef NOTIFY_H
+#define NOTIFY_H
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <httpd.h>
+#include <http_log.h>
+#include "mod_okioki.h"
+
+/** Called from the listener thread for every notification on a channel.
+ * When the connection to the database was lost, it is called for every channel with a NULL payload,
+ * as notifications may have been missed.
+ */
+typedef void (*notify_callback_t)(channel_t *channel, const char *payload, void *data);
+
+/** Get the channel with this name, creating it when needed, at configuration time.
+ */
+channel_t *mod_okioki_notify_channel(apr_pool_t *pool, const char *name);
+
+/** Forget the channels of the previous configuration, called before the configuration is (re)read.
+ */
+void mod_okioki_notify_pre_config(void);
+
+/** Call the callback for every notification, must be called before mod_okioki_notify_child_init().
+ */
+void mod_okioki_notify_subscribe(apr_pool_t *pool, notify_callback_t callback, void *data);
+
+/** The sum of the generations of the channels, it changes on each notification on one of them.
+ */
+apr_uint32_t mod_okioki_notify_generation(apr_array_header_t *channels);
+
+/** Wait until a notification is received on one of the channels.
+ *
+ * @param generation  The generation returned by mod_okioki_notify_generation() or by a previous wait,
+ *                    updated on return.
+ * @param timeout     The maximum time to wait.
+ * @returns           1 when a notification was received, 0 on timeout.
+ */
+int mod_okioki_notify_wait(apr_array_header_t *channels, apr_uint32_t *generation, apr_interval_time_t timeout);
+
+/** Start the listener thread, when any channel was configured. Called once for each child.
+ */
+int mod_okioki_notify_child_init(apr_pool_t *pool, server_rec *server);
+
+#endif
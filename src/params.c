@@ -0,0 +1,294 @@
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <apr_lib.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+#include <httpd.h>
+#include <http_log.h>
+#include <http_protocol.h>
+#include "params.h"
+
+/** Split "name(argument)" into the name and the argument.
+ * The argument is everything up to the last closing parenthesis, so it may contain parenthesis itself.
+ */
+static const char *mod_okioki_param_split(apr_pool_t *pool, const char *s, char **name, char **argument)
+{
+    const char *open;
+    const char *close;
+
+    if ((open = strchr(s, '(')) == NULL) {
+        *name = apr_pstrdup(pool, s);
+        *argument = NULL;
+        return NULL;
+    }
+
+    if ((close = strrchr(s, ')')) == NULL || close < open || close[1] != 0) {
+        return "Parameter type has an unterminated argument.";
+    }
+
+    *name = apr_pstrndup(pool, s, open - s);
+    *argument = apr_pstrndup(pool, open + 1, close - open - 1);
+    return NULL;
+}
+
+const char *mod_okioki_param_compile(apr_pool_t *pool, const char *s, param_spec_t **_spec)
+{
+    param_spec_t *spec;
+    char         *name;
+    char         *argument;
+    char         *value;
+    char         *last;
+    char         *end;
+    long         max_len;
+    const char   *msg;
+
+    if ((spec = apr_pcalloc(pool, sizeof (param_spec_t))) == NULL) {
+        return "Could not allocate parameter type.";
+    }
+
+    // A list of values of the type.
+    if (strlen(s) > 2 && strcmp(&s[strlen(s) - 2], "[]") == 0) {
+        spec->is_array = 1;
+        s = apr_pstrndup(pool, s, strlen(s) - 2);
+    }
+
+    if ((msg = mod_okioki_param_split(pool, s, &name, &argument)) != NULL) {
+        return msg;
+    }
+
+    if (strcmp(name, "text") == 0) {
+        spec->type = P_TEXT;
+        if (argument != NULL) {
+            // Parsed as a signed number, a negative length would wrap around in the size_t.
+            errno   = 0;
+            max_len = strtol(argument, &end, 10);
+            if (end == argument || *end != 0 || errno != 0 || max_len <= 0) {
+                return "Maximum length of text parameter must be a positive number.";
+            }
+            spec->max_len = (size_t)max_len;
+        }
+
+    } else if (strcmp(name, "int") == 0) {
+        spec->type = P_INT;
+
+    } else if (strcmp(name, "bigint") == 0) {
+        spec->type = P_BIGINT;
+
+    } else if (strcmp(name, "uuid") == 0) {
+        spec->type = P_UUID;
+
+    } else if (strcmp(name, "bool") == 0) {
+        spec->type = P_BOOL;
+
+    } else if (strcmp(name, "enum") == 0) {
+        spec->type = P_ENUM;
+        if (argument == NULL || (spec->values = apr_array_make(pool, 4, sizeof (char *))) == NULL) {
+            return "Enum parameter requires a list of values.";
+        }
+
+        for (value = apr_strtok(argument, "|", &last); value != NULL; value = apr_strtok(NULL, "|", &last)) {
+            APR_ARRAY_PUSH(spec->values, char *) = value;
+        }
+
+    } else if (strcmp(name, "regex") == 0) {
+        spec->type = P_REGEX;
+        if (argument == NULL || (spec->regex = ap_pregcomp(pool, argument, AP_REG_EXTENDED | AP_REG_NOSUB)) == NULL) {
+            return "Regex parameter requires a valid extended regular expression.";
+        }
+
+    } else {
+        return "Unknown parameter type, must be text, int, bigint, uuid, bool, enum or regex.";
+    }
+
+    *_spec = spec;
+    return NULL;
+}
+
+/** Check if a string is a decimal integer that fits in the given range.
+ */
+static int mod_okioki_param_is_integer(const char *s, long long min, long long max)
+{
+    char      *end;
+    long long value;
+
+    if (s[0] == 0 || apr_isspace(s[0])) {
+        return 0;
+    }
+
+    errno = 0;
+    value = strtoll(s, &end, 10);
+    return end[0] == 0 && errno == 0 && value >= min && value <= max;
+}
+
+/** Check if a string is a uuid in its canonical 8-4-4-4-12 hexadecimal form.
+ */
+static int mod_okioki_param_is_uuid(const char *s)
+{
+    int i;
+
+    for (i = 0; i < 36; i++) {
+        if (i == 8 || i == 13 || i == 18 || i == 23) {
+            if (s[i] != '-') {
+                return 0;
+            }
+        } else if (!apr_isxdigit(s[i])) {
+            return 0;
+        }
+    }
+    return s[36] == 0;
+}
+
+/** Check if a string is one of the boolean literals accepted by PostgreSQL.
+ */
+static int mod_okioki_param_is_bool(const char *s)
+{
+    static const char *literals[] = {"t", "f", "true", "false", "y", "n", "yes", "no", "on", "off", "1", "0", NULL};
+    int i;
+
+    for (i = 0; literals[i] != NULL; i++) {
+        if (strcasecmp(s, literals[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/** Check a single value against the type of the parameter.
+ */
+static int mod_okioki_param_check_value(param_spec_t *spec, const char *value)
+{
+    int i;
+
+    switch (spec->type) {
+    case P_TEXT:
+        return spec->max_len == 0 || strlen(value) <= spec->max_len;
+    case P_INT:
+        return mod_okioki_param_is_integer(value, -2147483648LL, 2147483647LL);
+    case P_BIGINT:
+        return mod_okioki_param_is_integer(value, LLONG_MIN, LLONG_MAX);
+    case P_UUID:
+        return mod_okioki_param_is_uuid(value);
+    case P_BOOL:
+        return mod_okioki_param_is_bool(value);
+    case P_ENUM:
+        for (i = 0; i < spec->values->nelts; i++) {
+            if (strcmp(value, APR_ARRAY_IDX(spec->values, i, char *)) == 0) {
+                return 1;
+            }
+        }
+        return 0;
+    case P_REGEX:
+        return ap_regexec(spec->regex, value, 0, NULL, 0) == 0;
+    }
+
+    /* NOTREACHED */
+    return 0;
+}
+
+/** Check each value of a list parameter, and replace them by a PostgreSQL array literal.
+ * The values are given by repeating the name, or as a single comma separated value.
+ */
+static int mod_okioki_param_check_array(apr_pool_t *pool, view_t *view, int param_nr, apr_hash_t *arguments, const char *value)
+{
+    apr_array_header_t *values;
+    char               *element;
+    char               *last;
+    char               *literal;
+    char               *p;
+    const char         *s;
+    apr_size_t         literal_len;
+    int                i;
+
+    values = apr_hash_get(arguments, view->sql_params[param_nr], view->sql_params_len[param_nr] + 1);
+    if (values == NULL || values->nelts <= 1) {
+        if ((values = apr_array_make(pool, 8, sizeof (char *))) == NULL) {
+            return 0;
+        }
+        for (element = apr_strtok(apr_pstrdup(pool, value), ",", &last); element != NULL; element = apr_strtok(NULL, ",", &last)) {
+            APR_ARRAY_PUSH(values, char *) = element;
+        }
+    }
+
+    if (values->nelts > MAX_ARRAY_ELEMENTS) {
+        return 0;
+    }
+
+    // Each element is quoted, so only quotes and backslashes need to be escaped.
+    literal_len = 3;
+    for (i = 0; i < values->nelts; i++) {
+        s = APR_ARRAY_IDX(values, i, char *);
+        if (!mod_okioki_param_check_value(view->sql_param_specs[param_nr], s)) {
+            return 0;
+        }
+        literal_len+= 2 * strlen(s) + 3;
+    }
+
+    if ((p = literal = apr_palloc(pool, literal_len)) == NULL) {
+        return 0;
+    }
+    *p++ = '{';
+    for (i = 0; i < values->nelts; i++) {
+        if (i > 0) {
+            *p++ = ',';
+        }
+        *p++ = '"';
+        for (s = APR_ARRAY_IDX(values, i, char *); *s != 0; s++) {
+            if (*s == '"' || *s == '\\') {
+                *p++ = '\\';
+            }
+            *p++ = *s;
+        }
+        *p++ = '"';
+    }
+    *p++ = '}';
+    *p = 0;
+
+    apr_hash_set(arguments, view->sql_params[param_nr], view->sql_params_len[param_nr], literal);
+    return 1;
+}
+
+int mod_okioki_param_check(request_rec *http_request, view_t *view, apr_hash_t *arguments, char **error)
+{
+    apr_pool_t *pool = http_request->pool;
+    const char *value;
+    int        i;
+
+    // Client errors are not logged, so that bad clients can not flood the error log.
+    for (i = 0; i < view->nr_sql_params; i++) {
+        if ((value = apr_hash_get(arguments, view->sql_params[i], view->sql_params_len[i])) == NULL) {
+            *error = apr_psprintf(pool, "Missing parameter '%s'.", view->sql_params[i]);
+            return HTTP_BAD_REQUEST;
+        }
+
+        if (view->sql_param_specs[i] != NULL && view->sql_param_specs[i]->is_array) {
+            if (!mod_okioki_param_check_array(pool, view, i, arguments, value)) {
+                *error = apr_psprintf(pool, "Malformed parameter '%s'.", view->sql_params[i]);
+                return HTTP_BAD_REQUEST;
+            }
+
+        } else if (view->sql_param_specs[i] != NULL && !mod_okioki_param_check_value(view->sql_param_specs[i], value)) {
+            *error = apr_psprintf(pool, "Malformed parameter '%s'.", view->sql_params[i]);
+            return HTTP_BAD_REQUEST;
+        }
+    }
+
+    return HTTP_OK;
+}
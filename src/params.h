@@ -0,0 +1,69 @@
+#ifndef PARAMS_H
+#define PARAMS_H
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <httpd.h>
+#include <http_log.h>
+#include <apr_hash.h>
+#include <ap_regex.h>
+#include "mod_okioki.h"
+
+#define MAX_ARRAY_ELEMENTS 1000
+
+typedef enum {
+    P_TEXT,
+    P_INT,
+    P_BIGINT,
+    P_UUID,
+    P_BOOL,
+    P_ENUM,
+    P_REGEX
+} param_type_t;
+
+/** The type of a view parameter, compiled from the part after the colon of "name:type".
+ */
+struct param_spec_t {
+    param_type_t       type;
+    size_t             max_len;
+    apr_array_header_t *values;
+    ap_regex_t         *regex;
+
+    // The parameter is a list of values of the type, bound as a PostgreSQL array literal.
+    int                is_array;
+};
+
+/** Compile a parameter type.
+ * Known types are: text, text(<max length>), int, bigint, uuid, bool, enum(<value>|<value>...)
+ * and regex(<extended regular expression>). Each type may be followed by [] for a list of values.
+ *
+ * @param pool  Memory pool to allocate the type on.
+ * @param s     The type.
+ * @param spec  On return the compiled type.
+ * @returns     NULL on success, or an error message.
+ */
+const char *mod_okioki_param_compile(apr_pool_t *pool, const char *s, param_spec_t **spec);
+
+/** Check that all parameters of the view are present and of the right type.
+ * This is done before any database work is done. The values of a list parameter, given by repeating
+ * the name or separated by commas, are replaced by a PostgreSQL array literal.
+ *
+ * @returns  HTTP_OK, or HTTP_BAD_REQUEST when a parameter is missing or malformed.
+ */
+int mod_okioki_param_check(request_rec *http_request, view_t *view, apr_hash_t *arguments, char **error);
+
+#endif
@@ -0,0 +1,422 @@
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <apr_atomic.h>
+#include <apr_hash.h>
+#include <apr_strings.h>
+#include <apr_reslist.h>
+#include <apr_dbd.h>
+#include <httpd.h>
+#include <http_config.h>
+#include <http_log.h>
+#include <http_protocol.h>
+#include <mod_dbd.h>
+#include "pool.h"
+
+extern module AP_MODULE_DECLARE_DATA okioki_module;
+
+/** Open a new connection to a backend, called by the resource list.
+ */
+static apr_status_t mod_okioki_pool_construct(void **_conn, void *params, apr_pool_t *pool)
+{
+    backend_t         *backend = (backend_t *)params;
+    mod_okioki_conn_t *conn;
+    apr_pool_t        *conn_pool;
+    const char        *db_error = NULL;
+    apr_status_t      ret;
+
+    // Each connection gets its own pool, so that its prepared statements are freed with it.
+    if ((ret = apr_pool_create(&conn_pool, pool)) != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, ret, pool, "[mod_okioki] Could not create pool for connection.");
+        return ret;
+    }
+
+    if ((conn = apr_pcalloc(conn_pool, sizeof (mod_okioki_conn_t))) == NULL) {
+        apr_pool_destroy(conn_pool);
+        return APR_ENOMEM;
+    }
+    conn->driver  = backend->db_driver;
+    conn->pool    = conn_pool;
+    conn->backend = backend;
+    conn->labels  = NULL;
+
+    if (
+        (conn->prepared = apr_pcalloc(conn_pool, MAX_VIEWS * sizeof (apr_dbd_prepared_t *))) == NULL ||
+        (conn->prepared_versions = apr_pcalloc(conn_pool, MAX_VIEWS * sizeof (apr_uint32_t))) == NULL
+    ) {
+        apr_pool_destroy(conn_pool);
+        return APR_ENOMEM;
+    }
+
+    if ((ret = apr_dbd_open_ex(conn->driver, conn_pool, backend->params, &conn->handle, &db_error)) != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, ret, pool, "[mod_okioki] Could not connect to database: %s", db_error ? db_error : "unknown error");
+        apr_pool_destroy(conn_pool);
+        return ret;
+    }
+
+    *_conn = conn;
+    return APR_SUCCESS;
+}
+
+/** Close a connection to a backend, called by the resource list.
+ */
+static apr_status_t mod_okioki_pool_destruct(void *_conn, void *params, apr_pool_t *pool)
+{
+    mod_okioki_conn_t *conn = (mod_okioki_conn_t *)_conn;
+
+    apr_dbd_close(conn->driver, conn->handle);
+    apr_pool_destroy(conn->pool);
+    return APR_SUCCESS;
+}
+
+/** Return a connection to its backend, called when the request's pool is cleaned up.
+ * Broken connections are removed from the pool, so that a new one will be opened.
+ */
+static apr_status_t mod_okioki_pool_release(void *_conn)
+{
+    mod_okioki_conn_t *conn = (mod_okioki_conn_t *)_conn;
+
+    if (apr_dbd_check_conn(conn->driver, conn->pool, conn->handle) != APR_SUCCESS) {
+        return apr_reslist_invalidate(conn->backend->connections, conn);
+    }
+    return apr_reslist_release(conn->backend->connections, conn);
+}
+
+static apr_status_t mod_okioki_pool_backend_init(apr_pool_t *pool, backend_t *backend)
+{
+    // Virtual hosts may share the backend of the main server.
+    if (backend->connections != NULL) {
+        return APR_SUCCESS;
+    }
+
+    return apr_reslist_create(
+        &backend->connections, 0, backend->max_connections, backend->max_connections, 0,
+        mod_okioki_pool_construct, mod_okioki_pool_destruct, backend, pool
+    );
+}
+
+/** FNV-1a hash, used for the consistent hash ring of the shards.
+ */
+static apr_uint32_t mod_okioki_pool_hash(const char *data, apr_size_t data_len, apr_uint32_t hash)
+{
+    apr_size_t i;
+
+    for (i = 0; i < data_len; i++) {
+        hash^= (unsigned char)data[i];
+        hash*= 16777619;
+    }
+    return hash;
+}
+
+static int mod_okioki_pool_shard_point_cmp(const void *_a, const void *_b)
+{
+    const shard_point_t *a = (const shard_point_t *)_a;
+    const shard_point_t *b = (const shard_point_t *)_b;
+
+    return a->hash < b->hash ? -1 : (a->hash > b->hash ? 1 : 0);
+}
+
+/** Build the consistent hash ring, each shard gets SHARD_POINTS points on the ring.
+ * The points are derived from the connection parameters, so adding a shard only moves the keys
+ * that the new shard takes over.
+ */
+static apr_status_t mod_okioki_pool_shard_ring(apr_pool_t *pool, mod_okioki_server_config *scfg)
+{
+    backend_t    *shard;
+    apr_uint32_t hash;
+    int          i;
+    int          j;
+
+    scfg->nr_shard_points = scfg->shards->nelts * SHARD_POINTS;
+    if ((scfg->shard_ring = apr_palloc(pool, scfg->nr_shard_points * sizeof (shard_point_t))) == NULL) {
+        return APR_ENOMEM;
+    }
+
+    for (i = 0; i < scfg->shards->nelts; i++) {
+        shard = APR_ARRAY_IDX(scfg->shards, i, backend_t *);
+        hash  = mod_okioki_pool_hash(shard->params, strlen(shard->params), 2166136261U);
+
+        for (j = 0; j < SHARD_POINTS; j++) {
+            hash = mod_okioki_pool_hash((const char *)&j, sizeof (j), hash);
+            scfg->shard_ring[i * SHARD_POINTS + j].hash    = hash;
+            scfg->shard_ring[i * SHARD_POINTS + j].backend = shard;
+        }
+    }
+
+    qsort(scfg->shard_ring, scfg->nr_shard_points, sizeof (shard_point_t), mod_okioki_pool_shard_point_cmp);
+    return APR_SUCCESS;
+}
+
+backend_t *mod_okioki_shard_backend(mod_okioki_server_config *scfg, const char *key, apr_size_t key_len)
+{
+    apr_uint32_t hash = mod_okioki_pool_hash(key, key_len, 2166136261U);
+    int          low = 0;
+    int          high = scfg->nr_shard_points;
+    int          middle;
+
+    // Find the first point on the ring at or after the hash of the key, wrapping around at the end.
+    while (low < high) {
+        middle = (low + high) / 2;
+        if (scfg->shard_ring[middle].hash < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return scfg->shard_ring[low % scfg->nr_shard_points].backend;
+}
+
+int mod_okioki_pool_child_init(apr_pool_t *pool, server_rec *server)
+{
+    mod_okioki_server_config *scfg;
+    const apr_dbd_driver_t   *db_driver;
+    apr_status_t             ret;
+    int                      i;
+
+    if ((ret = apr_dbd_init(pool)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, ret, server, "[mod_okioki] Could not initialize apr_dbd.");
+        return ret;
+    }
+
+    for (; server != NULL; server = server->next) {
+        scfg = (mod_okioki_server_config *)ap_get_module_config(server->module_config, &okioki_module);
+        if (scfg->primary == NULL && scfg->shards->nelts == 0) {
+            continue;
+        }
+
+        if ((ret = apr_dbd_get_driver(pool, scfg->db_driver_name, &db_driver)) != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, ret, server, "[mod_okioki] Could not load database driver '%s'.", scfg->db_driver_name);
+            return ret;
+        }
+
+        if (scfg->primary != NULL) {
+            scfg->primary->db_driver = db_driver;
+            if ((ret = mod_okioki_pool_backend_init(pool, scfg->primary)) != APR_SUCCESS) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, ret, server, "[mod_okioki] Could not create pool for primary database.");
+                return ret;
+            }
+        }
+
+        for (i = 0; i < scfg->replicas->nelts; i++) {
+            backend_t *replica = APR_ARRAY_IDX(scfg->replicas, i, backend_t *);
+
+            replica->db_driver = db_driver;
+            if ((ret = mod_okioki_pool_backend_init(pool, replica)) != APR_SUCCESS) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, ret, server, "[mod_okioki] Could not create pool for replica database.");
+                return ret;
+            }
+        }
+
+        for (i = 0; i < scfg->shards->nelts; i++) {
+            backend_t *shard = APR_ARRAY_IDX(scfg->shards, i, backend_t *);
+
+            shard->db_driver = db_driver;
+            if ((ret = mod_okioki_pool_backend_init(pool, shard)) != APR_SUCCESS) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, ret, server, "[mod_okioki] Could not create pool for shard database.");
+                return ret;
+            }
+        }
+
+        if (scfg->shards->nelts > 0 && (ret = mod_okioki_pool_shard_ring(pool, scfg)) != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, ret, server, "[mod_okioki] Could not create shard ring.");
+            return ret;
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+/** Select the backend of a request, reads are spread round robin over the replicas, writes always go to the primary.
+ */
+static backend_t *mod_okioki_pool_select(mod_okioki_server_config *scfg, int read_only)
+{
+    if (read_only && scfg->replicas->nelts > 0) {
+        return APR_ARRAY_IDX(scfg->replicas, apr_atomic_inc32(&scfg->next_replica) % scfg->replicas->nelts, backend_t *);
+    }
+    return scfg->primary;
+}
+
+int mod_okioki_conn_acquire(request_rec *http_request, int read_only, mod_okioki_conn_t **_conn, char **error)
+{
+    apr_pool_t               *pool = http_request->pool;
+    mod_okioki_server_config *scfg = (mod_okioki_server_config *)ap_get_module_config(http_request->server->module_config, &okioki_module);
+    mod_okioki_conn_t        *conn;
+    ap_dbd_t                 *db_conn;
+
+    // A connection pinned to the request holds its transaction.
+    if (apr_pool_userdata_get((void **)&conn, POOL_PINNED_KEY, pool) == APR_SUCCESS && conn != NULL) {
+        *_conn = conn;
+        return HTTP_OK;
+    }
+
+    // Without a primary database we fall back to mod_dbd.
+    if (scfg->primary == NULL) {
+        ASSERT_NOT_NULL(
+            db_conn = ap_dbd_acquire(http_request),
+            HTTP_INTERNAL_SERVER_ERROR, "Can not get database connection."
+        )
+
+        ASSERT_NOT_NULL(
+            conn = apr_pcalloc(pool, sizeof (mod_okioki_conn_t)),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not allocate connection."
+        )
+        conn->driver   = db_conn->driver;
+        conn->handle   = db_conn->handle;
+        conn->pool     = db_conn->pool;
+        conn->prepared = NULL;
+        conn->labels   = db_conn->prepared;
+
+        *_conn = conn;
+        return HTTP_OK;
+    }
+
+    return mod_okioki_conn_acquire_backend(pool, mod_okioki_pool_select(scfg, read_only), _conn, error);
+}
+
+int mod_okioki_conn_acquire_pool(request_rec *http_request, apr_pool_t *pool, int read_only, mod_okioki_conn_t **_conn, char **error)
+{
+    mod_okioki_server_config *scfg = (mod_okioki_server_config *)ap_get_module_config(http_request->server->module_config, &okioki_module);
+
+    // mod_dbd keeps the connection it gives to a request until the request ends.
+    if (scfg->primary == NULL) {
+        return mod_okioki_conn_open(pool, http_request->server, _conn, error);
+    }
+
+    return mod_okioki_conn_acquire_backend(pool, mod_okioki_pool_select(scfg, read_only), _conn, error);
+}
+
+void mod_okioki_conn_pin(request_rec *http_request, mod_okioki_conn_t *conn)
+{
+    apr_pool_userdata_setn(conn, POOL_PINNED_KEY, NULL, http_request->pool);
+}
+
+int mod_okioki_conn_acquire_backend(apr_pool_t *pool, backend_t *backend, mod_okioki_conn_t **_conn, char **error)
+{
+    mod_okioki_conn_t *conn;
+
+    ASSERT_APR_SUCCESS(
+        apr_reslist_acquire(backend->connections, (void **)&conn),
+        HTTP_INTERNAL_SERVER_ERROR, "Can not get database connection."
+    )
+    apr_pool_cleanup_register(pool, conn, mod_okioki_pool_release, apr_pool_cleanup_null);
+
+    *_conn = conn;
+    return HTTP_OK;
+}
+
+/** Close a connection opened through mod_dbd, called when the pool is cleaned up.
+ */
+static apr_status_t mod_okioki_pool_close(void *_conn)
+{
+    mod_okioki_conn_t *conn = (mod_okioki_conn_t *)_conn;
+
+    ap_dbd_close(conn->server, conn->dbd);
+    return APR_SUCCESS;
+}
+
+int mod_okioki_conn_open(apr_pool_t *pool, server_rec *server, mod_okioki_conn_t **_conn, char **error)
+{
+    mod_okioki_server_config *scfg = (mod_okioki_server_config *)ap_get_module_config(server->module_config, &okioki_module);
+    mod_okioki_conn_t        *conn;
+    ap_dbd_t                 *db_conn;
+
+    // Without a primary database we fall back to mod_dbd.
+    if (scfg->primary == NULL) {
+        ASSERT_NOT_NULL(
+            db_conn = ap_dbd_open(pool, server),
+            HTTP_INTERNAL_SERVER_ERROR, "Can not get database connection."
+        )
+
+        ASSERT_NOT_NULL(
+            conn = apr_pcalloc(pool, sizeof (mod_okioki_conn_t)),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not allocate connection."
+        )
+        conn->driver   = db_conn->driver;
+        conn->handle   = db_conn->handle;
+        conn->pool     = db_conn->pool;
+        conn->prepared = NULL;
+        conn->labels   = db_conn->prepared;
+        conn->server   = server;
+        conn->dbd      = db_conn;
+        apr_pool_cleanup_register(pool, conn, mod_okioki_pool_close, apr_pool_cleanup_null);
+
+        *_conn = conn;
+        return HTTP_OK;
+    }
+
+    ASSERT_APR_SUCCESS(
+        apr_reslist_acquire(scfg->primary->connections, (void **)&conn),
+        HTTP_INTERNAL_SERVER_ERROR, "Can not get database connection."
+    )
+    apr_pool_cleanup_register(pool, conn, mod_okioki_pool_release, apr_pool_cleanup_null);
+
+    *_conn = conn;
+    return HTTP_OK;
+}
+
+int mod_okioki_conn_prepare(apr_pool_t *pool, mod_okioki_conn_t *conn, view_t *view, apr_dbd_prepared_t **statement, char **error)
+{
+    char       *label;
+    int        nr_rows;
+    int        ret;
+
+    // With mod_dbd the sql of the view is the label of a DBDPrepareSQL statement.
+    if (conn->prepared == NULL) {
+        ASSERT_NOT_NULL(
+            *statement = apr_hash_get(conn->labels, view->sql, view->sql_len),
+            HTTP_INTERNAL_SERVER_ERROR, "Can not find '%s'", view->sql
+        )
+        return HTTP_OK;
+    }
+
+    // Otherwise the sql is inline. A statement number that was reused by a reloaded view still holds
+    // the statement of the old view on connections that executed it.
+    if (conn->prepared[view->statement_nr] != NULL && conn->prepared_versions[view->statement_nr] != view->statement_version) {
+        ASSERT_ZERO(
+            ret = apr_dbd_query(conn->driver, conn->handle, &nr_rows, apr_psprintf(pool, "DEALLOCATE %s", mod_okioki_conn_statement_name(pool, conn, view))),
+            HTTP_BAD_GATEWAY, "Can not deallocate statement: %s", apr_dbd_error(conn->driver, conn->handle, ret)
+        )
+        conn->prepared[view->statement_nr] = NULL;
+    }
+
+    // Prepare the statement the first time this connection executes the view.
+    if ((*statement = conn->prepared[view->statement_nr]) == NULL) {
+        ASSERT_NOT_NULL(
+            label = (char *)mod_okioki_conn_statement_name(conn->pool, conn, view),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not allocate statement label."
+        )
+
+        ASSERT_ZERO(
+            ret = apr_dbd_prepare(conn->driver, conn->pool, conn->handle, view->sql, label, statement),
+            HTTP_BAD_GATEWAY, "Can not prepare '%s': %s", view->sql, apr_dbd_error(conn->driver, conn->handle, ret)
+        )
+        conn->prepared[view->statement_nr]          = *statement;
+        conn->prepared_versions[view->statement_nr] = view->statement_version;
+    }
+
+    return HTTP_OK;
+}
+
+const char *mod_okioki_conn_statement_name(apr_pool_t *pool, mod_okioki_conn_t *conn, view_t *view)
+{
+    // apr_dbd prepares the statement under its label.
+    if (conn->prepared == NULL) {
+        return view->sql;
+    }
+    return apr_psprintf(pool, "okioki_%i", view->statement_nr);
+}
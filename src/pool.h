@@ -0,0 +1,97 @@
+#ifndef POOL_H
+#define POOL_H
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <httpd.h>
+#include <http_log.h>
+#include <apr_hash.h>
+#include <apr_dbd.h>
+#include <mod_dbd.h>
+#include "mod_okioki.h"
+
+#define SHARD_POINTS 64     // points on the consistent hash ring for each shard
+#define POOL_PINNED_KEY "mod_okioki_pinned_conn"
+
+/** A database connection, either from the module's own pool or from mod_dbd.
+ */
+typedef struct {
+    const apr_dbd_driver_t *driver;
+    apr_dbd_t              *handle;
+    apr_pool_t             *pool;
+    backend_t              *backend;
+
+    // Statements prepared on this connection indexed by view->statement_nr, NULL when using mod_dbd.
+    apr_dbd_prepared_t     **prepared;
+    apr_uint32_t           *prepared_versions;
+
+    // Statements prepared by mod_dbd indexed by label, NULL when using the module's own pool.
+    apr_hash_t             *labels;
+
+    // Set when the connection was opened through mod_dbd outside of a request.
+    server_rec             *server;
+    ap_dbd_t               *dbd;
+} mod_okioki_conn_t;
+
+/** Create the connection pools of every backend, called once for each child.
+ */
+int mod_okioki_pool_child_init(apr_pool_t *pool, server_rec *server);
+
+/** Acquire a connection for a request.
+ * Read only requests are routed to one of the read replicas, other requests to the primary. When
+ * no primary is configured the connection is acquired through mod_dbd instead.
+ * The connection is released when the request's pool is cleaned up.
+ */
+int mod_okioki_conn_acquire(request_rec *http_request, int read_only, mod_okioki_conn_t **conn, char **error);
+
+/** Acquire a connection like mod_okioki_conn_acquire(), which is released when pool is cleaned up instead.
+ * This is used by requests that execute views many times, such as event streams, so that a connection
+ * is only held while a view is executed.
+ */
+int mod_okioki_conn_acquire_pool(request_rec *http_request, apr_pool_t *pool, int read_only, mod_okioki_conn_t **conn, char **error);
+
+/** Use the connection for all views executed during the rest of the request.
+ * This allows work done before the view is executed, like storing an upload, to be part of
+ * the same transaction.
+ */
+void mod_okioki_conn_pin(request_rec *http_request, mod_okioki_conn_t *conn);
+
+/** Acquire a connection from a specific backend, such as a shard.
+ * The connection is released when the pool is cleaned up.
+ */
+int mod_okioki_conn_acquire_backend(apr_pool_t *pool, backend_t *backend, mod_okioki_conn_t **conn, char **error);
+
+/** Find the shard for a shard key on the consistent hash ring.
+ */
+backend_t *mod_okioki_shard_backend(mod_okioki_server_config *scfg, const char *key, apr_size_t key_len);
+
+/** Open a connection to the primary database outside of a request, for background work.
+ * The connection is released when the pool is cleaned up.
+ */
+int mod_okioki_conn_open(apr_pool_t *pool, server_rec *server, mod_okioki_conn_t **conn, char **error);
+
+/** Get the prepared statement of the view on this connection.
+ * With the module's own pool the statement is prepared on first use.
+ */
+int mod_okioki_conn_prepare(apr_pool_t *pool, mod_okioki_conn_t *conn, view_t *view, apr_dbd_prepared_t **statement, char **error);
+
+/** The name of the prepared statement of the view on the server, after mod_okioki_conn_prepare().
+ * It is used to execute the statement through libpq directly.
+ */
+const char *mod_okioki_conn_statement_name(apr_pool_t *pool, mod_okioki_conn_t *conn, view_t *view);
+
+#endif
@@ -0,0 +1,289 @@
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <apr_strings.h>
+#include <apr_dbd.h>
+#include <httpd.h>
+#include <http_log.h>
+#include <http_protocol.h>
+#include <http_request.h>
+#include <libpq-fe.h>
+#include <libpq/libpq-fs.h>
+#include "raw.h"
+#include "accesslog.h"
+#include "pool.h"
+#include "util.h"
+
+static apr_status_t mod_okioki_raw_clear(void *pg_result)
+{
+    PQclear((PGresult *)pg_result);
+    return APR_SUCCESS;
+}
+
+/** End the transaction of a raw view that was not completed, before the connection is released.
+ */
+static apr_status_t mod_okioki_raw_rollback(void *pg_conn)
+{
+    PQclear(PQexec((PGconn *)pg_conn, "ROLLBACK"));
+    return APR_SUCCESS;
+}
+
+/** Execute a command without a result on the connection.
+ */
+static int mod_okioki_raw_command(apr_pool_t *pool, PGconn *pg_conn, const char *command, char **error)
+{
+    PGresult *pg_result = PQexec(pg_conn, command);
+    int      ret = pg_result != NULL && PQresultStatus(pg_result) == PGRES_COMMAND_OK ? HTTP_OK : HTTP_BAD_GATEWAY;
+
+    PQclear(pg_result);
+    ASSERT_HTTP_OK(
+        ret,
+        HTTP_BAD_GATEWAY, "Could not execute %s: %s", command, PQerrorMessage(pg_conn)
+    )
+    return HTTP_OK;
+}
+
+/** Pass the brigade down the filter chain, mapping the APR status to the status of the handler.
+ *
+ * @returns  HTTP_OK, DONE when the client went away or a filter already answered the request,
+ *           or HTTP_INTERNAL_SERVER_ERROR.
+ */
+static int mod_okioki_raw_pass(request_rec *http_request, apr_bucket_brigade *bb, char **error)
+{
+    apr_pool_t   *pool = http_request->pool;
+    apr_status_t status = ap_pass_brigade(http_request->output_filters, bb);
+
+    apr_brigade_cleanup(bb);
+    if (status == APR_SUCCESS) {
+        return HTTP_OK;
+    }
+
+    // A filter that fails the request sends the error response itself.
+    if (status == AP_FILTER_ERROR) {
+        return DONE;
+    }
+
+    if (APR_STATUS_IS_ECONNABORTED(status) || APR_STATUS_IS_ECONNRESET(status) || APR_STATUS_IS_TIMEUP(status) || http_request->connection->aborted) {
+        ap_log_perror(APLOG_MARK, APLOG_INFO, status, pool, "[mod_okioki] Client went away while the raw value was sent.");
+        http_request->connection->aborted = 1;
+        return DONE;
+    }
+
+    *error = apr_pstrdup(pool, "Could not pass the raw value to the output filters.");
+    ap_log_perror(APLOG_MARK, APLOG_ERR, status, pool, "[mod_okioki] %s", *error);
+    return HTTP_INTERNAL_SERVER_ERROR;
+}
+
+/** The status of the handler when the value could not be sent.
+ * Before the body is started the error replaces it, afterwards the connection is aborted.
+ */
+static int mod_okioki_raw_failed(request_rec *http_request, int ret)
+{
+    if (ret == DONE) {
+        return OK;
+    }
+
+    // The error response has a length of its own.
+    apr_table_unset(http_request->headers_out, "Content-Length");
+    return mod_okioki_response_failed(http_request, ret);
+}
+
+/** Read a large object in chunks and pass each chunk down the filter chain.
+ * The memory of a chunk is released by the filters once it is sent, so at most a few chunks are in memory.
+ */
+static int mod_okioki_raw_large_object(request_rec *http_request, PGconn *pg_conn, Oid oid, apr_bucket_brigade *bb, char **error)
+{
+    apr_pool_t         *pool = http_request->pool;
+    apr_bucket_alloc_t *alloc = bb->bucket_alloc;
+    apr_bucket         *b;
+    pg_int64           size;
+    char               *buf;
+    int                fd;
+    int                n;
+    int                ret;
+
+    ASSERT_POSITIVE(
+        fd = lo_open(pg_conn, oid, INV_READ),
+        HTTP_NOT_FOUND, "Could not open large object %u: %s", oid, PQerrorMessage(pg_conn)
+    )
+
+    // The size is known up front, so the response does not need to be chunked.
+    if ((size = lo_lseek64(pg_conn, fd, 0, SEEK_END)) >= 0 && lo_lseek64(pg_conn, fd, 0, SEEK_SET) == 0) {
+        ap_set_content_length(http_request, size);
+    }
+
+    for (;;) {
+        ASSERT_NOT_NULL(
+            buf = apr_bucket_alloc(RAW_CHUNK_SIZE, alloc),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not allocate chunk."
+        )
+
+        if ((n = lo_read(pg_conn, fd, buf, RAW_CHUNK_SIZE)) <= 0) {
+            apr_bucket_free(buf);
+            ASSERT_ZERO(
+                n,
+                HTTP_BAD_GATEWAY, "Could not read large object %u: %s", oid, PQerrorMessage(pg_conn)
+            )
+            break;
+        }
+
+        ASSERT_NOT_NULL(
+            b = apr_bucket_heap_create(buf, n, apr_bucket_free, alloc),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
+        )
+        APR_BRIGADE_INSERT_TAIL(bb, b);
+
+        if ((ret = mod_okioki_raw_pass(http_request, bb, error)) != HTTP_OK) {
+            lo_close(pg_conn, fd);
+            return ret;
+        }
+    }
+
+    lo_close(pg_conn, fd);
+    return HTTP_OK;
+}
+
+int mod_okioki_raw_handler(request_rec *http_request, view_t *view, apr_hash_t *arguments, char **error)
+{
+    apr_pool_t          *pool = http_request->pool;
+    apr_bucket_alloc_t  *alloc = http_request->connection->bucket_alloc;
+    accesslog_record_t  *record = mod_okioki_accesslog_get(http_request);
+    apr_time_t          db_start = apr_time_now();
+    mod_okioki_conn_t   *db_conn;
+    apr_dbd_prepared_t  *db_statement;
+    PGconn              *pg_conn;
+    PGresult            *pg_result;
+    apr_bucket_brigade  *bb;
+    apr_bucket          *b;
+    const unsigned char *value;
+    int                 value_len;
+    const char          *name;
+    int                 argc = view->nr_sql_params;
+    const char          *argv[argc + 1];
+    Oid                 oid;
+    int                 i;
+    int                 ret;
+
+    // Copy the pointers parameters in the right order for the SQL statement.
+    for (i = 0; i < argc; i++) {
+        ASSERT_NOT_NULL(
+            argv[i] = apr_hash_get(arguments, view->sql_params[i], view->sql_params_len[i]),
+            HTTP_BAD_REQUEST, "Could not find parameter '%s' in request.", view->sql_params[i]
+        )
+    }
+    argv[i] = NULL;
+
+    ASSERT_HTTP_OK(
+        ret = mod_okioki_conn_acquire(http_request, http_request->method_number == M_GET, &db_conn, error),
+        ret, "Can not get database connection."
+    )
+    ASSERT_ZERO(
+        strcmp(apr_dbd_name(db_conn->driver), "pgsql"),
+        HTTP_INTERNAL_SERVER_ERROR, "The RAW output type requires PostgreSQL."
+    )
+    ASSERT_HTTP_OK(
+        ret = mod_okioki_conn_prepare(pool, db_conn, view, &db_statement, error),
+        ret, "Can not get prepared statement."
+    )
+    name = mod_okioki_conn_statement_name(pool, db_conn, view);
+
+    ASSERT_NOT_NULL(
+        pg_conn = apr_dbd_native_handle(db_conn->driver, db_conn->handle),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not get libpq connection."
+    )
+
+    // A large object can only be read inside a transaction, which lasts until the body is sent. The cleanup
+    // is registered after the connection was acquired, so it runs before the connection is released.
+    if ((ret = mod_okioki_raw_command(pool, pg_conn, "BEGIN", error)) != HTTP_OK) {
+        return ret;
+    }
+    apr_pool_cleanup_register(pool, pg_conn, mod_okioki_raw_rollback, apr_pool_cleanup_null);
+
+    // Ask for a binary result, so that a bytea does not have to be decoded and an oid is a 32 bit integer.
+    pg_result = PQexecPrepared(pg_conn, name, argc, argv, NULL, NULL, 1);
+    if (pg_result != NULL) {
+        apr_pool_cleanup_register(pool, pg_result, mod_okioki_raw_clear, apr_pool_cleanup_null);
+    }
+    ASSERT_ZERO(
+        pg_result == NULL || PQresultStatus(pg_result) != PGRES_TUPLES_OK,
+        HTTP_BAD_GATEWAY, "%s", PQerrorMessage(pg_conn)
+    )
+
+    if (record != NULL) {
+        record->db_time = apr_time_now() - db_start;
+        record->nr_rows = PQntuples(pg_result);
+    }
+
+    ASSERT_ZERO(
+        PQntuples(pg_result) == 0 || PQnfields(pg_result) == 0 || PQgetisnull(pg_result, 0, 0),
+        HTTP_NOT_FOUND, "No value found."
+    )
+
+    ASSERT_NOT_NULL(
+        bb = apr_brigade_create(pool, alloc),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate a bucket brigade."
+    )
+
+    // The content type must be known before the first chunk is passed down the filter chain.
+    if (PQnfields(pg_result) > 1 && !PQgetisnull(pg_result, 0, 1)) {
+        ap_set_content_type(http_request, apr_pstrmemdup(pool, PQgetvalue(pg_result, 0, 1), PQgetlength(pg_result, 0, 1)));
+    } else {
+        ap_set_content_type(http_request, "application/octet-stream");
+    }
+    http_request->status = HTTP_OK;
+
+    value     = (const unsigned char *)PQgetvalue(pg_result, 0, 0);
+    value_len = PQgetlength(pg_result, 0, 0);
+
+    if (PQftype(pg_result, 0) == RAW_OID_OID) {
+        ASSERT_ZERO(
+            value_len != 4,
+            HTTP_BAD_GATEWAY, "Large object id is not a 32 bit integer."
+        )
+        oid = ((Oid)value[0] << 24) | ((Oid)value[1] << 16) | ((Oid)value[2] << 8) | value[3];
+
+        // A chunk may already have been sent, then the response can not be replaced by an error.
+        if ((ret = mod_okioki_raw_large_object(http_request, pg_conn, oid, bb, error)) != HTTP_OK) {
+            return mod_okioki_raw_failed(http_request, ret);
+        }
+
+    } else {
+        // The value is owned by the result, filters that hold on to it will make their own copy.
+        ap_set_content_length(http_request, value_len);
+        ASSERT_NOT_NULL(
+            b = apr_bucket_transient_create((const char *)value, value_len, alloc),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
+        )
+        APR_BRIGADE_INSERT_TAIL(bb, b);
+    }
+
+    // Add an end-of-stream.
+    ASSERT_NOT_NULL(
+        b = apr_bucket_eos_create(alloc),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
+    )
+    APR_BRIGADE_INSERT_TAIL(bb, b);
+
+    if ((ret = mod_okioki_raw_pass(http_request, bb, error)) != HTTP_OK) {
+        return mod_okioki_raw_failed(http_request, ret);
+    }
+
+    // The view may have modified data, which is committed now that the body is sent.
+    apr_pool_cleanup_kill(pool, pg_conn, mod_okioki_raw_rollback);
+    mod_okioki_raw_command(pool, pg_conn, "COMMIT", error);
+    return OK;
+}
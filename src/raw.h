@@ -0,0 +1,39 @@
+#ifndef RAW_H
+#define RAW_H
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <httpd.h>
+#include <http_log.h>
+#include <apr_hash.h>
+#include "mod_okioki.h"
+
+#define RAW_CHUNK_SIZE  65536           // 64 kbyte read from a large object at a time
+#define RAW_OID_OID     26              // PostgreSQL type of an oid column, a large object
+
+/** Execute a view of the RAW output type and send the first column of the first row as the body.
+ * The statement is executed through libpq with a binary result, so a bytea is sent as is and an oid is
+ * read as a large object in chunks that are passed down the filter chain one at a time. Other types
+ * are sent as their binary representation, which for text is the text itself. The optional second
+ * column is the Content-Type of the response.
+ *
+ * @returns  OK, or the HTTP status of an error when nothing was sent yet.
+ */
+int mod_okioki_raw_handler(request_rec *http_request, view_t *view, apr_hash_t *arguments, char **error);
+
+#endif
@@ -0,0 +1,663 @@
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* okioki-replay sends the requests of an OkiokiCapture file to a server again, at the rate they
+ * where captured, and writes the latency of each view to a report. Two reports of different builds
+ * can be compared.
+ *
+ *   okioki-replay [-h host] [-p port] [-t threads] [-r rate] [-o report] <capture file>
+ *   okioki-replay -c <base report> <new report>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <apr_general.h>
+#include <apr_atomic.h>
+#include <apr_getopt.h>
+#include <apr_hash.h>
+#include <apr_lib.h>
+#include <apr_network_io.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+#include <apr_thread_proc.h>
+#include <apr_time.h>
+
+#define REPLAY_LINE_LEN       8192
+#define REPLAY_BUFFER_SIZE    65536
+#define REPLAY_NR_THREADS     8
+#define REPLAY_TIMEOUT        30       // seconds before a request is given up
+
+/** A request read from the capture file, and the result of sending it again.
+ */
+typedef struct {
+    apr_time_t          time;
+    const char          *method;
+    const char          *request;
+    const char          *view;
+    int                 captured_status;
+    int                 status;
+    apr_interval_time_t latency;
+} replay_request_t;
+
+/** The latencies of a view in a report.
+ */
+typedef struct {
+    const char          *view;
+    int                 count;
+    int                 nr_errors;
+    apr_interval_time_t mean;
+    apr_interval_time_t p50;
+    apr_interval_time_t p95;
+    apr_interval_time_t p99;
+    apr_array_header_t  *latencies;
+} replay_stats_t;
+
+/** The state shared by the worker threads.
+ */
+typedef struct {
+    apr_sockaddr_t        *address;
+    const char            *host;
+    replay_request_t      *requests;
+    int                   nr_requests;
+    double                rate;
+    apr_time_t            start;
+    volatile apr_uint32_t next;
+} replay_t;
+
+/** A keep-alive connection of a worker thread, with its read buffer.
+ */
+typedef struct {
+    apr_pool_t            *pool;
+    apr_socket_t          *socket;
+    char                  buffer[REPLAY_BUFFER_SIZE];
+    apr_size_t            len;
+    apr_size_t            pos;
+} replay_connection_t;
+
+/** Split a line into at most max_fields fields separated by tabs.
+ *
+ * @returns  The number of fields.
+ */
+static int replay_split(char *line, char **fields, int max_fields)
+{
+    char *last;
+    int  nr_fields = 0;
+    char *field;
+
+    for (field = apr_strtok(line, "\t\n", &last); field != NULL && nr_fields < max_fields; field = apr_strtok(NULL, "\t\n", &last)) {
+        fields[nr_fields++] = field;
+    }
+    return nr_fields;
+}
+
+/** Read more data from the connection into the buffer.
+ */
+static apr_status_t replay_fill(replay_connection_t *c)
+{
+    apr_size_t   n;
+    apr_status_t ret;
+
+    if (c->pos > 0) {
+        memmove(c->buffer, &c->buffer[c->pos], c->len - c->pos);
+        c->len-= c->pos;
+        c->pos = 0;
+    }
+    if (c->len == REPLAY_BUFFER_SIZE) {
+        return APR_ENOSPC;
+    }
+
+    n = REPLAY_BUFFER_SIZE - c->len;
+    if ((ret = apr_socket_recv(c->socket, &c->buffer[c->len], &n)) != APR_SUCCESS && n == 0) {
+        return ret;
+    }
+    c->len+= n;
+    return APR_SUCCESS;
+}
+
+/** Read a line of the response, without the CRLF.
+ */
+static apr_status_t replay_getline(replay_connection_t *c, char **line)
+{
+    apr_status_t ret;
+    char         *end;
+
+    while ((end = memchr(&c->buffer[c->pos], '\n', c->len - c->pos)) == NULL) {
+        if ((ret = replay_fill(c)) != APR_SUCCESS) {
+            return ret;
+        }
+    }
+
+    *line = &c->buffer[c->pos];
+    c->pos = end - c->buffer + 1;
+    *end = 0;
+    if (end > *line && end[-1] == '\r') {
+        end[-1] = 0;
+    }
+    return APR_SUCCESS;
+}
+
+/** Skip a number of bytes of the response body.
+ */
+static apr_status_t replay_skip(replay_connection_t *c, apr_off_t n)
+{
+    apr_status_t ret;
+    apr_size_t   available;
+
+    while (n > 0) {
+        if (c->pos == c->len && (ret = replay_fill(c)) != APR_SUCCESS) {
+            return ret;
+        }
+        available = c->len - c->pos;
+        if ((apr_off_t)available > n) {
+            available = (apr_size_t)n;
+        }
+        c->pos+= available;
+        n-= available;
+    }
+    return APR_SUCCESS;
+}
+
+/** Read a complete response, with a Content-Length or a chunked body.
+ *
+ * @param status      The status of the response.
+ * @param keep_alive  Set to 0 when the server closes the connection.
+ */
+static apr_status_t replay_read_response(replay_connection_t *c, const char *method, int *status, int *keep_alive)
+{
+    apr_status_t ret;
+    char         *line;
+    apr_off_t    content_length = -1;
+    int          chunked = 0;
+
+    if ((ret = replay_getline(c, &line)) != APR_SUCCESS) {
+        return ret;
+    }
+    if (strncmp(line, "HTTP/1.", 7) != 0 || strlen(line) < 12) {
+        return APR_EGENERAL;
+    }
+    *status = atoi(&line[9]);
+    *keep_alive = line[7] == '1';
+
+    // The headers, until the empty line.
+    for (;;) {
+        if ((ret = replay_getline(c, &line)) != APR_SUCCESS) {
+            return ret;
+        }
+        if (line[0] == 0) {
+            break;
+        }
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            content_length = apr_atoi64(&line[15]);
+        } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strstr(&line[18], "chunked") != NULL) {
+            chunked = 1;
+        } else if (strncasecmp(line, "Connection:", 11) == 0 && strstr(&line[11], "close") != NULL) {
+            *keep_alive = 0;
+        }
+    }
+
+    if (strcmp(method, "HEAD") == 0 || *status == 204 || *status == 304) {
+        return APR_SUCCESS;
+
+    } else if (chunked) {
+        for (;;) {
+            if ((ret = replay_getline(c, &line)) != APR_SUCCESS) {
+                return ret;
+            }
+            if ((content_length = apr_strtoi64(line, NULL, 16)) == 0) {
+                break;
+            }
+            if ((ret = replay_skip(c, content_length + 2)) != APR_SUCCESS) {
+                return ret;
+            }
+        }
+        // The trailers, until the empty line.
+        do {
+            if ((ret = replay_getline(c, &line)) != APR_SUCCESS) {
+                return ret;
+            }
+        } while (line[0] != 0);
+        return APR_SUCCESS;
+
+    } else if (content_length >= 0) {
+        return replay_skip(c, content_length);
+
+    } else {
+        // The body ends when the server closes the connection.
+        *keep_alive = 0;
+        while ((ret = replay_fill(c)) == APR_SUCCESS) {
+            c->pos = c->len;
+        }
+        return APR_SUCCESS;
+    }
+}
+
+/** Write all of the data to the connection, apr_socket_send() may write only part of it.
+ */
+static apr_status_t replay_write(replay_connection_t *c, const char *data, apr_size_t len)
+{
+    apr_status_t ret;
+    apr_size_t   n;
+
+    while (len > 0) {
+        n = len;
+        if ((ret = apr_socket_send(c->socket, data, &n)) != APR_SUCCESS) {
+            return ret;
+        }
+        data+= n;
+        len-= n;
+    }
+    return APR_SUCCESS;
+}
+
+/** Send a single request over the connection, opening it when needed.
+ */
+static apr_status_t replay_send(replay_t *replay, replay_connection_t *c, replay_request_t *r, apr_pool_t *pool)
+{
+    apr_status_t ret;
+    const char   *query;
+    const char   *http_request;
+    int          keep_alive;
+
+    if (c->socket == NULL) {
+        if (
+            (ret = apr_socket_create(&c->socket, replay->address->family, SOCK_STREAM, APR_PROTO_TCP, c->pool)) != APR_SUCCESS ||
+            (ret = apr_socket_timeout_set(c->socket, apr_time_from_sec(REPLAY_TIMEOUT))) != APR_SUCCESS ||
+            (ret = apr_socket_connect(c->socket, replay->address)) != APR_SUCCESS
+        ) {
+            c->socket = NULL;
+            return ret;
+        }
+        c->len = 0;
+        c->pos = 0;
+    }
+
+    // GET and HEAD requests send the arguments in the query, the others as a form.
+    query = strchr(r->request, '?');
+    if (query == NULL || strcmp(r->method, "GET") == 0 || strcmp(r->method, "HEAD") == 0) {
+        http_request = apr_psprintf(pool,
+            "%s %s HTTP/1.1\r\nHost: %s\r\nContent-Length: 0\r\n\r\n",
+            r->method, r->request, replay->host
+        );
+    } else {
+        http_request = apr_psprintf(pool,
+            "%s %.*s HTTP/1.1\r\nHost: %s\r\nContent-Type: application/x-www-form-urlencoded\r\nContent-Length: %" APR_SIZE_T_FMT "\r\n\r\n%s",
+            r->method, (int)(query - r->request), r->request, replay->host, strlen(&query[1]), &query[1]
+        );
+    }
+
+    if (
+        (ret = replay_write(c, http_request, strlen(http_request))) != APR_SUCCESS ||
+        (ret = replay_read_response(c, r->method, &r->status, &keep_alive)) != APR_SUCCESS
+    ) {
+        apr_socket_close(c->socket);
+        c->socket = NULL;
+        return ret;
+    }
+
+    if (!keep_alive) {
+        apr_socket_close(c->socket);
+        c->socket = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+/** Worker thread that takes the next request and sends it at its scheduled time.
+ */
+static void * APR_THREAD_FUNC replay_worker(apr_thread_t *thread, void *data)
+{
+    replay_t            *replay = (replay_t *)data;
+    replay_connection_t *c;
+    replay_request_t    *r;
+    apr_pool_t          *pool;
+    apr_pool_t          *request_pool;
+    apr_time_t          due;
+    apr_time_t          now;
+    apr_uint32_t        i;
+
+    apr_pool_create(&pool, NULL);
+    apr_pool_create(&request_pool, pool);
+    c = apr_pcalloc(pool, sizeof (replay_connection_t));
+    c->pool = pool;
+
+    while ((i = apr_atomic_inc32(&replay->next)) < (apr_uint32_t)replay->nr_requests) {
+        r = &replay->requests[i];
+
+        // Keep the intervals between the requests as they where captured, scaled by the rate.
+        due = replay->start + (apr_time_t)((r->time - replay->requests[0].time) / replay->rate);
+        if ((now = apr_time_now()) < due) {
+            apr_sleep(due - now);
+        }
+
+        now = apr_time_now();
+        if (replay_send(replay, c, r, request_pool) != APR_SUCCESS) {
+            r->status = 0;
+        }
+        r->latency = apr_time_now() - now;
+        apr_pool_clear(request_pool);
+    }
+
+    if (c->socket != NULL) {
+        apr_socket_close(c->socket);
+    }
+    apr_pool_destroy(pool);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+static int replay_compare_time(const void *a, const void *b)
+{
+    apr_time_t x = ((const replay_request_t *)a)->time;
+    apr_time_t y = ((const replay_request_t *)b)->time;
+
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/** Read the requests of a capture file, sorted by the time they were received.
+ * Each line has the time, method, request, status, duration, database time and number of rows, separated by tabs.
+ * Lines are written when a request is done, so a slow request comes after requests that were received later.
+ */
+static int replay_read_capture(apr_pool_t *pool, const char *path, apr_array_header_t *requests)
+{
+    FILE             *file;
+    char             line[REPLAY_LINE_LEN];
+    char             *fields[7];
+    const char       *query;
+    replay_request_t *r;
+
+    if ((file = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "Could not open capture '%s'.\n", path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof (line), file) != NULL) {
+        if (replay_split(line, fields, 7) < 4) {
+            continue;
+        }
+
+        r = (replay_request_t *)apr_array_push(requests);
+        r->time            = apr_atoi64(fields[0]);
+        r->method          = apr_pstrdup(pool, fields[1]);
+        r->request         = apr_pstrdup(pool, fields[2]);
+        r->captured_status = atoi(fields[3]);
+        r->status          = 0;
+        r->latency         = 0;
+
+        // Requests are grouped by method and path, without the arguments.
+        query = strchr(r->request, '?');
+        r->view = apr_psprintf(pool, "%s %.*s", r->method, query ? (int)(query - r->request) : (int)strlen(r->request), r->request);
+    }
+
+    fclose(file);
+    qsort(requests->elts, requests->nelts, sizeof (replay_request_t), replay_compare_time);
+    return 0;
+}
+
+static int replay_compare_latency(const void *a, const void *b)
+{
+    apr_interval_time_t x = *(const apr_interval_time_t *)a;
+    apr_interval_time_t y = *(const apr_interval_time_t *)b;
+
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static int replay_compare_view(const void *a, const void *b)
+{
+    return strcmp((*(replay_stats_t * const *)a)->view, (*(replay_stats_t * const *)b)->view);
+}
+
+/** Write the latencies of each view, in microseconds, as tab separated lines sorted by view.
+ * A request counts as an error when its status differs from the captured status.
+ */
+static int replay_write_report(apr_pool_t *pool, FILE *file, replay_request_t *requests, int nr_requests)
+{
+    apr_hash_t          *views = apr_hash_make(pool);
+    apr_array_header_t  *sorted = apr_array_make(pool, 16, sizeof (replay_stats_t *));
+    apr_interval_time_t *l;
+    apr_interval_time_t total;
+    replay_stats_t      *stats;
+    int                 nr_errors = 0;
+    int                 i;
+    int                 j;
+
+    for (i = 0; i < nr_requests; i++) {
+        if ((stats = apr_hash_get(views, requests[i].view, APR_HASH_KEY_STRING)) == NULL) {
+            stats = apr_pcalloc(pool, sizeof (replay_stats_t));
+            stats->view      = requests[i].view;
+            stats->latencies = apr_array_make(pool, 64, sizeof (apr_interval_time_t));
+            apr_hash_set(views, stats->view, APR_HASH_KEY_STRING, stats);
+            *(replay_stats_t **)apr_array_push(sorted) = stats;
+        }
+        *(apr_interval_time_t *)apr_array_push(stats->latencies) = requests[i].latency;
+        if (requests[i].status != requests[i].captured_status) {
+            stats->nr_errors++;
+            nr_errors++;
+        }
+    }
+
+    qsort(sorted->elts, sorted->nelts, sizeof (replay_stats_t *), replay_compare_view);
+    fprintf(file, "# view\tcount\terrors\tmean\tp50\tp95\tp99\n");
+    for (i = 0; i < sorted->nelts; i++) {
+        stats = ((replay_stats_t **)sorted->elts)[i];
+        l = (apr_interval_time_t *)stats->latencies->elts;
+        qsort(l, stats->latencies->nelts, sizeof (apr_interval_time_t), replay_compare_latency);
+
+        stats->count = stats->latencies->nelts;
+        for (total = 0, j = 0; j < stats->count; j++) {
+            total+= l[j];
+        }
+        stats->mean = total / stats->count;
+        stats->p50  = l[(stats->count - 1) * 50 / 100];
+        stats->p95  = l[(stats->count - 1) * 95 / 100];
+        stats->p99  = l[(stats->count - 1) * 99 / 100];
+
+        fprintf(file, "%s\t%i\t%i\t%" APR_TIME_T_FMT "\t%" APR_TIME_T_FMT "\t%" APR_TIME_T_FMT "\t%" APR_TIME_T_FMT "\n",
+            stats->view, stats->count, stats->nr_errors, stats->mean, stats->p50, stats->p95, stats->p99
+        );
+    }
+    return nr_errors;
+}
+
+/** Read a report written by replay_write_report.
+ *
+ * @returns  A hash of replay_stats_t by view, or NULL.
+ */
+static apr_hash_t *replay_read_report(apr_pool_t *pool, const char *path)
+{
+    apr_hash_t     *views = apr_hash_make(pool);
+    FILE           *file;
+    char           line[REPLAY_LINE_LEN];
+    char           *fields[7];
+    replay_stats_t *stats;
+
+    if ((file = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "Could not open report '%s'.\n", path);
+        return NULL;
+    }
+
+    while (fgets(line, sizeof (line), file) != NULL) {
+        if (line[0] == '#') {
+            continue;
+        }
+        if (replay_split(line, fields, 7) < 7) {
+            continue;
+        }
+
+        stats = apr_pcalloc(pool, sizeof (replay_stats_t));
+        stats->view      = apr_pstrdup(pool, fields[0]);
+        stats->count     = atoi(fields[1]);
+        stats->nr_errors = atoi(fields[2]);
+        stats->mean      = apr_atoi64(fields[3]);
+        stats->p50       = apr_atoi64(fields[4]);
+        stats->p95       = apr_atoi64(fields[5]);
+        stats->p99       = apr_atoi64(fields[6]);
+        apr_hash_set(views, stats->view, APR_HASH_KEY_STRING, stats);
+    }
+
+    fclose(file);
+    return views;
+}
+
+/** The change from a to b in percent.
+ */
+static double replay_delta(apr_interval_time_t a, apr_interval_time_t b)
+{
+    return a > 0 ? (double)(b - a) * 100.0 / (double)a : 0.0;
+}
+
+/** Print the change in latency of each view between two reports.
+ */
+static int replay_compare(apr_pool_t *pool, const char *base_path, const char *new_path)
+{
+    apr_hash_t       *base;
+    apr_hash_t       *other;
+    apr_hash_index_t *hi;
+    replay_stats_t   *a;
+    replay_stats_t   *b;
+
+    if ((base = replay_read_report(pool, base_path)) == NULL || (other = replay_read_report(pool, new_path)) == NULL) {
+        return 1;
+    }
+
+    printf("# view\tcount\terrors\tmean\tp50\tp95\tp99 (change in percent)\n");
+    for (hi = apr_hash_first(pool, base); hi != NULL; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, (void **)&a);
+        if ((b = apr_hash_get(other, a->view, APR_HASH_KEY_STRING)) == NULL) {
+            printf("%s\tmissing\n", a->view);
+            continue;
+        }
+        printf("%s\t%i\t%+i\t%+.1f\t%+.1f\t%+.1f\t%+.1f\n",
+            a->view, b->count, b->nr_errors - a->nr_errors,
+            replay_delta(a->mean, b->mean), replay_delta(a->p50, b->p50), replay_delta(a->p95, b->p95), replay_delta(a->p99, b->p99)
+        );
+    }
+    for (hi = apr_hash_first(pool, other); hi != NULL; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, (void **)&b);
+        if (apr_hash_get(base, b->view, APR_HASH_KEY_STRING) == NULL) {
+            printf("%s\tnew\n", b->view);
+        }
+    }
+    return 0;
+}
+
+static void replay_usage(void)
+{
+    fprintf(stderr,
+        "usage: okioki-replay [-h host] [-p port] [-t threads] [-r rate] [-o report] <capture file>\n"
+        "       okioki-replay -c <base report> <new report>\n"
+    );
+}
+
+int main(int argc, const char * const argv[])
+{
+    apr_pool_t         *pool;
+    apr_getopt_t       *opt;
+    apr_status_t       ret;
+    apr_thread_t       **threads;
+    apr_status_t       thread_ret;
+    apr_array_header_t *requests;
+    replay_t           replay;
+    const char         *arg;
+    const char         *host = "localhost";
+    const char         *report_path = NULL;
+    FILE               *report = stdout;
+    apr_port_t         port = 80;
+    int                nr_threads = REPLAY_NR_THREADS;
+    int                compare = 0;
+    int                nr_errors;
+    int                i;
+    char               c;
+
+    apr_app_initialize(&argc, &argv, NULL);
+    atexit(apr_terminate);
+    apr_pool_create(&pool, NULL);
+
+    replay.rate = 1.0;
+    apr_getopt_init(&opt, pool, argc, argv);
+    while ((ret = apr_getopt(opt, "h:p:t:r:o:c", &c, &arg)) == APR_SUCCESS) {
+        switch (c) {
+        case 'h': host = arg; break;
+        case 'p': port = (apr_port_t)atoi(arg); break;
+        case 't': nr_threads = atoi(arg); break;
+        case 'r': replay.rate = atof(arg); break;
+        case 'o': report_path = arg; break;
+        case 'c': compare = 1; break;
+        }
+    }
+    if (ret != APR_EOF || nr_threads < 1 || replay.rate <= 0.0) {
+        replay_usage();
+        return 2;
+    }
+
+    if (compare) {
+        if (argc - opt->ind != 2) {
+            replay_usage();
+            return 2;
+        }
+        return replay_compare(pool, argv[opt->ind], argv[opt->ind + 1]);
+    }
+
+    if (argc - opt->ind != 1) {
+        replay_usage();
+        return 2;
+    }
+
+    requests = apr_array_make(pool, 1024, sizeof (replay_request_t));
+    if (replay_read_capture(pool, argv[opt->ind], requests) != 0) {
+        return 1;
+    }
+    if (requests->nelts == 0) {
+        fprintf(stderr, "The capture has no requests.\n");
+        return 1;
+    }
+
+    if ((ret = apr_sockaddr_info_get(&replay.address, host, APR_UNSPEC, port, 0, pool)) != APR_SUCCESS) {
+        fprintf(stderr, "Could not resolve '%s'.\n", host);
+        return 1;
+    }
+    replay.host        = port == 80 ? host : apr_psprintf(pool, "%s:%u", host, port);
+    replay.requests    = (replay_request_t *)requests->elts;
+    replay.nr_requests = requests->nelts;
+    replay.next        = 0;
+    replay.start       = apr_time_now();
+
+    threads = apr_palloc(pool, nr_threads * sizeof (apr_thread_t *));
+    for (i = 0; i < nr_threads; i++) {
+        if ((ret = apr_thread_create(&threads[i], NULL, replay_worker, &replay, pool)) != APR_SUCCESS) {
+            fprintf(stderr, "Could not start thread.\n");
+            return 1;
+        }
+    }
+    for (i = 0; i < nr_threads; i++) {
+        apr_thread_join(&thread_ret, threads[i]);
+    }
+
+    if (report_path != NULL && (report = fopen(report_path, "w")) == NULL) {
+        fprintf(stderr, "Could not open report '%s'.\n", report_path);
+        return 1;
+    }
+    nr_errors = replay_write_report(pool, report, replay.requests, replay.nr_requests);
+    if (report != stdout) {
+        fclose(report);
+    }
+
+    fprintf(stderr, "Replayed %i requests in %.1f seconds, %i with a different status.\n",
+        replay.nr_requests, (double)(apr_time_now() - replay.start) / APR_USEC_PER_SEC, nr_errors
+    );
+    return 0;
+}
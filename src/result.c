@@ -0,0 +1,300 @@
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <apr_strings.h>
+#include <apr_dbd.h>
+#include <httpd.h>
+#include <http_log.h>
+#include "result.h"
+
+result_t *mod_okioki_result_make(apr_pool_t *pool, const apr_dbd_driver_t *driver, apr_dbd_results_t *db_result)
+{
+    result_t *result;
+
+    if ((result = apr_pcalloc(pool, sizeof (result_t))) == NULL) {
+        return NULL;
+    }
+    if ((result->parts = apr_palloc(pool, sizeof (apr_dbd_results_t *))) == NULL) {
+        return NULL;
+    }
+    result->driver       = driver;
+    result->nr_parts     = 1;
+    result->parts[0]     = db_result;
+    result->merge_col_nr = -1;
+    result->advance_part = -1;
+    return result;
+}
+
+/** Clear a libpq result together with the pool it is used in.
+ */
+static apr_status_t mod_okioki_result_pg_clear(void *data)
+{
+    PQclear((PGresult *)data);
+    return APR_SUCCESS;
+}
+
+result_t *mod_okioki_result_make_pg(apr_pool_t *pool, PGresult *pg_result)
+{
+    result_t *result;
+
+    if ((result = apr_pcalloc(pool, sizeof (result_t))) == NULL) {
+        return NULL;
+    }
+    result->nr_parts     = 1;
+    result->merge_col_nr = -1;
+    result->advance_part = -1;
+    result->pg_result    = pg_result;
+    result->pg_row_nr    = -1;
+
+    apr_pool_cleanup_register(pool, pg_result, mod_okioki_result_pg_clear, apr_pool_cleanup_null);
+    return result;
+}
+
+/** Fetch the next row of a part into its row structure.
+ *
+ * @returns  0 on success, -1 when the part has no more rows.
+ */
+static int mod_okioki_result_fetch(result_t *result, apr_pool_t *pool, int part_nr)
+{
+    if (result->nr_fetched[part_nr] >= result->nr_tuples[part_nr]) {
+        return -1;
+    }
+
+    // Row numbers are 1-based.
+    if (apr_dbd_get_row(result->driver, pool, result->parts[part_nr], &result->rows[part_nr], result->nr_fetched[part_nr] + 1) != 0) {
+        return -1;
+    }
+    result->nr_fetched[part_nr]++;
+    return 0;
+}
+
+int mod_okioki_result_gather(apr_pool_t *pool, const apr_dbd_driver_t *driver, int nr_parts, apr_dbd_results_t **parts, const char *merge_column, int merge_desc, result_t **_result, char **error)
+{
+    result_t   *result;
+    const char *name;
+    int        i;
+
+    ASSERT_NOT_NULL(
+        result = apr_pcalloc(pool, sizeof (result_t)),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate result."
+    )
+    result->driver       = driver;
+    result->nr_parts     = nr_parts;
+    result->parts        = parts;
+    result->current_part = 0;
+    result->merge_col_nr = -1;
+    result->merge_desc   = merge_desc;
+    result->advance_part = -1;
+
+    ASSERT_NOT_NULL(
+        result->rows = apr_pcalloc(pool, nr_parts * sizeof (apr_dbd_row_t *)),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate rows."
+    )
+    ASSERT_NOT_NULL(
+        result->nr_fetched = apr_pcalloc(pool, nr_parts * sizeof (int)),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate rows."
+    )
+    ASSERT_NOT_NULL(
+        result->nr_tuples = apr_pcalloc(pool, nr_parts * sizeof (int)),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate rows."
+    )
+    ASSERT_NOT_NULL(
+        result->has_row = apr_pcalloc(pool, nr_parts * sizeof (int)),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate rows."
+    )
+    for (i = 0; i < nr_parts; i++) {
+        result->nr_tuples[i] = apr_dbd_num_tuples(driver, parts[i]);
+    }
+
+    if (merge_column != NULL) {
+        for (i = 0; i < apr_dbd_num_cols(driver, parts[0]); i++) {
+            if ((name = apr_dbd_get_name(driver, parts[0], i)) != NULL && strcmp(name, merge_column) == 0) {
+                result->merge_col_nr = i;
+            }
+        }
+        ASSERT_POSITIVE(
+            result->merge_col_nr,
+            HTTP_INTERNAL_SERVER_ERROR, "Could not find merge column '%s' in result.", merge_column
+        )
+
+        // Look ahead one row in each part.
+        for (i = 0; i < nr_parts; i++) {
+            result->has_row[i] = mod_okioki_result_fetch(result, pool, i) == 0;
+        }
+    }
+
+    *_result = result;
+    return HTTP_OK;
+}
+
+int mod_okioki_result_num_cols(result_t *result)
+{
+    if (result->pg_result != NULL) {
+        return PQnfields(result->pg_result);
+    }
+    return apr_dbd_num_cols(result->driver, result->parts[0]);
+}
+
+int mod_okioki_result_num_tuples(result_t *result)
+{
+    int nr_tuples = 0;
+    int i;
+
+    if (result->pg_result != NULL) {
+        return PQntuples(result->pg_result);
+    }
+
+    for (i = 0; i < result->nr_parts; i++) {
+        nr_tuples+= apr_dbd_num_tuples(result->driver, result->parts[i]);
+    }
+    return nr_tuples;
+}
+
+const char *mod_okioki_result_get_name(result_t *result, int col_nr)
+{
+    if (result->pg_result != NULL) {
+        return PQfname(result->pg_result, col_nr);
+    }
+    return apr_dbd_get_name(result->driver, result->parts[0], col_nr);
+}
+
+/** Compare two values of the merge column, numerically when both are numbers.
+ */
+static int mod_okioki_result_compare(const char *a, const char *b)
+{
+    char   *a_end;
+    char   *b_end;
+    double a_number;
+    double b_number;
+
+    a_number = strtod(a, &a_end);
+    b_number = strtod(b, &b_end);
+    if (a[0] != 0 && b[0] != 0 && a_end[0] == 0 && b_end[0] == 0) {
+        return a_number < b_number ? -1 : (a_number > b_number ? 1 : 0);
+    }
+    return strcmp(a, b);
+}
+
+int mod_okioki_result_get_row(result_t *result, apr_pool_t *pool, apr_dbd_row_t **row)
+{
+    const char *value;
+    const char *best_value = NULL;
+    int        best_part = -1;
+    int        cmp;
+    int        i;
+
+    if (result->pg_result != NULL) {
+        if (result->pg_row_nr + 1 >= PQntuples(result->pg_result)) {
+            return -1;
+        }
+        result->pg_row_nr++;
+        *row = (apr_dbd_row_t *)&result->pg_row_nr;
+        return 0;
+    }
+
+    // A single result is read sequentially, as before.
+    if (result->nr_parts == 1 && result->merge_col_nr < 0) {
+        return apr_dbd_get_row(result->driver, pool, result->parts[0], row, -1);
+    }
+
+    if (result->merge_col_nr < 0) {
+        // Concatenate, continue with the next part when a part has no more rows.
+        for (; result->current_part < result->nr_parts; result->current_part++) {
+            if (mod_okioki_result_fetch(result, pool, result->current_part) == 0) {
+                *row = result->rows[result->current_part];
+                return 0;
+            }
+        }
+        return -1;
+    }
+
+    // The caller is done with the previous row, so its part can look ahead again.
+    if (result->advance_part >= 0) {
+        result->has_row[result->advance_part] = mod_okioki_result_fetch(result, pool, result->advance_part) == 0;
+        result->advance_part = -1;
+    }
+
+    // K-way merge, take the smallest (or largest) of the rows that are looked ahead.
+    for (i = 0; i < result->nr_parts; i++) {
+        if (!result->has_row[i]) {
+            continue;
+        }
+
+        if ((value = apr_dbd_get_entry(result->driver, result->rows[i], result->merge_col_nr)) == NULL) {
+            value = "";
+        }
+        if (best_part >= 0) {
+            cmp = mod_okioki_result_compare(value, best_value);
+            if (result->merge_desc ? cmp <= 0 : cmp >= 0) {
+                continue;
+            }
+        }
+        best_part  = i;
+        best_value = value;
+    }
+
+    if (best_part < 0) {
+        return -1;
+    }
+
+    *row = result->rows[best_part];
+    result->advance_part = best_part;
+    return 0;
+}
+
+const char *mod_okioki_result_get_entry(result_t *result, apr_dbd_row_t *row, int col_nr)
+{
+    // Like apr_dbd, a NULL is returned as an empty string.
+    if (result->pg_result != NULL) {
+        return PQgetvalue(result->pg_result, *(int *)row, col_nr);
+    }
+    return apr_dbd_get_entry(result->driver, row, col_nr);
+}
+
+const char *mod_okioki_result_get_first(result_t *result, apr_pool_t *pool, const char *column)
+{
+    apr_dbd_row_t *row = NULL;
+    const char    *name;
+    int           col_nr;
+    int           nr_cols = mod_okioki_result_num_cols(result);
+    int           i;
+
+    for (col_nr = 0; col_nr < nr_cols; col_nr++) {
+        if ((name = mod_okioki_result_get_name(result, col_nr)) != NULL && strcmp(name, column) == 0) {
+            break;
+        }
+    }
+    if (col_nr >= nr_cols) {
+        return NULL;
+    }
+
+    if (result->pg_result != NULL) {
+        return PQntuples(result->pg_result) > 0 ? PQgetvalue(result->pg_result, 0, col_nr) : NULL;
+    }
+
+    // A row structure of its own is fetched by number, the row structures of the parts are left alone.
+    for (i = 0; i < result->nr_parts; i++) {
+        if (apr_dbd_num_tuples(result->driver, result->parts[i]) > 0) {
+            if (apr_dbd_get_row(result->driver, pool, result->parts[i], &row, 1) != 0) {
+                return NULL;
+            }
+            return apr_dbd_get_entry(result->driver, row, col_nr);
+        }
+    }
+    return NULL;
+}
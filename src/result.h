@@ -0,0 +1,97 @@
+#ifndef RESULT_H
+#define RESULT_H
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <httpd.h>
+#include <http_log.h>
+#include <apr_dbd.h>
+#include <libpq-fe.h>
+#include "mod_okioki.h"
+
+/** The result of a view, which may be gathered from several shards.
+ * The rows of the parts are concatenated, or merged on a sort column when the parts are sorted.
+ */
+typedef struct {
+    const apr_dbd_driver_t *driver;
+    int                    nr_parts;
+    apr_dbd_results_t      **parts;
+
+    // A row structure for each part and the number of rows fetched from it, rows are fetched by number
+    // as a row structure can not move to another part.
+    apr_dbd_row_t          **rows;
+    int                    *nr_fetched;
+    int                    *nr_tuples;
+
+    // Concatenate: the part rows are fetched from.
+    int                    current_part;
+
+    // Merge: the column the parts are sorted on, -1 to concatenate the parts. The row fetched from each part
+    // is the look ahead for the merge, the part of the row that was returned last is advanced on the next call.
+    int                    merge_col_nr;
+    int                    merge_desc;
+    int                    *has_row;
+    int                    advance_part;
+
+    // A result received directly through libpq instead of apr_dbd, NULL otherwise. The row returned
+    // by mod_okioki_result_get_row() points to the number of the current row.
+    PGresult               *pg_result;
+    int                    pg_row_nr;
+
+    // The columns of the view as described at startup, NULL when the view was not described.
+    const view_columns_t   *columns;
+} result_t;
+
+/** Wrap a single database result.
+ */
+result_t *mod_okioki_result_make(apr_pool_t *pool, const apr_dbd_driver_t *driver, apr_dbd_results_t *db_result);
+
+/** Wrap a result received directly through libpq.
+ * The result is cleared when the pool is cleaned up.
+ */
+result_t *mod_okioki_result_make_pg(apr_pool_t *pool, PGresult *pg_result);
+
+/** Gather the results of several shards.
+ *
+ * @param merge_column  The column each part is sorted on, or NULL to concatenate the parts.
+ * @param merge_desc    Set when the parts are sorted in descending order.
+ */
+int mod_okioki_result_gather(apr_pool_t *pool, const apr_dbd_driver_t *driver, int nr_parts, apr_dbd_results_t **parts, const char *merge_column, int merge_desc, result_t **result, char **error);
+
+int mod_okioki_result_num_cols(result_t *result);
+int mod_okioki_result_num_tuples(result_t *result);
+const char *mod_okioki_result_get_name(result_t *result, int col_nr);
+
+/** Get the next row, like apr_dbd_get_row() in sequential mode.
+ * The values of the row are retrieved with mod_okioki_result_get_entry().
+ *
+ * @returns  0 on success, -1 when there are no more rows.
+ */
+int mod_okioki_result_get_row(result_t *result, apr_pool_t *pool, apr_dbd_row_t **row);
+
+/** Get a value of a row returned by mod_okioki_result_get_row().
+ */
+const char *mod_okioki_result_get_entry(result_t *result, apr_dbd_row_t *row, int col_nr);
+
+/** Get a value of the first row, without moving the rows returned by mod_okioki_result_get_row().
+ *
+ * @param column  The name of the column.
+ * @returns       The value, or NULL when there are no rows or the result has no such column.
+ */
+const char *mod_okioki_result_get_first(result_t *result, apr_pool_t *pool, const char *column);
+
+#endif
@@ -0,0 +1,227 @@
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <apr_strings.h>
+#include <apr_dbd.h>
+#include <httpd.h>
+#include <http_log.h>
+#include <http_protocol.h>
+#include <http_request.h>
+#include <util_filter.h>
+#include "sse.h"
+#include "json.h"
+#include "admission.h"
+#include "notify.h"
+#include "pool.h"
+#include "views.h"
+
+/** Write a comment or event to the client and flush it.
+ */
+static int mod_okioki_sse_send(request_rec *http_request, apr_bucket_brigade *bb, char **error)
+{
+    apr_pool_t  *pool = http_request->pool;
+    apr_bucket  *b;
+
+    ASSERT_NOT_NULL(
+        b = apr_bucket_flush_create(bb->bucket_alloc),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
+    )
+    APR_BRIGADE_INSERT_TAIL(bb, b);
+
+    ASSERT_APR_SUCCESS(
+        ap_pass_brigade(http_request->output_filters, bb),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not send event."
+    )
+    apr_brigade_cleanup(bb);
+
+    return http_request->connection->aborted ? HTTP_INTERNAL_SERVER_ERROR : HTTP_OK;
+}
+
+/** Execute the view and append its result to the brigade as a single event.
+ * Each line of the JSON document becomes a data line of the event.
+ *
+ * @param pool  Pool for this event, the database connection is released when it is cleaned up.
+ */
+static int mod_okioki_sse_execute(request_rec *http_request, apr_pool_t *pool, apr_bucket_brigade *bb, view_t *view, apr_hash_t *arguments, apr_uint32_t event_id, char **error)
+{
+    apr_bucket_alloc_t *alloc = bb->bucket_alloc;
+    mod_okioki_conn_t  *db_conn;
+    apr_dbd_results_t  *db_result;
+    result_t           *result;
+    apr_bucket_brigade *json_bb;
+    char               *data;
+    apr_size_t         data_len;
+    char               *line;
+    char               *end;
+    int                ret;
+
+    // A connection is only held while the view is executed, not while waiting for a notification.
+    ASSERT_HTTP_OK(
+        ret = mod_okioki_conn_acquire_pool(http_request, pool, 1, &db_conn, error),
+        ret, "Can not get database connection."
+    )
+
+    if ((ret = mod_okioki_view_select(pool, db_conn, view, arguments, &db_result, error)) != HTTP_OK) {
+        return ret;
+    }
+
+    ASSERT_NOT_NULL(
+        result = mod_okioki_result_make(pool, db_conn->driver, db_result),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate result."
+    )
+    result->columns = view->columns;
+
+    ASSERT_NOT_NULL(
+        json_bb = apr_brigade_create(pool, alloc),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate a bucket brigade."
+    )
+
+    if ((ret = mod_okioki_json_append_result(json_bb, pool, alloc, result, view->result_strings, view->nest, NULL, error)) != HTTP_OK) {
+        return ret;
+    }
+
+    ASSERT_APR_SUCCESS(
+        apr_brigade_pflatten(json_bb, &data, &data_len, pool),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not flatten event."
+    )
+
+    ASSERT_APR_SUCCESS(
+        apr_brigade_printf(bb, NULL, NULL, "id: %u\nevent: update\n", event_id),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not write event."
+    )
+
+    // The JSON document always ends in a linefeed, and strings never contain one.
+    for (line = data; line < &data[data_len]; line = end + 1) {
+        if ((end = memchr(line, '\n', &data[data_len] - line)) == NULL) {
+            end = &data[data_len];
+        }
+
+        ASSERT_APR_SUCCESS(
+            apr_brigade_puts(bb, NULL, NULL, "data: "),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not write event."
+        )
+        ASSERT_APR_SUCCESS(
+            apr_brigade_write(bb, NULL, NULL, line, end - line),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not write event."
+        )
+        ASSERT_APR_SUCCESS(
+            apr_brigade_puts(bb, NULL, NULL, "\n"),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not write event."
+        )
+    }
+
+    ASSERT_APR_SUCCESS(
+        apr_brigade_puts(bb, NULL, NULL, "\n"),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not write event."
+    )
+    return HTTP_OK;
+}
+
+/** Execute the view for an event, within the limiters of the directory and the view.
+ * The stream itself does not hold a place in the limiters while it waits for a notification.
+ */
+static int mod_okioki_sse_event(request_rec *http_request, mod_okioki_dir_config *cfg, apr_pool_t *pool, apr_bucket_brigade *bb, view_t *view, apr_hash_t *arguments, apr_uint32_t event_id, char **error)
+{
+    int ret;
+
+    if ((ret = mod_okioki_admission_enter(http_request, cfg->limiter, error)) != HTTP_OK) {
+        return ret;
+    }
+    if ((ret = mod_okioki_admission_enter(http_request, view->limiter, error)) != HTTP_OK) {
+        mod_okioki_admission_leave(cfg->limiter);
+        return ret;
+    }
+
+    // The error outlives the pool of the event.
+    if ((ret = mod_okioki_sse_execute(http_request, pool, bb, view, arguments, event_id, error)) != HTTP_OK) {
+        *error = apr_pstrdup(http_request->pool, *error);
+    }
+
+    // The connection is released before the places in the limiters.
+    apr_pool_clear(pool);
+    mod_okioki_admission_leave(view->limiter);
+    mod_okioki_admission_leave(cfg->limiter);
+    return ret;
+}
+
+int mod_okioki_sse_handler(request_rec *http_request, mod_okioki_dir_config *cfg, view_t *view, apr_hash_t *arguments, char **error)
+{
+    apr_pool_t         *pool = http_request->pool;
+    apr_bucket_alloc_t *alloc = http_request->connection->bucket_alloc;
+    apr_pool_t         *event_pool;
+    apr_bucket_brigade *bb;
+    apr_bucket         *b;
+    apr_uint32_t       generation;
+    apr_uint32_t       event_id = 0;
+    int                ret;
+
+    ASSERT_NOT_NULL(
+        bb = apr_brigade_create(pool, alloc),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate a bucket brigade."
+    )
+
+    ASSERT_APR_SUCCESS(
+        apr_pool_create(&event_pool, pool),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate event pool."
+    )
+
+    // Notifications from now on cause a new event, so none can be missed during the first execution.
+    generation = mod_okioki_notify_generation(view->event_channels);
+
+    // When the first execution fails the request fails with a normal error.
+    if ((ret = mod_okioki_sse_event(http_request, cfg, event_pool, bb, view, arguments, event_id++, error)) != HTTP_OK) {
+        apr_pool_destroy(event_pool);
+        return ret;
+    }
+
+    ap_set_content_type(http_request, "text/event-stream");
+    apr_table_setn(http_request->headers_out, "Cache-Control", "no-cache");
+    http_request->status = HTTP_OK;
+
+    while (mod_okioki_sse_send(http_request, bb, error) == HTTP_OK) {
+        if (!mod_okioki_notify_wait(view->event_channels, &generation, apr_time_from_sec(SSE_KEEPALIVE_INTERVAL))) {
+            // A comment is ignored by the client, it finds out if the client is still there.
+            ASSERT_APR_SUCCESS(
+                apr_brigade_puts(bb, NULL, NULL, ": keepalive\n\n"),
+                HTTP_INTERNAL_SERVER_ERROR, "Could not write comment."
+            )
+            continue;
+        }
+
+        // Later failures are reported as an event, the stream continues with the next notification.
+        if ((ret = mod_okioki_sse_event(http_request, cfg, event_pool, bb, view, arguments, event_id++, error)) != HTTP_OK) {
+            apr_brigade_cleanup(bb);
+            ASSERT_APR_SUCCESS(
+                apr_brigade_printf(bb, NULL, NULL, "event: error\ndata: %i\n\n", ret),
+                HTTP_INTERNAL_SERVER_ERROR, "Could not write event."
+            )
+        }
+    }
+
+    apr_pool_destroy(event_pool);
+
+    // The loop only ends when sending failed, normally because the client went away.
+    if (!http_request->connection->aborted) {
+        ASSERT_NOT_NULL(
+            b = apr_bucket_eos_create(alloc),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
+        )
+        APR_BRIGADE_INSERT_TAIL(bb, b);
+        ap_pass_brigade(http_request->output_filters, bb);
+    }
+    return OK;
+}
@@ -0,0 +1,38 @@
+#ifndef SSE_H
+#define SSE_H
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <httpd.h>
+#include <http_log.h>
+#include <apr_hash.h>
+#include "mod_okioki.h"
+
+#define SSE_KEEPALIVE_INTERVAL 15       // seconds between comments, to find out if the client went away
+
+/** Stream the result of the view as Server-Sent Events.
+ * The view is executed once when the stream starts, and again after each notification on one of
+ * view->event_channels. Each result is sent as one event, formatted by the JSON generator.
+ * Every execution waits for a place in the limiters of the directory and the view, and uses a
+ * connection selected like for other views, which is released right after.
+ * This only returns when the client closes the connection.
+ *
+ * @returns  HTTP status, an error status is only returned when the first execution failed.
+ */
+int mod_okioki_sse_handler(request_rec *http_request, mod_okioki_dir_config *cfg, view_t *view, apr_hash_t *arguments, char **error);
+
+#endif
@@ -0,0 +1,637 @@
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <apr_strings.h>
+#include <apr_dbd.h>
+#include <httpd.h>
+#include <http_log.h>
+#include <http_protocol.h>
+#include <http_request.h>
+#include <libpq-fe.h>
+#include <libpq/libpq-fs.h>
+#include "upload.h"
+#include "pool.h"
+#include "util.h"
+
+typedef enum {
+    MP_PREAMBLE,
+    MP_DELIMITER,
+    MP_HEADERS,
+    MP_BODY,
+    MP_END
+} multipart_state_t;
+
+/** An upload that is being stored.
+ */
+typedef struct {
+    request_rec       *http_request;
+    upload_spec_t     *spec;
+    mod_okioki_conn_t *db_conn;
+    PGconn            *pg_conn;
+    int               in_transaction;
+
+    // Large object.
+    Oid               oid;
+    int               fd;
+
+    // COPY, the length of the body must be known before it is received.
+    apr_off_t         length;
+    apr_off_t         written;
+
+    // Set when the body is stored, to the id bound to the upload parameter.
+    char              *id;
+} upload_t;
+
+/** State of the parser of a multipart body.
+ * Data is kept in a window, until it is known not to be part of a delimiter.
+ */
+typedef struct {
+    multipart_state_t state;
+    char              *delimiter;
+    apr_size_t        delimiter_len;
+    char              *window;
+    apr_size_t        window_len;
+    apr_size_t        window_size;
+
+    // The current part is stored as the upload, or is the value of a field.
+    int               is_upload;
+    char              *field;
+    char              *value;
+    apr_size_t        value_len;
+} multipart_t;
+
+/** Roll back the transaction of an upload that was not completed, before the connection is released.
+ */
+static apr_status_t mod_okioki_upload_rollback(void *_upload)
+{
+    upload_t *upload = (upload_t *)_upload;
+    int      nr_rows;
+
+    if (upload->in_transaction) {
+        apr_dbd_query(upload->db_conn->driver, upload->db_conn->handle, &nr_rows, "ROLLBACK");
+        upload->in_transaction = 0;
+    }
+    return APR_SUCCESS;
+}
+
+/** Find the first occurrence of needle in the data.
+ */
+static char *mod_okioki_upload_find(char *data, apr_size_t data_len, const char *needle, apr_size_t needle_len)
+{
+    char *end = data + data_len;
+    char *p;
+
+    for (p = data; (p = memchr(p, needle[0], end - p)) != NULL && (apr_size_t)(end - p) >= needle_len; p++) {
+        if (memcmp(p, needle, needle_len) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static void mod_okioki_upload_put32(unsigned char *p, apr_uint32_t x)
+{
+    p[0] = (x >> 24) & 0xff;
+    p[1] = (x >> 16) & 0xff;
+    p[2] = (x >> 8) & 0xff;
+    p[3] = x & 0xff;
+}
+
+/** Start storing a body.
+ */
+static int mod_okioki_upload_open(upload_t *upload, char **error)
+{
+    apr_pool_t    *pool = upload->http_request->pool;
+    PGresult      *pg_result;
+    unsigned char header[25];
+    char          *command;
+    int           ret;
+
+    ASSERT_ZERO(
+        upload->id != NULL,
+        HTTP_BAD_REQUEST, "Only one upload is allowed for each request."
+    )
+
+    if (upload->spec->mode == U_LARGE_OBJECT) {
+        ASSERT_ZERO(
+            (upload->oid = lo_create(upload->pg_conn, InvalidOid)) == InvalidOid,
+            HTTP_BAD_GATEWAY, "Could not create large object: %s", PQerrorMessage(upload->pg_conn)
+        )
+        ASSERT_POSITIVE(
+            upload->fd = lo_open(upload->pg_conn, upload->oid, INV_WRITE),
+            HTTP_BAD_GATEWAY, "Could not open large object: %s", PQerrorMessage(upload->pg_conn)
+        )
+        return HTTP_OK;
+    }
+
+    // The binary COPY format gives the length of a value before the value.
+    ASSERT_POSITIVE(
+        upload->length,
+        HTTP_LENGTH_REQUIRED, "An upload into a column requires an application/octet-stream body with a Content-Length."
+    )
+
+    ASSERT_NOT_NULL(
+        command = apr_psprintf(pool, "COPY %s (%s) FROM STDIN (FORMAT binary)", upload->spec->table, upload->spec->column),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate COPY command."
+    )
+    pg_result = PQexec(upload->pg_conn, command);
+    ret = pg_result != NULL && PQresultStatus(pg_result) == PGRES_COPY_IN ? HTTP_OK : HTTP_BAD_GATEWAY;
+    PQclear(pg_result);
+    ASSERT_HTTP_OK(
+        ret,
+        HTTP_BAD_GATEWAY, "Could not start COPY: %s", PQerrorMessage(upload->pg_conn)
+    )
+
+    // Signature, flags and header extension, followed by a tuple of one field and the length of the field.
+    memcpy(header, "PGCOPY\n\377\r\n\0", 11);
+    memset(&header[11], 0, 8);
+    header[19] = 0;
+    header[20] = 1;
+    mod_okioki_upload_put32(&header[21], upload->length);
+
+    ASSERT_ZERO(
+        PQputCopyData(upload->pg_conn, (const char *)header, sizeof (header)) != 1,
+        HTTP_BAD_GATEWAY, "Could not send COPY header: %s", PQerrorMessage(upload->pg_conn)
+    )
+    return HTTP_OK;
+}
+
+/** Store a piece of the body.
+ */
+static int mod_okioki_upload_write(upload_t *upload, const char *data, apr_size_t data_len, char **error)
+{
+    apr_pool_t *pool = upload->http_request->pool;
+    int        n;
+
+    if (upload->spec->mode == U_LARGE_OBJECT) {
+        while (data_len > 0) {
+            ASSERT_POSITIVE(
+                n = lo_write(upload->pg_conn, upload->fd, data, MIN(data_len, UPLOAD_READ_SIZE)),
+                HTTP_BAD_GATEWAY, "Could not write large object: %s", PQerrorMessage(upload->pg_conn)
+            )
+            data+= n;
+            data_len-= n;
+        }
+        return HTTP_OK;
+    }
+
+    upload->written+= data_len;
+    ASSERT_POSITIVE(
+        upload->length - upload->written,
+        HTTP_BAD_REQUEST, "Upload is longer than its Content-Length."
+    )
+    ASSERT_ZERO(
+        PQputCopyData(upload->pg_conn, data, data_len) != 1,
+        HTTP_BAD_GATEWAY, "Could not send COPY data: %s", PQerrorMessage(upload->pg_conn)
+    )
+    return HTTP_OK;
+}
+
+/** Finish storing the body and determine its id.
+ */
+static int mod_okioki_upload_close(upload_t *upload, char **error)
+{
+    apr_pool_t *pool = upload->http_request->pool;
+    PGresult   *pg_result;
+    const char *id_params[2];
+    int        ret;
+
+    if (upload->spec->mode == U_LARGE_OBJECT) {
+        ASSERT_ZERO(
+            lo_close(upload->pg_conn, upload->fd),
+            HTTP_BAD_GATEWAY, "Could not close large object: %s", PQerrorMessage(upload->pg_conn)
+        )
+        ASSERT_NOT_NULL(
+            upload->id = apr_psprintf(pool, "%u", upload->oid),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not allocate id."
+        )
+        return HTTP_OK;
+    }
+
+    if (upload->written != upload->length) {
+        PQputCopyEnd(upload->pg_conn, "Upload is shorter than its Content-Length.");
+        while ((pg_result = PQgetResult(upload->pg_conn)) != NULL) {
+            PQclear(pg_result);
+        }
+        *error = "Upload is shorter than its Content-Length.";
+        return HTTP_BAD_REQUEST;
+    }
+
+    // Trailer, a tuple with a field count of -1.
+    ASSERT_ZERO(
+        PQputCopyData(upload->pg_conn, "\377\377", 2) != 1 || PQputCopyEnd(upload->pg_conn, NULL) != 1,
+        HTTP_BAD_GATEWAY, "Could not end COPY: %s", PQerrorMessage(upload->pg_conn)
+    )
+
+    ret = HTTP_OK;
+    while ((pg_result = PQgetResult(upload->pg_conn)) != NULL) {
+        if (PQresultStatus(pg_result) != PGRES_COMMAND_OK) {
+            ret = HTTP_BAD_GATEWAY;
+        }
+        PQclear(pg_result);
+    }
+    ASSERT_HTTP_OK(
+        ret,
+        HTTP_BAD_GATEWAY, "Could not COPY upload: %s", PQerrorMessage(upload->pg_conn)
+    )
+
+    // The id of the new row comes from the sequence of its id column, not lastval(), which a trigger may have moved.
+    id_params[0] = upload->spec->table;
+    id_params[1] = upload->spec->id_column;
+    pg_result = PQexecParams(upload->pg_conn, "SELECT currval(pg_get_serial_sequence($1, $2))", 2, NULL, id_params, NULL, NULL, 0);
+    if (pg_result != NULL && PQresultStatus(pg_result) == PGRES_TUPLES_OK && PQntuples(pg_result) == 1 && !PQgetisnull(pg_result, 0, 0)) {
+        upload->id = apr_pstrdup(pool, PQgetvalue(pg_result, 0, 0));
+    }
+    PQclear(pg_result);
+    ASSERT_NOT_NULL(
+        upload->id,
+        HTTP_BAD_GATEWAY, "Could not get id of upload from the sequence of %s.%s: %s", upload->spec->table, upload->spec->id_column, PQerrorMessage(upload->pg_conn)
+    )
+    return HTTP_OK;
+}
+
+/** Start a part of a multipart body, the name of the part is taken from its Content-Disposition.
+ */
+static int mod_okioki_upload_part(upload_t *upload, multipart_t *multipart, char *headers, char **error)
+{
+    apr_pool_t *pool = upload->http_request->pool;
+    char       *name;
+    char       *end;
+
+    multipart->field     = NULL;
+    multipart->value_len = 0;
+    multipart->is_upload = 0;
+
+    // The name parameter of the Content-Disposition, not the filename; a part without a name is skipped.
+    name = strstr(headers, "name=\"");
+    while (name != NULL && name[-1] != ' ' && name[-1] != ';') {
+        name = strstr(&name[1], "name=\"");
+    }
+    if (name == NULL) {
+        return HTTP_OK;
+    }
+    name+= 6;
+    ASSERT_NOT_NULL(
+        end = strchr(name, '"'),
+        HTTP_BAD_REQUEST, "Malformed Content-Disposition of multipart body."
+    )
+    *end = 0;
+
+    if (strcmp(name, upload->spec->param) == 0) {
+        multipart->is_upload = 1;
+        return mod_okioki_upload_open(upload, error);
+    }
+
+    ASSERT_NOT_NULL(
+        multipart->field = apr_pstrdup(pool, name),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not copy name of field."
+    )
+    return HTTP_OK;
+}
+
+/** Handle data of the current part of a multipart body.
+ */
+static int mod_okioki_upload_part_data(upload_t *upload, multipart_t *multipart, const char *data, apr_size_t data_len, char **error)
+{
+    apr_pool_t *pool = upload->http_request->pool;
+
+    if (multipart->is_upload) {
+        return mod_okioki_upload_write(upload, data, data_len, error);
+    }
+
+    if (multipart->field != NULL) {
+        // Fields are small, they are kept in memory like urlencoded form data.
+        ASSERT_POSITIVE(
+            MIN_INPUT_BUFFER - 1 - (apr_off_t)(multipart->value_len + data_len),
+            HTTP_BAD_REQUEST, "Field '%s' of multipart body is too large.", multipart->field
+        )
+        memcpy(&multipart->value[multipart->value_len], data, data_len);
+        multipart->value_len+= data_len;
+    }
+    return HTTP_OK;
+}
+
+/** Finish the current part of a multipart body.
+ */
+static int mod_okioki_upload_part_end(upload_t *upload, multipart_t *multipart, apr_hash_t *arguments, char **error)
+{
+    apr_pool_t *pool = upload->http_request->pool;
+    char       *value;
+
+    if (multipart->is_upload) {
+        multipart->is_upload = 0;
+        return mod_okioki_upload_close(upload, error);
+    }
+
+    if (multipart->field != NULL) {
+        ASSERT_NOT_NULL(
+            value = apr_pstrmemdup(pool, multipart->value, multipart->value_len),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not copy field."
+        )
+        apr_hash_set(arguments, multipart->field, APR_HASH_KEY_STRING, value);
+        multipart->field = NULL;
+    }
+    return HTTP_OK;
+}
+
+/** Parse the data in the window of a multipart body as far as possible.
+ */
+static int mod_okioki_upload_multipart_parse(upload_t *upload, multipart_t *multipart, apr_hash_t *arguments, char **error)
+{
+    apr_pool_t *pool = upload->http_request->pool;
+    apr_size_t consumed = 0;
+    apr_size_t keep;
+    char       *window;
+    apr_size_t window_len;
+    char       *found;
+    int        ret = HTTP_OK;
+
+    for (;;) {
+        window     = &multipart->window[consumed];
+        window_len = multipart->window_len - consumed;
+
+        if (multipart->state == MP_PREAMBLE || multipart->state == MP_BODY) {
+            if ((found = mod_okioki_upload_find(window, window_len, multipart->delimiter, multipart->delimiter_len)) != NULL) {
+                if (multipart->state == MP_BODY) {
+                    if ((ret = mod_okioki_upload_part_data(upload, multipart, window, found - window, error)) != HTTP_OK) {
+                        return ret;
+                    }
+                    if ((ret = mod_okioki_upload_part_end(upload, multipart, arguments, error)) != HTTP_OK) {
+                        return ret;
+                    }
+                }
+                consumed+= (found - window) + multipart->delimiter_len;
+                multipart->state = MP_DELIMITER;
+                continue;
+            }
+
+            // The end of the window may be the start of a delimiter.
+            keep = MIN(window_len, multipart->delimiter_len - 1);
+            if (multipart->state == MP_BODY && (ret = mod_okioki_upload_part_data(upload, multipart, window, window_len - keep, error)) != HTTP_OK) {
+                return ret;
+            }
+            consumed+= window_len - keep;
+            break;
+
+        } else if (multipart->state == MP_DELIMITER) {
+            // A delimiter is followed by "--" for the last part, or by the line break that starts the headers.
+            if (window_len < 2) {
+                break;
+            }
+            if (memcmp(window, "--", 2) == 0) {
+                multipart->state = MP_END;
+            } else {
+                ASSERT_ZERO(
+                    memcmp(window, "\r\n", 2),
+                    HTTP_BAD_REQUEST, "Malformed delimiter in multipart body."
+                )
+                multipart->state = MP_HEADERS;
+            }
+
+        } else if (multipart->state == MP_HEADERS) {
+            // The headers start with the line break after the delimiter and end with an empty line.
+            if ((found = mod_okioki_upload_find(window, window_len, "\r\n\r\n", 4)) == NULL) {
+                ASSERT_POSITIVE(
+                    UPLOAD_MAX_HEADERS - (apr_off_t)window_len,
+                    HTTP_BAD_REQUEST, "Headers of multipart body are too large."
+                )
+                break;
+            }
+            *found = 0;
+            if ((ret = mod_okioki_upload_part(upload, multipart, window, error)) != HTTP_OK) {
+                return ret;
+            }
+            consumed+= (found - window) + 4;
+            multipart->state = MP_BODY;
+
+        } else {
+            // The epilogue is ignored.
+            consumed = multipart->window_len;
+            break;
+        }
+    }
+
+    memmove(multipart->window, &multipart->window[consumed], multipart->window_len - consumed);
+    multipart->window_len-= consumed;
+    return HTTP_OK;
+}
+
+/** Pass data of a multipart body through the window of the parser.
+ */
+static int mod_okioki_upload_multipart(upload_t *upload, multipart_t *multipart, apr_hash_t *arguments, const char *data, apr_size_t data_len, char **error)
+{
+    apr_size_t n;
+    int        ret;
+
+    while (data_len > 0) {
+        n = MIN(data_len, multipart->window_size - multipart->window_len);
+        memcpy(&multipart->window[multipart->window_len], data, n);
+        multipart->window_len+= n;
+        data+= n;
+        data_len-= n;
+
+        if ((ret = mod_okioki_upload_multipart_parse(upload, multipart, arguments, error)) != HTTP_OK) {
+            return ret;
+        }
+    }
+    return HTTP_OK;
+}
+
+/** Prepare the parser for a multipart body with the boundary from the Content-Type.
+ */
+static int mod_okioki_upload_multipart_init(apr_pool_t *pool, multipart_t *multipart, const char *content_type, char **error)
+{
+    const char *boundary;
+    apr_size_t boundary_len;
+
+    ASSERT_NOT_NULL(
+        boundary = strstr(content_type, "boundary="),
+        HTTP_BAD_REQUEST, "Multipart body without boundary."
+    )
+    boundary+= 9;
+    if (*boundary == '"') {
+        boundary++;
+        boundary_len = strcspn(boundary, "\"");
+    } else {
+        boundary_len = strcspn(boundary, "; \t");
+    }
+    ASSERT_POSITIVE(
+        (int)boundary_len - 1,
+        HTTP_BAD_REQUEST, "Multipart body with an empty boundary."
+    )
+
+    // The body starts with the delimiter without its line break, which is given to the parser as the first data.
+    multipart->state         = MP_PREAMBLE;
+    multipart->delimiter     = apr_pstrcat(pool, "\r\n--", apr_pstrndup(pool, boundary, boundary_len), NULL);
+    multipart->delimiter_len = boundary_len + 4;
+    multipart->window_size   = UPLOAD_READ_SIZE + UPLOAD_MAX_HEADERS + multipart->delimiter_len;
+    multipart->window_len    = 2;
+    multipart->is_upload     = 0;
+    multipart->field         = NULL;
+    multipart->value_len     = 0;
+
+    ASSERT_NOT_NULL(
+        multipart->window = apr_palloc(pool, multipart->window_size),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate window for multipart body."
+    )
+    ASSERT_NOT_NULL(
+        multipart->value = apr_palloc(pool, MIN_INPUT_BUFFER),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate value for multipart body."
+    )
+    memcpy(multipart->window, "\r\n", 2);
+    return HTTP_OK;
+}
+
+int mod_okioki_upload_handler(request_rec *http_request, view_t *view, apr_hash_t *arguments, const char *content_type, char **error)
+{
+    apr_pool_t         *pool = http_request->pool;
+    apr_bucket_alloc_t *bucket_alloc = http_request->connection->bucket_alloc;
+    upload_t           *upload;
+    multipart_t        multipart;
+    int                is_multipart = strncmp(content_type, "multipart/form-data", 19) == 0;
+    const char         *length;
+    apr_bucket_brigade *bb;
+    apr_bucket         *bucket;
+    int                seen_eos = 0;
+    const char         *data;
+    apr_size_t         data_len;
+    int                nr_rows;
+    int                ret;
+
+    ASSERT_NOT_NULL(
+        upload = apr_pcalloc(pool, sizeof (upload_t)),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate upload."
+    )
+    upload->http_request = http_request;
+    upload->spec         = view->upload;
+    upload->length       = -1;
+
+    if (!is_multipart && (length = apr_table_get(http_request->headers_in, "Content-Length")) != NULL) {
+        upload->length = apr_atoi64(length);
+    }
+    if (is_multipart && (ret = mod_okioki_upload_multipart_init(pool, &multipart, content_type, error)) != HTTP_OK) {
+        return ret;
+    }
+
+    // The upload and the view are executed in a single transaction on the primary database.
+    ASSERT_HTTP_OK(
+        ret = mod_okioki_conn_acquire(http_request, 0, &upload->db_conn, error),
+        ret, "Can not get database connection."
+    )
+    ASSERT_ZERO(
+        strcmp(apr_dbd_name(upload->db_conn->driver), "pgsql"),
+        HTTP_INTERNAL_SERVER_ERROR, "Uploads require PostgreSQL."
+    )
+    ASSERT_NOT_NULL(
+        upload->pg_conn = apr_dbd_native_handle(upload->db_conn->driver, upload->db_conn->handle),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not get libpq connection."
+    )
+
+    ASSERT_ZERO(
+        apr_dbd_query(upload->db_conn->driver, upload->db_conn->handle, &nr_rows, "BEGIN"),
+        HTTP_BAD_GATEWAY, "Could not start transaction: %s", apr_dbd_error(upload->db_conn->driver, upload->db_conn->handle, 0)
+    )
+    upload->in_transaction = 1;
+    apr_pool_cleanup_register(pool, upload, mod_okioki_upload_rollback, apr_pool_cleanup_null);
+    apr_pool_userdata_setn(upload, UPLOAD_KEY, NULL, pool);
+    mod_okioki_conn_pin(http_request, upload->db_conn);
+
+    if (!is_multipart && (ret = mod_okioki_upload_open(upload, error)) != HTTP_OK) {
+        return ret;
+    }
+
+    ASSERT_NOT_NULL(
+        bb = apr_brigade_create(pool, bucket_alloc),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not create brigade for input."
+    )
+
+    // Each piece of the body is stored before the next is read, so the memory used does not depend on its size.
+    do {
+        ASSERT_APR_SUCCESS(
+            ap_get_brigade(http_request->input_filters, bb, AP_MODE_READBYTES, APR_BLOCK_READ, UPLOAD_READ_SIZE),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not get input brigade from request."
+        )
+
+        for (bucket = APR_BRIGADE_FIRST(bb); bucket != APR_BRIGADE_SENTINEL(bb); bucket = APR_BUCKET_NEXT(bucket)) {
+            if (APR_BUCKET_IS_EOS(bucket)) {
+                seen_eos = 1;
+                break;
+            }
+            if (APR_BUCKET_IS_METADATA(bucket)) {
+                continue;
+            }
+
+            ASSERT_APR_SUCCESS(
+                apr_bucket_read(bucket, &data, &data_len, APR_BLOCK_READ),
+                HTTP_INTERNAL_SERVER_ERROR, "Could not read input bucket."
+            )
+
+            if (is_multipart) {
+                ret = mod_okioki_upload_multipart(upload, &multipart, arguments, data, data_len, error);
+            } else {
+                ret = mod_okioki_upload_write(upload, data, data_len, error);
+            }
+            if (ret != HTTP_OK) {
+                return ret;
+            }
+        }
+
+        apr_brigade_cleanup(bb);
+    } while (!seen_eos);
+
+    if (is_multipart) {
+        ASSERT_ZERO(
+            multipart.state != MP_END,
+            HTTP_BAD_REQUEST, "Multipart body is truncated."
+        )
+    } else if ((ret = mod_okioki_upload_close(upload, error)) != HTTP_OK) {
+        return ret;
+    }
+
+    ASSERT_NOT_NULL(
+        upload->id,
+        HTTP_BAD_REQUEST, "Multipart body has no part named '%s'.", upload->spec->param
+    )
+    apr_hash_set(arguments, upload->spec->param, upload->spec->param_len, upload->id);
+    return HTTP_OK;
+}
+
+int mod_okioki_upload_end(request_rec *http_request, int ret, char **error)
+{
+    apr_pool_t *pool = http_request->pool;
+    upload_t   *upload = NULL;
+    int        nr_rows;
+
+    if (apr_pool_userdata_get((void **)&upload, UPLOAD_KEY, pool) != APR_SUCCESS || upload == NULL || !upload->in_transaction) {
+        return ret;
+    }
+
+    apr_pool_cleanup_kill(pool, upload, mod_okioki_upload_rollback);
+    upload->in_transaction = 0;
+
+    if (ret != HTTP_OK) {
+        apr_dbd_query(upload->db_conn->driver, upload->db_conn->handle, &nr_rows, "ROLLBACK");
+        return ret;
+    }
+
+    ASSERT_ZERO(
+        apr_dbd_query(upload->db_conn->driver, upload->db_conn->handle, &nr_rows, "COMMIT"),
+        HTTP_BAD_GATEWAY, "Could not commit upload: %s", apr_dbd_error(upload->db_conn->driver, upload->db_conn->handle, 0)
+    )
+    return HTTP_OK;
+}
@@ -0,0 +1,48 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <httpd.h>
+#include <http_log.h>
+#include <apr_hash.h>
+#include "mod_okioki.h"
+
+#define UPLOAD_READ_SIZE     65536      // 64 kbyte read from the client at a time
+#define UPLOAD_MAX_HEADERS   8192       // largest headers of a part of a multipart body
+#define UPLOAD_KEY           "mod_okioki_upload"
+
+/** Store the body of the request while it is received, and bind its id to the upload parameter.
+ * An application/octet-stream body is stored as a whole; of a multipart/form-data body the part named
+ * after the upload parameter is stored, the other parts become arguments like the fields of a form.
+ * The body is stored inside a transaction on a connection that is pinned to the request, so that the
+ * view is executed in the same transaction; mod_okioki_upload_end() completes it.
+ *
+ * @param content_type  The Content-Type header of the request.
+ * @returns             HTTP_OK, or an HTTP error.
+ */
+int mod_okioki_upload_handler(request_rec *http_request, view_t *view, apr_hash_t *arguments, const char *content_type, char **error);
+
+/** Commit the transaction of the upload when the view was executed, or roll it back.
+ *
+ * @param ret  The HTTP status of executing the view.
+ * @returns    ret, or HTTP_BAD_GATEWAY when the commit failed.
+ */
+int mod_okioki_upload_end(request_rec *http_request, int ret, char **error);
+
+#endif
@@ -67,6 +67,7 @@ int mod_okioki_parse_query_phrase(request_rec *http_req, apr_hash_t *arguments,
     char *last;
     char *name;
     char *value;
+    apr_array_header_t *values;
 
     // Get the name by looking for a '=' character
     ASSERT_NOT_NULL(
@@ -92,6 +93,16 @@ int mod_okioki_parse_query_phrase(request_rec *http_req, apr_hash_t *arguments,
     // name and value is already newly allocated by duplication of value.
     apr_hash_set(arguments, name, APR_HASH_KEY_STRING, value);
 
+    // All values of a repeated name are kept as a list, under the name including its terminating nul.
+    if ((values = apr_hash_get(arguments, name, strlen(name) + 1)) == NULL) {
+        ASSERT_NOT_NULL(
+            values = apr_array_make(pool, 1, sizeof (char *)),
+            HTTP_INTERNAL_SERVER_ERROR, "[mod_okioki] Failed to allocate list of values."
+        )
+        apr_hash_set(arguments, name, strlen(name) + 1, values);
+    }
+    APR_ARRAY_PUSH(values, char *) = value;
+
     return HTTP_OK;
 }
 
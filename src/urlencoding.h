@@ -22,6 +22,10 @@
 #include <apr_hash.h>
 
 void mod_okioki_urldecode(char *out, const char *in);
+/** Parse a name=value phrase into the arguments.
+ * The arguments hold the last value of each name. All values of a name are also kept as an
+ * apr_array_header_t of strings, with as key the name including its terminating nul character.
+ */
 int mod_okioki_parse_query_phrase(request_rec *http_req, apr_hash_t *arguments, char *s, char **error);
 int mod_okioki_parse_query(request_rec *http_req, apr_hash_t *arguments, char *_s, char **error);
 
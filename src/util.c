@@ -16,9 +16,17 @@
  */
 
 
+#include <apr_lib.h>
+#include <apr_md5.h>
+#include <httpd.h>
+#include <http_config.h>
+#include <http_log.h>
+#include <http_protocol.h>
 #include "mod_okioki.h"
 #include "util.h"
 
+extern module AP_MODULE_DECLARE_DATA okioki_module;
+
 void *mod_okioki_realloc(apr_pool_t *pool, void *buf, size_t old_size, size_t new_size)
 {
     void   *tmp = apr_palloc(pool, new_size);
@@ -50,3 +58,129 @@ size_t mod_okioki_nlpo2(size_t x)
     return x + 1;
 }
 
+
+char *mod_okioki_etag(apr_pool_t *pool, const char *data, apr_size_t data_len)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char     digest[APR_MD5_DIGESTSIZE];
+    char              *etag;
+    int               i;
+
+    if ((etag = apr_palloc(pool, APR_MD5_DIGESTSIZE * 2 + 3)) == NULL) {
+        return NULL;
+    }
+
+    apr_md5(digest, data, data_len);
+
+    etag[0] = '"';
+    for (i = 0; i < APR_MD5_DIGESTSIZE; i++) {
+        etag[i * 2 + 1] = hex[digest[i] >> 4];
+        etag[i * 2 + 2] = hex[digest[i] & 0xf];
+    }
+    etag[APR_MD5_DIGESTSIZE * 2 + 1] = '"';
+    etag[APR_MD5_DIGESTSIZE * 2 + 2] = 0;
+    return etag;
+}
+
+int mod_okioki_etag_match(const char *header, const char *etag)
+{
+    apr_size_t etag_len = strlen(etag);
+    const char *tag;
+    const char *end;
+
+    while (*header != 0) {
+        // Skip the separators between the tags.
+        if (*header == ',' || apr_isspace(*header)) {
+            header++;
+            continue;
+        }
+
+        if (*header == '*') {
+            return 1;
+        }
+
+        if (header[0] == 'W' && header[1] == '/') {
+            header+= 2;
+        }
+        if (*header != '"' || (end = strchr(&header[1], '"')) == NULL) {
+            return 0;
+        }
+        tag    = header;
+        header = &end[1];
+
+        if ((apr_size_t)(header - tag) == etag_len && memcmp(tag, etag, etag_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+apr_status_t mod_okioki_pass_chunk(ap_filter_t *next, apr_bucket_brigade *bb)
+{
+    apr_status_t ret;
+
+    if ((ret = ap_pass_brigade(next, bb)) != APR_SUCCESS) {
+        return ret;
+    }
+    apr_brigade_cleanup(bb);
+    return APR_SUCCESS;
+}
+
+int mod_okioki_response_failed(request_rec *http_request, int ret)
+{
+    if (!http_request->sent_bodyct) {
+        return ret;
+    }
+
+    ap_log_perror(APLOG_MARK, APLOG_ERR, 0, http_request->pool, "[mod_okioki] Response failed with status %i after it was partly sent, aborting the connection.", ret);
+    http_request->connection->aborted = 1;
+    return OK;
+}
+
+int mod_okioki_pass_response(request_rec *http_request, apr_bucket_brigade *bb, apr_bucket_alloc_t *alloc, int whole, char **error)
+{
+    apr_pool_t            *pool = http_request->pool;
+    mod_okioki_dir_config *cfg = (mod_okioki_dir_config *)ap_get_module_config(http_request->per_dir_config, &okioki_module);
+    apr_bucket            *b;
+    apr_off_t             len;
+    apr_size_t            flat_len;
+    char                  *flat;
+
+    // A small response is made of many tiny buckets, copying it once is cheaper than writing it piece by piece.
+    if (whole && cfg->flatten_size > 0 && apr_brigade_length(bb, 1, &len) == APR_SUCCESS && len <= (apr_off_t)cfg->flatten_size) {
+        flat_len = (apr_size_t)len;
+
+        if (flat_len > 0) {
+            ASSERT_NOT_NULL(
+                flat = apr_bucket_alloc(flat_len, alloc),
+                HTTP_INTERNAL_SERVER_ERROR, "Could not allocate response buffer."
+            )
+            ASSERT_APR_SUCCESS(
+                apr_brigade_flatten(bb, flat, &flat_len),
+                HTTP_INTERNAL_SERVER_ERROR, "Could not flatten response."
+            )
+            apr_brigade_cleanup(bb);
+
+            ASSERT_NOT_NULL(
+                b = apr_bucket_heap_create(flat, flat_len, apr_bucket_free, alloc),
+                HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
+            )
+            APR_BRIGADE_INSERT_TAIL(bb, b);
+        }
+        ap_set_content_length(http_request, flat_len);
+    }
+
+    // Add an end-of-stream.
+    ASSERT_NOT_NULL(
+        b = apr_bucket_eos_create(alloc),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate bucket."
+    )
+    APR_BRIGADE_INSERT_TAIL(bb, b);
+
+    // Return the rest of the data, a failure of the filter chain is not an HTTP status.
+    if (ap_pass_brigade(http_request->output_filters, bb) != APR_SUCCESS) {
+        *error = "Could not pass response to the output filters.";
+        return mod_okioki_response_failed(http_request, HTTP_INTERNAL_SERVER_ERROR);
+    }
+    return OK;
+}
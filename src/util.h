@@ -18,6 +18,9 @@
  */
 
 #include <apr.h>
+#include <apr_buckets.h>
+#include <httpd.h>
+#include <util_filter.h>
 
 #ifndef MIN
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
@@ -46,4 +49,52 @@ void *mod_okioki_realloc(apr_pool_t *pool, void *buf, size_t old_size, size_t ne
  */
 size_t mod_okioki_nlpo2(size_t x);
 
+/** Calculate a strong entity tag.
+ * The tag is the MD5 digest of the data in hexadecimal, between double quotes, so that
+ * every child gives the same tag for the same data.
+ *
+ * @param pool      The pool to allocate the tag from.
+ * @param data      The data.
+ * @param data_len  The length of the data.
+ * @returns         The entity tag.
+ */
+char *mod_okioki_etag(apr_pool_t *pool, const char *data, apr_size_t data_len);
+
+/** Check if a header with a list of entity tags, like If-None-Match, names the entity tag.
+ * Each tag of the list is compared whole; a weak tag matches the strong tag with the same value.
+ *
+ * @param header  The value of the header.
+ * @param etag    The strong entity tag, between double quotes.
+ * @returns       1 when the header is "*" or one of its tags matches, otherwise 0.
+ */
+int mod_okioki_etag_match(const char *header, const char *etag);
+
+/** Pass a chunk of a response down the filter chain, so that its buckets are written and freed.
+ * Filters that hold on to buckets set them aside, so the brigade can be reused.
+ *
+ * @param next  The filter to pass the chunk to.
+ * @param bb    The brigade with the chunk, empty on return.
+ * @returns     APR_SUCCESS, or the status of the filter chain.
+ */
+apr_status_t mod_okioki_pass_chunk(ap_filter_t *next, apr_bucket_brigade *bb);
+
+/** Finish a response that failed after part of it may have been sent.
+ * Once the headers are sent an error response is no longer possible, so the connection is aborted
+ * and the client sees a truncated response, instead of an error in the middle of the body.
+ *
+ * @param ret  The HTTP status of the failure.
+ * @returns    ret when nothing was sent yet, otherwise OK.
+ */
+int mod_okioki_response_failed(request_rec *http_request, int ret);
+
+/** Pass the rest of a response down the filter chain, followed by an end-of-stream.
+ * When the brigade holds the whole response and it is no larger than OkiokiFlattenSize, it is copied
+ * into a single bucket and the Content-Length is set, so that it is sent in one write.
+ *
+ * @param bb     The brigade with the rest of the response.
+ * @param whole  Set when no chunk of the response was passed before.
+ * @returns      OK, or HTTP status.
+ */
+int mod_okioki_pass_response(request_rec *http_request, apr_bucket_brigade *bb, apr_bucket_alloc_t *alloc, int whole, char **error);
+
 #endif
@@ -0,0 +1,414 @@
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <apr_hash.h>
+#include <apr_strings.h>
+#include <apr_file_info.h>
+#include <apr_thread_mutex.h>
+#include <httpd.h>
+#include <http_config.h>
+#include <http_log.h>
+#include "viewfile.h"
+#include "cache.h"
+#include "views.h"
+
+/** A view loaded from a view file, shared by the versions of the file that define it the same.
+ * It has its own pool, so that it is freed when the last version that contains it is freed.
+ */
+typedef struct {
+    apr_pool_t            *pool;
+    view_t                *view;
+    char                  *definition;
+    int                   nr_references;
+} viewfile_view_t;
+
+/** A version of the views of a file, requests hold a reference while they use one of its views.
+ */
+typedef struct {
+    apr_pool_t            *pool;
+    apr_hash_t            *views;
+    int                   nr_references;
+} viewfile_table_t;
+
+struct viewfile_t {
+    char                  *path;
+    mod_okioki_dir_config conf;
+
+    // The version in use and the state of the file when it was last checked, in the child.
+    viewfile_table_t      *current;
+    apr_time_t            mtime;
+    apr_time_t            checked;
+
+    // Set while a request loads the file, other requests keep using the current version meanwhile.
+    int                   loading;
+};
+
+// The view files of the configuration.
+static apr_array_header_t *mod_okioki_viewfiles = NULL;
+
+// The statement numbers that are not in use by any view, and the version given to the last reused one.
+static apr_thread_mutex_t *mod_okioki_viewfile_mutex = NULL;
+static apr_pool_t         *mod_okioki_viewfile_pool;
+static int                mod_okioki_viewfile_free[MAX_VIEWS];
+static int                mod_okioki_viewfile_nr_free;
+static apr_uint32_t       mod_okioki_viewfile_version;
+
+/** Free a version that failed to load, with the views that are not shared with the current version.
+ */
+static void mod_okioki_viewfile_discard(viewfile_table_t *table)
+{
+    apr_hash_index_t *hi;
+    void             *_fview;
+
+    for (hi = apr_hash_first(NULL, table->views); hi != NULL; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, &_fview);
+        if (((viewfile_view_t *)_fview)->nr_references == 0) {
+            apr_pool_destroy(((viewfile_view_t *)_fview)->pool);
+        }
+    }
+    apr_pool_destroy(table->pool);
+}
+
+/** Read the view file into a new version.
+ * A view that is defined the same as in the current version is reused, with its statement and cache.
+ *
+ * @param pool       The parent of the pools of the new version and of its new views.
+ * @param temp_pool  Pool for the error message.
+ * @param current    The current version, NULL when the file was not loaded before.
+ * @returns          NULL, or an error message.
+ */
+static const char *mod_okioki_viewfile_parse(apr_pool_t *pool, apr_pool_t *temp_pool, viewfile_t *vf, viewfile_table_t *current, viewfile_table_t **_table)
+{
+    apr_pool_t       *table_pool;
+    apr_pool_t       *view_pool;
+    viewfile_table_t *table;
+    viewfile_view_t  *fview;
+    ap_configfile_t  *cfp;
+    char             line[HUGE_STRING_LEN];
+    char             *argv[MAX_PARAMETERS + 4];
+    const char       *args;
+    char             *name;
+    const char       *msg = NULL;
+    int              argc;
+
+    if (
+        apr_pool_create(&table_pool, pool) != APR_SUCCESS ||
+        (table = apr_pcalloc(table_pool, sizeof (viewfile_table_t))) == NULL ||
+        (table->views = apr_hash_make(table_pool)) == NULL
+    ) {
+        return "Could not allocate view file.";
+    }
+    table->pool = table_pool;
+
+    if (ap_pcfg_openfile(&cfp, table_pool, vf->path) != APR_SUCCESS) {
+        apr_pool_destroy(table_pool);
+        return apr_psprintf(temp_pool, "Could not open view file %s.", vf->path);
+    }
+
+    // Each line holds the arguments of an OkiokiCommand.
+    while (msg == NULL && ap_cfg_getline(line, sizeof (line), cfp) == 0) {
+        if (line[0] == 0 || line[0] == '#') {
+            continue;
+        }
+
+        args = line;
+        argc = 0;
+        while (*args != 0 && argc < MAX_PARAMETERS + 4) {
+            argv[argc++] = ap_getword_conf(table_pool, &args);
+        }
+        if (*args != 0 || argc < 4) {
+            msg = apr_psprintf(table_pool, "Requires at least four arguments and at most %i parameters.", MAX_PARAMETERS);
+            break;
+        }
+
+        name = apr_pstrcat(table_pool, argv[0], " ", argv[1], NULL);
+        if (apr_hash_get(table->views, name, APR_HASH_KEY_STRING) != NULL) {
+            msg = apr_psprintf(table_pool, "View '%s' is defined twice.", name);
+            break;
+        }
+
+        if (current != NULL && (fview = apr_hash_get(current->views, name, APR_HASH_KEY_STRING)) != NULL && strcmp(fview->definition, line) == 0) {
+            apr_hash_set(table->views, name, APR_HASH_KEY_STRING, fview);
+            continue;
+        }
+
+        if (apr_pool_create(&view_pool, pool) != APR_SUCCESS) {
+            msg = "Could not allocate view.";
+            break;
+        }
+        if (
+            (fview = apr_pcalloc(view_pool, sizeof (viewfile_view_t))) == NULL ||
+            (fview->definition = apr_pstrdup(view_pool, line)) == NULL
+        ) {
+            apr_pool_destroy(view_pool);
+            msg = "Could not allocate view.";
+            break;
+        }
+        fview->pool = view_pool;
+
+        if ((msg = mod_okioki_view_make(fview->pool, NULL, &vf->conf, argc, argv, &fview->view)) != NULL) {
+            apr_pool_destroy(fview->pool);
+            break;
+        }
+        apr_hash_set(table->views, name, APR_HASH_KEY_STRING, fview);
+    }
+
+    if (msg != NULL) {
+        msg = apr_psprintf(temp_pool, "%s line %i: %s", vf->path, cfp->line_number, msg);
+        ap_cfg_closefile(cfp);
+        mod_okioki_viewfile_discard(table);
+        return msg;
+    }
+
+    ap_cfg_closefile(cfp);
+    *_table = table;
+    return NULL;
+}
+
+/** Release a reference to a version, the caller must hold the mutex.
+ * The views that are not in any other version are freed with it, and their statement numbers are reused.
+ */
+static void mod_okioki_viewfile_release(viewfile_table_t *table)
+{
+    apr_hash_index_t *hi;
+    void             *_fview;
+    viewfile_view_t  *fview;
+
+    if (--table->nr_references > 0) {
+        return;
+    }
+
+    for (hi = apr_hash_first(NULL, table->views); hi != NULL; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, &_fview);
+        fview = (viewfile_view_t *)_fview;
+
+        if (--fview->nr_references == 0) {
+            mod_okioki_cache_forget(fview->view);
+            mod_okioki_viewfile_free[mod_okioki_viewfile_nr_free++] = fview->view->statement_nr;
+            apr_pool_destroy(fview->pool);
+        }
+    }
+    apr_pool_destroy(table->pool);
+}
+
+static apr_status_t mod_okioki_viewfile_cleanup(void *table)
+{
+    apr_thread_mutex_lock(mod_okioki_viewfile_mutex);
+    mod_okioki_viewfile_release((viewfile_table_t *)table);
+    apr_thread_mutex_unlock(mod_okioki_viewfile_mutex);
+    return APR_SUCCESS;
+}
+
+/** Make a parsed version the current version, the caller must hold the mutex.
+ * The new views get a statement number of their own; when there are not enough the version is discarded.
+ */
+static void mod_okioki_viewfile_swap(viewfile_t *vf, viewfile_table_t *table)
+{
+    apr_pool_t       *pool = mod_okioki_viewfile_pool;
+    viewfile_table_t *old;
+    apr_hash_index_t *hi;
+    void             *_fview;
+    viewfile_view_t  *fview;
+    int              nr_new = 0;
+
+    // Every new view needs a statement number of its own.
+    for (hi = apr_hash_first(NULL, table->views); hi != NULL; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, &_fview);
+        nr_new+= ((viewfile_view_t *)_fview)->nr_references == 0;
+    }
+    if (nr_new > mod_okioki_viewfile_nr_free) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, 0, pool, "[mod_okioki] Could not load views of %s, more than %i views.", vf->path, MAX_VIEWS);
+        mod_okioki_viewfile_discard(table);
+        return;
+    }
+
+    for (hi = apr_hash_first(NULL, table->views); hi != NULL; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, &_fview);
+        fview = (viewfile_view_t *)_fview;
+
+        if (fview->nr_references == 0) {
+            fview->view->statement_nr      = mod_okioki_viewfile_free[--mod_okioki_viewfile_nr_free];
+            fview->view->statement_version = ++mod_okioki_viewfile_version;
+        }
+        fview->nr_references++;
+    }
+
+    // The old version is freed when the last request that uses it is done.
+    old                  = vf->current;
+    table->nr_references = 1;
+    vf->current          = table;
+    if (old != NULL) {
+        mod_okioki_viewfile_release(old);
+    }
+
+    ap_log_perror(APLOG_MARK, APLOG_INFO, 0, pool, "[mod_okioki] Loaded %i views from %s, %i changed.", apr_hash_count(table->views), vf->path, nr_new);
+}
+
+/** Load a new version of the view file when it changed, and make it the current version.
+ * The file is parsed without holding the mutex, so that other requests are not blocked; only the
+ * statement numbers are handed out and the versions swapped under it. The caller must have set
+ * vf->loading under the mutex, so that a single request loads the file; it is cleared when done.
+ * When the file has an error the current version stays in use.
+ */
+static void mod_okioki_viewfile_load(viewfile_t *vf, apr_pool_t *temp_pool)
+{
+    apr_pool_t       *pool = mod_okioki_viewfile_pool;
+    viewfile_table_t *current;
+    viewfile_table_t *table;
+    apr_finfo_t      finfo;
+    const char       *msg;
+    int              changed;
+
+    // Only the loading request changes the current version and the modification time, they can be read without the mutex.
+    if (apr_stat(&finfo, vf->path, APR_FINFO_MTIME, temp_pool) == APR_SUCCESS) {
+        changed   = finfo.mtime != vf->mtime || vf->current == NULL;
+        vf->mtime = finfo.mtime;
+    } else {
+        changed = vf->current == NULL;
+    }
+
+    // The current version is kept alive while the new version is parsed, it shares the views that did not change.
+    apr_thread_mutex_lock(mod_okioki_viewfile_mutex);
+    if ((current = changed ? vf->current : NULL) != NULL) {
+        current->nr_references++;
+    }
+    apr_thread_mutex_unlock(mod_okioki_viewfile_mutex);
+
+    msg = changed ? mod_okioki_viewfile_parse(pool, temp_pool, vf, current, &table) : NULL;
+
+    apr_thread_mutex_lock(mod_okioki_viewfile_mutex);
+    if (msg != NULL) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, 0, pool, "[mod_okioki] Could not load views, %s", msg);
+    } else if (changed) {
+        mod_okioki_viewfile_swap(vf, table);
+    }
+    if (current != NULL) {
+        mod_okioki_viewfile_release(current);
+    }
+    vf->loading = 0;
+    apr_thread_mutex_unlock(mod_okioki_viewfile_mutex);
+}
+
+const char *mod_okioki_viewfile_configure(apr_pool_t *pool, apr_pool_t *temp_pool, mod_okioki_dir_config *conf, const char *path)
+{
+    viewfile_t       *vf;
+    viewfile_table_t *table;
+    const char       *msg;
+
+    if (conf->view_file != NULL) {
+        return "Only one view file can be used in a directory.";
+    }
+
+    if (
+        (vf = apr_pcalloc(pool, sizeof (viewfile_t))) == NULL ||
+        (vf->path = apr_pstrdup(pool, path)) == NULL
+    ) {
+        return "Could not allocate view file.";
+    }
+
+    // The views get the settings given so far, write-behind queues can only be started with the child.
+    vf->conf                        = *conf;
+    vf->conf.writebehind_max_queued = 0;
+
+    // Report errors in the file at startup, the views are loaded again by each child.
+    if ((msg = mod_okioki_viewfile_parse(temp_pool, temp_pool, vf, NULL, &table)) != NULL) {
+        return msg;
+    }
+    mod_okioki_viewfile_discard(table);
+
+    if (mod_okioki_viewfiles == NULL && (mod_okioki_viewfiles = apr_array_make(pool, 1, sizeof (viewfile_t *))) == NULL) {
+        return "Could not allocate view files.";
+    }
+    APR_ARRAY_PUSH(mod_okioki_viewfiles, viewfile_t *) = vf;
+
+    conf->view_file = vf;
+    return NULL;
+}
+
+void mod_okioki_viewfile_pre_config(void)
+{
+    mod_okioki_viewfiles = NULL;
+}
+
+int mod_okioki_viewfile_child_init(apr_pool_t *pool, server_rec *server, int nr_statements)
+{
+    viewfile_t   *vf;
+    apr_status_t ret;
+    int          i;
+
+    if (mod_okioki_viewfiles == NULL) {
+        return APR_SUCCESS;
+    }
+
+    if ((ret = apr_thread_mutex_create(&mod_okioki_viewfile_mutex, APR_THREAD_MUTEX_DEFAULT, pool)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, ret, server, "[mod_okioki] Could not create view file mutex.");
+        return ret;
+    }
+    mod_okioki_viewfile_pool = pool;
+
+    // The lowest free statement number is handed out first.
+    mod_okioki_viewfile_nr_free = 0;
+    for (i = MAX_VIEWS - 1; i >= nr_statements; i--) {
+        mod_okioki_viewfile_free[mod_okioki_viewfile_nr_free++] = i;
+    }
+    mod_okioki_viewfile_version = 0;
+
+    for (i = 0; i < mod_okioki_viewfiles->nelts; i++) {
+        vf = APR_ARRAY_IDX(mod_okioki_viewfiles, i, viewfile_t *);
+
+        vf->current = NULL;
+        vf->checked = apr_time_now();
+        vf->mtime   = 0;
+        vf->loading = 1;
+        mod_okioki_viewfile_load(vf, pool);
+    }
+    return APR_SUCCESS;
+}
+
+view_t *mod_okioki_viewfile_find(request_rec *http_request, mod_okioki_dir_config *cfg, const char *view_name)
+{
+    viewfile_t       *vf = cfg->view_file;
+    viewfile_table_t *table;
+    viewfile_view_t  *fview = NULL;
+
+    if (vf != NULL && mod_okioki_viewfile_mutex != NULL) {
+        apr_thread_mutex_lock(mod_okioki_viewfile_mutex);
+
+        // The file is checked at most once every interval by a single request, a changed modification time reloads it.
+        if (!vf->loading && http_request->request_time - vf->checked >= apr_time_from_sec(VIEWFILE_CHECK_INTERVAL)) {
+            vf->checked = http_request->request_time;
+            vf->loading = 1;
+
+            apr_thread_mutex_unlock(mod_okioki_viewfile_mutex);
+            mod_okioki_viewfile_load(vf, http_request->pool);
+            apr_thread_mutex_lock(mod_okioki_viewfile_mutex);
+        }
+
+        // The version stays alive until the end of the request, even when it is replaced in the meantime.
+        if ((table = vf->current) != NULL && (fview = apr_hash_get(table->views, view_name, APR_HASH_KEY_STRING)) != NULL) {
+            table->nr_references++;
+            apr_pool_cleanup_register(http_request->pool, table, mod_okioki_viewfile_cleanup, apr_pool_cleanup_null);
+        }
+
+        apr_thread_mutex_unlock(mod_okioki_viewfile_mutex);
+        if (fview != NULL) {
+            return fview->view;
+        }
+    }
+
+    return apr_hash_get(cfg->views, view_name, APR_HASH_KEY_STRING);
+}
@@ -0,0 +1,52 @@
+#ifndef VIEWFILE_H
+#define VIEWFILE_H
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <httpd.h>
+#include <http_log.h>
+#include "mod_okioki.h"
+
+#define VIEWFILE_CHECK_INTERVAL  1        // seconds between checks for a changed view file
+
+/** Add a file with view definitions to a directory at configuration time.
+ * The file is read once to report errors at startup; the views are loaded in each child.
+ *
+ * @param conf  The settings of the directory given so far, used for the views in the file.
+ * @returns     NULL, or an error message.
+ */
+const char *mod_okioki_viewfile_configure(apr_pool_t *pool, apr_pool_t *temp_pool, mod_okioki_dir_config *conf, const char *path);
+
+/** Forget the view files of the previous configuration, called before the configuration is (re)read.
+ */
+void mod_okioki_viewfile_pre_config(void);
+
+/** Load the view files, called once for each child.
+ *
+ * @param nr_statements  The number of statement numbers used by the views of the configuration,
+ *                       the rest is used for the views of the view files.
+ */
+int mod_okioki_viewfile_child_init(apr_pool_t *pool, server_rec *server, int nr_statements);
+
+/** Find a view by its method and path.
+ * The views of the view file of the directory are used before the views of the configuration. A view
+ * from a view file stays valid until the end of the request, even when the file is reloaded.
+ */
+view_t *mod_okioki_viewfile_find(request_rec *http_request, mod_okioki_dir_config *cfg, const char *view_name);
+
+#endif
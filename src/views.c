@@ -17,21 +17,65 @@
 
 #include <sys/types.h>
 #include <apr_hash.h>
+#include <apr_lib.h>
 #include <apr_strings.h>
 #include <apr_dbd.h>
+#include <apr_thread_proc.h>
 #include <httpd.h>
 #include <http_log.h>
 #include <http_request.h>
 #include <http_protocol.h>
+#include <http_config.h>
 #include <mod_dbd.h>
 #include "views.h"
+#include "admission.h"
+#include "params.h"
+#include "pool.h"
+#include "writebehind.h"
 
 #define MAX_ARGUMENTS 32
 
-int mod_okioki_view_execute(request_rec *http_request, mod_okioki_dir_config *cfg, view_t *view, apr_hash_t *arguments, const apr_dbd_driver_t **db_driver, apr_dbd_results_t **db_result, char **error)
+extern module AP_MODULE_DECLARE_DATA okioki_module;
+
+int mod_okioki_view_key(apr_pool_t *pool, view_t *view, const char *view_name, apr_hash_t *arguments, char **_key, apr_size_t *_key_len, char **error)
+{
+    const char   *args[MAX_PARAMETERS];
+    apr_size_t   args_len[MAX_PARAMETERS];
+    apr_uint32_t id[2] = {view->statement_nr, view->statement_version};
+    apr_size_t   name_len = strlen(view_name) + 1;
+    apr_size_t   key_len = sizeof (id) + name_len;
+    char         *key;
+    int          i;
+
+    for (i = 0; i < view->nr_sql_params; i++) {
+        if ((args[i] = apr_hash_get(arguments, view->sql_params[i], view->sql_params_len[i])) == NULL) {
+            *error = apr_psprintf(pool, "Missing parameter '%s'.", view->sql_params[i]);
+            return HTTP_BAD_REQUEST;
+        }
+        args_len[i] = strlen(args[i]) + 1;
+        key_len+= args_len[i];
+    }
+
+    ASSERT_NOT_NULL(
+        key = apr_palloc(pool, key_len),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate key."
+    )
+
+    memcpy(key, id, sizeof (id));
+    memcpy(&key[sizeof (id)], view_name, name_len);
+    key_len = sizeof (id) + name_len;
+    for (i = 0; i < view->nr_sql_params; i++) {
+        memcpy(&key[key_len], args[i], args_len[i]);
+        key_len+= args_len[i];
+    }
+
+    *_key = key;
+    *_key_len = key_len;
+    return HTTP_OK;
+}
+
+int mod_okioki_view_select(apr_pool_t *pool, mod_okioki_conn_t *db_conn, view_t *view, apr_hash_t *arguments, apr_dbd_results_t **db_result, char **error)
 {
-    apr_pool_t         *pool = http_request->pool;
-    ap_dbd_t           *db_conn;
     apr_dbd_prepared_t *db_statement;
     char               *arg;
     int                argc = view->nr_sql_params;
@@ -43,24 +87,17 @@ int mod_okioki_view_execute(request_rec *http_request, mod_okioki_dir_config *cf
     for (i = 0; i < argc; i++) {
         ASSERT_NOT_NULL(
             arg = (char *)apr_hash_get(arguments, view->sql_params[i], view->sql_params_len[i]),
-            HTTP_INTERNAL_SERVER_ERROR, "Could not find parameter '%s' in request.", view->sql_params[i]
+            HTTP_BAD_REQUEST, "Could not find parameter '%s' in request.", view->sql_params[i]
         )
 
         argv[i] = arg;
     }
     argv[i] = NULL;
 
-    // Retrieve a database connection from the resource pool.
-    ASSERT_NOT_NULL(
-        db_conn = ap_dbd_acquire(http_request),
-        HTTP_INTERNAL_SERVER_ERROR, "Can not get database connection."
-    )
-    *db_driver = db_conn->driver;
-
     // Get the prepared statement.
-    ASSERT_NOT_NULL(
-        db_statement = apr_hash_get((db_conn)->prepared, view->sql, view->sql_len),
-        HTTP_INTERNAL_SERVER_ERROR, "Can not find '%s'", view->sql
+    ASSERT_HTTP_OK(
+        ret = mod_okioki_conn_prepare(pool, db_conn, view, &db_statement, error),
+        ret, "Can not get prepared statement."
     )
 
     // Execute the statement.
@@ -71,7 +108,7 @@ int mod_okioki_view_execute(request_rec *http_request, mod_okioki_dir_config *cf
     // Also because we use buckets and brigades everything is done in memory already, so streaming data would not
     // have worked anyway.
     ASSERT_APR_SUCCESS(
-        ret = apr_dbd_pselect(db_conn->driver, db_conn->pool, db_conn->handle, db_result, db_statement, 1, argc, (const char **)argv),
+        ret = apr_dbd_pselect(db_conn->driver, pool, db_conn->handle, db_result, db_statement, 1, argc, (const char **)argv),
         HTTP_BAD_GATEWAY, "%s", apr_dbd_error(db_conn->driver, db_conn->handle, ret)
     )
 
@@ -82,4 +119,358 @@ int mod_okioki_view_execute(request_rec *http_request, mod_okioki_dir_config *cf
     return HTTP_OK;
 }
 
+/** One shard of a scatter-gather execution.
+ */
+typedef struct {
+    apr_pool_t             *pool;
+    backend_t              *backend;
+    view_t                 *view;
+    apr_hash_t             *arguments;
+    const apr_dbd_driver_t *db_driver;
+    apr_dbd_results_t      *db_result;
+    int                    ret;
+    char                   *error;
+} scatter_t;
+
+/** Execute the view on one shard, on a thread of its own.
+ */
+static void * APR_THREAD_FUNC mod_okioki_view_scatter_thread(apr_thread_t *thread, void *data)
+{
+    scatter_t         *scatter = (scatter_t *)data;
+    mod_okioki_conn_t *db_conn;
+
+    if ((scatter->ret = mod_okioki_conn_acquire_backend(scatter->pool, scatter->backend, &db_conn, &scatter->error)) == HTTP_OK) {
+        scatter->db_driver = db_conn->driver;
+        scatter->ret = mod_okioki_view_select(scatter->pool, db_conn, scatter->view, scatter->arguments, &scatter->db_result, &scatter->error);
+    }
+
+    if (thread != NULL) {
+        apr_thread_exit(thread, APR_SUCCESS);
+    }
+    return NULL;
+}
+
+static apr_status_t mod_okioki_view_scatter_cleanup(void *pool)
+{
+    apr_pool_destroy((apr_pool_t *)pool);
+    return APR_SUCCESS;
+}
+
+/** Execute the view on all shards in parallel and gather the results.
+ */
+static int mod_okioki_view_scatter(request_rec *http_request, mod_okioki_server_config *scfg, view_t *view, apr_hash_t *arguments, result_t **db_result, char **error)
+{
+    apr_pool_t         *pool = http_request->pool;
+    int                nr_shards = scfg->shards->nelts;
+    scatter_t          scatters[nr_shards];
+    apr_thread_t       *threads[nr_shards];
+    apr_dbd_results_t  **parts;
+    apr_status_t       thread_ret;
+    int                i;
+
+    ASSERT_NOT_NULL(
+        parts = apr_palloc(pool, nr_shards * sizeof (apr_dbd_results_t *)),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate results."
+    )
+
+    for (i = 0; i < nr_shards; i++) {
+        // Each shard gets a pool of its own, as the request's pool may not be used by several threads.
+        ASSERT_APR_SUCCESS(
+            apr_pool_create(&scatters[i].pool, NULL),
+            HTTP_INTERNAL_SERVER_ERROR, "Could not allocate pool for shard."
+        )
+        apr_pool_cleanup_register(pool, scatters[i].pool, mod_okioki_view_scatter_cleanup, apr_pool_cleanup_null);
+
+        scatters[i].backend   = APR_ARRAY_IDX(scfg->shards, i, backend_t *);
+        scatters[i].view      = view;
+        scatters[i].arguments = arguments;
+        scatters[i].db_result = NULL;
+        scatters[i].error     = NULL;
+        threads[i]            = NULL;
+    }
+
+    // The first shard is executed on this thread, while the others run in parallel.
+    for (i = 1; i < nr_shards; i++) {
+        if (apr_thread_create(&threads[i], NULL, mod_okioki_view_scatter_thread, &scatters[i], pool) != APR_SUCCESS) {
+            threads[i] = NULL;
+            mod_okioki_view_scatter_thread(NULL, &scatters[i]);
+        }
+    }
+    mod_okioki_view_scatter_thread(NULL, &scatters[0]);
+
+    for (i = 1; i < nr_shards; i++) {
+        if (threads[i] != NULL) {
+            apr_thread_join(&thread_ret, threads[i]);
+        }
+    }
+
+    for (i = 0; i < nr_shards; i++) {
+        if (scatters[i].ret != HTTP_OK) {
+            *error = apr_pstrdup(pool, scatters[i].error ? scatters[i].error : "Could not execute view on shard.");
+            return scatters[i].ret;
+        }
+        parts[i] = scatters[i].db_result;
+    }
+
+    return mod_okioki_result_gather(pool, scatters[0].db_driver, nr_shards, parts, view->shard->merge_column, view->shard->merge_desc, db_result, error);
+}
+
+int mod_okioki_view_execute(request_rec *http_request, mod_okioki_dir_config *cfg, view_t *view, apr_hash_t *arguments, result_t **db_result, char **error)
+{
+    apr_pool_t               *pool = http_request->pool;
+    mod_okioki_server_config *scfg = (mod_okioki_server_config *)ap_get_module_config(http_request->server->module_config, &okioki_module);
+    mod_okioki_conn_t        *db_conn;
+    apr_dbd_results_t        *db_single_result;
+    const char               *shard_key;
+    int                      i;
+    int                      ret;
+
+    // Report a missing parameter before a database connection is used.
+    for (i = 0; i < view->nr_sql_params; i++) {
+        ASSERT_NOT_NULL(
+            apr_hash_get(arguments, view->sql_params[i], view->sql_params_len[i]),
+            HTTP_BAD_REQUEST, "Could not find parameter '%s' in request.", view->sql_params[i]
+        )
+    }
+
+    if (view->shard != NULL) {
+        ASSERT_NOT_NULL(
+            scfg->shard_ring,
+            HTTP_INTERNAL_SERVER_ERROR, "View is sharded, but no shards are configured."
+        )
+
+        // Without a shard key the view is executed on all shards.
+        if (view->shard->shard_key == NULL) {
+            if ((ret = mod_okioki_view_scatter(http_request, scfg, view, arguments, db_result, error)) == HTTP_OK) {
+                (*db_result)->columns = view->columns;
+            }
+            return ret;
+        }
+
+        ASSERT_NOT_NULL(
+            shard_key = apr_hash_get(arguments, view->shard->shard_key, view->shard->shard_key_len),
+            HTTP_BAD_REQUEST, "Could not find shard key '%s' in request.", view->shard->shard_key
+        )
+
+        ASSERT_HTTP_OK(
+            ret = mod_okioki_conn_acquire_backend(pool, mod_okioki_shard_backend(scfg, shard_key, strlen(shard_key)), &db_conn, error),
+            ret, "Can not get database connection."
+        )
+
+    } else {
+        // Retrieve a database connection from the resource pool.
+        ASSERT_HTTP_OK(
+            ret = mod_okioki_conn_acquire(http_request, http_request->method_number == M_GET, &db_conn, error),
+            ret, "Can not get database connection."
+        )
+    }
+
+    if ((ret = mod_okioki_view_select(pool, db_conn, view, arguments, &db_single_result, error)) != HTTP_OK) {
+        return ret;
+    }
+
+    ASSERT_NOT_NULL(
+        *db_result = mod_okioki_result_make(pool, db_conn->driver, db_single_result),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate result."
+    )
+    (*db_result)->columns = view->columns;
+    return HTTP_OK;
+}
+
+const char *mod_okioki_view_make(apr_pool_t *pool, server_rec *server, mod_okioki_dir_config *conf, int argc, char *const argv[], view_t **_view)
+{
+    view_t       *view;
+    unsigned int i;
+    char         *param;
+    char         *param_type;
+    const char   *msg;
+
+    // Make sure this configuration directive has at least two arguments.
+    if (argc < 4) {
+        return "Requires at least four arguments.";
+    }
+
+    // Create a new view.
+    if ((view = (view_t *)apr_pcalloc(pool, sizeof (view_t))) == NULL) {
+        return "Could not allocate view.";
+    }
+
+    if (strcmp(argv[2], "CSV") == 0) {
+        view->output_type = O_CSV;
+    } else if (strcmp(argv[2], "JSON") == 0) {
+        view->output_type = O_JSON;
+    } else if (strcmp(argv[2], "NDJSON") == 0) {
+        view->output_type = O_NDJSON;
+    } else if (strcmp(argv[2], "SSE") == 0) {
+        view->output_type = O_SSE;
+    } else if (strcmp(argv[2], "RAW") == 0) {
+        view->output_type = O_RAW;
+    } else {
+        return "Third argument must be CSV, JSON, NDJSON, SSE or RAW";
+    }
+
+    // An event stream is re-executed on notifications, so it needs at least one channel.
+    view->event_channels = conf->event_channels;
+    if (view->output_type == O_SSE && (strcmp(argv[0], "GET") != 0 || view->event_channels == NULL)) {
+        return "SSE requires GET and a preceding OkiokiEventChannels.";
+    }
+
+    if ((view->sql = apr_pstrdup(pool, argv[3])) == NULL) {
+        return "Failed to copy fourth argument.";
+    }
+    view->sql_len = strlen(view->sql);
+
+    // Copy the parameter names from the rest of argv, a parameter may be followed by a colon and its type.
+    view->nr_sql_params = 0;
+    for (i = 0; i < MAX_PARAMETERS; i++) {
+        if (i < argc - 4) {
+            if ((param = apr_pstrdup(pool, argv[i + 4])) == NULL) {
+                return "Failed to copy sql parameter.";
+            }
+
+            view->sql_param_specs[i] = NULL;
+            if ((param_type = strchr(param, ':')) != NULL) {
+                *param_type++ = 0;
+                if ((msg = mod_okioki_param_compile(pool, param_type, &view->sql_param_specs[i])) != NULL) {
+                    return msg;
+                }
+            }
+
+            view->sql_params[i]     = param;
+            view->sql_params_len[i] = strlen(param);
+            view->nr_sql_params++;
+        } else {
+            view->sql_params[i]      = NULL;
+            view->sql_params_len[i]  = 0;
+            view->sql_param_specs[i] = NULL;
+        }
+    }
+
+    // Views that modify data may be executed in the background.
+    view->writebehind = NULL;
+    if (conf->writebehind_max_queued > 0 && strcmp(argv[0], "GET") != 0) {
+        if ((view->writebehind = mod_okioki_writebehind_create(pool, server, view, conf->writebehind_max_queued, conf->writebehind_batch_size)) == NULL) {
+            return "Could not allocate write-behind queue.";
+        }
+    }
+
+    // Copy the result strings, multiple views can use the same result strings.
+    view->result_strings = conf->result_strings;
+
+    // Copy the settings of the directory that where given before this command.
+    view->coalesce_timeout = conf->coalesce_timeout;
+    view->cache            = strcmp(argv[0], "GET") == 0 ? conf->cache : NULL;
+    view->shard            = conf->shard;
+    view->nest             = conf->nest;
+    view->delta            = view->cache != NULL && view->output_type == O_JSON && view->nest == NULL ? conf->delta : NULL;
+    view->upload           = strcmp(argv[0], "POST") == 0 || strcmp(argv[0], "PUT") == 0 ? conf->upload : NULL;
+    view->if_match         = strcmp(argv[0], "PUT") == 0 || strcmp(argv[0], "DELETE") == 0 ? conf->if_match : NULL;
+
+    // The upload and the view are executed in one transaction, on the primary database.
+    if (view->upload != NULL && (view->shard != NULL || view->writebehind != NULL)) {
+        return "An upload can not be used with OkiokiShard or OkiokiWriteBehind.";
+    }
+
+    // The new version is only known once the statement is executed.
+    if (view->if_match != NULL && (view->writebehind != NULL || view->output_type == O_RAW || view->output_type == O_SSE)) {
+        return "OkiokiIfMatch can not be used with OkiokiWriteBehind, RAW or SSE.";
+    }
+
+    // A raw body is streamed from the database, it is not kept in memory to be cached or shared.
+    if (view->output_type == O_RAW) {
+        if (view->shard != NULL) {
+            return "RAW can not be used with OkiokiShard.";
+        }
+        view->coalesce_timeout = 0;
+        view->cache            = NULL;
+    }
+
+    // Each view gets its own limiter.
+    if (conf->view_max_active > 0) {
+        if ((view->limiter = mod_okioki_limiter_create(pool, conf->view_max_active, conf->view_max_queued, conf->view_max_wait)) == NULL) {
+            return "Could not allocate limiter.";
+        }
+    } else {
+        view->limiter = NULL;
+    }
+
+    *_view = view;
+    return NULL;
+}
+
+int mod_okioki_view_require_if_match(request_rec *http_request, char **error)
+{
+    if (apr_table_get(http_request->headers_in, "If-Match") == NULL) {
+        *error = "This resource can only be changed with an If-Match of the version that was read.";
+        return HTTP_PRECONDITION_REQUIRED;
+    }
+    return HTTP_OK;
+}
+
+int mod_okioki_view_bind_if_match(request_rec *http_request, view_t *view, apr_hash_t *arguments, char **error)
+{
+    apr_pool_t *pool = http_request->pool;
+    const char *header;
+    char       *tag;
+    apr_size_t tag_len;
+    int        ret;
+
+    if ((ret = mod_okioki_view_require_if_match(http_request, error)) != HTTP_OK) {
+        return ret;
+    }
+    header = apr_table_get(http_request->headers_in, "If-Match");
+
+    // Strip the white space around the entity-tag.
+    while (apr_isspace(*header)) {
+        header++;
+    }
+    ASSERT_NOT_NULL(
+        tag = apr_pstrdup(pool, header),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate entity-tag."
+    )
+    tag_len = strlen(tag);
+    while (tag_len > 0 && apr_isspace(tag[tag_len - 1])) {
+        tag[--tag_len] = 0;
+    }
+
+    // Only a single entity-tag can be compared with the version column by the statement.
+    if (strcmp(tag, "*") == 0 || strchr(tag, ',') != NULL) {
+        *error = "If-Match requires a single entity-tag.";
+        return HTTP_BAD_REQUEST;
+    }
+
+    // If-Match uses the strong comparison, a weak entity-tag never matches.
+    if (strncmp(tag, "W/", 2) == 0) {
+        *error = "If-Match does not match a weak entity-tag.";
+        return HTTP_PRECONDITION_FAILED;
+    }
+
+    if (tag_len < 2 || tag[0] != '"' || tag[tag_len - 1] != '"') {
+        *error = "If-Match requires a quoted entity-tag.";
+        return HTTP_BAD_REQUEST;
+    }
+    tag[tag_len - 1] = 0;
+
+    apr_hash_set(arguments, view->if_match->param, view->if_match->param_len, &tag[1]);
+    return HTTP_OK;
+}
+
+int mod_okioki_view_check_if_match(request_rec *http_request, view_t *view, result_t *db_result, char **error)
+{
+    apr_pool_t *pool = http_request->pool;
+    const char *version;
+
+    // No row is changed when the version in the database is not the version the client has read.
+    if (db_result == NULL || mod_okioki_result_num_tuples(db_result) == 0) {
+        *error = "The resource was changed since the version given in If-Match.";
+        return HTTP_PRECONDITION_FAILED;
+    }
+
+    ASSERT_NOT_NULL(
+        version = mod_okioki_result_get_first(db_result, pool, view->if_match->version_column),
+        HTTP_INTERNAL_SERVER_ERROR, "View does not return the version column '%s'.", view->if_match->version_column
+    )
 
+    apr_table_setn(http_request->headers_out, "ETag", apr_pstrcat(pool, "\"", version, "\"", NULL));
+    return HTTP_OK;
+}
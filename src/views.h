@@ -22,9 +22,59 @@
 #include <apr_hash.h>
 #include <apr_dbd.h>
 #include "mod_okioki.h"
+#include "pool.h"
+#include "result.h"
+
+#ifndef HTTP_PRECONDITION_REQUIRED
+#define HTTP_PRECONDITION_REQUIRED 428
+#endif
+
+/** Create a view from the arguments of OkiokiCommand, with the settings of the directory given so far.
+ * The statement number of the view is left for the caller to assign.
+ *
+ * @param server  The server of the view, used to create its write-behind queue.
+ * @returns       NULL, or an error message.
+ */
+const char *mod_okioki_view_make(apr_pool_t *pool, server_rec *server, mod_okioki_dir_config *conf, int argc, char *const argv[], view_t **view);
+
+/** Build a key that identifies the view together with its arguments.
+ * The key is the statement number and version of the view, so that views with the same name in other
+ * directories or in another version of a view file do not share it, followed by the name of the view and
+ * the arguments in the order of the sql parameters, each terminated by a nul character.
+ *
+ * @param key      On return the key, allocated from pool.
+ * @param key_len  On return the length of the key.
+ * @returns        HTTP_OK, or HTTP_BAD_REQUEST when a parameter is missing.
+ */
+int mod_okioki_view_key(apr_pool_t *pool, view_t *view, const char *view_name, apr_hash_t *arguments, char **key, apr_size_t *key_len, char **error);
+
+/** Execute the select statement of the view on a connection the caller already has.
+ */
+int mod_okioki_view_select(apr_pool_t *pool, mod_okioki_conn_t *db_conn, view_t *view, apr_hash_t *arguments, apr_dbd_results_t **db_result, char **error);
 
 /** Handle the view.
+ * A sharded view is executed on the shard of its shard key, or on all shards.
+ */
+int mod_okioki_view_execute(request_rec *http_request, mod_okioki_dir_config *cfg, view_t *view, apr_hash_t *arguments, result_t **db_result, char **error);
+
+/** Check that a conditional write has an If-Match header, before any work is done for it.
+ *
+ * @returns  HTTP_OK, or HTTP_PRECONDITION_REQUIRED when the header is missing.
+ */
+int mod_okioki_view_require_if_match(request_rec *http_request, char **error);
+
+/** Bind the entity-tag of the If-Match header of a conditional write to the parameter of the view.
+ * A value of the parameter given by the client is replaced.
+ *
+ * @returns  HTTP_OK, HTTP_PRECONDITION_REQUIRED when the header is missing, HTTP_PRECONDITION_FAILED for a
+ *           weak entity-tag or HTTP_BAD_REQUEST when it can not be bound.
+ */
+int mod_okioki_view_bind_if_match(request_rec *http_request, view_t *view, apr_hash_t *arguments, char **error);
+
+/** Check the result of a conditional write and set the entity-tag of the new version.
+ *
+ * @returns  HTTP_OK, or HTTP_PRECONDITION_FAILED when the statement returned no rows.
  */
-int mod_okioki_view_execute(request_rec *http_request, mod_okioki_dir_config *cfg, view_t *view, apr_hash_t *arguments, const apr_dbd_driver_t **db_driver, apr_dbd_results_t **db_result, char **error);
+int mod_okioki_view_check_if_match(request_rec *http_request, view_t *view, result_t *db_result, char **error);
 
 #endif
@@ -0,0 +1,359 @@
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <apr_hash.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+#include <apr_thread_proc.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#include <apr_dbd.h>
+#include <httpd.h>
+#include <http_log.h>
+#include <http_protocol.h>
+#include "writebehind.h"
+#include "pool.h"
+
+struct writebehind_t {
+    view_t             *view;
+    server_rec         *server;
+    int                max_queued;
+    int                batch_size;
+
+    // Ring buffer of queued requests, each entry is a single malloc()ed argv.
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t  *cond;
+    char               ***entries;
+    int                head;
+    int                nr_queued;
+    int                stopping;
+    apr_thread_t       *thread;
+
+    // Counters.
+    apr_uint64_t       nr_enqueued;
+    apr_uint64_t       nr_rejected;
+    apr_uint64_t       nr_batches;
+    apr_uint64_t       nr_failed;
+};
+
+static apr_array_header_t *mod_okioki_writebehind_queues = NULL;
+
+writebehind_t *mod_okioki_writebehind_create(apr_pool_t *pool, server_rec *server, view_t *view, int max_queued, int batch_size)
+{
+    writebehind_t *queue;
+
+    if (mod_okioki_writebehind_queues == NULL) {
+        if ((mod_okioki_writebehind_queues = apr_array_make(pool, 4, sizeof (writebehind_t *))) == NULL) {
+            return NULL;
+        }
+    }
+
+    if ((queue = apr_pcalloc(pool, sizeof (writebehind_t))) == NULL) {
+        return NULL;
+    }
+    queue->view       = view;
+    queue->server     = server;
+    queue->max_queued = max_queued;
+    queue->batch_size = batch_size;
+
+    APR_ARRAY_PUSH(mod_okioki_writebehind_queues, writebehind_t *) = queue;
+    return queue;
+}
+
+void mod_okioki_writebehind_pre_config(void)
+{
+    // The array was allocated on the previous configuration pool.
+    mod_okioki_writebehind_queues = NULL;
+}
+
+/** Execute a batch of requests in a single transaction.
+ * When the transaction fails, each request is retried by itself, so that a single bad request
+ * does not lose the whole batch.
+ *
+ * @param db_conn    The connection of the thread.
+ * @param nr_failed  On return the number of requests that where dropped.
+ */
+static int mod_okioki_writebehind_execute(apr_pool_t *pool, writebehind_t *queue, mod_okioki_conn_t *db_conn, char ***batch, int nr_entries, int *nr_failed, char **error)
+{
+    view_t                *view = queue->view;
+    apr_dbd_prepared_t    *db_statement;
+    apr_dbd_transaction_t *db_transaction = NULL;
+    int                   nr_rows;
+    int                   i;
+    int                   ret;
+    int                   failed = 0;
+
+    *nr_failed = 0;
+
+    ASSERT_HTTP_OK(
+        ret = mod_okioki_conn_prepare(pool, db_conn, view, &db_statement, error),
+        ret, "Can not get prepared statement for write-behind."
+    )
+
+    ASSERT_ZERO(
+        ret = apr_dbd_transaction_start(db_conn->driver, pool, db_conn->handle, &db_transaction),
+        HTTP_BAD_GATEWAY, "%s", apr_dbd_error(db_conn->driver, db_conn->handle, ret)
+    )
+
+    for (i = 0; i < nr_entries && !failed; i++) {
+        if (apr_dbd_pquery(db_conn->driver, pool, db_conn->handle, &nr_rows, db_statement, view->nr_sql_params, (const char **)batch[i]) != 0) {
+            failed = 1;
+        }
+    }
+
+    // A failed query makes apr_dbd roll back the transaction when it ends.
+    ASSERT_ZERO(
+        ret = apr_dbd_transaction_end(db_conn->driver, pool, db_transaction),
+        HTTP_BAD_GATEWAY, "%s", apr_dbd_error(db_conn->driver, db_conn->handle, ret)
+    )
+
+    if (!failed) {
+        return HTTP_OK;
+    }
+
+    for (i = 0; i < nr_entries; i++) {
+        if ((ret = apr_dbd_pquery(db_conn->driver, pool, db_conn->handle, &nr_rows, db_statement, view->nr_sql_params, (const char **)batch[i])) != 0) {
+            ap_log_perror(APLOG_MARK, APLOG_ERR, 0, pool, "[mod_okioki] Write-behind request dropped: %s", apr_dbd_error(db_conn->driver, db_conn->handle, ret));
+            (*nr_failed)++;
+        }
+    }
+    return HTTP_OK;
+}
+
+/** Get the connection of the thread, it is opened again when it was closed or lost.
+ *
+ * @param conn_pool  The pool the connection lives in, it is cleared to close the connection.
+ * @returns          The connection, or NULL when the database can not be reached.
+ */
+static mod_okioki_conn_t *mod_okioki_writebehind_conn(apr_pool_t *conn_pool, writebehind_t *queue, mod_okioki_conn_t *db_conn, char **error)
+{
+    if (db_conn != NULL && apr_dbd_check_conn(db_conn->driver, conn_pool, db_conn->handle) == APR_SUCCESS) {
+        return db_conn;
+    }
+
+    apr_pool_clear(conn_pool);
+    if (mod_okioki_conn_open(conn_pool, queue->server, &db_conn, error) != HTTP_OK) {
+        return NULL;
+    }
+    return db_conn;
+}
+
+/** Background thread that drains the queue of a view in batches.
+ * The thread keeps its database connection between batches.
+ */
+static void * APR_THREAD_FUNC mod_okioki_writebehind_thread(apr_thread_t *thread, void *data)
+{
+    writebehind_t     *queue = (writebehind_t *)data;
+    apr_pool_t        *pool;
+    apr_pool_t        *batch_pool;
+    apr_pool_t        *conn_pool;
+    mod_okioki_conn_t *db_conn = NULL;
+    char              ***batch;
+    char              *_error;
+    char              **error = &_error;
+    int               nr_entries;
+    int               nr_failed;
+    int               i;
+
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS) {
+        return NULL;
+    }
+
+    // The memory of a batch is released after each batch, the connection only when it is opened again.
+    if (
+        apr_pool_create(&batch_pool, pool) != APR_SUCCESS ||
+        apr_pool_create(&conn_pool, pool) != APR_SUCCESS ||
+        (batch = apr_palloc(pool, queue->batch_size * sizeof (char **))) == NULL
+    ) {
+        apr_pool_destroy(pool);
+        return NULL;
+    }
+
+    apr_thread_mutex_lock(queue->mutex);
+    for (;;) {
+        while (queue->nr_queued == 0 && !queue->stopping) {
+            apr_thread_cond_wait(queue->cond, queue->mutex);
+        }
+
+        // Still drain the queue when stopping.
+        if (queue->nr_queued == 0) {
+            break;
+        }
+
+        // Take a batch from the queue, so that the queue can be filled while the batch is executed.
+        for (nr_entries = 0; nr_entries < queue->batch_size && queue->nr_queued > 0; nr_entries++) {
+            batch[nr_entries] = queue->entries[queue->head];
+            queue->entries[queue->head] = NULL;
+            queue->head = (queue->head + 1) % queue->max_queued;
+            queue->nr_queued--;
+        }
+        apr_thread_mutex_unlock(queue->mutex);
+
+        if (
+            (db_conn = mod_okioki_writebehind_conn(conn_pool, queue, db_conn, error)) == NULL ||
+            mod_okioki_writebehind_execute(batch_pool, queue, db_conn, batch, nr_entries, &nr_failed, error) != HTTP_OK
+        ) {
+            ap_log_perror(APLOG_MARK, APLOG_ERR, 0, batch_pool, "[mod_okioki] Write-behind batch of %i requests dropped: %s", nr_entries, *error);
+            nr_failed = nr_entries;
+        }
+
+        for (i = 0; i < nr_entries; i++) {
+            free(batch[i]);
+        }
+
+        apr_pool_clear(batch_pool);
+
+        apr_thread_mutex_lock(queue->mutex);
+        queue->nr_batches++;
+        queue->nr_failed+= nr_failed;
+    }
+    apr_thread_mutex_unlock(queue->mutex);
+
+    apr_pool_destroy(pool);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+/** Stop the background thread of a queue, after the queue has been drained.
+ */
+static apr_status_t mod_okioki_writebehind_stop(void *data)
+{
+    writebehind_t *queue = (writebehind_t *)data;
+    apr_status_t  thread_ret;
+
+    apr_thread_mutex_lock(queue->mutex);
+    queue->stopping = 1;
+    apr_thread_cond_signal(queue->cond);
+    apr_thread_mutex_unlock(queue->mutex);
+
+    apr_thread_join(&thread_ret, queue->thread);
+    return APR_SUCCESS;
+}
+
+int mod_okioki_writebehind_child_init(apr_pool_t *pool, server_rec *server)
+{
+    writebehind_t *queue;
+    apr_status_t  ret;
+    int           i;
+
+    if (mod_okioki_writebehind_queues == NULL) {
+        return APR_SUCCESS;
+    }
+
+    for (i = 0; i < mod_okioki_writebehind_queues->nelts; i++) {
+        queue = APR_ARRAY_IDX(mod_okioki_writebehind_queues, i, writebehind_t *);
+
+        if (
+            (ret = apr_thread_mutex_create(&queue->mutex, APR_THREAD_MUTEX_DEFAULT, pool)) != APR_SUCCESS ||
+            (ret = apr_thread_cond_create(&queue->cond, pool)) != APR_SUCCESS
+        ) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, ret, server, "[mod_okioki] Could not create write-behind lock.");
+            return ret;
+        }
+
+        if ((queue->entries = apr_pcalloc(pool, queue->max_queued * sizeof (char **))) == NULL) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, server, "[mod_okioki] Could not allocate write-behind queue.");
+            return APR_ENOMEM;
+        }
+
+        if ((ret = apr_thread_create(&queue->thread, NULL, mod_okioki_writebehind_thread, queue, pool)) != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, ret, server, "[mod_okioki] Could not start write-behind thread.");
+            queue->thread = NULL;
+            return ret;
+        }
+        apr_pool_cleanup_register(pool, queue, mod_okioki_writebehind_stop, apr_pool_cleanup_null);
+    }
+
+    return APR_SUCCESS;
+}
+
+int mod_okioki_writebehind_enqueue(request_rec *http_request, view_t *view, apr_hash_t *arguments, char **error)
+{
+    apr_pool_t    *pool = http_request->pool;
+    writebehind_t *queue = view->writebehind;
+    const char    *args[MAX_PARAMETERS];
+    size_t        args_len[MAX_PARAMETERS];
+    size_t        entry_size;
+    char          **entry;
+    char          *s;
+    int           argc = view->nr_sql_params;
+    int           i;
+
+    ASSERT_NOT_NULL(
+        queue->thread,
+        HTTP_INTERNAL_SERVER_ERROR, "Write-behind queue was not started."
+    )
+
+    // Copy the arguments in the order of the sql parameters into a single block, which outlives the request.
+    entry_size = argc * sizeof (char *);
+    for (i = 0; i < argc; i++) {
+        ASSERT_NOT_NULL(
+            args[i] = apr_hash_get(arguments, view->sql_params[i], view->sql_params_len[i]),
+            HTTP_BAD_REQUEST, "Could not find parameter '%s' in request.", view->sql_params[i]
+        )
+        args_len[i] = strlen(args[i]) + 1;
+        entry_size+= args_len[i];
+    }
+
+    ASSERT_NOT_NULL(
+        entry = malloc(entry_size > 0 ? entry_size : 1),
+        HTTP_INTERNAL_SERVER_ERROR, "Could not allocate write-behind entry."
+    )
+    s = (char *)&entry[argc];
+    for (i = 0; i < argc; i++) {
+        memcpy(s, args[i], args_len[i]);
+        entry[i] = s;
+        s+= args_len[i];
+    }
+
+    apr_thread_mutex_lock(queue->mutex);
+    if (queue->nr_queued >= queue->max_queued) {
+        queue->nr_rejected++;
+        apr_thread_mutex_unlock(queue->mutex);
+        free(entry);
+
+        apr_table_setn(http_request->err_headers_out, "Retry-After", "1");
+        *error = apr_pstrdup(pool, "Write-behind queue is full.");
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    queue->entries[(queue->head + queue->nr_queued) % queue->max_queued] = entry;
+    queue->nr_queued++;
+    queue->nr_enqueued++;
+    apr_thread_cond_signal(queue->cond);
+    apr_thread_mutex_unlock(queue->mutex);
+
+    return HTTP_ACCEPTED;
+}
+
+apr_status_t mod_okioki_writebehind_status_line(apr_bucket_brigade *bb, const char *name, writebehind_t *queue)
+{
+    apr_status_t ret;
+
+    if (queue->mutex == NULL) {
+        return APR_SUCCESS;
+    }
+
+    apr_thread_mutex_lock(queue->mutex);
+    ret = apr_brigade_printf(bb, NULL, NULL,
+        "\"%s\",%i,%i,%" APR_UINT64_T_FMT ",%" APR_UINT64_T_FMT ",%" APR_UINT64_T_FMT ",%" APR_UINT64_T_FMT "\r\n",
+        name, queue->max_queued, queue->nr_queued, queue->nr_enqueued, queue->nr_rejected, queue->nr_batches, queue->nr_failed
+    );
+    apr_thread_mutex_unlock(queue->mutex);
+    return ret;
+}
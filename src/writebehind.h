@@ -0,0 +1,55 @@
+#ifndef WRITEBEHIND_H
+#define WRITEBEHIND_H
+/* mod_okioki is an apche module which provides a RESTful data service.
+ * Copyright (C) 2010  Take Vos
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <httpd.h>
+#include <http_log.h>
+#include <apr_hash.h>
+#include <apr_buckets.h>
+#include "mod_okioki.h"
+
+/** Create the write-behind queue of a view at configuration time.
+ *
+ * @param pool        The configuration pool.
+ * @param server      The server of the view, used to connect to the database.
+ * @param view        The view to execute in the background.
+ * @param max_queued  The maximum number of requests in the queue.
+ * @param batch_size  The maximum number of requests executed in a single transaction.
+ * @returns           The queue, or NULL on failure.
+ */
+writebehind_t *mod_okioki_writebehind_create(apr_pool_t *pool, server_rec *server, view_t *view, int max_queued, int batch_size);
+
+/** Forget the queues of the previous configuration, called before the configuration is (re)read.
+ */
+void mod_okioki_writebehind_pre_config(void);
+
+/** Start a background thread for each queue, called once for each child.
+ */
+int mod_okioki_writebehind_child_init(apr_pool_t *pool, server_rec *server);
+
+/** Add the arguments of the request to the queue of the view.
+ *
+ * @returns  HTTP_ACCEPTED, or HTTP_SERVICE_UNAVAILABLE when the queue is full.
+ */
+int mod_okioki_writebehind_enqueue(request_rec *http_request, view_t *view, apr_hash_t *arguments, char **error);
+
+/** Write the counters of the queue of a view as a line of CSV, for the okioki-status handler.
+ */
+apr_status_t mod_okioki_writebehind_status_line(apr_bucket_brigade *bb, const char *name, writebehind_t *queue);
+
+#endif